@@ -0,0 +1,462 @@
+// Copyright (c) 2022. Yang Zhu
+// lobajson 性能基准: 生成若干典型语料, 测 parse / stringify / 遍历 / free 的吞吐
+//
+// 用法: lobajson_bench [--size=MB] [--reps=N] [--filter=子串] [--mode=json,cbor,msgpack,canonical]
+//                      [--format=text|csv|json] [--threads=N] [--raw-numbers]
+//                      [--pack-numbers]
+// 吞吐统一按语料 JSON 文本的字节数计算, 不同模式之间可以直接比较
+// 数据要有意义请用 -DCMAKE_BUILD_TYPE=Release 构建
+#include "lobajson.h"
+#include "lobajson_binary.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+struct BenchCorpus {
+  std::string name;
+  std::vector<std::string> docs;
+  size_t bytes;
+};
+
+// 每种模式对应一种输入格式, parse 把输入变成 LobaValue, stringify 反过来
+struct BenchMode {
+  const char *name;
+  std::string (*prepare)(LobaBinary *loba, const std::string &json);
+  int (*parse)(LobaBinary *loba, LobaValue *v, const std::string &input);
+  char *(*stringify)(LobaBinary *loba, const LobaValue *v, size_t *length);
+};
+
+struct BenchResult {
+  std::string corpus;
+  std::string op;
+  std::string mode;
+  size_t bytes;
+  double best_ns;
+  double median_ns;
+};
+
+static std::string JsonPrepare(LobaBinary *, const std::string &json) { return json; }
+static int JsonParse(LobaBinary *loba, LobaValue *v, const std::string &input) {
+  return loba->LobaParse(v, input.c_str());
+}
+static char *JsonStringify(LobaBinary *loba, const LobaValue *v, size_t *length) {
+  return loba->LobaStringify(v, length);
+}
+
+// 输入同 json, stringify 换成 RFC 8785 规范化输出
+static char *CanonicalStringify(LobaBinary *loba, const LobaValue *v, size_t *length) {
+  return loba->LobaStringifyCanonical(v, length);
+}
+
+static std::string CborPrepare(LobaBinary *loba, const std::string &json) {
+  LobaValue v;
+  size_t length;
+  LobaInit(&v);
+  loba->LobaParse(&v, json.c_str());
+  char *bin = loba->LobaEncodeCbor(&v, &length);
+  std::string ret(bin, length);
+  free(bin);
+  loba->LobaFree(&v);
+  return ret;
+}
+static int CborParse(LobaBinary *loba, LobaValue *v, const std::string &input) {
+  return loba->LobaDecodeCbor(v, input.data(), input.size());
+}
+static char *CborStringify(LobaBinary *loba, const LobaValue *v, size_t *length) {
+  return loba->LobaEncodeCbor(v, length);
+}
+
+static std::string MsgPackPrepare(LobaBinary *loba, const std::string &json) {
+  LobaValue v;
+  size_t length;
+  LobaInit(&v);
+  loba->LobaParse(&v, json.c_str());
+  char *bin = loba->LobaEncodeMsgPack(&v, &length);
+  std::string ret(bin, length);
+  free(bin);
+  loba->LobaFree(&v);
+  return ret;
+}
+static int MsgPackParse(LobaBinary *loba, LobaValue *v, const std::string &input) {
+  return loba->LobaDecodeMsgPack(v, input.data(), input.size());
+}
+static char *MsgPackStringify(LobaBinary *loba, const LobaValue *v, size_t *length) {
+  return loba->LobaEncodeMsgPack(v, length);
+}
+
+static const BenchMode kModes[] = {
+    {"json", JsonPrepare, JsonParse, JsonStringify},
+    {"cbor", CborPrepare, CborParse, CborStringify},
+    {"msgpack", MsgPackPrepare, MsgPackParse, MsgPackStringify},
+    {"canonical", JsonPrepare, JsonParse, CanonicalStringify},
+};
+
+// 固定种子的线性同余发生器, 保证每次生成的语料一样
+static unsigned long long bench_seed = 20220901;
+static unsigned Rand(unsigned n) {
+  bench_seed = bench_seed * 6364136223846793005ULL + 1442695040888963407ULL;
+  return static_cast<unsigned>((bench_seed >> 33) % n);
+}
+
+static void AppendWord(std::string *s, unsigned min, unsigned max) {
+  unsigned len = min + Rand(max - min + 1);
+  for (unsigned i = 0; i < len; i++) {
+    s->push_back(static_cast<char>('a' + Rand(26)));
+  }
+}
+
+// 夹杂转义和非 ASCII 字符的文本
+static void AppendText(std::string *s, unsigned words) {
+  static const char *kExtras[] = {"\\n", "\\\"", "\\u00e9", "\xe4\xbd\xa0\xe5\xa5\xbd", "\\\\", "\\t"};
+  for (unsigned i = 0; i < words; i++) {
+    if (i) {
+      s->push_back(' ');
+    }
+    if (Rand(8) == 0) {
+      s->append(kExtras[Rand(6)]);
+    } else {
+      AppendWord(s, 2, 10);
+    }
+  }
+}
+
+static void AppendNumber(std::string *s) {
+  char buffer[32];
+  switch (Rand(4)) {
+    case 0:snprintf(buffer, sizeof(buffer), "%u", Rand(1000000));
+      break;
+    case 1:snprintf(buffer, sizeof(buffer), "-%u.%u", Rand(1000), Rand(100000));
+      break;
+    case 2:snprintf(buffer, sizeof(buffer), "%.17g", Rand(1000000) / 7.0);
+      break;
+    default:snprintf(buffer, sizeof(buffer), "%ue-%u", Rand(100), Rand(30));
+      break;
+  }
+  s->append(buffer);
+}
+
+static void GenTweet(std::string *s, unsigned id) {
+  *s += "{\"id\":" + std::to_string(1000000000ULL + id) + ",\"id_str\":\"" +
+      std::to_string(1000000000ULL + id) + "\",\"text\":\"";
+  AppendText(s, 8 + Rand(20));
+  *s += "\",\"user\":{\"id\":" + std::to_string(Rand(100000000)) + ",\"screen_name\":\"";
+  AppendWord(s, 4, 15);
+  *s += "\",\"followers_count\":" + std::to_string(Rand(100000)) +
+      ",\"verified\":" + (Rand(10) == 0 ? "true" : "false") + "},\"entities\":{\"hashtags\":[";
+  for (unsigned i = 0, n = Rand(4); i < n; i++) {
+    *s += i ? ",{\"text\":\"" : "{\"text\":\"";
+    AppendWord(s, 3, 12);
+    unsigned at = Rand(100);
+    *s += "\",\"indices\":[" + std::to_string(at) + "," + std::to_string(at + 8) + "]}";
+  }
+  *s += "],\"urls\":[]},\"retweet_count\":" + std::to_string(Rand(5000)) +
+      ",\"favorited\":false,\"coordinates\":null,\"lang\":\"en\"}";
+}
+
+static void GenTwitter(BenchCorpus *c, size_t bytes) {
+  std::string s = "{\"statuses\":[";
+  for (unsigned i = 0; s.size() < bytes; i++) {
+    if (i) {
+      s.push_back(',');
+    }
+    GenTweet(&s, i);
+  }
+  s += "]}";
+  c->docs.push_back(s);
+}
+
+static void GenNumbers(BenchCorpus *c, size_t bytes) {
+  std::string s = "[";
+  for (unsigned i = 0; s.size() < bytes; i++) {
+    s += i ? ",[" : "[";
+    for (int j = 0; j < 3; j++) {
+      if (j) {
+        s.push_back(',');
+      }
+      AppendNumber(&s);
+    }
+    s.push_back(']');
+  }
+  s += "]";
+  c->docs.push_back(s);
+}
+
+// 特征向量: 每条记录带一个 128 维的数字数组, --pack-numbers 打包的就是这种数组
+static void GenVectors(BenchCorpus *c, size_t bytes) {
+  std::string s = "[";
+  for (unsigned i = 0; s.size() < bytes; i++) {
+    s += (i ? ",{\"id\":" : "{\"id\":") + std::to_string(i) + ",\"embedding\":[";
+    for (int j = 0; j < 128; j++) {
+      if (j) {
+        s.push_back(',');
+      }
+      char buffer[32];
+      snprintf(buffer, sizeof(buffer), "%.6g", (static_cast<double>(Rand(2000001)) - 1000000) / 1000000);
+      s += buffer;
+    }
+    s += "]}";
+  }
+  s += "]";
+  c->docs.push_back(s);
+}
+
+static void GenStrings(BenchCorpus *c, size_t bytes) {
+  std::string s = "[";
+  for (unsigned i = 0; s.size() < bytes; i++) {
+    s += i ? ",\"" : "\"";
+    AppendText(&s, 20 + Rand(200));
+    s.push_back('"');
+  }
+  s += "]";
+  c->docs.push_back(s);
+}
+
+// 每个元素都是 64 层交替嵌套的数组和对象
+static void GenNested(BenchCorpus *c, size_t bytes) {
+  std::string s = "[";
+  for (unsigned i = 0; s.size() < bytes; i++) {
+    if (i) {
+      s.push_back(',');
+    }
+    for (int d = 0; d < 64; d++) {
+      s += d % 2 ? "{\"k\":" : "[";
+    }
+    s += std::to_string(i);
+    for (int d = 63; d >= 0; d--) {
+      s += d % 2 ? "}" : "]";
+    }
+  }
+  s += "]";
+  c->docs.push_back(s);
+}
+
+static void GenSmall(BenchCorpus *c, size_t bytes) {
+  for (size_t total = 0; total < bytes;) {
+    std::string s = "{\"op\":\"";
+    AppendWord(&s, 3, 8);
+    s += "\",\"seq\":" + std::to_string(Rand(1000000)) + ",\"ok\":true,\"args\":[";
+    AppendNumber(&s);
+    s += ",\"";
+    AppendWord(&s, 5, 20);
+    s += "\"],\"meta\":{\"trace\":\"";
+    AppendWord(&s, 16, 16);
+    s += "\",\"ts\":" + std::to_string(Rand(2000000000)) + "}}";
+    total += s.size();
+    c->docs.push_back(s);
+  }
+}
+
+static double NowNs() {
+  return static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// 紧凑数组的元素经代理读出, 遍历不会把它展开
+static size_t Traverse(LobaJson *loba, const LobaValue *v) {
+  size_t n = 1, i;
+  LobaValue proxy;
+  switch (loba->LobaGetType(v)) {
+    case lobaString:n += loba->LobaGetStringLength(v);
+      break;
+    case lobaNumber:n += loba->LobaGetNumber(v) > 0;
+      break;
+    case lobaArray:
+      for (i = 0; i < loba->LobaGetArraySize(v); i++) {
+        n += Traverse(loba, loba->LobaGetArrayElement(v, i, &proxy));
+      }
+      break;
+    case lobaObject:
+      for (i = 0; i < loba->LobaGetObjectSize(v); i++) {
+        n += loba->LobaGetObjectKeyLength(v, i);
+        n += Traverse(loba, loba->LobaGetObjectValue(v, i));
+      }
+      break;
+    default:break;
+  }
+  return n;
+}
+
+static volatile size_t bench_sink;
+// 传给 LobaSetParseThreads 和 LobaSetStringifyThreads, 0 表示按 CPU 核数
+static unsigned bench_threads = 1;
+// 传给 LobaSetRawNumbers
+static int bench_raw_numbers = 0;
+// 传给 LobaSetPackNumbers
+static int bench_pack_numbers = 0;
+
+// 跑 reps 次, 返回每次的耗时; 计时只覆盖 op 本身, 准备与清理不计入
+static BenchResult RunOne(const BenchCorpus &corpus, const BenchMode &mode, const char *op, int reps) {
+  LobaBinary loba;
+  loba.LobaSetParseThreads(bench_threads);
+  loba.LobaSetStringifyThreads(bench_threads);
+  loba.LobaSetRawNumbers(bench_raw_numbers);
+  loba.LobaSetPackNumbers(bench_pack_numbers);
+  std::vector<std::string> inputs;
+  for (const std::string &doc : corpus.docs) {
+    inputs.push_back(mode.prepare(&loba, doc));
+  }
+  std::vector<LobaValue> values(inputs.size());
+  std::vector<double> times;
+  std::string name = op;
+  for (int rep = 0; rep < reps; rep++) {
+    double start = 0, end = 0;
+    if (name != "parse") {
+      for (size_t i = 0; i < inputs.size(); i++) {
+        mode.parse(&loba, &values[i], inputs[i]);
+      }
+    }
+    if (name == "parse") {
+      start = NowNs();
+      for (size_t i = 0; i < inputs.size(); i++) {
+        mode.parse(&loba, &values[i], inputs[i]);
+      }
+      end = NowNs();
+    } else if (name == "stringify") {
+      start = NowNs();
+      for (size_t i = 0; i < values.size(); i++) {
+        size_t length;
+        free(mode.stringify(&loba, &values[i], &length));
+        bench_sink = length;
+      }
+      end = NowNs();
+    } else if (name == "traverse") {
+      size_t n = 0;
+      start = NowNs();
+      for (size_t i = 0; i < values.size(); i++) {
+        n += Traverse(&loba, &values[i]);
+      }
+      end = NowNs();
+      bench_sink = n;
+    }
+    if (name == "free") {
+      start = NowNs();
+    }
+    for (size_t i = 0; i < values.size(); i++) {
+      loba.LobaFree(&values[i]);
+    }
+    if (name == "free") {
+      end = NowNs();
+    }
+    times.push_back(end - start);
+  }
+  std::sort(times.begin(), times.end());
+  BenchResult r;
+  r.corpus = corpus.name;
+  r.op = op;
+  r.mode = mode.name;
+  r.bytes = corpus.bytes;
+  r.best_ns = times.front();
+  r.median_ns = times[times.size() / 2];
+  return r;
+}
+
+static double MBps(size_t bytes, double ns) {
+  return ns > 0 ? bytes / ns * 1e9 / (1024.0 * 1024.0) : 0;
+}
+
+static void Report(const std::vector<BenchResult> &results, const std::string &format) {
+  if (format == "json") {
+    printf("[\n");
+    for (size_t i = 0; i < results.size(); i++) {
+      const BenchResult &r = results[i];
+      printf("  {\"corpus\":\"%s\",\"op\":\"%s\",\"mode\":\"%s\",\"bytes\":%zu,"
+             "\"best_ns\":%.0f,\"median_ns\":%.0f,\"best_mbps\":%.2f,\"median_mbps\":%.2f}%s\n",
+             r.corpus.c_str(), r.op.c_str(), r.mode.c_str(), r.bytes, r.best_ns, r.median_ns,
+             MBps(r.bytes, r.best_ns), MBps(r.bytes, r.median_ns), i + 1 < results.size() ? "," : "");
+    }
+    printf("]\n");
+  } else if (format == "csv") {
+    printf("corpus,op,mode,bytes,best_ns,median_ns,best_mbps,median_mbps\n");
+    for (const BenchResult &r : results) {
+      printf("%s,%s,%s,%zu,%.0f,%.0f,%.2f,%.2f\n", r.corpus.c_str(), r.op.c_str(), r.mode.c_str(),
+             r.bytes, r.best_ns, r.median_ns, MBps(r.bytes, r.best_ns), MBps(r.bytes, r.median_ns));
+    }
+  } else {
+    printf("%-10s %-10s %-8s %10s %12s %12s\n", "corpus", "op", "mode", "bytes", "best MB/s", "median MB/s");
+    for (const BenchResult &r : results) {
+      printf("%-10s %-10s %-8s %10zu %12.2f %12.2f\n", r.corpus.c_str(), r.op.c_str(), r.mode.c_str(),
+             r.bytes, MBps(r.bytes, r.best_ns), MBps(r.bytes, r.median_ns));
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  size_t size_mb = 4;
+  int reps = 5;
+  std::string filter, modes = "json,cbor,msgpack", format = "text";
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg.compare(0, 7, "--size=") == 0) {
+      size_mb = strtoul(arg.c_str() + 7, nullptr, 10);
+    } else if (arg.compare(0, 7, "--reps=") == 0) {
+      reps = atoi(arg.c_str() + 7);
+    } else if (arg.compare(0, 9, "--filter=") == 0) {
+      filter = arg.substr(9);
+    } else if (arg.compare(0, 7, "--mode=") == 0) {
+      modes = arg.substr(7);
+    } else if (arg.compare(0, 9, "--format=") == 0) {
+      format = arg.substr(9);
+    } else if (arg.compare(0, 10, "--threads=") == 0) {
+      bench_threads = static_cast<unsigned>(strtoul(arg.c_str() + 10, nullptr, 10));
+    } else if (arg == "--raw-numbers") {
+      bench_raw_numbers = 1;
+    } else if (arg == "--pack-numbers") {
+      bench_pack_numbers = 1;
+    } else {
+      fprintf(stderr, "usage: %s [--size=MB] [--reps=N] [--filter=STR] "
+                      "[--mode=json,cbor,msgpack,canonical] [--format=text|csv|json] [--threads=N] [--raw-numbers] [--pack-numbers]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (reps < 1 || size_mb < 1) {
+    fprintf(stderr, "--size and --reps must be positive\n");
+    return 1;
+  }
+  size_t bytes = size_mb * 1024 * 1024;
+  struct {
+    const char *name;
+    void (*gen)(BenchCorpus *c, size_t bytes);
+  } generators[] = {
+      {"twitter", GenTwitter},
+      {"numbers", GenNumbers},
+      {"vectors", GenVectors},
+      {"strings", GenStrings},
+      {"nested", GenNested},
+      {"small", GenSmall},
+  };
+  static const char *kOps[] = {"parse", "stringify", "traverse", "free"};
+  std::vector<BenchResult> results;
+  for (auto &g : generators) {
+    BenchCorpus corpus;
+    corpus.name = g.name;
+    g.gen(&corpus, bytes);
+    corpus.bytes = 0;
+    for (const std::string &doc : corpus.docs) {
+      corpus.bytes += doc.size();
+      // 生成器出错时吞吐数字没有意义, 直接退出
+      LobaJson loba;
+      LobaValue v;
+      if (loba.LobaParse(&v, doc.c_str()) != lobaParseOk) {
+        fprintf(stderr, "corpus %s does not parse\n", g.name);
+        return 1;
+      }
+      loba.LobaFree(&v);
+    }
+    for (const BenchMode &mode : kModes) {
+      if (("," + modes + ",").find(std::string(",") + mode.name + ",") == std::string::npos) {
+        continue;
+      }
+      for (const char *op : kOps) {
+        std::string id = corpus.name + "/" + op + "/" + mode.name;
+        if (filter.empty() || id.find(filter) != std::string::npos) {
+          results.push_back(RunOne(corpus, mode, op, reps));
+        }
+      }
+    }
+  }
+  Report(results, format);
+  return 0;
+}
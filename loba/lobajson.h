@@ -3,16 +3,45 @@
 #ifndef LOBAJSON_H_
 #define LOBAJSON_H_
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cfloat>
+#include <cstdint>
+#include <cstdlib>
 #include <string>
 #include <cmath>
 #include <cstring>
+#include <map>
+#include <thread>
+#include <unordered_map>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LOBA_SIMD_X86
+#include <immintrin.h>
+#endif
+#include <vector>
+#include <chrono>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 template<typename T, typename T1>
 void EXPECT(T c, T1 ch) {
   assert(*c->json == (ch));
   c->json++;
 }
 
+#define LOBA_KEY_NOT_EXIST ((size_t)-1)
+
+// FNV-1a, 用于对象键的哈希查找; constexpr 以便用作 switch 的 case 标签
+constexpr size_t LobaHash(const char *s, size_t len) {
+  size_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++) {
+    h ^= static_cast<unsigned char>(s[i]);
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
 #define ISDIGIT(ch)         ((ch) >= '0' && (ch) <= '9')
 #define ISDIGIT1TO9(ch)     ((ch) >= '1' && (ch) <= '9')
 
@@ -24,6 +53,10 @@ enum LobaType {
   lobaString,
   lobaArray,
   lobaObject,
+  // LobaSetRawNumbers 下解析出的数字, u.s 指向源文本; LobaGetType 仍报告为 lobaNumber
+  lobaRawNumber,
+  // LobaSetPackNumbers 下全是数字的数组, u.p 指向连续的 double; LobaGetType 报告为 lobaArray
+  lobaPackedArray,
   lobaTestDefaultType,
 };
 
@@ -46,6 +79,10 @@ union U {
     LobaMember *m;
     size_t size;
   } o;
+  struct {
+    double *d;
+    size_t size;
+  } p;
   double n;
 };
 
@@ -81,7 +118,16 @@ enum {
 
   lobaParseMissKey,
   lobaParseMissCommaOrCurlyBracket,
-  lobaParseMissColon
+  lobaParseMissColon,
+
+  lobaParseInvalidUtf8,
+
+  // 超出 LobaSetParseLimits 设置的预算
+  lobaParseInputTooLarge,
+  lobaParseTooDeep,
+  lobaParseMemoryLimit,
+  lobaParseStringTooLong,
+  lobaParseTooManyElements
 };
 
 struct LobaContext {
@@ -90,14 +136,800 @@ struct LobaContext {
   char *stack;
   size_t size; //capacity
   size_t top;//size
+  // 只有 LOBA_STATS 才用到, 但始终保留, 布局不随宏变化
+  size_t depth;
+};
+
+// 一次 LobaParse / LobaStringify 的统计, 只有定义了 LOBA_STATS 才会填写
+struct LobaParseStats {
+  size_t bytes;  // parse 消耗的输入字节, stringify 输出的字节
+  unsigned long long elapsed_ns;
+  size_t values[lobaTestDefaultType];  // 按 LobaType 计数
+  size_t mallocs;
+  size_t reallocs;
+  size_t peak_stack;  // LobaContext 栈的最大使用量
+  size_t max_depth;  // 数组/对象最大嵌套层数
+};
+
+// 单次解析的资源上限, 0 表示不限. 超出时解析立即失败, 已分配的部分全部释放
+struct LobaParseLimits {
+  size_t max_input_bytes;  // 输入的字节数, 不含结尾的 '\0'
+  size_t max_depth;  // 数组/对象的嵌套层数
+  size_t max_alloc_bytes;  // 解析期间新分配的字节数: 树上的分配加解析栈的增长, 不扣除中途释放的
+  size_t max_string_length;  // 单个字符串或键解码后的字节数
+  size_t max_elements;  // 整份文档中数组元素与对象成员的总数
+};
+
+// LobaMemoryUsage 的结果, 不含根 LobaValue 本身
+struct LobaMemoryStats {
+  size_t nodes;  // 元素数组与成员数组
+  size_t strings;  // 字符串值, 含结尾的 '\0'
+  size_t keys;  // 对象的键, 不含驻留在 LobaKeyTable 中的键
+  size_t slack;  // 压实块内的对齐填充; 用 glibc malloc 时还有取整和块头
+  size_t blocks;  // 树占用的独立堆块数, 一个压实块计 1
+  size_t total;
+};
+
+// 内存分配策略. 释放时都会带上分配时的大小, 便于实现按尺寸分级的池;
+// LobaRealloc 的 ptr 为 nullptr 时等同分配, new_size 为 0 时等同释放并返回 nullptr
+class LobaAllocator {
+ public:
+  virtual ~LobaAllocator() = default;
+  virtual void *LobaAlloc(size_t size) = 0;
+  virtual void *LobaRealloc(void *ptr, size_t old_size, size_t new_size) = 0;
+  virtual void LobaDealloc(void *ptr, size_t size) = 0;
+  // 多线程解析时会被多个线程同时调用, 不是线程安全的 allocator 只走单线程解析
+  virtual int LobaIsThreadSafe() const { return 0; }
+};
+
+// 键驻留表的默认容量上限: 键的个数和单个键的长度, 超出的键照常单独分配
+#define LobaKeyTableMaxKeys (1 << 16)
+#define LobaKeyTableMaxLength 128
+#define LobaKeyTableBlockBytes (64 * 1024)
+
+// 跨文档共享的键驻留表: 相同的键只存一份, LobaMember::k 直接指向它,
+// 同一张表里的两个键相等当且仅当指针相等. 表不是线程安全的, 且必须比引用它的树活得久
+class LobaKeyTable {
+ public:
+  explicit LobaKeyTable(size_t max_keys = LobaKeyTableMaxKeys,
+                        size_t max_length = LobaKeyTableMaxLength)
+      : max_keys_(max_keys), max_length_(max_length) {}
+  ~LobaKeyTable();
+  LobaKeyTable(const LobaKeyTable &) = delete;
+  LobaKeyTable &operator=(const LobaKeyTable &) = delete;
+
+  // 返回驻留的键 (以 '\0' 结尾), 表满或键太长时返回 nullptr
+  const char *LobaIntern(const char *key, size_t klen);
+  // p 是否是本表分配的键
+  int LobaOwns(const char *p) const;
+  size_t LobaGetSize() const { return size_; }
+
+ private:
+  struct Slot {
+    size_t hash;
+    const char *k;  // nullptr 表示空槽
+    size_t klen;
+  };
+  struct Block {
+    uintptr_t begin;
+    size_t size;
+  };
+  void LobaRehash(size_t capacity);
+
+  std::vector<Slot> slots_;  // 开放寻址, 容量是 2 的幂, 装载率不超过 1/2
+  std::vector<Block> blocks_;  // 按地址排序, 用于 LobaOwns
+  char *cur_ = nullptr;
+  char *end_ = nullptr;
+  size_t size_ = 0;
+  size_t max_keys_;
+  size_t max_length_;
+};
+
+inline LobaKeyTable::~LobaKeyTable() {
+  for (const Block &b : blocks_) {
+    free(reinterpret_cast<void *>(b.begin));
+  }
+}
+
+inline void LobaKeyTable::LobaRehash(size_t capacity) {
+  std::vector<Slot> old(capacity);
+  old.swap(slots_);
+  size_t mask = capacity - 1;
+  for (const Slot &s : old) {
+    if (s.k != nullptr) {
+      size_t i = s.hash & mask;
+      while (slots_[i].k != nullptr) {
+        i = (i + 1) & mask;
+      }
+      slots_[i] = s;
+    }
+  }
+}
+
+inline const char *LobaKeyTable::LobaIntern(const char *key, size_t klen) {
+  if (klen > max_length_) {
+    return nullptr;
+  }
+  if (slots_.empty()) {
+    LobaRehash(64);
+  }
+  size_t h = LobaHash(key, klen);
+  size_t mask = slots_.size() - 1;
+  size_t i = h & mask;
+  for (; slots_[i].k != nullptr; i = (i + 1) & mask) {
+    if (slots_[i].hash == h && slots_[i].klen == klen && memcmp(slots_[i].k, key, klen) == 0) {
+      return slots_[i].k;
+    }
+  }
+  if (size_ >= max_keys_) {
+    return nullptr;
+  }
+  if (static_cast<size_t>(end_ - cur_) < klen + 1) {
+    size_t n = klen + 1 > LobaKeyTableBlockBytes ? klen + 1 : LobaKeyTableBlockBytes;
+    cur_ = (char *)malloc(n);
+    end_ = cur_ + n;
+    Block b{reinterpret_cast<uintptr_t>(cur_), n};
+    blocks_.insert(std::upper_bound(blocks_.begin(), blocks_.end(), b,
+                                    [](const Block &x, const Block &y) { return x.begin < y.begin; }),
+                   b);
+  }
+  memcpy(cur_, key, klen);
+  cur_[klen] = '\0';
+  const char *k = cur_;
+  cur_ += klen + 1;
+  if ((size_ + 1) * 2 > slots_.size()) {
+    LobaRehash(slots_.size() * 2);
+    mask = slots_.size() - 1;
+    for (i = h & mask; slots_[i].k != nullptr; i = (i + 1) & mask) {
+    }
+  }
+  slots_[i] = Slot{h, k, klen};
+  size_++;
+  return k;
+}
+
+inline int LobaKeyTable::LobaOwns(const char *p) const {
+  uintptr_t u = reinterpret_cast<uintptr_t>(p);
+  auto it = std::upper_bound(blocks_.begin(), blocks_.end(), u,
+                             [](uintptr_t x, const Block &b) { return x < b.begin; });
+  return it != blocks_.begin() && u - (it - 1)->begin < (it - 1)->size;
+}
+
+// 序列化结果短于该值的容器不单独缓存, 它的字节留在外层容器的结果里
+#define LobaStringifyCacheMinBytes 256
+
+// 数组和对象的序列化结果缓存, 按节点地址索引, 同时记下每个孩子的值在结果中的起止.
+// 通过 LobaJson::LobaSetStringifyCache 接入后, 没有变过的子树整段拷贝上次的结果;
+// 有孩子被标记的容器只重新序列化这些孩子, 其余部分从旧结果中拷贝, 代价与改动的大小相当.
+// 树被直接改动时 (写元素、换成员的值...) 调用者须用 LobaMarkDirty 按路径标记;
+// 经同一个 LobaJson 释放的容器自动移出缓存, 增删孩子或换了孩子缓冲区的容器整体重新序列化.
+// 增删元素时被挪动的节点在原地址留下的条目不再命中, 直到 LobaClear 才清掉.
+// 每层祖先各存一份自己的结果, 内存约为输出长度乘以嵌套层数. 不是线程安全的
+class LobaStringifyCache {
+ public:
+  explicit LobaStringifyCache(size_t min_bytes = LobaStringifyCacheMinBytes) : min_bytes_(min_bytes) {}
+  LobaStringifyCache(const LobaStringifyCache &) = delete;
+  LobaStringifyCache &operator=(const LobaStringifyCache &) = delete;
+
+  // v 整个重新序列化, 它的祖先要另外按路径标记
+  void LobaMarkDirty(const LobaValue *v);
+  // 沿 JSON Pointer 从 root 走到目标, 途经的每个容器只把路上的那个孩子记为已改动, 目标整个
+  // 重新序列化; 走不下去时停在最后一个存在的容器. 返回目标是否存在
+  int LobaMarkDirty(const LobaValue *root, const char *pointer, size_t len);
+  void LobaClear();
+
+  size_t LobaGetSize() const { return entries_.size(); }
+  // 缓存的输出和孩子位置占用的字节数
+  size_t LobaGetBytes() const { return bytes_; }
+  // 整段拷贝、只重做部分孩子、整个重新序列化的容器个数
+  size_t LobaGetHits() const { return hits_; }
+  size_t LobaGetPartialHits() const { return partial_hits_; }
+  size_t LobaGetMisses() const { return misses_; }
+
+ private:
+  friend class LobaJson;
+  struct Entry {
+    const void *children;  // 缓存时的 u.a.e 或 u.o.m
+    size_t size;
+    std::string text;
+    std::vector<size_t> spans;  // 第 i 个孩子的值是 text[spans[2i], spans[2i + 1])
+    std::vector<size_t> dirty;  // 标记过的孩子下标, 可能重复
+  };
+  static const void *LobaChildren(const LobaValue *v) {
+    return v->type == LobaType::lobaArray ? static_cast<const void *>(v->u.a.e)
+                                          : static_cast<const void *>(v->u.o.m);
+  }
+  static size_t LobaChildCount(const LobaValue *v) {
+    return v->type == LobaType::lobaArray ? v->u.a.size : v->u.o.size;
+  }
+  // 孩子缓冲区和个数都没变时返回 v 的条目
+  Entry *LobaFind(const LobaValue *v);
+  void LobaStore(const LobaValue *v, const char *text, size_t len, std::vector<size_t> *spans);
+  void LobaErase(std::unordered_map<const LobaValue *, Entry>::iterator it);
+
+  std::unordered_map<const LobaValue *, Entry> entries_;
+  size_t min_bytes_;
+  size_t bytes_ = 0;
+  size_t hits_ = 0;
+  size_t partial_hits_ = 0;
+  size_t misses_ = 0;
+};
+
+inline void LobaStringifyCache::LobaErase(std::unordered_map<const LobaValue *, Entry>::iterator it) {
+  bytes_ -= it->second.text.size() + it->second.spans.size() * sizeof(size_t);
+  entries_.erase(it);
+}
+
+inline void LobaStringifyCache::LobaMarkDirty(const LobaValue *v) {
+  auto it = entries_.find(v);
+  if (it != entries_.end()) {
+    LobaErase(it);
+  }
+}
+
+inline int LobaStringifyCache::LobaMarkDirty(const LobaValue *root, const char *pointer, size_t len) {
+  assert(root != nullptr && (pointer != nullptr || len == 0));
+  const char *p = pointer, *end = pointer + len;
+  const LobaValue *v = root;
+  std::string token;
+  while (p != end) {
+    if (*p++ != '/') {
+      LobaMarkDirty(v);
+      return 0;
+    }
+    token.clear();
+    for (; p != end && *p != '/'; p++) {
+      if (*p == '~' && p + 1 != end && (p[1] == '0' || p[1] == '1')) {
+        token.push_back(*++p == '0' ? '~' : '/');
+      } else {
+        token.push_back(*p);
+      }
+    }
+    size_t index = LOBA_KEY_NOT_EXIST;
+    if (v->type == LobaType::lobaObject) {
+      for (size_t i = 0; i < v->u.o.size; i++) {
+        if (v->u.o.m[i].klen == token.size() && memcmp(v->u.o.m[i].k, token.data(), token.size()) == 0) {
+          index = i;
+          break;
+        }
+      }
+    } else if ((v->type == LobaType::lobaArray || v->type == LobaType::lobaPackedArray) && !token.empty() &&
+        std::all_of(token.begin(), token.end(), [](char ch) { return ISDIGIT(ch); })) {
+      index = strtoull(token.c_str(), nullptr, 10);
+      if (index >= (v->type == LobaType::lobaArray ? v->u.a.size : v->u.p.size)) {
+        index = LOBA_KEY_NOT_EXIST;
+      }
+    }
+    if (index == LOBA_KEY_NOT_EXIST) {
+      LobaMarkDirty(v);
+      return 0;
+    }
+    if (v->type == LobaType::lobaPackedArray) {
+      // 紧凑数组的元素不是节点, 也不进缓存
+      return p == end;
+    }
+    auto it = entries_.find(v);
+    if (it != entries_.end()) {
+      it->second.dirty.push_back(index);
+    }
+    v = v->type == LobaType::lobaArray ? &v->u.a.e[index] : &v->u.o.m[index].v;
+  }
+  LobaMarkDirty(v);
+  return 1;
+}
+
+inline void LobaStringifyCache::LobaClear() {
+  entries_.clear();
+  bytes_ = 0;
+}
+
+inline LobaStringifyCache::Entry *LobaStringifyCache::LobaFind(const LobaValue *v) {
+  auto it = entries_.find(v);
+  if (it == entries_.end()) {
+    return nullptr;
+  }
+  if (it->second.children != LobaChildren(v) || it->second.size != LobaChildCount(v)) {
+    LobaErase(it);
+    return nullptr;
+  }
+  return &it->second;
+}
+
+inline void LobaStringifyCache::LobaStore(const LobaValue *v, const char *text, size_t len,
+                                          std::vector<size_t> *spans) {
+  if (len < min_bytes_) {
+    LobaMarkDirty(v);
+    return;
+  }
+  Entry &e = entries_[v];
+  bytes_ -= e.text.size() + e.spans.size() * sizeof(size_t);
+  e.children = LobaChildren(v);
+  e.size = LobaChildCount(v);
+  e.text.assign(text, len);
+  e.spans.swap(*spans);
+  e.dirty.clear();
+  bytes_ += len + e.spans.size() * sizeof(size_t);
+}
+
+// SIMD 内核的运行时分派. 同一份二进制要在不同的 CPU 上运行, 编译时只能假定基线指令集,
+// 因此每个内核按 SSE2 / AVX2 / AVX-512 各编译一份 (用 target 属性, 不依赖编译选项),
+// 第一次使用时用 cpuid 检测一次, 把函数指针绑定到 CPU 支持的最高一档.
+// 环境变量 LOBA_SIMD (scalar / sse2 / avx2 / avx512) 可以压低这一档, 测试时也可用 LobaSetSimdLevel 强制
+enum LobaSimdLevel {
+  lobaSimdScalar = 0,
+  lobaSimdSse2,
+  lobaSimdAvx2,
+  lobaSimdAvx512
+};
+
+struct LobaKernels {
+  LobaSimdLevel level;
+  // 从 p 开始连续的普通字节数: 0x20~0x7F 且不是 '"' 和 '\\'. 遇到 '\0' 一定会停下
+  size_t (*scan_plain)(const char *p);
+  // 从 p 开始连续的空白字节数 (' ' '\t' '\n' '\r'), 遇到 '\0' 一定会停下
+  size_t (*scan_space)(const char *p);
+  // s[0..len) 开头不需要转义的字节数: 不小于 0x20 且不是 '"' 和 '\\'. 不读 s + len 所在的对齐块之后
+  size_t (*scan_escape)(const char *s, size_t len);
+  // 从 p 开始连续的普通字节和合法 UTF-8 序列的字节数, 停在 '"'、'\\'、控制字符和不合法的序列上
+  size_t (*scan_utf8)(const char *p);
 };
 
+inline size_t LobaScanPlainScalar(const char *p) {
+  const char *start = p;
+  while (static_cast<unsigned char>(*p) >= 0x20 && static_cast<unsigned char>(*p) < 0x80 &&
+      *p != '"' && *p != '\\') {
+    p++;
+  }
+  return static_cast<size_t>(p - start);
+}
+
+inline size_t LobaScanSpaceScalar(const char *p) {
+  const char *start = p;
+  while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') {
+    p++;
+  }
+  return static_cast<size_t>(p - start);
+}
+
+inline size_t LobaScanEscapeScalar(const char *s, size_t len) {
+  size_t i = 0;
+  while (i < len && static_cast<unsigned char>(s[i]) >= 0x20 && s[i] != '"' && s[i] != '\\') {
+    i++;
+  }
+  return i;
+}
+
+// 以 0x80 以上字节开头的一个 UTF-8 序列的长度, 不合法返回 0. 按 Unicode 表 3-7
+// 检查每个字节的取值范围, 排除了过长编码、代理区和超过 U+10FFFF 的码点;
+// 序列被 '\0' 截断时后续字节检查失败, 不会越界
+inline size_t LobaUtf8Length(const char *s) {
+  const unsigned char *p = reinterpret_cast<const unsigned char *>(s);
+  unsigned char lo = 0x80, hi = 0xBF;
+  if (p[0] >= 0xC2 && p[0] <= 0xDF) {
+    return (p[1] & 0xC0) == 0x80 ? 2 : 0;
+  }
+  if (p[0] >= 0xE0 && p[0] <= 0xEF) {
+    if (p[0] == 0xE0) {
+      lo = 0xA0;
+    } else if (p[0] == 0xED) {
+      hi = 0x9F;
+    }
+    return p[1] >= lo && p[1] <= hi && (p[2] & 0xC0) == 0x80 ? 3 : 0;
+  }
+  if (p[0] >= 0xF0 && p[0] <= 0xF4) {
+    if (p[0] == 0xF0) {
+      lo = 0x90;
+    } else if (p[0] == 0xF4) {
+      hi = 0x8F;
+    }
+    return p[1] >= lo && p[1] <= hi && (p[2] & 0xC0) == 0x80 && (p[3] & 0xC0) == 0x80 ? 4 : 0;
+  }
+  return 0;
+}
+
+// 从 p 开始连续的普通字节和完整合法的 UTF-8 序列的字节数, 停在 '"'、'\\'、控制字符以及
+// 不合法或被截断的序列的首字节上. 普通字节的段交给 Plain 扫描
+template<size_t (*Plain)(const char *)>
+inline size_t LobaScanUtf8Runs(const char *p) {
+  const char *start = p;
+  for (;;) {
+    p += Plain(p);
+    size_t n;
+    if (static_cast<unsigned char>(*p) < 0x80 || (n = LobaUtf8Length(p)) == 0) {
+      return static_cast<size_t>(p - start);
+    }
+    p += n;
+  }
+}
+
+// 向量版本都从 p 所在的对齐块开始按块对齐读取, 对齐的读取不会跨页, 所以读过 '\0'
+// 也不会碰到非法内存, 但会越过分配的边界, 因此对 ASan 关闭检查. 块内 p 之前的字节用 skip 屏蔽
+#if defined(LOBA_SIMD_X86)
+__attribute__((target("sse2"), no_sanitize_address)) inline size_t LobaScanPlainSse2(const char *p) {
+  uintptr_t misalign = reinterpret_cast<uintptr_t>(p) & 15;
+  const __m128i *q = reinterpret_cast<const __m128i *>(p - misalign);
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i space = _mm_set1_epi8(0x20);
+  unsigned skip = 0xFFFFu << misalign;
+  for (;; q++, skip = 0xFFFF) {
+    __m128i x = _mm_load_si128(q);
+    // 有符号比较下 0x80 以上的字节是负数, 与控制字符一起落在 < 0x20 里
+    __m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, quote), _mm_cmpeq_epi8(x, backslash)),
+                                   _mm_cmplt_epi8(x, space));
+    unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(special)) & skip;
+    if (mask != 0) {
+      return static_cast<size_t>(reinterpret_cast<const char *>(q) + __builtin_ctz(mask) - p);
+    }
+  }
+}
+
+__attribute__((target("sse2"), no_sanitize_address)) inline size_t LobaScanSpaceSse2(const char *p) {
+  uintptr_t misalign = reinterpret_cast<uintptr_t>(p) & 15;
+  const __m128i *q = reinterpret_cast<const __m128i *>(p - misalign);
+  // 取反后 movemask 之外的高位也是 1, skip 只能留低 16 位
+  unsigned skip = (0xFFFFu << misalign) & 0xFFFF;
+  for (;; q++, skip = 0xFFFF) {
+    __m128i x = _mm_load_si128(q);
+    __m128i ws = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(x, _mm_set1_epi8('\t'))),
+                              _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(x, _mm_set1_epi8('\r'))));
+    unsigned mask = ~static_cast<unsigned>(_mm_movemask_epi8(ws)) & skip;
+    if (mask != 0) {
+      return static_cast<size_t>(reinterpret_cast<const char *>(q) + __builtin_ctz(mask) - p);
+    }
+  }
+}
+
+__attribute__((target("sse2"), no_sanitize_address)) inline size_t LobaScanEscapeSse2(const char *s, size_t len) {
+  uintptr_t misalign = reinterpret_cast<uintptr_t>(s) & 15;
+  const __m128i *q = reinterpret_cast<const __m128i *>(s - misalign);
+  const char *end = s + len;
+  const __m128i control = _mm_set1_epi8(0x1F);
+  unsigned skip = 0xFFFFu << misalign;
+  for (; reinterpret_cast<const char *>(q) < end; q++, skip = 0xFFFF) {
+    __m128i x = _mm_load_si128(q);
+    // 无符号的 x <= 0x1F 即 min(x, 0x1F) == x
+    __m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('"')),
+                                                _mm_cmpeq_epi8(x, _mm_set1_epi8('\\'))),
+                                   _mm_cmpeq_epi8(_mm_min_epu8(x, control), x));
+    unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(special)) & skip;
+    if (mask != 0) {
+      size_t n = static_cast<size_t>(reinterpret_cast<const char *>(q) + __builtin_ctz(mask) - s);
+      return n < len ? n : len;
+    }
+  }
+  return len;
+}
+
+__attribute__((target("avx2"), no_sanitize_address)) inline size_t LobaScanPlainAvx2(const char *p) {
+  uintptr_t misalign = reinterpret_cast<uintptr_t>(p) & 31;
+  const __m256i *q = reinterpret_cast<const __m256i *>(p - misalign);
+  const __m256i quote = _mm256_set1_epi8('"');
+  const __m256i backslash = _mm256_set1_epi8('\\');
+  const __m256i space = _mm256_set1_epi8(0x20);
+  uint32_t skip = 0xFFFFFFFFu << misalign;
+  for (;; q++, skip = 0xFFFFFFFFu) {
+    __m256i x = _mm256_load_si256(q);
+    __m256i special = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(x, quote), _mm256_cmpeq_epi8(x, backslash)),
+                                      _mm256_cmpgt_epi8(space, x));
+    uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(special)) & skip;
+    if (mask != 0) {
+      return static_cast<size_t>(reinterpret_cast<const char *>(q) + __builtin_ctz(mask) - p);
+    }
+  }
+}
+
+__attribute__((target("avx2"), no_sanitize_address)) inline size_t LobaScanSpaceAvx2(const char *p) {
+  uintptr_t misalign = reinterpret_cast<uintptr_t>(p) & 31;
+  const __m256i *q = reinterpret_cast<const __m256i *>(p - misalign);
+  uint32_t skip = 0xFFFFFFFFu << misalign;
+  for (;; q++, skip = 0xFFFFFFFFu) {
+    __m256i x = _mm256_load_si256(q);
+    __m256i ws = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\t'))),
+        _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('\n')), _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\r'))));
+    uint32_t mask = ~static_cast<uint32_t>(_mm256_movemask_epi8(ws)) & skip;
+    if (mask != 0) {
+      return static_cast<size_t>(reinterpret_cast<const char *>(q) + __builtin_ctz(mask) - p);
+    }
+  }
+}
+
+__attribute__((target("avx2"), no_sanitize_address)) inline size_t LobaScanEscapeAvx2(const char *s, size_t len) {
+  uintptr_t misalign = reinterpret_cast<uintptr_t>(s) & 31;
+  const __m256i *q = reinterpret_cast<const __m256i *>(s - misalign);
+  const char *end = s + len;
+  const __m256i control = _mm256_set1_epi8(0x1F);
+  uint32_t skip = 0xFFFFFFFFu << misalign;
+  for (; reinterpret_cast<const char *>(q) < end; q++, skip = 0xFFFFFFFFu) {
+    __m256i x = _mm256_load_si256(q);
+    __m256i special = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('"')),
+                                                      _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\\'))),
+                                      _mm256_cmpeq_epi8(_mm256_min_epu8(x, control), x));
+    uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(special)) & skip;
+    if (mask != 0) {
+      size_t n = static_cast<size_t>(reinterpret_cast<const char *>(q) + __builtin_ctz(mask) - s);
+      return n < len ? n : len;
+    }
+  }
+  return len;
+}
+
+// UTF-8 的查表校验 (Keiser & Lemire): 每个字节和它前面的字节组成一对, 用前一字节的高、低半字节和
+// 当前字节的高半字节各查一张 16 项的表, 三者相与不为 0 即这一对里有某种错误 (过短、过长、过长编码、
+// 代理区、超过 U+10FFFF); 前两三个字节是 3、4 字节序列的首字节时当前字节必须是后续字节, 与表中的
+// "两个后续字节" 位异或抵消. 返回的向量中非 0 的字节即出错的位置, prev 是上一块
+__attribute__((target("avx2"))) inline __m256i LobaUtf8ErrorsAvx2(__m256i prev, __m256i x) {
+  const __m256i byte_1_high = _mm256_setr_epi8(
+      0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, -0x80, -0x80, -0x80, -0x80, 0x21, 0x01, 0x15, 0x49,
+      0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, -0x80, -0x80, -0x80, -0x80, 0x21, 0x01, 0x15, 0x49);
+  const __m256i byte_1_low = _mm256_setr_epi8(
+      -0x19, -0x5D, -0x7D, -0x7D, -0x75, -0x35, -0x35, -0x35, -0x35, -0x35, -0x35, -0x35, -0x35, -0x25, -0x35, -0x35,
+      -0x19, -0x5D, -0x7D, -0x7D, -0x75, -0x35, -0x35, -0x35, -0x35, -0x35, -0x35, -0x35, -0x35, -0x25, -0x35, -0x35);
+  const __m256i byte_2_high = _mm256_setr_epi8(
+      0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, -0x1A, -0x52, -0x46, -0x46, 0x01, 0x01, 0x01, 0x01,
+      0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, -0x1A, -0x52, -0x46, -0x46, 0x01, 0x01, 0x01, 0x01);
+  const __m256i low = _mm256_set1_epi8(0x0F);
+  // prevN 的第 i 个字节是 x 的第 i - N 个字节, 不足时取自 prev
+  __m256i carry = _mm256_permute2x128_si256(prev, x, 0x21);
+  __m256i prev1 = _mm256_alignr_epi8(x, carry, 15);
+  __m256i prev2 = _mm256_alignr_epi8(x, carry, 14);
+  __m256i prev3 = _mm256_alignr_epi8(x, carry, 13);
+  __m256i special = _mm256_and_si256(
+      _mm256_and_si256(_mm256_shuffle_epi8(byte_1_high, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), low)),
+                       _mm256_shuffle_epi8(byte_1_low, _mm256_and_si256(prev1, low))),
+      _mm256_shuffle_epi8(byte_2_high, _mm256_and_si256(_mm256_srli_epi16(x, 4), low)));
+  // 只有 prev2 >= 0xE0 或 prev3 >= 0xF0 时饱和减法的结果才有最高位
+  __m256i must_continue = _mm256_or_si256(_mm256_subs_epu8(prev2, _mm256_set1_epi8(0xE0 - 0x80)),
+                                          _mm256_subs_epu8(prev3, _mm256_set1_epi8(0xF0 - 0x80)));
+  return _mm256_xor_si256(_mm256_and_si256(must_continue, _mm256_set1_epi8(-0x80)), special);
+}
+
+// 全是 ASCII 且上一块没有未完的序列时只做 scan_plain 的比较; 否则查表校验, 在第一个停止字节之前
+// (含该字节, 截断的序列在那里报错) 没有错误就返回. 有错误时从出错块里第一个完整字符的开头
+// 改用标量版本, 结果与标量版本相同. 块内 p 之前的字节换成空格, 不参与校验
+__attribute__((target("avx2"), no_sanitize_address)) inline size_t LobaScanUtf8Avx2(const char *p) {
+  uintptr_t misalign = reinterpret_cast<uintptr_t>(p) & 31;
+  const __m256i *q = reinterpret_cast<const __m256i *>(p - misalign);
+  const __m256i control = _mm256_set1_epi8(0x1F);
+  const __m256i zero = _mm256_setzero_si256();
+  // 块尾的最后 3 个字节分别不小于 0xF0、0xE0、0xC0 时序列延续到下一块
+  const __m256i tail = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -0x11, -0x21, -0x41);
+  const __m256i index = _mm256_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+                                         16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31);
+  __m256i prev = zero;
+  __m256i incomplete = zero;
+  __m256i x = _mm256_blendv_epi8(_mm256_load_si256(q), _mm256_set1_epi8(' '),
+                                 _mm256_cmpgt_epi8(_mm256_set1_epi8(static_cast<char>(misalign)), index));
+  for (;;) {
+    __m256i special = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('"')),
+                                                      _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\\'))),
+                                      _mm256_cmpeq_epi8(_mm256_min_epu8(x, control), x));
+    uint32_t stop = static_cast<uint32_t>(_mm256_movemask_epi8(special));
+    uint32_t error = 0;
+    if (_mm256_movemask_epi8(x) != 0 || !_mm256_testz_si256(incomplete, incomplete)) {
+      error = ~static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(LobaUtf8ErrorsAvx2(prev, x), zero)));
+      incomplete = _mm256_subs_epu8(x, tail);
+    }
+    if (stop != 0) {
+      uint32_t k = static_cast<uint32_t>(__builtin_ctz(stop));
+      // k 为 31 时 2u << k 为 0, 掩码是全部 32 位
+      if ((error & ((2u << k) - 1)) == 0) {
+        return static_cast<size_t>(reinterpret_cast<const char *>(q) + k - p);
+      }
+      break;
+    }
+    if (error != 0) {
+      break;
+    }
+    prev = x;
+    x = _mm256_load_si256(++q);
+  }
+  const char *start = reinterpret_cast<const char *>(q);
+  if (start <= p) {
+    return LobaScanUtf8Runs<LobaScanPlainScalar>(p);
+  }
+  // 之前的块都已校验, 退到跨块的那个字符的首字节
+  start--;
+  while (start > p && (static_cast<unsigned char>(*start) & 0xC0) == 0x80) {
+    start--;
+  }
+  return static_cast<size_t>(start - p) + LobaScanUtf8Runs<LobaScanPlainScalar>(start);
+}
+
+// AVX-512BW 的比较直接得到 64 位掩码, 不必再 movemask
+__attribute__((target("avx512f,avx512bw"), no_sanitize_address)) inline size_t LobaScanPlainAvx512(const char *p) {
+  uintptr_t misalign = reinterpret_cast<uintptr_t>(p) & 63;
+  const __m512i *q = reinterpret_cast<const __m512i *>(p - misalign);
+  const __m512i quote = _mm512_set1_epi8('"');
+  const __m512i backslash = _mm512_set1_epi8('\\');
+  const __m512i space = _mm512_set1_epi8(0x20);
+  uint64_t skip = ~0ULL << misalign;
+  for (;; q++, skip = ~0ULL) {
+    __m512i x = _mm512_load_si512(q);
+    uint64_t mask = (_mm512_cmpeq_epi8_mask(x, quote) | _mm512_cmpeq_epi8_mask(x, backslash) |
+        _mm512_cmplt_epi8_mask(x, space)) & skip;
+    if (mask != 0) {
+      return static_cast<size_t>(reinterpret_cast<const char *>(q) + __builtin_ctzll(mask) - p);
+    }
+  }
+}
+
+__attribute__((target("avx512f,avx512bw"), no_sanitize_address)) inline size_t LobaScanSpaceAvx512(const char *p) {
+  uintptr_t misalign = reinterpret_cast<uintptr_t>(p) & 63;
+  const __m512i *q = reinterpret_cast<const __m512i *>(p - misalign);
+  uint64_t skip = ~0ULL << misalign;
+  for (;; q++, skip = ~0ULL) {
+    __m512i x = _mm512_load_si512(q);
+    uint64_t ws = _mm512_cmpeq_epi8_mask(x, _mm512_set1_epi8(' ')) | _mm512_cmpeq_epi8_mask(x, _mm512_set1_epi8('\t')) |
+        _mm512_cmpeq_epi8_mask(x, _mm512_set1_epi8('\n')) | _mm512_cmpeq_epi8_mask(x, _mm512_set1_epi8('\r'));
+    uint64_t mask = ~ws & skip;
+    if (mask != 0) {
+      return static_cast<size_t>(reinterpret_cast<const char *>(q) + __builtin_ctzll(mask) - p);
+    }
+  }
+}
+
+__attribute__((target("avx512f,avx512bw"), no_sanitize_address)) inline size_t LobaScanEscapeAvx512(const char *s,
+                                                                                                   size_t len) {
+  uintptr_t misalign = reinterpret_cast<uintptr_t>(s) & 63;
+  const __m512i *q = reinterpret_cast<const __m512i *>(s - misalign);
+  const char *end = s + len;
+  uint64_t skip = ~0ULL << misalign;
+  for (; reinterpret_cast<const char *>(q) < end; q++, skip = ~0ULL) {
+    __m512i x = _mm512_load_si512(q);
+    uint64_t mask = (_mm512_cmpeq_epi8_mask(x, _mm512_set1_epi8('"')) | _mm512_cmpeq_epi8_mask(x, _mm512_set1_epi8('\\')) |
+        _mm512_cmplt_epu8_mask(x, _mm512_set1_epi8(0x20))) & skip;
+    if (mask != 0) {
+      size_t n = static_cast<size_t>(reinterpret_cast<const char *>(q) + __builtin_ctzll(mask) - s);
+      return n < len ? n : len;
+    }
+  }
+  return len;
+}
+#endif
+
+// 各档的内核表, 下标是 LobaSimdLevel. 不支持 x86 向量指令的平台上各档都是标量版本
+inline const LobaKernels &LobaKernelTable(LobaSimdLevel level) {
+  static const LobaKernels table[] = {
+      {lobaSimdScalar, LobaScanPlainScalar, LobaScanSpaceScalar, LobaScanEscapeScalar,
+       LobaScanUtf8Runs<LobaScanPlainScalar>},
+#if defined(LOBA_SIMD_X86)
+      // SSE2 没有 pshufb, UTF-8 仍逐个序列校验; AVX-512 档沿用 AVX2 的查表校验
+      {lobaSimdSse2, LobaScanPlainSse2, LobaScanSpaceSse2, LobaScanEscapeSse2, LobaScanUtf8Runs<LobaScanPlainSse2>},
+      {lobaSimdAvx2, LobaScanPlainAvx2, LobaScanSpaceAvx2, LobaScanEscapeAvx2, LobaScanUtf8Avx2},
+      {lobaSimdAvx512, LobaScanPlainAvx512, LobaScanSpaceAvx512, LobaScanEscapeAvx512, LobaScanUtf8Avx2},
+#endif
+  };
+  return table[level < sizeof(table) / sizeof(table[0]) ? level : lobaSimdScalar];
+}
+
+// 当前 CPU 支持的最高一档, 只检测一次
+inline LobaSimdLevel LobaGetMaxSimdLevel() {
+  static const LobaSimdLevel max_level = [] {
+    LobaSimdLevel level = lobaSimdScalar;
+#if defined(LOBA_SIMD_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+      level = lobaSimdSse2;
+      if (__builtin_cpu_supports("avx2")) {
+        level = lobaSimdAvx2;
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+          level = lobaSimdAvx512;
+        }
+      }
+    }
+#endif
+    return level;
+  }();
+  return max_level;
+}
+
+inline std::atomic<const LobaKernels *> &LobaKernelSlot() {
+  static std::atomic<const LobaKernels *> slot([] {
+    LobaSimdLevel level = LobaGetMaxSimdLevel();
+    const char *env = getenv("LOBA_SIMD");
+    if (env != nullptr) {
+      static const char *const names[] = {"scalar", "sse2", "avx2", "avx512"};
+      for (int i = 0; i < 4; i++) {
+        if (strcmp(env, names[i]) == 0 && i < level) {
+          level = static_cast<LobaSimdLevel>(i);
+        }
+      }
+    }
+    return &LobaKernelTable(level);
+  }());
+  return slot;
+}
+
+// 当前绑定的内核. 解析和序列化在入口取一次, 不在每个字节上查表
+inline const LobaKernels &LobaGetKernels() {
+  return *LobaKernelSlot().load(std::memory_order_acquire);
+}
+
+inline LobaSimdLevel LobaGetSimdLevel() {
+  return LobaGetKernels().level;
+}
+
+// 强制使用某一档, 超过 CPU 支持的档位时不改变并返回 -1. 对之后开始的解析和序列化生效,
+// 正在进行的调用继续用它取到的那一档
+inline int LobaSetSimdLevel(LobaSimdLevel level) {
+  if (level < lobaSimdScalar || level > LobaGetMaxSimdLevel()) {
+    return -1;
+  }
+  LobaKernelSlot().store(&LobaKernelTable(level), std::memory_order_release);
+  return 0;
+}
+
+// 多线程解析时每个线程至少分到的输入字节数, 根数组小于两块时直接单线程解析
+#define LobaParallelMinChunk (256 * 1024)
+// 每个线程在自己的块里最多尝试的切分点个数, 都失败就留给主线程串行补上
+#define LobaParallelMaxAttempts 16
+// 多线程序列化: 子树权重 (节点数加字符串长度/16) 低于该值时不值得开线程
+#define LobaParallelMinWeight (1 << 15)
+// 每个线程任务至少包含的权重
+#define LobaParallelMinGrain (1 << 12)
+// 单个孩子占了一半以上权重时往里走, 最多走这么多层
+#define LobaParallelMaxDescend 8
+
+#ifdef LOBA_STATS
+#define LOBA_STAT(stmt) do { if (cur_stats_ != nullptr) { stmt; } } while (0)
+#else
+#define LOBA_STAT(stmt) do { } while (0)
+#endif
+
 class LobaJson {
  public:
   LobaJson() = default;
   ~LobaJson() = default;
+  // 压实块登记在各自的 LobaJson 里, 拷贝会让两边都以为自己拥有同一批块
+  LobaJson(const LobaJson &) = delete;
+  LobaJson &operator=(const LobaJson &) = delete;
   int LobaParse(LobaValue *v, const char *json);
   char *LobaStringify(const LobaValue *v, size_t *length);
+  // RFC 8785 (JCS) 规范化输出: 成员按键的 UTF-16 码元排序, 数字按 ECMAScript 的最短表示,
+  // 字符串只做必要的转义. 不复制也不修改树; 含 NaN 或无穷时返回 nullptr. 结果的释放同 LobaStringify
+  char *LobaStringifyCanonical(const LobaValue *v, size_t *length);
+  // 之后每次 LobaParse / LobaStringify 先清零再写入 stats, 传 nullptr 关闭
+  void LobaSetParseStats(LobaParseStats *stats);
+  // 之后每次解析都受 limits 约束, 传 nullptr 取消. 内容会被拷贝
+  void LobaSetParseLimits(const LobaParseLimits *limits);
+  // 根为大数组时按元素边界切块, 用 threads 个线程并行解析, 0 表示按 CPU 核数;
+  // 默认 1 即单线程. 打开统计、设置了资源上限或 allocator 不是线程安全时仍走单线程
+  void LobaSetParseThreads(unsigned threads);
+  // 大数组/对象的孩子按权重分段, 各段在不同线程序列化后按顺序拼接, 输出与单线程逐字节相同;
+  // 0 表示按 CPU 核数, 默认 1. 条件同 LobaSetParseThreads
+  void LobaSetStringifyThreads(unsigned threads);
+  // 打开后数字只校验语法并记下它在源文本中的位置, 到 LobaGetNumber 时才转换,
+  // LobaStringify 原样输出源文本. 源文本须比解析出的树活得久; 过大的数字不再报
+  // lobaParseNumberTooBig, 而是在 LobaGetNumber 时得到 ±HUGE_VAL. 默认关闭
+  void LobaSetRawNumbers(int enable);
+  // 打开后元素全是数字且不少于 LobaPackMinSize 个的数组存成连续的 double, 每个元素 8 字节
+  // 而不是一个 LobaValue. 只读时用带 proxy 的 LobaGetArrayElement 或 LobaGetPackedArray,
+  // 不带 proxy 的 LobaGetArrayElement 会先把它就地展开. 默认关闭
+  void LobaSetPackNumbers(int enable);
+
+  // 树上的所有内存都经由 allocator 分配, nullptr 表示直接用 malloc/free;
+  // 树必须由分配它的同一个 allocator 释放. 设置了 allocator 时,
+  // LobaStringify 的结果要用 LobaDealloc(s, length + 1) 释放而不是 free
+  void LobaSetAllocator(LobaAllocator *allocator);
+  LobaAllocator *LobaGetAllocator() const;
+  void *LobaMalloc(size_t size);
+  void *LobaRealloc(void *ptr, size_t old_size, size_t new_size);
+  void LobaDealloc(void *ptr, size_t size);
+
+  // 之后解析和拷贝出的键都尽量驻留到 table 中, nullptr 关闭. 释放这些树时必须设置同一张表,
+  // 否则会把驻留的键当成普通内存释放; 设置了表时不走多线程
+  void LobaSetKeyTable(LobaKeyTable *table);
+  LobaKeyTable *LobaGetKeyTable() const;
+  // 之后 LobaStringify 复用 cache 中没有变过的数组和对象的结果, nullptr 关闭;
+  // 设置了缓存时不走多线程
+  void LobaSetStringifyCache(LobaStringifyCache *cache);
+  LobaStringifyCache *LobaGetStringifyCache() const;
+  // 按当前设置驻留或分配一个以 '\0' 结尾的键, 以及对应的释放
+  char *LobaNewKey(const char *key, size_t klen);
+  void LobaFreeKey(char *key, size_t klen);
   LobaType LobaGetType(const LobaValue *v);
 
   void LobaFree(LobaValue *p_value);
@@ -107,6 +939,8 @@ class LobaJson {
 
   double LobaGetNumber(const LobaValue *v);
   void LobaSetNumber(LobaValue *v, double n);
+  // 惰性数字返回源文本 (不以 '\0' 结尾), 否则返回 nullptr
+  const char *LobaGetRawNumber(const LobaValue *v, size_t *length);
 
   const char *LobaGetString(const LobaValue *v);
   void LobaSetString(LobaValue *v, const char *s, size_t len);
@@ -114,14 +948,41 @@ class LobaJson {
   int LobaParseStringRaw(LobaContext *c, char **str, size_t *len);
 
   size_t LobaGetArraySize(const LobaValue *v);
+  // 数组的元素, 可以就地修改. 紧凑数组没有逐个的 LobaValue, 先就地展开成普通数组
+  // (同 LobaUnpackArray), 因此不能与别的线程同时读这棵树; 只读时用带 proxy 的版本
   LobaValue *LobaGetArrayElement(const LobaValue *v, size_t index);
+  // 任何数组的元素, 只读. 紧凑数组的元素写进 *proxy 后返回 proxy, 其他返回数组里的元素
+  const LobaValue *LobaGetArrayElement(const LobaValue *v, size_t index, LobaValue *proxy);
+  // 紧凑数组的元素, 其他数组返回 nullptr
+  const double *LobaGetPackedArray(const LobaValue *v);
+  void LobaSetPackedArray(LobaValue *v, const double *d, size_t size);
+  // 紧凑数组就地展开成普通数组, 其他值不变
+  void LobaUnpackArray(LobaValue *v);
 
   size_t LobaGetObjectSize(const LobaValue *v);
   const char *LobaGetObjectKey(const LobaValue *v, size_t index);
   size_t LobaGetObjectKeyLength(const LobaValue *v, size_t index);
   LobaValue *LobaGetObjectValue(const LobaValue *v, size_t index);
+  size_t LobaFindObjectIndex(const LobaValue *v, const char *key, size_t klen);
+  LobaValue *LobaFindObjectValue(const LobaValue *v, const char *key, size_t klen);
+
+  void LobaCopy(LobaValue *dst, const LobaValue *src);
+  void LobaMove(LobaValue *dst, LobaValue *src);
+  void LobaSwap(LobaValue *lhs, LobaValue *rhs);
+  int LobaIsEqual(const LobaValue *lhs, const LobaValue *rhs);
+
+  void LobaMemoryUsage(const LobaValue *v, LobaMemoryStats *stats);
+  // 把 v 下的整棵树按深度优先顺序搬进一整块内存, 原来的碎片随即释放. 之后照常读写和释放:
+  // 修改时新分配的部分落在块外, 块在其中最后一片被释放时归还. 压实后的树只能由
+  // 做压实的这个 LobaJson 修改和释放, 要交给别的 LobaJson 须经 LobaAdoptCompact
+  void LobaCompact(LobaValue *v);
+  // 把 v 用到的压实块从 from 转到自己名下, 之后 v 由自己修改和释放. 两者的 allocator 须相同,
+  // 这些块里不能还有留在 from 的其他树的片. from 没有压实块时什么也不做
+  void LobaAdoptCompact(LobaJson *from, const LobaValue *v);
 
  protected:
+  // 单线程解析 c->json 处的一整份文档 (根值加前后空白), 借用 c 的栈, 不释放它
+  int LobaParseRoot(LobaContext *c, LobaValue *v);
   int LobaParseValue(LobaContext *c, LobaValue *v);
 
   void LobaParseWhitespace(LobaContext *c);
@@ -130,52 +991,163 @@ class LobaJson {
                        const char *literal, LobaType type);
 
   int LobaParseNumber(LobaContext *c, LobaValue *v);
+  int LobaParseRawNumber(LobaContext *c, LobaValue *v);
+  // 按 JSON 数字语法扫描, 返回数字之后的位置, 不合语法时返回 nullptr
+  static const char *LobaScanNumber(const char *p);
 
   int LobaParseString(LobaContext *c, LobaValue *v);
   int LobaParseArray(LobaContext *c, LobaValue *v);
 
   int LobaParseObject(LobaContext *c, LobaValue *v);
+  // 校验并跳过一个值, 除 c 的栈外不分配内存
+  int LobaSkipValue(LobaContext *c, size_t max_depth = SIZE_MAX);
+
+  void LobaStringifyNumber(LobaContext *p_context, const LobaValue *p_value);
+  // 与 "%.17g" 输出相同, 整数走快速路径; buffer 至少 LobaNumberMaxChars 字节
+  static size_t LobaFormatNumber(char *buffer, double n);
+  void LobaStringifyString(LobaContext *p_context, const char *s, size_t len);
 
- private:
   void *LobaContextPush(LobaContext *c, size_t size);
+  // 交出 c 的缓冲区作为结果, 有自定义 allocator 时收缩到 length 字节
+  char *LobaContextRelease(LobaContext *c, size_t length);
 
   void *LobaContextPop(LobaContext *c, size_t size);
 
+  // 一次解析的预算与用量. limits 中的 0 已换成 SIZE_MAX, 每项检查只需一次比较
+  struct LobaParseBudget {
+    LobaParseLimits limits;
+    size_t depth;
+    size_t bytes;
+    size_t elements;
+  };
+  int LobaCheckBudget();
+  int has_limits_ = 0;
+  LobaParseLimits limits_ = {};
+  // 只在设置了上限的解析期间不为 nullptr
+  LobaParseBudget *cur_budget_ = nullptr;
+
  private:
+  // 一个线程解析出的一段连续元素, 元素按顺序留在 c 的栈底
+  struct LobaParseRun {
+    LobaContext c;
+    const char *start;  // 指向这段之前的 '[' 或 ','
+    const char *end;  // 指向这段之后的 ',' 或 ']'
+    size_t size;
+    int closed;  // 以 ']' 结束
+    int ok;
+  };
+  int LobaParseParallel(LobaValue *v, const char *json);
+  int LobaParseElements(LobaContext *c, const char *stop, size_t *size, int *closed);
+  void LobaParseSpeculate(LobaParseRun *run, const char *guess, const char *stop, int last);
+  void LobaDropElements(LobaContext *c, size_t size);
+  static const char *LobaFindSplit(const char *p, const char *limit);
+  static int LobaIsTrailingSpace(const char *p);
+
+  // 一个压实块及其中尚未释放的片数
+  struct LobaCompactBlock {
+    size_t size;
+    size_t live;
+  };
+  static size_t LobaCompactAlign(size_t n) {
+    return (n + alignof(LobaMember) - 1) & ~(alignof(LobaMember) - 1);
+  }
+  size_t LobaCompactSize(const LobaValue *v);
+  void *LobaCompactTake(char **cursor, const void *src, size_t n, size_t *pieces);
+  void LobaCompactCopy(LobaValue *dst, const LobaValue *src, char **cursor, size_t *pieces);
+  std::map<const char *, LobaCompactBlock>::iterator LobaFindCompact(const void *ptr);
+  void LobaMemoryPiece(const void *ptr, size_t n, size_t *bytes, LobaMemoryStats *stats,
+                       std::vector<const char *> *blocks);
+  void LobaMemoryWalk(const LobaValue *v, LobaMemoryStats *stats, std::vector<const char *> *blocks);
+  // 按起始地址索引, 空时分配与释放不多做任何事
+  std::map<const char *, LobaCompactBlock> compact_;
+
   std::string parser_name_;
+  unsigned parse_threads_ = 1;
+  unsigned stringify_threads_ = 1;
+  int raw_numbers_ = 0;
+  int pack_numbers_ = 0;
+  LobaKeyTable *key_table_ = nullptr;
+  LobaStringifyCache *stringify_cache_ = nullptr;
+  LobaAllocator *allocator_ = nullptr;
+  LobaParseStats *stats_ = nullptr;
+  // 只在 LobaParse / LobaStringify 执行期间指向 stats_
+  LobaParseStats *cur_stats_ = nullptr;
+  // 类的布局不随 LOBA_STATS 变化, 宏只决定是否调用
+  void LobaStatsBegin(LobaContext *c);
+  void LobaStatsEnd(LobaContext *c, size_t bytes);
+  std::chrono::steady_clock::time_point stats_start_;
   const char *LobaParseHex4(const char *p, unsigned int *p_int);
   void LobaEncodeUtf8(LobaContext *p_context, unsigned int u);
 
   void LobaStringifyValue(LobaContext *p_context, const LobaValue *p_value);
-  void LobaStringifyNumber(LobaContext *p_context, const LobaValue *p_value);
-  void LobaStringifyString(LobaContext *p_context, char *s, size_t len);
   void LobaStringifyArray(LobaContext *p_context, const LobaValue *p_value);
+  void LobaStringifyPacked(LobaContext *p_context, const LobaValue *p_value);
+  void LobaStringifyCached(LobaContext *p_context, const LobaValue *p_value);
+  int LobaTryPack(LobaValue *v, const LobaValue *e, size_t size);
   void LobaStringifyObject(LobaContext *p_context, const LobaValue *p_value);
+  void LobaStringifyParallel(LobaContext *p_context, const LobaValue *p_value, int depth);
+  void LobaStringifyRange(LobaContext *p_context, const LobaValue *p_value, size_t begin, size_t end);
+  static size_t LobaStringifyWeight(const LobaValue *p_value);
+  int LobaCanonicalValue(LobaContext *p_context, const LobaValue *p_value, std::vector<size_t> *order);
+  int LobaCanonicalObject(LobaContext *p_context, const LobaValue *p_value, std::vector<size_t> *order);
+  void LobaCanonicalString(LobaContext *p_context, const char *s, size_t len);
+  static size_t LobaCanonicalNumber(char *buffer, double n);
+  static int LobaCompareUtf16(const char *a, size_t alen, const char *b, size_t blen);
+  int LobaCanUseThreads(unsigned threads) const;
 };
 
 inline int LobaJson::LobaParseValue(LobaContext *c, LobaValue *v) {
+  int ret;
   switch (*c->json) {
-    case 'n':return LobaParseLiteral(c, v, "null", LobaType::lobaNull);
-    case 't':return LobaParseLiteral(c, v, "true", LobaType::lobaTrue);
-    case 'f':return LobaParseLiteral(c, v, "false", LobaType::lobaFalse);
-    case '"': return LobaParseString(c, v);
-    case '[': return LobaParseArray(c, v);
-    case '{': return LobaParseObject(c, v);
+    case 'n':ret = LobaParseLiteral(c, v, "null", LobaType::lobaNull);
+      break;
+    case 't':ret = LobaParseLiteral(c, v, "true", LobaType::lobaTrue);
+      break;
+    case 'f':ret = LobaParseLiteral(c, v, "false", LobaType::lobaFalse);
+      break;
+    case '"': ret = LobaParseString(c, v);
+      break;
+    case '[':if (cur_budget_ != nullptr && ++cur_budget_->depth > cur_budget_->limits.max_depth) {
+        return lobaParseTooDeep;
+      }
+      LOBA_STAT(if (++c->depth > cur_stats_->max_depth) cur_stats_->max_depth = c->depth);
+      ret = LobaParseArray(c, v);
+      LOBA_STAT(c->depth--);
+      if (cur_budget_ != nullptr) {
+        cur_budget_->depth--;
+      }
+      break;
+    case '{':if (cur_budget_ != nullptr && ++cur_budget_->depth > cur_budget_->limits.max_depth) {
+        return lobaParseTooDeep;
+      }
+      LOBA_STAT(if (++c->depth > cur_stats_->max_depth) cur_stats_->max_depth = c->depth);
+      ret = LobaParseObject(c, v);
+      LOBA_STAT(c->depth--);
+      if (cur_budget_ != nullptr) {
+        cur_budget_->depth--;
+      }
+      break;
     case '\0':return lobaParseExpectValue;
-    default:return LobaParseNumber(c, v);
+    default:ret = raw_numbers_ ? LobaParseRawNumber(c, v) : LobaParseNumber(c, v);
+      break;
   }
+  LOBA_STAT(if (ret == lobaParseOk) cur_stats_->values[v->type]++);
+  return ret;
 }
 
 inline void LobaJson::LobaParseWhitespace(LobaContext *c) {
   const char *p = c->json;
-  while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') {
+  // 紧凑的 JSON 里多是零个或一个空白, 连续的缩进才交给内核
+  if (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') {
     p++;
+    if (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') {
+      p += LobaGetKernels().scan_space(p);
+    }
   }
   c->json = p;
 }
 
-int LobaJson::LobaParseNumber(LobaContext *c, LobaValue *v) {
-  const char *p = c->json;
+inline const char *LobaJson::LobaScanNumber(const char *p) {
   /* 负号 ... */
   if (*p == '-') {
     p++;
@@ -184,14 +1156,14 @@ int LobaJson::LobaParseNumber(LobaContext *c, LobaValue *v) {
   if (*p == '0') {
     p++;
   } else {
-    if (!ISDIGIT1TO9(*p)) { return lobaParseInvalidValue; }
+    if (!ISDIGIT1TO9(*p)) { return nullptr; }
     for (p++; ISDIGIT(*p); p++) {}
   }
   /* 小数 ... */
   if (*p == '.') {
     p++;
     if (!ISDIGIT(*p)) {
-      return lobaParseInvalidValue;
+      return nullptr;
     }
     for (p++; ISDIGIT(*p); p++) {}
   }
@@ -202,11 +1174,18 @@ int LobaJson::LobaParseNumber(LobaContext *c, LobaValue *v) {
       p++;
     }
     if (!ISDIGIT(*p)) {
-      return lobaParseInvalidValue;
+      return nullptr;
     }
     for (p++; ISDIGIT(*p); p++) {}
   }
+  return p;
+}
 
+int LobaJson::LobaParseNumber(LobaContext *c, LobaValue *v) {
+  const char *p = LobaScanNumber(c->json);
+  if (p == nullptr) {
+    return lobaParseInvalidValue;
+  }
   errno = 0;
   v->u.n = strtod(c->json, NULL);
   if (errno == ERANGE && (v->u.n == HUGE_VAL || v->u.n == -HUGE_VAL)) {
@@ -218,144 +1197,503 @@ int LobaJson::LobaParseNumber(LobaContext *c, LobaValue *v) {
   return lobaParseOk;
 }
 
+// 跳过 strtod, 只记下数字在源文本中的位置
+inline int LobaJson::LobaParseRawNumber(LobaContext *c, LobaValue *v) {
+  const char *p = LobaScanNumber(c->json);
+  if (p == nullptr) {
+    return lobaParseInvalidValue;
+  }
+  v->u.s.s = const_cast<char *>(c->json);
+  v->u.s.len = static_cast<size_t>(p - c->json);
+  v->type = LobaType::lobaRawNumber;
+  c->json = p;
+  return lobaParseOk;
+}
+
 #define LobaInit(v) do { (v)->type = LobaType::lobaNull; } while(0)
 
 inline int LobaJson::LobaParse(LobaValue *v, const char *json) {
   LobaContext c;
   assert(v != nullptr);
+  if (!has_limits_ && LobaCanUseThreads(parse_threads_)) {
+    LobaInit(v);
+    if (LobaParseParallel(v, json)) {
+      return lobaParseOk;
+    }
+  }
   c.json = json;
   c.stack = nullptr;
   c.size = c.top = 0;
+#ifdef LOBA_STATS
+  LobaStatsBegin(&c);
+#endif
+  int ret = LobaParseRoot(&c, v);
+  assert(c.top == 0);
+#ifdef LOBA_STATS
+  LobaStatsEnd(&c, static_cast<size_t>(c.json - json));
+#endif
+  LobaDealloc(c.stack, c.size);
+  return ret;
+}
+
+inline int LobaJson::LobaParseRoot(LobaContext *c, LobaValue *v) {
   LobaInit(v);
-  LobaParseWhitespace(&c);
-  int ret = LobaParseValue(&c, v);
+  LobaParseBudget budget{};
+  if (has_limits_) {
+    // strnlen 最多看 max_input_bytes + 1 个字节, 过长的输入不必读完
+    size_t max_input = limits_.max_input_bytes;
+    if (max_input != SIZE_MAX && strnlen(c->json, max_input + 1) > max_input) {
+      return lobaParseInputTooLarge;
+    }
+    budget.limits = limits_;
+    cur_budget_ = &budget;
+  }
+  LobaParseWhitespace(c);
+  int ret = LobaParseValue(c, v);
   if (ret == lobaParseOk) {
-    LobaParseWhitespace(&c);
-    if (*c.json != '\0') {
-      v->type = LobaType::lobaNull;
+    LobaParseWhitespace(c);
+    if (*c->json != '\0') {
       LobaFree(v);
-      return lobaParseRootNotSingular;
+      ret = lobaParseRootNotSingular;
+    } else if (has_limits_ && budget.bytes > budget.limits.max_alloc_bytes) {
+      // 最后一次分配越过了上限
+      LobaFree(v);
+      ret = lobaParseMemoryLimit;
     }
   }
-  assert(c.top == 0);
-  free(c.stack);
+  cur_budget_ = nullptr;
   return ret;
 }
 
-inline LobaType LobaJson::LobaGetType(const LobaValue *v) {
-  assert(v != nullptr);
-  return v->type;
+inline void LobaJson::LobaSetParseThreads(unsigned threads) {
+  parse_threads_ = threads;
 }
-int LobaJson::LobaParseLiteral(LobaContext *c, LobaValue *v,
-                               const char *literal, LobaType type) {
-  size_t i;
-  EXPECT(c, literal[0]);
-  for (i = 0; literal[i + 1]; i++) {
-    if (c->json[i] != literal[i + 1])
-      return lobaParseInvalidValue;
-  }
-  c->json += i;
-  v->type = type;
-  return lobaParseOk;
+
+inline void LobaJson::LobaSetStringifyThreads(unsigned threads) {
+  stringify_threads_ = threads;
+}
+
+inline void LobaJson::LobaSetRawNumbers(int enable) {
+  raw_numbers_ = enable;
+}
+
+inline void LobaJson::LobaSetPackNumbers(int enable) {
+  pack_numbers_ = enable;
+}
+
+// 统计没有加锁, allocator 也可能不能并发调用, 这两种情况只走单线程
+inline int LobaJson::LobaCanUseThreads(unsigned threads) const {
+  return threads != 1 && stats_ == nullptr && key_table_ == nullptr && stringify_cache_ == nullptr &&
+      (allocator_ == nullptr || allocator_->LobaIsThreadSafe());
+}
+
+inline void LobaJson::LobaSetKeyTable(LobaKeyTable *table) {
+  key_table_ = table;
+}
+
+inline LobaKeyTable *LobaJson::LobaGetKeyTable() const {
+  return key_table_;
+}
+
+inline void LobaJson::LobaSetStringifyCache(LobaStringifyCache *cache) {
+  stringify_cache_ = cache;
+}
+
+inline LobaStringifyCache *LobaJson::LobaGetStringifyCache() const {
+  return stringify_cache_;
+}
+
+inline char *LobaJson::LobaNewKey(const char *key, size_t klen) {
+  if (key_table_ != nullptr) {
+    const char *k = key_table_->LobaIntern(key, klen);
+    if (k != nullptr) {
+      return const_cast<char *>(k);
+    }
+  }
+  char *k = (char *)LobaMalloc(klen + 1);
+  memcpy(k, key, klen);
+  k[klen] = '\0';
+  return k;
+}
+
+inline void LobaJson::LobaFreeKey(char *key, size_t klen) {
+  if (key_table_ == nullptr || !key_table_->LobaOwns(key)) {
+    LobaDealloc(key, klen + 1);
+  }
+}
+
+// 从 c->json 指向的 '[' 或 ',' 之后开始逐个解析元素, 压入 c 的栈;
+// 某个元素之后的 ',' 到达 stop 或者遇到 ']' 时停下, c->json 停在该字符上
+inline int LobaJson::LobaParseElements(LobaContext *c, const char *stop, size_t *size, int *closed) {
+  c->json++;
+  for (;;) {
+    LobaParseWhitespace(c);
+    LobaValue e;
+    LobaInit(&e);
+    int ret = LobaParseValue(c, &e);
+    if (ret != lobaParseOk) {
+      return ret;
+    }
+    memcpy(LobaContextPush(c, sizeof(LobaValue)), &e, sizeof(LobaValue));
+    (*size)++;
+    LobaParseWhitespace(c);
+    if (*c->json == ']') {
+      *closed = 1;
+      return lobaParseOk;
+    }
+    if (*c->json != ',') {
+      return lobaParseMissCommaOrSquareBracket;
+    }
+    if (c->json >= stop) {
+      *closed = 0;
+      return lobaParseOk;
+    }
+    c->json++;
+  }
+}
+
+inline void LobaJson::LobaDropElements(LobaContext *c, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    LobaFree((LobaValue *)LobaContextPop(c, sizeof(LobaValue)));
+  }
+}
+
+// 在 [p, limit) 里找一个像元素边界的 ',': 前面像值的结尾, 后面像值的开头.
+// 不知道 p 是否落在字符串或更深的嵌套里, 只是猜测, 由后续的校验兜底
+inline const char *LobaJson::LobaFindSplit(const char *p, const char *limit) {
+  for (; p < limit; p++) {
+    if (*p != ',') {
+      continue;
+    }
+    const char *q = p - 1;
+    while (*q == ' ' || *q == '\t' || *q == '\n' || *q == '\r') {
+      q--;
+    }
+    const char *r = p + 1;
+    while (*r == ' ' || *r == '\t' || *r == '\n' || *r == '\r') {
+      r++;
+    }
+    if (*r != '\0' && strchr("}]\"el0123456789", *q) != nullptr &&
+        strchr("{[\"-tfn0123456789", *r) != nullptr) {
+      return p;
+    }
+  }
+  return nullptr;
+}
+
+inline int LobaJson::LobaIsTrailingSpace(const char *p) {
+  while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') {
+    p++;
+  }
+  return *p == '\0';
+}
+
+// 从 guess 之后的候选切分点开始解析到 stop, 候选点解析失败就换下一个
+inline void LobaJson::LobaParseSpeculate(LobaParseRun *run, const char *guess, const char *stop,
+                                         int last) {
+  const char *p = guess;
+  run->ok = 0;
+  for (int attempt = 0; attempt < LobaParallelMaxAttempts; attempt++) {
+    const char *s = LobaFindSplit(p, stop);
+    if (s == nullptr) {
+      return;
+    }
+    run->c.json = s;
+    run->size = 0;
+    if (LobaParseElements(&run->c, stop, &run->size, &run->closed) == lobaParseOk &&
+        run->closed == last && (!last || LobaIsTrailingSpace(run->c.json + 1))) {
+      run->start = s;
+      run->end = run->c.json;
+      run->ok = 1;
+      return;
+    }
+    LobaDropElements(&run->c, run->size);
+    run->size = 0;
+    p = s + 1;
+  }
+}
+
+// 根数组按字节数等分成若干块, 除第一块外每块从猜测的切分点开始各自解析.
+// 第一块从 '[' 开始, 一定是对的; 之后按顺序校验每块的起点恰好是前一块停下的位置,
+// 对不上就由主线程从正确的位置串行重解这一块. 返回 0 表示放弃, 由调用者串行解析,
+// 出错时也放弃, 保证错误码与串行解析一致
+inline int LobaJson::LobaParseParallel(LobaValue *v, const char *json) {
+  const char *p = json;
+  while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') {
+    p++;
+  }
+  if (*p != '[') {
+    return 0;
+  }
+  const char *end = p + strlen(p);
+  size_t n = static_cast<size_t>(end - p);
+  size_t threads = parse_threads_ ? parse_threads_ : std::thread::hardware_concurrency();
+  if (threads > n / LobaParallelMinChunk) {
+    threads = n / LobaParallelMinChunk;
+  }
+  if (threads < 2) {
+    return 0;
+  }
+  std::vector<LobaParseRun> runs(threads);
+  std::vector<const char *> guess(threads + 1);
+  for (size_t i = 0; i < threads; i++) {
+    guess[i] = p + n / threads * i;
+    runs[i].c.stack = nullptr;
+    runs[i].c.size = runs[i].c.top = 0;
+    runs[i].c.depth = 0;
+    runs[i].size = 0;
+    runs[i].ok = 0;
+  }
+  guess[threads] = end;
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < threads; i++) {
+    workers.emplace_back([this, &runs, &guess, i, threads] {
+      LobaParseSpeculate(&runs[i], guess[i], guess[i + 1], i + 1 == threads);
+    });
+  }
+  LobaParseRun *first = &runs[0];
+  first->c.json = first->start = p;
+  first->ok = LobaParseElements(&first->c, guess[1], &first->size, &first->closed) == lobaParseOk;
+  first->end = first->c.json;
+  for (std::thread &t : workers) {
+    t.join();
+  }
+
+  int ok = first->ok;
+  size_t used = 0, total = first->size;
+  const char *pos = first->end;
+  int closed = first->closed;
+  for (size_t i = 1; ok && !closed && i < threads; i++) {
+    LobaParseRun *run = &runs[i];
+    if (!run->ok || run->start != pos) {
+      LobaDropElements(&run->c, run->size);
+      run->size = 0;
+      run->c.json = run->start = pos;
+      if (LobaParseElements(&run->c, guess[i + 1], &run->size, &run->closed) != lobaParseOk) {
+        ok = 0;
+        break;
+      }
+      run->end = run->c.json;
+    }
+    pos = run->end;
+    closed = run->closed;
+    total += run->size;
+    used = i;
+  }
+  ok = ok && closed && LobaIsTrailingSpace(pos + 1);
+  if (ok) {
+    LobaValue *e = (LobaValue *)LobaMalloc(total * sizeof(LobaValue));
+    v->type = LobaType::lobaArray;
+    v->u.a.e = e;
+    v->u.a.size = total;
+    for (size_t i = 0; i <= used; i++) {
+      memcpy(e, runs[i].c.stack, runs[i].size * sizeof(LobaValue));
+      e += runs[i].size;
+      runs[i].size = 0;
+    }
+    if (LobaTryPack(v, v->u.a.e, total)) {
+      LobaDealloc(e - total, total * sizeof(LobaValue));
+    }
+  }
+  for (LobaParseRun &run : runs) {
+    LobaDropElements(&run.c, run.size);
+    LobaDealloc(run.c.stack, run.c.size);
+  }
+  return ok;
+}
+
+inline void LobaJson::LobaSetAllocator(LobaAllocator *allocator) {
+  allocator_ = allocator;
+}
+
+inline LobaAllocator *LobaJson::LobaGetAllocator() const {
+  return allocator_;
+}
+
+inline void *LobaJson::LobaMalloc(size_t size) {
+  LOBA_STAT(cur_stats_->mallocs++);
+  if (cur_budget_ != nullptr) {
+    cur_budget_->bytes += size;
+  }
+  return allocator_ ? allocator_->LobaAlloc(size) : malloc(size);
+}
+
+inline void *LobaJson::LobaRealloc(void *ptr, size_t old_size, size_t new_size) {
+  LOBA_STAT(cur_stats_->reallocs++);
+  if (cur_budget_ != nullptr && new_size > old_size) {
+    cur_budget_->bytes += new_size - old_size;
+  }
+  if (!compact_.empty() && ptr != nullptr && LobaFindCompact(ptr) != compact_.end()) {
+    // 压实块里的片不能原地伸缩, 搬到块外
+    void *p = new_size ? LobaMalloc(new_size) : nullptr;
+    if (p != nullptr) {
+      memcpy(p, ptr, old_size < new_size ? old_size : new_size);
+    }
+    LobaDealloc(ptr, old_size);
+    return p;
+  }
+  if (allocator_ != nullptr) {
+    return allocator_->LobaRealloc(ptr, old_size, new_size);
+  }
+  if (new_size == 0) {
+    free(ptr);
+    return nullptr;
+  }
+  return realloc(ptr, new_size);
+}
+
+inline void LobaJson::LobaDealloc(void *ptr, size_t size) {
+  if (ptr == nullptr) {
+    return;
+  }
+  if (!compact_.empty()) {
+    auto it = LobaFindCompact(ptr);
+    if (it != compact_.end()) {
+      if (--it->second.live > 0) {
+        return;
+      }
+      ptr = const_cast<char *>(it->first);
+      size = it->second.size;
+      compact_.erase(it);
+    }
+  }
+  if (allocator_ != nullptr) {
+    allocator_->LobaDealloc(ptr, size);
+  } else {
+    free(ptr);
+  }
+}
+
+inline void LobaJson::LobaSetParseStats(LobaParseStats *stats) {
+  stats_ = stats;
+}
+
+inline void LobaJson::LobaSetParseLimits(const LobaParseLimits *limits) {
+  has_limits_ = limits != nullptr;
+  if (limits == nullptr) {
+    return;
+  }
+  limits_ = *limits;
+  size_t *fields[] = {&limits_.max_input_bytes, &limits_.max_depth, &limits_.max_alloc_bytes,
+                      &limits_.max_string_length, &limits_.max_elements};
+  for (size_t *field : fields) {
+    if (*field == 0) {
+      *field = SIZE_MAX;
+    }
+  }
+}
+
+// 有预算时每放入一个元素或成员检查一次: 总个数, 以及到目前为止的分配量.
+// 解析栈按 1.5 倍增长, 分配量最多越过上限一次增长的大小就会被发现
+inline int LobaJson::LobaCheckBudget() {
+  if (++cur_budget_->elements > cur_budget_->limits.max_elements) {
+    return lobaParseTooManyElements;
+  }
+  if (cur_budget_->bytes > cur_budget_->limits.max_alloc_bytes) {
+    return lobaParseMemoryLimit;
+  }
+  return lobaParseOk;
+}
+
+inline void LobaJson::LobaStatsBegin(LobaContext *c) {
+  c->depth = 0;
+  if ((cur_stats_ = stats_) != nullptr) {
+    memset(cur_stats_, 0, sizeof(LobaParseStats));
+    stats_start_ = std::chrono::steady_clock::now();
+  }
+}
+
+inline void LobaJson::LobaStatsEnd(LobaContext *c, size_t bytes) {
+  (void)c;
+  (void)bytes;
+  LOBA_STAT(cur_stats_->bytes = bytes;
+            cur_stats_->elapsed_ns = static_cast<unsigned long long>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - stats_start_).count()));
+  cur_stats_ = nullptr;
+}
+
+inline LobaType LobaJson::LobaGetType(const LobaValue *v) {
+  assert(v != nullptr);
+  switch (v->type) {
+    case LobaType::lobaRawNumber:return LobaType::lobaNumber;
+    case LobaType::lobaPackedArray:return LobaType::lobaArray;
+    default:return v->type;
+  }
+}
+int LobaJson::LobaParseLiteral(LobaContext *c, LobaValue *v,
+                               const char *literal, LobaType type) {
+  size_t i;
+  EXPECT(c, literal[0]);
+  for (i = 0; literal[i + 1]; i++) {
+    if (c->json[i] != literal[i + 1])
+      return lobaParseInvalidValue;
+  }
+  c->json += i;
+  v->type = type;
+  return lobaParseOk;
 }
 
 #define  PUTC(c, ch) do { *(char*)LobaContextPush(c, sizeof(char)) = (ch); } while(0)
 #define PUTS(c, s, len)     memcpy(LobaContextPush(c, len), s, len)
 #define STRING_ERROR(ret) do { c->top = head; return ret; } while(0)
 int LobaJson::LobaParseString(LobaContext *c, LobaValue *v) {
-  size_t head = c->top;
-  size_t len = 0;
-  const char *p;
-  EXPECT(c, '\"');
-  p = c->json;
-  for (;;) {
-    char ch = *p++;
-    switch (ch) {
-      case '\"':len = c->top - head;
-        LobaSetString(v, static_cast<const char *>(LobaContextPop(c, len)), len);
-        c->json = p;
-        return lobaParseOk;
-      case '\0':c->top = head;
-        return lobaParseMissQuotationMark;
-      case '\\':
-        switch (*p++) {
-          case '\"':PUTC(c, '\"');
-            break;
-          case '\\':PUTC(c, '\\');
-            break;
-          case '/':PUTC(c, '/');
-            break;
-          case 'b':PUTC(c, '\b');
-            break;
-          case 'f':PUTC(c, '\f');
-            break;
-          case 'n':PUTC(c, '\n');
-            break;
-          case 'r':PUTC(c, '\r');
-            break;
-          case 't':PUTC(c, '\t');
-            break;
-          case 'u': {
-            unsigned u;
-            if (!(p = LobaParseHex4(p, &u)))
-              STRING_ERROR(lobaParseInvalidUnicodeHex);
-            if (u >= 0xD800 && u <= 0xDBFF) {
-              if (*p++ != '\\')
-                STRING_ERROR(lobaParseInvalidUnicodeSurrogate);
-              if (*p++ != 'u')
-                STRING_ERROR(lobaParseInvalidUnicodeSurrogate);
-              unsigned u2;
-              if (!(p = LobaParseHex4(p, &u2)))
-                STRING_ERROR(lobaParseInvalidUnicodeHex);
-              if (u2 < 0xDC00 || u2 > 0xDFFF)
-                STRING_ERROR(lobaParseInvalidUnicodeSurrogate);
-              u = (((u - 0xD800) << 10) | (u2 - 0xDC00)) + 0x10000;
-            }
-            LobaEncodeUtf8(c, u);
-            break;
-          }
-          default:c->top = head;
-            return lobaParseInvalidStringEscape;
-        }
-        break;
-      default:
-        if (static_cast<unsigned char>(ch) < 0x20) {
-          c->top = head;
-          return lobaParseInvalidStringChar;
-        }
-        PUTC(c, ch);
-    }
+  char *s;
+  size_t len;
+  int ret = LobaParseStringRaw(c, &s, &len);
+  if (ret == lobaParseOk) {
+    LobaSetString(v, s, len);
   }
+  return ret;
 }
 
 void LobaJson::LobaFree(LobaValue *p_value) {
   assert(p_value != nullptr);
   size_t i;
+  if (stringify_cache_ != nullptr &&
+      (p_value->type == LobaType::lobaArray || p_value->type == LobaType::lobaObject)) {
+    stringify_cache_->LobaMarkDirty(p_value);
+  }
   switch (p_value->type) {
-    case LobaType::lobaString:free(p_value->u.s.s);
+    case LobaType::lobaString:LobaDealloc(p_value->u.s.s, p_value->u.s.len + 1);
       break;
     case LobaType::lobaArray:
       for (i = 0; i < p_value->u.a.size; i++) {
         LobaFree(&p_value->u.a.e[i]);
       }
-      free(p_value->u.a.e);
+      LobaDealloc(p_value->u.a.e, p_value->u.a.size * sizeof(LobaValue));
+      break;
+    case LobaType::lobaPackedArray:LobaDealloc(p_value->u.p.d, p_value->u.p.size * sizeof(double));
       break;
     case LobaType::lobaObject:
       for (i = 0; i < p_value->u.o.size; i++) {
-        free(p_value->u.o.m[i].k);
+        LobaFreeKey(p_value->u.o.m[i].k, p_value->u.o.m[i].klen);
         LobaFree(&p_value->u.o.m[i].v);
       }
-      free(p_value->u.o.m);
+      LobaDealloc(p_value->u.o.m, p_value->u.o.size * sizeof(LobaMember));
       break;
   }
   p_value->type = LobaType::lobaNull;
 }
 
 double LobaJson::LobaGetNumber(const LobaValue *v) {
-  assert(v != nullptr && v->type == LobaType::lobaNumber);
+  assert(v != nullptr && (v->type == LobaType::lobaNumber || v->type == LobaType::lobaRawNumber));
+  if (v->type == LobaType::lobaRawNumber) {
+    // 数字之后紧跟的是分隔符或 '\0', strtod 恰好停在数字末尾
+    return strtod(v->u.s.s, nullptr);
+  }
   return v->u.n;
 }
 
+inline const char *LobaJson::LobaGetRawNumber(const LobaValue *v, size_t *length) {
+  assert(v != nullptr && length != nullptr);
+  if (v->type != LobaType::lobaRawNumber) {
+    return nullptr;
+  }
+  *length = v->u.s.len;
+  return v->u.s.s;
+}
+
 void LobaJson::LobaSetNumber(LobaValue *v, double n) {
   LobaFree(v);
   v->u.n = n;
@@ -368,7 +1706,7 @@ const char *LobaJson::LobaGetString(const LobaValue *v) {
 void LobaJson::LobaSetString(LobaValue *v, const char *s, size_t len) {
   assert(v != nullptr && (s != nullptr || len == 0));
   LobaFree(v);
-  v->u.s.s = (char *)malloc(len + 1);
+  v->u.s.s = (char *)LobaMalloc(len + 1);
   memcpy(v->u.s.s, s, len);
   v->u.s.s[len] = '\0';
   v->u.s.len = len;
@@ -391,20 +1729,24 @@ void LobaJson::LobaSetBoolean(LobaValue *v, LobaType b) {
 }
 
 #define LobaContextStackSize 256
+// "%.17g" 最长的输出 (如 -2.2250738585072014e-308) 加上结尾的 '\0'
+#define LobaNumberMaxChars 25
 void *LobaJson::LobaContextPush(LobaContext *c, size_t size) {
   void *ret;
   assert(size > 0);
   if (c->top + size >= c->size) {
+    size_t old_size = c->size;
     if (c->size == 0) {
       c->size = LobaContextStackSize;
     }
     while (c->top + size >= c->size) {
       c->size += c->size >> 1;
     }
-    c->stack = (char *)realloc(c->stack, c->size);
+    c->stack = (char *)LobaRealloc(c->stack, old_size, c->size);
   }
   ret = c->stack + c->top;
   c->top += size; //["][h][e][l][l][o]["]
+  LOBA_STAT(if (c->top > cur_stats_->peak_stack) cur_stats_->peak_stack = c->top);
   return ret;
 }
 
@@ -413,6 +1755,14 @@ void *LobaJson::LobaContextPop(LobaContext *c, size_t size) {
   return c->stack + (c->top -= size);
 }
 
+inline char *LobaJson::LobaContextRelease(LobaContext *c, size_t length) {
+  if (allocator_ != nullptr && length != c->size) {
+    c->stack = (char *)LobaRealloc(c->stack, c->size, length);
+    c->size = length;
+  }
+  return c->stack;
+}
+
 // 4位16进制字符转换为一个16进制数 /u0001
 const char *LobaJson::LobaParseHex4(const char *p, unsigned int *p_int) {
   *p_int = 0;
@@ -451,15 +1801,89 @@ void LobaJson::LobaEncodeUtf8(LobaContext *p_context, unsigned int u) {
 }
 
 size_t LobaJson::LobaGetArraySize(const LobaValue *v) {
-  assert(v != nullptr && v->type == LobaType::lobaArray);
-  return v->u.a.size;
+  assert(v != nullptr && (v->type == LobaType::lobaArray || v->type == LobaType::lobaPackedArray));
+  return v->type == LobaType::lobaPackedArray ? v->u.p.size : v->u.a.size;
 }
 
+#define LobaPackMinSize 4
 LobaValue *LobaJson::LobaGetArrayElement(const LobaValue *v, size_t index) {
-  assert(v != nullptr && v->type == LobaType::lobaArray);
+  assert(v != nullptr && (v->type == LobaType::lobaArray || v->type == LobaType::lobaPackedArray));
+  // 交出去的元素可以被修改, 紧凑数组只能先展开
+  if (v->type == LobaType::lobaPackedArray) {
+    LobaUnpackArray(const_cast<LobaValue *>(v));
+  }
   assert(index < v->u.a.size);
   return &v->u.a.e[index];
 }
+
+inline const LobaValue *LobaJson::LobaGetArrayElement(const LobaValue *v, size_t index,
+                                                      LobaValue *proxy) {
+  assert(v != nullptr && proxy != nullptr);
+  if (v->type == LobaType::lobaPackedArray) {
+    assert(index < v->u.p.size);
+    proxy->type = LobaType::lobaNumber;
+    proxy->u.n = v->u.p.d[index];
+    return proxy;
+  }
+  return LobaGetArrayElement(v, index);
+}
+
+inline const double *LobaJson::LobaGetPackedArray(const LobaValue *v) {
+  assert(v != nullptr);
+  return v->type == LobaType::lobaPackedArray ? v->u.p.d : nullptr;
+}
+
+inline void LobaJson::LobaSetPackedArray(LobaValue *v, const double *d, size_t size) {
+  assert(v != nullptr && (d != nullptr || size == 0));
+  LobaFree(v);
+  if (size == 0) {
+    v->u.a.e = nullptr;
+    v->u.a.size = 0;
+    v->type = LobaType::lobaArray;
+    return;
+  }
+  v->u.p.d = (double *)LobaMalloc(size * sizeof(double));
+  memcpy(v->u.p.d, d, size * sizeof(double));
+  v->u.p.size = size;
+  v->type = LobaType::lobaPackedArray;
+}
+
+// 打开了 pack_numbers_ 且 e 全是数字时把 v 设成紧凑数组, e 仍归调用者
+inline int LobaJson::LobaTryPack(LobaValue *v, const LobaValue *e, size_t size) {
+  if (!pack_numbers_ || size < LobaPackMinSize) {
+    return 0;
+  }
+  for (size_t i = 0; i < size; i++) {
+    if (e[i].type != LobaType::lobaNumber) {
+      return 0;
+    }
+  }
+  double *d = (double *)LobaMalloc(size * sizeof(double));
+  for (size_t i = 0; i < size; i++) {
+    d[i] = e[i].u.n;
+  }
+  v->type = LobaType::lobaPackedArray;
+  v->u.p.d = d;
+  v->u.p.size = size;
+  return 1;
+}
+
+inline void LobaJson::LobaUnpackArray(LobaValue *v) {
+  assert(v != nullptr);
+  if (v->type != LobaType::lobaPackedArray) {
+    return;
+  }
+  size_t size = v->u.p.size;
+  LobaValue *e = (LobaValue *)LobaMalloc(size * sizeof(LobaValue));
+  for (size_t i = 0; i < size; i++) {
+    e[i].type = LobaType::lobaNumber;
+    e[i].u.n = v->u.p.d[i];
+  }
+  LobaDealloc(v->u.p.d, size * sizeof(double));
+  v->u.a.e = e;
+  v->u.a.size = size;
+  v->type = LobaType::lobaArray;
+}
 int LobaJson::LobaParseArray(LobaContext *c, LobaValue *v) {
   size_t size = 0;
   int ret;
@@ -481,19 +1905,25 @@ int LobaJson::LobaParseArray(LobaContext *c, LobaValue *v) {
     }
     memcpy(LobaContextPush(c, sizeof(LobaValue)), &e, sizeof(LobaValue));
     size++;
+    if (cur_budget_ != nullptr && (ret = LobaCheckBudget()) != lobaParseOk) {
+      break;
+    }
     LobaParseWhitespace(c);
     if (*c->json == ',') {
       c->json++;
     } else if (*c->json == ']') {
       c->json++;
+      LobaValue *e = (LobaValue *)LobaContextPop(c, size * sizeof(LobaValue));
+      if (LobaTryPack(v, e, size)) {
+        return lobaParseOk;
+      }
       v->type = LobaType::lobaArray;
       v->u.a.size = size;
-      size *= sizeof(LobaValue);
-      memcpy(v->u.a.e = (LobaValue *)malloc(size), LobaContextPop(c, size), size);
+      memcpy(v->u.a.e = (LobaValue *)LobaMalloc(size * sizeof(LobaValue)), e, size * sizeof(LobaValue));
       return lobaParseOk;
     } else {
-      c->top = 0;
-      return lobaParseMissCommaOrSquareBracket;
+      ret = lobaParseMissCommaOrSquareBracket;
+      break;
     }
   }
   for (size_t i = 0; i < size; i++) {
@@ -528,8 +1958,7 @@ int LobaJson::LobaParseObject(LobaContext *c, LobaValue *v) {
     if ((ret = LobaParseStringRaw(c, &str, &m.klen)) != lobaParseOk) {
       break;
     }
-    memcpy(m.k = (char *)malloc(m.klen + 1), str, m.klen);
-    m.k[m.klen] = '\0';
+    m.k = LobaNewKey(str, m.klen);
 
     LobaParseWhitespace(c);
     if (*c->json != ':') {
@@ -545,6 +1974,9 @@ int LobaJson::LobaParseObject(LobaContext *c, LobaValue *v) {
     memcpy(LobaContextPush(c, sizeof(LobaMember)), &m, sizeof(LobaMember));
     size++;
     m.k = nullptr;
+    if (cur_budget_ != nullptr && (ret = LobaCheckBudget()) != lobaParseOk) {
+      break;
+    }
 
     LobaParseWhitespace(c);
     if (*c->json == ',') {
@@ -554,23 +1986,124 @@ int LobaJson::LobaParseObject(LobaContext *c, LobaValue *v) {
       v->type = LobaType::lobaObject;
       v->u.o.size = size;
       size *= sizeof(LobaMember);
-      memcpy(v->u.o.m = (LobaMember *)malloc(size), LobaContextPop(c, size), size);
+      memcpy(v->u.o.m = (LobaMember *)LobaMalloc(size), LobaContextPop(c, size), size);
       return lobaParseOk;
     } else {
       ret = lobaParseMissCommaOrCurlyBracket;
       break;
     }
   }
-  free(m.k);
+  if (m.k != nullptr) {
+    LobaFreeKey(m.k, m.klen);
+  }
   for (size_t i = 0; i < size; i++) {
     LobaMember *m = (LobaMember *)LobaContextPop(c, sizeof(LobaMember));
-    free(m->k);
+    LobaFreeKey(m->k, m->klen);
     LobaFree(&m->v);
   }
   v->type = lobaNull;
   return ret;
 }
 
+// 与 LobaParseValue 的语法和错误码一致, 只是不建树. 不递归, 未闭合的括号记在 c 的栈上,
+// 嵌套超过 max_depth 层时返回 lobaParseTooDeep; 有预算时同样检查深度、元素数和字符串长度
+inline int LobaJson::LobaSkipValue(LobaContext *c, size_t max_depth) {
+  LobaValue tmp;
+  char *str;
+  size_t len;
+  int ret;
+  size_t head = c->top;
+  size_t depth = 0;
+  if (cur_budget_ != nullptr && cur_budget_->limits.max_depth - cur_budget_->depth < max_depth) {
+    max_depth = cur_budget_->limits.max_depth - cur_budget_->depth;
+  }
+  // 1: 下一个是对象的键
+  int key = 0;
+  for (;;) {
+    if (key) {
+      LobaParseWhitespace(c);
+      if (*c->json != '"') {
+        ret = lobaParseMissKey;
+        break;
+      }
+      if ((ret = LobaParseStringRaw(c, &str, &len)) != lobaParseOk) {
+        break;
+      }
+      LobaParseWhitespace(c);
+      if (*c->json != ':') {
+        ret = lobaParseMissColon;
+        break;
+      }
+      c->json++;
+      key = 0;
+    }
+    if (depth > 0) {
+      LobaParseWhitespace(c);
+    }
+    switch (*c->json) {
+      case 'n':ret = LobaParseLiteral(c, &tmp, "null", LobaType::lobaNull);
+        break;
+      case 't':ret = LobaParseLiteral(c, &tmp, "true", LobaType::lobaTrue);
+        break;
+      case 'f':ret = LobaParseLiteral(c, &tmp, "false", LobaType::lobaFalse);
+        break;
+      case '"':ret = LobaParseStringRaw(c, &str, &len);
+        break;
+      case '[':
+      case '{': {
+        // 空容器也算一层, 与 LobaParseValue 相同
+        if (depth == max_depth) {
+          ret = lobaParseTooDeep;
+          break;
+        }
+        char open = *c->json++;
+        LobaParseWhitespace(c);
+        if (*c->json == (open == '[' ? ']' : '}')) {
+          c->json++;
+          ret = lobaParseOk;
+          break;
+        }
+        depth++;
+        *(char *)LobaContextPush(c, sizeof(char)) = open;
+        key = open == '{';
+        continue;
+      }
+      case '\0':ret = lobaParseExpectValue;
+        break;
+      default:ret = LobaParseNumber(c, &tmp);
+        break;
+    }
+    if (ret != lobaParseOk) {
+      break;
+    }
+    // 一个值结束, 收掉之后的结束括号, 直到遇到逗号. 容器里的每个值都计入预算
+    while (depth > 0) {
+      if (cur_budget_ != nullptr && (ret = LobaCheckBudget()) != lobaParseOk) {
+        break;
+      }
+      LobaParseWhitespace(c);
+      char open = c->stack[c->top - 1];
+      if (*c->json == ',') {
+        c->json++;
+        key = open == '{';
+        break;
+      }
+      if (*c->json != (open == '[' ? ']' : '}')) {
+        ret = open == '[' ? lobaParseMissCommaOrSquareBracket : lobaParseMissCommaOrCurlyBracket;
+        break;
+      }
+      c->json++;
+      c->top--;
+      depth--;
+    }
+    if (ret != lobaParseOk || depth == 0) {
+      break;
+    }
+  }
+  c->top = head;
+  return ret;
+}
+
 size_t LobaJson::LobaGetObjectSize(const LobaValue *v) {
   assert(v != nullptr && v->type == LobaType::lobaObject);
   return v->u.o.size;
@@ -590,15 +2123,341 @@ LobaValue *LobaJson::LobaGetObjectValue(const LobaValue *v, size_t index) {
   assert(index < v->u.o.size);
   return &v->u.o.m[index].v;
 }
+inline size_t LobaJson::LobaFindObjectIndex(const LobaValue *v, const char *key, size_t klen) {
+  assert(v != nullptr && v->type == LobaType::lobaObject && key != nullptr);
+  for (size_t i = 0; i < v->u.o.size; i++) {
+    if (v->u.o.m[i].k == key || (v->u.o.m[i].klen == klen && memcmp(v->u.o.m[i].k, key, klen) == 0)) {
+      return i;
+    }
+  }
+  return LOBA_KEY_NOT_EXIST;
+}
+inline LobaValue *LobaJson::LobaFindObjectValue(const LobaValue *v, const char *key, size_t klen) {
+  size_t index = LobaFindObjectIndex(v, key, klen);
+  return index != LOBA_KEY_NOT_EXIST ? &v->u.o.m[index].v : nullptr;
+}
+
+// 深拷贝 src 到 dst, dst 原有内容会被释放
+inline void LobaJson::LobaCopy(LobaValue *dst, const LobaValue *src) {
+  assert(dst != nullptr && src != nullptr && src != dst);
+  size_t i;
+  switch (src->type) {
+    case LobaType::lobaString:LobaSetString(dst, src->u.s.s, src->u.s.len);
+      break;
+    case LobaType::lobaPackedArray:LobaSetPackedArray(dst, src->u.p.d, src->u.p.size);
+      break;
+    case LobaType::lobaArray:LobaFree(dst);
+      dst->u.a.size = src->u.a.size;
+      dst->u.a.e = src->u.a.size ? (LobaValue *)LobaMalloc(src->u.a.size * sizeof(LobaValue)) : nullptr;
+      for (i = 0; i < src->u.a.size; i++) {
+        LobaInit(&dst->u.a.e[i]);
+        LobaCopy(&dst->u.a.e[i], &src->u.a.e[i]);
+      }
+      dst->type = LobaType::lobaArray;
+      break;
+    case LobaType::lobaObject:LobaFree(dst);
+      dst->u.o.size = src->u.o.size;
+      dst->u.o.m = src->u.o.size ? (LobaMember *)LobaMalloc(src->u.o.size * sizeof(LobaMember)) : nullptr;
+      for (i = 0; i < src->u.o.size; i++) {
+        LobaMember *m = &dst->u.o.m[i];
+        m->klen = src->u.o.m[i].klen;
+        m->k = LobaNewKey(src->u.o.m[i].k, m->klen);
+        LobaInit(&m->v);
+        LobaCopy(&m->v, &src->u.o.m[i].v);
+      }
+      dst->type = LobaType::lobaObject;
+      break;
+    default:LobaFree(dst);
+      memcpy(dst, src, sizeof(LobaValue));
+      break;
+  }
+}
+
+// 转移所有权, src 变为 null
+inline void LobaJson::LobaMove(LobaValue *dst, LobaValue *src) {
+  assert(dst != nullptr && src != nullptr && src != dst);
+  LobaFree(dst);
+  memcpy(dst, src, sizeof(LobaValue));
+  LobaInit(src);
+}
+
+inline void LobaJson::LobaSwap(LobaValue *lhs, LobaValue *rhs) {
+  assert(lhs != nullptr && rhs != nullptr);
+  if (lhs != rhs) {
+    LobaValue temp;
+    memcpy(&temp, lhs, sizeof(LobaValue));
+    memcpy(lhs, rhs, sizeof(LobaValue));
+    memcpy(rhs, &temp, sizeof(LobaValue));
+  }
+}
+
+inline std::map<const char *, LobaJson::LobaCompactBlock>::iterator LobaJson::LobaFindCompact(
+    const void *ptr) {
+  const char *p = static_cast<const char *>(ptr);
+  auto it = compact_.upper_bound(p);
+  if (it == compact_.begin()) {
+    return compact_.end();
+  }
+  --it;
+  return p < it->first + it->second.size ? it : compact_.end();
+}
+
+// 压实后整棵树所需的字节数, 每一片都按 LobaMember 的对齐取整
+inline size_t LobaJson::LobaCompactSize(const LobaValue *v) {
+  size_t n = 0, i;
+  switch (v->type) {
+    case LobaType::lobaString:n = LobaCompactAlign(v->u.s.len + 1);
+      break;
+    case LobaType::lobaPackedArray:n = LobaCompactAlign(v->u.p.size * sizeof(double));
+      break;
+    case LobaType::lobaArray:n = LobaCompactAlign(v->u.a.size * sizeof(LobaValue));
+      for (i = 0; i < v->u.a.size; i++) {
+        n += LobaCompactSize(&v->u.a.e[i]);
+      }
+      break;
+    case LobaType::lobaObject:n = LobaCompactAlign(v->u.o.size * sizeof(LobaMember));
+      for (i = 0; i < v->u.o.size; i++) {
+        const LobaMember *m = &v->u.o.m[i];
+        if (key_table_ == nullptr || !key_table_->LobaOwns(m->k)) {
+          n += LobaCompactAlign(m->klen + 1);
+        }
+        n += LobaCompactSize(&m->v);
+      }
+      break;
+    default:break;
+  }
+  return n;
+}
+
+inline void *LobaJson::LobaCompactTake(char **cursor, const void *src, size_t n, size_t *pieces) {
+  void *p = *cursor;
+  if (src != nullptr) {
+    memcpy(p, src, n);
+  }
+  *cursor += LobaCompactAlign(n);
+  (*pieces)++;
+  return p;
+}
+
+// 先放容器自己的数组, 再依次放每个孩子的内容, 即深度优先的先序
+inline void LobaJson::LobaCompactCopy(LobaValue *dst, const LobaValue *src, char **cursor, size_t *pieces) {
+  size_t i;
+  memcpy(dst, src, sizeof(LobaValue));
+  switch (src->type) {
+    case LobaType::lobaString:
+      dst->u.s.s = (char *)LobaCompactTake(cursor, src->u.s.s, src->u.s.len + 1, pieces);
+      break;
+    case LobaType::lobaPackedArray:
+      dst->u.p.d = (double *)LobaCompactTake(cursor, src->u.p.d, src->u.p.size * sizeof(double), pieces);
+      break;
+    case LobaType::lobaArray:
+      if (src->u.a.size == 0) {
+        break;
+      }
+      dst->u.a.e = (LobaValue *)LobaCompactTake(cursor, nullptr, src->u.a.size * sizeof(LobaValue), pieces);
+      for (i = 0; i < src->u.a.size; i++) {
+        LobaCompactCopy(&dst->u.a.e[i], &src->u.a.e[i], cursor, pieces);
+      }
+      break;
+    case LobaType::lobaObject:
+      if (src->u.o.size == 0) {
+        break;
+      }
+      dst->u.o.m = (LobaMember *)LobaCompactTake(cursor, nullptr, src->u.o.size * sizeof(LobaMember), pieces);
+      for (i = 0; i < src->u.o.size; i++) {
+        const LobaMember *from = &src->u.o.m[i];
+        LobaMember *to = &dst->u.o.m[i];
+        to->klen = from->klen;
+        to->k = from->k;
+        if (key_table_ == nullptr || !key_table_->LobaOwns(from->k)) {
+          to->k = (char *)LobaCompactTake(cursor, from->k, from->klen + 1, pieces);
+        }
+        LobaCompactCopy(&to->v, &from->v, cursor, pieces);
+      }
+      break;
+    default:break;
+  }
+}
+
+inline void LobaJson::LobaCompact(LobaValue *v) {
+  assert(v != nullptr);
+  size_t size = LobaCompactSize(v);
+  if (size == 0) {
+    return;
+  }
+  char *block = (char *)LobaMalloc(size);
+  char *cursor = block;
+  size_t pieces = 0;
+  LobaValue tmp;
+  LobaCompactCopy(&tmp, v, &cursor, &pieces);
+  assert(cursor == block + size);
+  // 旧树可能本身就在某个压实块里, 先释放再登记新块
+  LobaFree(v);
+  compact_[block] = LobaCompactBlock{size, pieces};
+  memcpy(v, &tmp, sizeof(LobaValue));
+}
+
+inline void LobaJson::LobaAdoptCompact(LobaJson *from, const LobaValue *v) {
+  assert(from != nullptr && v != nullptr);
+  if (from == this || from->compact_.empty()) {
+    return;
+  }
+  LobaMemoryStats stats = {};
+  std::vector<const char *> blocks;
+  from->LobaMemoryWalk(v, &stats, &blocks);
+  for (const char *block : blocks) {
+    auto it = from->compact_.find(block);
+    if (it != from->compact_.end()) {
+      compact_.insert(*it);
+      from->compact_.erase(it);
+    }
+  }
+}
+
+inline void LobaJson::LobaMemoryPiece(const void *ptr, size_t n, size_t *bytes, LobaMemoryStats *stats,
+                                      std::vector<const char *> *blocks) {
+  *bytes += n;
+  auto it = compact_.empty() ? compact_.end() : LobaFindCompact(ptr);
+  if (it != compact_.end()) {
+    stats->slack += LobaCompactAlign(n) - n;
+    blocks->push_back(it->first);
+    return;
+  }
+  stats->blocks++;
+#ifdef __GLIBC__
+  if (allocator_ == nullptr) {
+    stats->slack += malloc_usable_size(const_cast<void *>(ptr)) - n + sizeof(size_t);
+  }
+#endif
+}
+
+inline void LobaJson::LobaMemoryWalk(const LobaValue *v, LobaMemoryStats *stats,
+                                     std::vector<const char *> *blocks) {
+  size_t i;
+  switch (v->type) {
+    case LobaType::lobaString:LobaMemoryPiece(v->u.s.s, v->u.s.len + 1, &stats->strings, stats, blocks);
+      break;
+    case LobaType::lobaPackedArray:
+      LobaMemoryPiece(v->u.p.d, v->u.p.size * sizeof(double), &stats->nodes, stats, blocks);
+      break;
+    case LobaType::lobaArray:
+      if (v->u.a.size > 0) {
+        LobaMemoryPiece(v->u.a.e, v->u.a.size * sizeof(LobaValue), &stats->nodes, stats, blocks);
+      }
+      for (i = 0; i < v->u.a.size; i++) {
+        LobaMemoryWalk(&v->u.a.e[i], stats, blocks);
+      }
+      break;
+    case LobaType::lobaObject:
+      if (v->u.o.size > 0) {
+        LobaMemoryPiece(v->u.o.m, v->u.o.size * sizeof(LobaMember), &stats->nodes, stats, blocks);
+      }
+      for (i = 0; i < v->u.o.size; i++) {
+        const LobaMember *m = &v->u.o.m[i];
+        if (key_table_ == nullptr || !key_table_->LobaOwns(m->k)) {
+          LobaMemoryPiece(m->k, m->klen + 1, &stats->keys, stats, blocks);
+        }
+        LobaMemoryWalk(&m->v, stats, blocks);
+      }
+      break;
+    default:break;
+  }
+}
+
+inline void LobaJson::LobaMemoryUsage(const LobaValue *v, LobaMemoryStats *stats) {
+  assert(v != nullptr && stats != nullptr);
+  std::vector<const char *> blocks;
+  memset(stats, 0, sizeof(LobaMemoryStats));
+  LobaMemoryWalk(v, stats, &blocks);
+  std::sort(blocks.begin(), blocks.end());
+  stats->blocks += static_cast<size_t>(std::unique(blocks.begin(), blocks.end()) - blocks.begin());
+  // 压实块中已释放的片留下的空洞不计入
+  stats->total = stats->nodes + stats->strings + stats->keys + stats->slack;
+}
+
+// 对象比较与成员顺序无关
+inline int LobaJson::LobaIsEqual(const LobaValue *lhs, const LobaValue *rhs) {
+  assert(lhs != nullptr && rhs != nullptr);
+  size_t i;
+  if (lhs->type == LobaType::lobaPackedArray || rhs->type == LobaType::lobaPackedArray) {
+    if (LobaGetType(lhs) != LobaType::lobaArray || LobaGetType(rhs) != LobaType::lobaArray ||
+        LobaGetArraySize(lhs) != LobaGetArraySize(rhs)) {
+      return 0;
+    }
+    for (i = 0; i < LobaGetArraySize(lhs); i++) {
+      LobaValue x, y;
+      if (!LobaIsEqual(LobaGetArrayElement(lhs, i, &x), LobaGetArrayElement(rhs, i, &y))) {
+        return 0;
+      }
+    }
+    return 1;
+  }
+  if (lhs->type == LobaType::lobaRawNumber || rhs->type == LobaType::lobaRawNumber) {
+    return LobaGetType(lhs) == LobaType::lobaNumber && LobaGetType(rhs) == LobaType::lobaNumber &&
+        LobaGetNumber(lhs) == LobaGetNumber(rhs);
+  }
+  if (lhs->type != rhs->type) {
+    return 0;
+  }
+  switch (lhs->type) {
+    case LobaType::lobaString:
+      return lhs->u.s.len == rhs->u.s.len &&
+          memcmp(lhs->u.s.s, rhs->u.s.s, lhs->u.s.len) == 0;
+    case LobaType::lobaNumber:return lhs->u.n == rhs->u.n;
+    case LobaType::lobaArray:
+      if (lhs->u.a.size != rhs->u.a.size) {
+        return 0;
+      }
+      for (i = 0; i < lhs->u.a.size; i++) {
+        if (!LobaIsEqual(&lhs->u.a.e[i], &rhs->u.a.e[i])) {
+          return 0;
+        }
+      }
+      return 1;
+    case LobaType::lobaObject:
+      if (lhs->u.o.size != rhs->u.o.size) {
+        return 0;
+      }
+      for (i = 0; i < lhs->u.o.size; i++) {
+        // 成员顺序相同且键驻留在同一张表时, 同一下标的指针比较就能命中
+        const LobaValue *r = rhs->u.o.m[i].k == lhs->u.o.m[i].k ? &rhs->u.o.m[i].v :
+            LobaFindObjectValue(rhs, lhs->u.o.m[i].k, lhs->u.o.m[i].klen);
+        if (r == nullptr || !LobaIsEqual(&lhs->u.o.m[i].v, r)) {
+          return 0;
+        }
+      }
+      return 1;
+    default:return 1;
+  }
+}
+
 int LobaJson::LobaParseStringRaw(LobaContext *c, char **str, size_t *len) {
   size_t head = c->top;
   const char *p;
+  const LobaKernels &kernels = LobaGetKernels();
   EXPECT(c, '\"');
   p = c->json;
   for (;;) {
+    // 不需要转义的 ASCII 字节和校验过的 UTF-8 序列整段拷贝
+    size_t run = kernels.scan_utf8(p);
+    if (cur_budget_ != nullptr) {
+      // 在放上解析栈之前检查, 超长的字符串不会先整段拷贝. 这些字节之后还要拷进树里
+      size_t total = c->top - head + run;
+      if (total > cur_budget_->limits.max_string_length)
+        STRING_ERROR(lobaParseStringTooLong);
+      if (cur_budget_->bytes + total > cur_budget_->limits.max_alloc_bytes)
+        STRING_ERROR(lobaParseMemoryLimit);
+    }
+    if (run > 0) {
+      PUTS(c, p, run);
+      p += run;
+    }
     char ch = *p++;
     switch (ch) {
       case '\"':*len = c->top - head;
+        // 转义序列在上面的检查之后放入, 最后再核对一次
+        if (cur_budget_ != nullptr && *len > cur_budget_->limits.max_string_length)
+          STRING_ERROR(lobaParseStringTooLong);
         *str = (char *)LobaContextPop(c, *len);
         c->json = p;
         return lobaParseOk;
@@ -626,6 +2485,9 @@ int LobaJson::LobaParseStringRaw(LobaContext *c, char **str, size_t *len) {
             unsigned u;
             if (!(p = LobaParseHex4(p, &u)))
               STRING_ERROR(lobaParseInvalidUnicodeHex);
+            // 单独的低位代理编码出来不是合法的 UTF-8
+            if (u >= 0xDC00 && u <= 0xDFFF)
+              STRING_ERROR(lobaParseInvalidUnicodeSurrogate);
             if (u >= 0xD800 && u <= 0xDBFF) {
               if (*p++ != '\\')
                 STRING_ERROR(lobaParseInvalidUnicodeSurrogate);
@@ -650,11 +2512,13 @@ int LobaJson::LobaParseStringRaw(LobaContext *c, char **str, size_t *len) {
           c->top = head;
           return lobaParseInvalidStringChar;
         }
-        PUTC(c, ch);
+        // scan_utf8 只会停在不合法的序列上
+        STRING_ERROR(lobaParseInvalidUtf8);
     }
   }
 }
 void LobaJson::LobaStringifyValue(LobaContext *p_context, const LobaValue *p_value) {
+    LOBA_STAT(cur_stats_->values[p_value->type]++);
     switch (p_value->type) {
         case LobaType::lobaNull:PUTS(p_context, "null", 4);
         break;
@@ -662,13 +2526,27 @@ void LobaJson::LobaStringifyValue(LobaContext *p_context, const LobaValue *p_val
         break;
         case LobaType::lobaTrue:PUTS(p_context, "true", 4);
         break;
-        case LobaType::lobaNumber:LobaStringifyNumber(p_context, p_value);
+        case LobaType::lobaNumber:
+        case LobaType::lobaRawNumber:LobaStringifyNumber(p_context, p_value);
         break;
         case LobaType::lobaString:LobaStringifyString(p_context, p_value->u.s.s, p_value->u.s.len);
         break;
-        case LobaType::lobaArray:LobaStringifyArray(p_context, p_value);
+        case LobaType::lobaArray:
+        case LobaType::lobaPackedArray:
+        LOBA_STAT(if (++p_context->depth > cur_stats_->max_depth) cur_stats_->max_depth = p_context->depth);
+        if (stringify_cache_ != nullptr && p_value->type == LobaType::lobaArray)
+            LobaStringifyCached(p_context, p_value);
+        else
+            LobaStringifyArray(p_context, p_value);
+        LOBA_STAT(p_context->depth--);
         break;
-        case LobaType::lobaObject:LobaStringifyObject(p_context, p_value);
+        case LobaType::lobaObject:
+        LOBA_STAT(if (++p_context->depth > cur_stats_->max_depth) cur_stats_->max_depth = p_context->depth);
+        if (stringify_cache_ != nullptr)
+            LobaStringifyCached(p_context, p_value);
+        else
+            LobaStringifyObject(p_context, p_value);
+        LOBA_STAT(p_context->depth--);
         break;
         default:break;
     }
@@ -676,23 +2554,302 @@ void LobaJson::LobaStringifyValue(LobaContext *p_context, const LobaValue *p_val
 char *LobaJson::LobaStringify(const LobaValue *v, size_t *length) {
     LobaContext c;
     assert(v != nullptr);
-    c.stack = (char *)malloc(c.size = LobaContextStackSize);
+#ifdef LOBA_STATS
+    LobaStatsBegin(&c);
+#endif
+    c.stack = (char *)LobaMalloc(c.size = LobaContextStackSize);
+    c.top = 0;
+    if (LobaCanUseThreads(stringify_threads_))
+        LobaStringifyParallel(&c, v, 0);
+    else
+        LobaStringifyValue(&c, v);
+    if (length)
+        *length = c.top;
+#ifdef LOBA_STATS
+    LobaStatsEnd(&c, c.top);
+#endif
+    PUTC(&c, '\0');
+    return LobaContextRelease(&c, c.top);
+}
+inline char *LobaJson::LobaStringifyCanonical(const LobaValue *v, size_t *length) {
+    LobaContext c;
+    assert(v != nullptr);
+    c.stack = (char *)LobaMalloc(c.size = LobaContextStackSize);
     c.top = 0;
-    LobaStringifyValue(&c, v);
+    // 各层对象的成员顺序依次压在一个数组里
+    std::vector<size_t> order;
+    if (!LobaCanonicalValue(&c, v, &order)) {
+        LobaDealloc(c.stack, c.size);
+        return nullptr;
+    }
     if (length)
         *length = c.top;
     PUTC(&c, '\0');
-    return c.stack;
+    return LobaContextRelease(&c, c.top);
+}
+inline int LobaJson::LobaCanonicalValue(LobaContext *p_context, const LobaValue *p_value,
+                                        std::vector<size_t> *order) {
+    char buffer[32];
+    double n;
+    switch (p_value->type) {
+        case LobaType::lobaNull:PUTS(p_context, "null", 4);
+        break;
+        case LobaType::lobaFalse:PUTS(p_context, "false", 5);
+        break;
+        case LobaType::lobaTrue:PUTS(p_context, "true", 4);
+        break;
+        case LobaType::lobaNumber:
+        case LobaType::lobaRawNumber:n = LobaGetNumber(p_value);
+        if (!std::isfinite(n))
+            return 0;
+        PUTS(p_context, buffer, LobaCanonicalNumber(buffer, n));
+        break;
+        case LobaType::lobaString:LobaCanonicalString(p_context, p_value->u.s.s, p_value->u.s.len);
+        break;
+        case LobaType::lobaArray:PUTC(p_context, '[');
+        for (size_t i = 0; i < p_value->u.a.size; i++) {
+            if (i > 0)
+                PUTC(p_context, ',');
+            if (!LobaCanonicalValue(p_context, &p_value->u.a.e[i], order))
+                return 0;
+        }
+        PUTC(p_context, ']');
+        break;
+        case LobaType::lobaPackedArray:PUTC(p_context, '[');
+        for (size_t i = 0; i < p_value->u.p.size; i++) {
+            if (i > 0)
+                PUTC(p_context, ',');
+            if (!std::isfinite(p_value->u.p.d[i]))
+                return 0;
+            PUTS(p_context, buffer, LobaCanonicalNumber(buffer, p_value->u.p.d[i]));
+        }
+        PUTC(p_context, ']');
+        break;
+        case LobaType::lobaObject:return LobaCanonicalObject(p_context, p_value, order);
+        default:break;
+    }
+    return 1;
+}
+// 已经有序的对象 (常见于规范化过的输入) 直接按原顺序输出, 否则把下标压进 order 稳定排序,
+// 重复的键保持原来的先后
+inline int LobaJson::LobaCanonicalObject(LobaContext *p_context, const LobaValue *p_value,
+                                         std::vector<size_t> *order) {
+    const LobaMember *m = p_value->u.o.m;
+    size_t size = p_value->u.o.size;
+    size_t base = order->size();
+    int sorted = 1;
+    for (size_t i = 1; i < size && sorted; i++)
+        sorted = LobaCompareUtf16(m[i - 1].k, m[i - 1].klen, m[i].k, m[i].klen) <= 0;
+    if (!sorted) {
+        for (size_t i = 0; i < size; i++)
+            order->push_back(i);
+        std::stable_sort(order->begin() + base, order->end(), [m](size_t x, size_t y) {
+            return LobaCompareUtf16(m[x].k, m[x].klen, m[y].k, m[y].klen) < 0;
+        });
+    }
+    PUTC(p_context, '{');
+    for (size_t i = 0; i < size; i++) {
+        // 递归时 order 可能搬家, 每次都按下标取
+        const LobaMember &member = m[sorted ? i : (*order)[base + i]];
+        if (i > 0)
+            PUTC(p_context, ',');
+        LobaCanonicalString(p_context, member.k, member.klen);
+        PUTC(p_context, ':');
+        if (!LobaCanonicalValue(p_context, &member.v, order))
+            return 0;
+    }
+    PUTC(p_context, '}');
+    order->resize(base);
+    return 1;
+}
+// UTF-8 的字节序就是码点序, 只有一边是 U+E000~U+FFFF、另一边是 U+10000 以上时
+// 与 UTF-16 码元序相反 (后者的代理对 0xD800~0xDFFF 更小), 所以只在第一个不同的码点处解码
+inline int LobaJson::LobaCompareUtf16(const char *a, size_t alen, const char *b, size_t blen) {
+    size_t n = alen < blen ? alen : blen;
+    size_t i = 0;
+    while (i < n && a[i] == b[i])
+        i++;
+    if (i == n)
+        return alen < blen ? -1 : (alen > blen ? 1 : 0);
+    unsigned char x = static_cast<unsigned char>(a[i]), y = static_cast<unsigned char>(b[i]);
+    // 四字节序列以 0xF0 以上开头, 另一边是 0xEE~0xEF 开头的三字节序列 (U+E000~U+FFFF) 时翻转
+    if ((x >= 0xF0 && y >= 0xEE && y < 0xF0) || (y >= 0xF0 && x >= 0xEE && x < 0xF0))
+        return x < y ? 1 : -1;
+    // 其余情况 (含不同处在同一码点的后续字节) 字节序与码元序一致
+    return x < y ? -1 : 1;
+}
+inline void LobaJson::LobaCanonicalString(LobaContext *p_context, const char *s, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    const LobaKernels &kernels = LobaGetKernels();
+    PUTC(p_context, '"');
+    for (size_t i = 0; i < len; i++) {
+        size_t run = kernels.scan_escape(s + i, len - i);
+        if (run > 0)
+            PUTS(p_context, s + i, run);
+        i += run;
+        if (i == len)
+            break;
+        unsigned char ch = static_cast<unsigned char>(s[i]);
+        switch (ch) {
+            case '"':PUTS(p_context, "\\\"", 2);
+            break;
+            case '\\':PUTS(p_context, "\\\\", 2);
+            break;
+            case '\b':PUTS(p_context, "\\b", 2);
+            break;
+            case '\f':PUTS(p_context, "\\f", 2);
+            break;
+            case '\n':PUTS(p_context, "\\n", 2);
+            break;
+            case '\r':PUTS(p_context, "\\r", 2);
+            break;
+            case '\t':PUTS(p_context, "\\t", 2);
+            break;
+            default: {
+                char buffer[6] = {'\\', 'u', '0', '0', hex[ch >> 4], hex[ch & 15]};
+                PUTS(p_context, buffer, 6);
+            }
+        }
+    }
+    PUTC(p_context, '"');
+}
+// ECMAScript Number::toString: 取能还原出 n 的最少有效位, 小数点位置在 (-6, 21] 内写成普通小数,
+// 否则写成指数形式. 规格化数的 15 位 "%.14e" 能还原时去掉末尾的 0 就是最短的; 16 位时最近的那个还原不了,
+// 朝 n 一侧的相邻值仍可能落在 n 的舍入区间里 (区间在 2 的幂处不对称); 都不行时 17 位一定可以.
+// buffer 至少 32 字节
+inline size_t LobaJson::LobaCanonicalNumber(char *buffer, double n) {
+    if (n == 0) {
+        buffer[0] = '0';
+        return 1;
+    }
+    if (n > -1e15 && n < 1e15 && n == static_cast<double>(static_cast<int64_t>(n)))
+        return LobaFormatNumber(buffer, n);
+    static const double pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                   1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    char digits[20];
+    int k = 0, point = 0;
+    size_t i = 0;
+    if (n < 0)
+        buffer[i++] = '-';
+    // 小数位不多的数不进 sprintf: 最小的 scale 使 |n| * 10^scale 取整后再除回去仍是 |n|, 这个整数的各位
+    // 就是最短表示 (不超过 15 位时能还原的小数只有一个). 整数和 10 的幂都精确, 除法正确舍入
+    double a = std::fabs(n);
+    for (int scale = 1; scale <= 22 && a * pow10[scale] < 1e15; scale++) {
+        double m = std::nearbyint(a * pow10[scale]);
+        if (m / pow10[scale] == a) {
+            char tmp[20];
+            for (uint64_t u = static_cast<uint64_t>(m); u != 0; u /= 10)
+                tmp[k++] = static_cast<char>('0' + u % 10);
+            for (int j = 0; j < k; j++)
+                digits[j] = tmp[k - 1 - j];
+            point = k - scale;
+            break;
+        }
+    }
+    if (k == 0) {
+        char e[32];
+        if (a < DBL_MIN) {
+            // 非规格化数的精度不到 15 位, 从 1 位试起
+            for (int precision = 1; precision <= 17; precision++) {
+                sprintf(e, "%.*e", precision - 1, n);
+                if (strtod(e, nullptr) == n)
+                    break;
+            }
+        } else if (sprintf(e, "%.14e", n), strtod(e, nullptr) != n) {
+            sprintf(e, "%.15e", n);
+            double m = strtod(e, nullptr);
+            if (m != n) {
+                // 末位朝 n 加减 1; 进位或借位会改变首位数字的位数时不再尝试
+                char *first = e + (n < 0);
+                char *q = strchr(e, 'e') - 1;
+                int up = std::fabs(m) < std::fabs(n);
+                for (; q > first && (*q == (up ? '9' : '0') || *q == '.'); q--)
+                    if (*q != '.')
+                        *q = up ? '0' : '9';
+                int ok = up ? *q != '9' : *q != (q == first ? '1' : '0');
+                if (ok)
+                    *q = static_cast<char>(*q + (up ? 1 : -1));
+                if (!ok || strtod(e, nullptr) != n)
+                    sprintf(e, "%.16e", n);
+            }
+        }
+        const char *p = e + (n < 0);
+        for (; *p != 'e'; p++) {
+            if (*p != '.')
+                digits[k++] = *p;
+        }
+        point = atoi(p + 1) + 1;
+    }
+    while (k > 1 && digits[k - 1] == '0')
+        k--;
+    // 小数点在第 point 位数字之后
+    if (k <= point && point <= 21) {
+        memcpy(buffer + i, digits, k);
+        memset(buffer + i + k, '0', point - k);
+        return i + point;
+    }
+    if (0 < point && point <= 21) {
+        memcpy(buffer + i, digits, point);
+        buffer[i + point] = '.';
+        memcpy(buffer + i + point + 1, digits + point, k - point);
+        return i + k + 1;
+    }
+    if (-6 < point && point <= 0) {
+        buffer[i++] = '0';
+        buffer[i++] = '.';
+        memset(buffer + i, '0', -point);
+        memcpy(buffer + i - point, digits, k);
+        return i - point + k;
+    }
+    buffer[i++] = digits[0];
+    if (k > 1) {
+        buffer[i++] = '.';
+        memcpy(buffer + i, digits + 1, k - 1);
+        i += k - 1;
+    }
+    return i + sprintf(buffer + i, "e%c%d", point - 1 >= 0 ? '+' : '-', std::abs(point - 1));
 }
 void LobaJson::LobaStringifyNumber(LobaContext *p_context, const LobaValue *p_value) {
+    if (p_value->type == LobaType::lobaRawNumber) {
+        PUTS(p_context, p_value->u.s.s, p_value->u.s.len);
+        return;
+    }
     char buffer[32];
     int length = sprintf(buffer, "%.17g", p_value->u.n);
-    PUTS(p_context, buffer, static_cast<size_t>(length));
+    PUTS(p_context, buffer, length);
+}
+inline size_t LobaJson::LobaFormatNumber(char *buffer, double n) {
+    // 绝对值小于 1e15 的整数 "%.17g" 输出的就是全部十进制位, 不用进 sprintf
+    if (n > -1e15 && n < 1e15 && n == static_cast<double>(static_cast<int64_t>(n)) &&
+        !(n == 0 && std::signbit(n))) {
+        int64_t k = static_cast<int64_t>(n);
+        uint64_t u = k < 0 ? static_cast<uint64_t>(-k) : static_cast<uint64_t>(k);
+        char digits[20];
+        size_t len = 0, i = 0;
+        do {
+            digits[len++] = static_cast<char>('0' + u % 10);
+            u /= 10;
+        } while (u != 0);
+        if (k < 0)
+            buffer[i++] = '-';
+        while (len > 0)
+            buffer[i++] = digits[--len];
+        return i;
+    }
+    return static_cast<size_t>(sprintf(buffer, "%.17g", n));
 }
-void LobaJson::LobaStringifyString(LobaContext *p_context, char *s, size_t len) {
+void LobaJson::LobaStringifyString(LobaContext *p_context, const char *s, size_t len) {
     assert(s != nullptr);
+    const LobaKernels &kernels = LobaGetKernels();
     PUTC(p_context, '"');
     for (size_t i = 0; i < len; i++) {
+        // 不需要转义的字节 (包括 UTF-8 多字节序列) 整段拷贝
+        size_t run = kernels.scan_escape(s + i, len - i);
+        if (run > 0)
+            PUTS(p_context, s + i, run);
+        i += run;
+        if (i == len)
+            break;
         unsigned char ch = static_cast<unsigned char>(s[i]);
         switch (ch) {
             case '\"':PUTS(p_context, "\\\"", 2);
@@ -709,19 +2866,21 @@ void LobaJson::LobaStringifyString(LobaContext *p_context, char *s, size_t len)
             break;
             case '\t':PUTS(p_context, "\\t", 2);
             break;
-            default:
-                if (ch < 0x20) {
-                    char buffer[7];
-                    sprintf(buffer, "\\u%04X", ch);
-                    PUTS(p_context, buffer, 6);
-                } else
-                    PUTC(p_context, s[i]);
+            default: {
+                char buffer[7];
+                sprintf(buffer, "\\u%04X", ch);
+                PUTS(p_context, buffer, 6);
+            }
         }
     }
     PUTC(p_context, '"');
 }
 void LobaJson::LobaStringifyArray(LobaContext *p_context, const LobaValue *p_value) {
     assert(p_value != nullptr);
+    if (p_value->type == LobaType::lobaPackedArray) {
+        LobaStringifyPacked(p_context, p_value);
+        return;
+    }
     PUTC(p_context, '[');
     for (size_t i = 0; i < p_value->u.a.size; i++) {
         if (i > 0)
@@ -730,6 +2889,88 @@ void LobaJson::LobaStringifyArray(LobaContext *p_context, const LobaValue *p_val
     }
     PUTC(p_context, ']');
 }
+// 没有标记时整段拷贝上次的结果; 只有部分孩子被标记时孩子之间的字节 (含键和逗号)
+// 从旧结果拷贝, 只重新序列化这些孩子并平移其余孩子的位置; 没有可用条目时整个序列化
+inline void LobaJson::LobaStringifyCached(LobaContext *p_context, const LobaValue *p_value) {
+    LobaStringifyCache *cache = stringify_cache_;
+    int array = p_value->type == LobaType::lobaArray;
+    size_t size = LobaStringifyCache::LobaChildCount(p_value);
+    size_t start = p_context->top;
+    LobaStringifyCache::Entry *e = cache->LobaFind(p_value);
+    if (e != nullptr && e->dirty.empty()) {
+        cache->hits_++;
+        PUTS(p_context, e->text.data(), e->text.size());
+        return;
+    }
+    if (e != nullptr) {
+        // 孩子的条目都是别的节点, 递归时这个条目不会被删除, 引用一直有效
+        cache->partial_hits_++;
+        std::vector<size_t> &dirty = e->dirty;
+        std::sort(dirty.begin(), dirty.end());
+        dirty.erase(std::unique(dirty.begin(), dirty.end()), dirty.end());
+        std::vector<size_t> fresh(dirty.size() * 2);
+        size_t pos = 0;
+        for (size_t k = 0; k < dirty.size(); k++) {
+            size_t i = dirty[k];
+            PUTS(p_context, e->text.data() + pos, e->spans[2 * i] - pos);
+            fresh[2 * k] = p_context->top - start;
+            LobaStringifyValue(p_context, array ? &p_value->u.a.e[i] : &p_value->u.o.m[i].v);
+            fresh[2 * k + 1] = p_context->top - start;
+            pos = e->spans[2 * i + 1];
+        }
+        PUTS(p_context, e->text.data() + pos, e->text.size() - pos);
+        ptrdiff_t delta = 0;
+        for (size_t i = 0, k = 0; i < size; i++) {
+            if (k < dirty.size() && dirty[k] == i) {
+                delta = static_cast<ptrdiff_t>(fresh[2 * k + 1]) - static_cast<ptrdiff_t>(e->spans[2 * i + 1]);
+                e->spans[2 * i] = fresh[2 * k];
+                e->spans[2 * i + 1] = fresh[2 * k + 1];
+                k++;
+            } else {
+                e->spans[2 * i] += delta;
+                e->spans[2 * i + 1] += delta;
+            }
+        }
+        std::vector<size_t> spans;
+        spans.swap(e->spans);
+        cache->LobaStore(p_value, p_context->stack + start, p_context->top - start, &spans);
+        return;
+    }
+    cache->misses_++;
+    std::vector<size_t> spans(size * 2);
+    PUTC(p_context, array ? '[' : '{');
+    for (size_t i = 0; i < size; i++) {
+        if (i > 0)
+            PUTC(p_context, ',');
+        if (!array) {
+            LobaStringifyString(p_context, p_value->u.o.m[i].k, p_value->u.o.m[i].klen);
+            PUTC(p_context, ':');
+        }
+        spans[2 * i] = p_context->top - start;
+        LobaStringifyValue(p_context, array ? &p_value->u.a.e[i] : &p_value->u.o.m[i].v);
+        spans[2 * i + 1] = p_context->top - start;
+    }
+    PUTC(p_context, array ? ']' : '}');
+    cache->LobaStore(p_value, p_context->stack + start, p_context->top - start, &spans);
+}
+// 每次按最坏长度给一批元素留出空间, 直接格式化进栈里, 再退回没用完的部分
+#define LobaPackedBatch 256
+inline void LobaJson::LobaStringifyPacked(LobaContext *p_context, const LobaValue *p_value) {
+    const double *d = p_value->u.p.d;
+    size_t size = p_value->u.p.size;
+    PUTC(p_context, '[');
+    for (size_t i = 0; i < size;) {
+        size_t end = std::min(size, i + LobaPackedBatch);
+        char *q = (char *)LobaContextPush(p_context, (end - i) * LobaNumberMaxChars + 1);
+        for (; i < end; i++) {
+            if (i > 0)
+                *q++ = ',';
+            q += LobaFormatNumber(q, d[i]);
+        }
+        p_context->top = static_cast<size_t>(q - p_context->stack);
+    }
+    PUTC(p_context, ']');
+}
 void LobaJson::LobaStringifyObject(LobaContext *p_context, const LobaValue *p_value) {
     assert(p_value != nullptr);
     PUTC(p_context, '{');
@@ -742,5 +2983,119 @@ void LobaJson::LobaStringifyObject(LobaContext *p_context, const LobaValue *p_va
     }
     PUTC(p_context, '}');
 }
+// 序列化 [begin, end) 之间的孩子, 孩子之间用 ',' 分隔, 不含外层括号
+inline void LobaJson::LobaStringifyRange(LobaContext *p_context, const LobaValue *p_value,
+                                         size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+        if (i > begin)
+            PUTC(p_context, ',');
+        if (p_value->type == LobaType::lobaArray) {
+            LobaStringifyValue(p_context, &p_value->u.a.e[i]);
+        } else {
+            LobaStringifyString(p_context, p_value->u.o.m[i].k, p_value->u.o.m[i].klen);
+            PUTC(p_context, ':');
+            LobaStringifyValue(p_context, &p_value->u.o.m[i].v);
+        }
+    }
+}
+// 粗略估计序列化的开销: 每个节点记 1, 字符串和键再按长度加权
+inline size_t LobaJson::LobaStringifyWeight(const LobaValue *p_value) {
+    size_t w = 1;
+    switch (p_value->type) {
+        case LobaType::lobaString:w += p_value->u.s.len / 16;
+        break;
+        case LobaType::lobaPackedArray:w += p_value->u.p.size;
+        break;
+        case LobaType::lobaArray:
+        for (size_t i = 0; i < p_value->u.a.size; i++)
+            w += LobaStringifyWeight(&p_value->u.a.e[i]);
+        break;
+        case LobaType::lobaObject:
+        for (size_t i = 0; i < p_value->u.o.size; i++)
+            w += p_value->u.o.m[i].klen / 16 + LobaStringifyWeight(&p_value->u.o.m[i].v);
+        break;
+        default:break;
+    }
+    return w;
+}
+// 把孩子按权重切成大约 线程数*4 段, 由线程池按序号领取, 各自写进独立的 LobaContext,
+// 最后按段的顺序拼回 p_context. 某个孩子独占一半以上权重时不切分, 而是往这个孩子里走
+inline void LobaJson::LobaStringifyParallel(LobaContext *p_context, const LobaValue *p_value, int depth) {
+    int is_array = p_value->type == LobaType::lobaArray;
+    if ((!is_array && p_value->type != LobaType::lobaObject) || depth > LobaParallelMaxDescend) {
+        LobaStringifyValue(p_context, p_value);
+        return;
+    }
+    size_t n = is_array ? p_value->u.a.size : p_value->u.o.size;
+    std::vector<size_t> weight(n);
+    size_t total = 0, heavy = 0;
+    for (size_t i = 0; i < n; i++) {
+        weight[i] = LobaStringifyWeight(is_array ? &p_value->u.a.e[i] : &p_value->u.o.m[i].v);
+        total += weight[i];
+        if (weight[i] > weight[heavy])
+            heavy = i;
+    }
+    if (total < LobaParallelMinWeight) {
+        LobaStringifyValue(p_context, p_value);
+        return;
+    }
+    if (weight[heavy] * 2 > total) {
+        PUTC(p_context, is_array ? '[' : '{');
+        LobaStringifyRange(p_context, p_value, 0, heavy);
+        if (heavy > 0)
+            PUTC(p_context, ',');
+        if (!is_array) {
+            LobaStringifyString(p_context, p_value->u.o.m[heavy].k, p_value->u.o.m[heavy].klen);
+            PUTC(p_context, ':');
+        }
+        LobaStringifyParallel(p_context, is_array ? &p_value->u.a.e[heavy] : &p_value->u.o.m[heavy].v,
+                              depth + 1);
+        if (heavy + 1 < n)
+            PUTC(p_context, ',');
+        LobaStringifyRange(p_context, p_value, heavy + 1, n);
+        PUTC(p_context, is_array ? ']' : '}');
+        return;
+    }
+    size_t threads = stringify_threads_ ? stringify_threads_ : std::thread::hardware_concurrency();
+    size_t grain = threads ? total / (threads * 4) : total;
+    if (grain < LobaParallelMinGrain)
+        grain = LobaParallelMinGrain;
+    std::vector<size_t> bounds(1, 0);
+    size_t acc = 0;
+    for (size_t i = 0; i < n; i++) {
+        acc += weight[i];
+        if (acc >= grain && i + 1 < n) {
+            bounds.push_back(i + 1);
+            acc = 0;
+        }
+    }
+    bounds.push_back(n);
+    size_t ranges = bounds.size() - 1;
+    std::vector<LobaContext> parts(ranges);
+    for (LobaContext &part : parts) {
+        part.stack = nullptr;
+        part.size = part.top = 0;
+        part.depth = 0;
+    }
+    std::atomic<size_t> next(0);
+    auto work = [this, p_value, &parts, &bounds, &next, ranges] {
+        for (size_t r; (r = next++) < ranges;)
+            LobaStringifyRange(&parts[r], p_value, bounds[r], bounds[r + 1]);
+    };
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < threads && i < ranges; i++)
+        workers.emplace_back(work);
+    work();
+    for (std::thread &t : workers)
+        t.join();
+    PUTC(p_context, is_array ? '[' : '{');
+    for (size_t r = 0; r < ranges; r++) {
+        if (r > 0)
+            PUTC(p_context, ',');
+        PUTS(p_context, parts[r].stack, parts[r].top);
+        LobaDealloc(parts[r].stack, parts[r].size);
+    }
+    PUTC(p_context, is_array ? ']' : '}');
+}
 
 #endif  // LOBAJSON_H_
\ No newline at end of file
@@ -0,0 +1,272 @@
+// Copyright (c) 2022. Yang Zhu
+
+#ifndef LOBAJSON_ALLOCATOR_H_
+#define LOBAJSON_ALLOCATOR_H_
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "lobajson.h"
+
+// 几种现成的 LobaAllocator 实现, 通过 LobaJson::LobaSetAllocator 接入
+
+// 直接转给 malloc/realloc/free, 与不设置 allocator 时的行为相同
+class LobaMallocAllocator : public LobaAllocator {
+ public:
+  void *LobaAlloc(size_t size) override { return malloc(size); }
+  void *LobaRealloc(void *ptr, size_t old_size, size_t new_size) override {
+    (void)old_size;
+    if (new_size == 0) {
+      free(ptr);
+      return nullptr;
+    }
+    return realloc(ptr, new_size);
+  }
+  void LobaDealloc(void *ptr, size_t size) override {
+    (void)size;
+    free(ptr);
+  }
+  int LobaIsThreadSafe() const override { return 1; }
+};
+
+// 小块按 8 字节分级放进空闲链表, 从 64KB 的 slab 里切; 大块直接走 malloc.
+// 字符串、键和小容器占了解析结果的绝大多数, 这些分配不再进入 malloc
+#define LobaSlabGranularity 8
+#define LobaSlabMaxSize 512
+#define LobaSlabBytes (64 * 1024)
+
+class LobaSlabAllocator : public LobaAllocator {
+ public:
+  LobaSlabAllocator() { memset(free_, 0, sizeof(free_)); }
+  ~LobaSlabAllocator() override {
+    for (char *slab : slabs_) {
+      free(slab);
+    }
+  }
+  LobaSlabAllocator(const LobaSlabAllocator &) = delete;
+  LobaSlabAllocator &operator=(const LobaSlabAllocator &) = delete;
+
+  void *LobaAlloc(size_t size) override;
+  void *LobaRealloc(void *ptr, size_t old_size, size_t new_size) override;
+  void LobaDealloc(void *ptr, size_t size) override;
+
+ private:
+  struct FreeNode { FreeNode *next; };
+  static size_t LobaSizeClass(size_t size) {
+    return size == 0 ? 0 : (size - 1) / LobaSlabGranularity;
+  }
+
+  FreeNode *free_[LobaSlabMaxSize / LobaSlabGranularity];
+  std::vector<char *> slabs_;
+  char *cur_ = nullptr;
+  char *end_ = nullptr;
+};
+
+inline void *LobaSlabAllocator::LobaAlloc(size_t size) {
+  if (size > LobaSlabMaxSize) {
+    return malloc(size);
+  }
+  size_t cls = LobaSizeClass(size);
+  if (free_[cls] != nullptr) {
+    FreeNode *node = free_[cls];
+    free_[cls] = node->next;
+    return node;
+  }
+  size_t bytes = (cls + 1) * LobaSlabGranularity;
+  if (static_cast<size_t>(end_ - cur_) < bytes) {
+    // slab 尾部放不下的零头直接丢弃, 最多浪费 LobaSlabMaxSize 字节
+    cur_ = (char *)malloc(LobaSlabBytes);
+    end_ = cur_ + LobaSlabBytes;
+    slabs_.push_back(cur_);
+  }
+  void *p = cur_;
+  cur_ += bytes;
+  return p;
+}
+
+inline void *LobaSlabAllocator::LobaRealloc(void *ptr, size_t old_size, size_t new_size) {
+  if (ptr == nullptr) {
+    return new_size ? LobaAlloc(new_size) : nullptr;
+  }
+  if (new_size == 0) {
+    LobaDealloc(ptr, old_size);
+    return nullptr;
+  }
+  if (old_size > LobaSlabMaxSize && new_size > LobaSlabMaxSize) {
+    return realloc(ptr, new_size);
+  }
+  if (old_size <= LobaSlabMaxSize && new_size <= LobaSlabMaxSize &&
+      LobaSizeClass(old_size) == LobaSizeClass(new_size)) {
+    return ptr;
+  }
+  void *p = LobaAlloc(new_size);
+  memcpy(p, ptr, old_size < new_size ? old_size : new_size);
+  LobaDealloc(ptr, old_size);
+  return p;
+}
+
+inline void LobaSlabAllocator::LobaDealloc(void *ptr, size_t size) {
+  if (ptr == nullptr) {
+    return;
+  }
+  if (size > LobaSlabMaxSize) {
+    free(ptr);
+    return;
+  }
+  size_t cls = LobaSizeClass(size);
+  FreeNode *node = static_cast<FreeNode *>(ptr);
+  node->next = free_[cls];
+  free_[cls] = node;
+}
+
+// 只会往前推指针的 arena: LobaDealloc 什么也不做, 最后一次分配可以原地伸缩.
+// 适合解析完只读、整体丢弃的文档, LobaReset 后复用已申请的块
+#define LobaArenaBlockBytes (64 * 1024)
+
+class LobaArenaAllocator : public LobaAllocator {
+ public:
+  explicit LobaArenaAllocator(size_t block_bytes = LobaArenaBlockBytes)
+      : block_bytes_(block_bytes) {}
+  ~LobaArenaAllocator() override {
+    for (Block &b : blocks_) {
+      free(b.p);
+    }
+  }
+  LobaArenaAllocator(const LobaArenaAllocator &) = delete;
+  LobaArenaAllocator &operator=(const LobaArenaAllocator &) = delete;
+
+  void *LobaAlloc(size_t size) override;
+  void *LobaRealloc(void *ptr, size_t old_size, size_t new_size) override;
+  void LobaDealloc(void *ptr, size_t size) override {
+    (void)ptr;
+    (void)size;
+  }
+
+  // 之前分配出去的内存全部作废, 块留着给后续分配
+  void LobaReset();
+  // 已从块中分配出去的字节数 (含对齐填充)
+  size_t LobaGetUsed() const;
+  size_t LobaGetReserved() const;
+
+ private:
+  struct Block {
+    char *p;
+    size_t size;
+  };
+  static size_t LobaAlign(size_t n) {
+    return (n + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+  }
+
+  size_t block_bytes_;
+  std::vector<Block> blocks_;
+  size_t block_ = 0;
+  size_t used_ = 0;
+  size_t used_before_ = 0;
+  char *last_ = nullptr;
+};
+
+inline void *LobaArenaAllocator::LobaAlloc(size_t size) {
+  size_t bytes = LobaAlign(size ? size : 1);
+  while (block_ < blocks_.size() && blocks_[block_].size - used_ < bytes) {
+    used_before_ += used_;
+    block_++;
+    used_ = 0;
+  }
+  if (block_ == blocks_.size()) {
+    size_t n = bytes > block_bytes_ ? bytes : block_bytes_;
+    blocks_.push_back(Block{(char *)malloc(n), n});
+  }
+  last_ = blocks_[block_].p + used_;
+  used_ += bytes;
+  return last_;
+}
+
+inline void *LobaArenaAllocator::LobaRealloc(void *ptr, size_t old_size, size_t new_size) {
+  if (ptr == nullptr) {
+    return new_size ? LobaAlloc(new_size) : nullptr;
+  }
+  if (new_size == 0) {
+    return nullptr;
+  }
+  // 最后一次分配且块内放得下时原地伸缩, LobaContext 栈的增长大多落在这里
+  if (ptr == last_) {
+    size_t start = static_cast<size_t>(last_ - blocks_[block_].p);
+    size_t bytes = LobaAlign(new_size);
+    if (blocks_[block_].size - start >= bytes) {
+      used_ = start + bytes;
+      return ptr;
+    }
+  }
+  if (new_size <= old_size) {
+    return ptr;
+  }
+  void *p = LobaAlloc(new_size);
+  memcpy(p, ptr, old_size);
+  return p;
+}
+
+inline void LobaArenaAllocator::LobaReset() {
+  block_ = 0;
+  used_ = 0;
+  used_before_ = 0;
+  last_ = nullptr;
+}
+
+inline size_t LobaArenaAllocator::LobaGetUsed() const {
+  return used_before_ + used_;
+}
+
+inline size_t LobaArenaAllocator::LobaGetReserved() const {
+  size_t n = 0;
+  for (const Block &b : blocks_) {
+    n += b.size;
+  }
+  return n;
+}
+
+// 包一层底层 allocator 并统计调用次数和在用字节数, 用于测试和排查泄漏
+class LobaCountingAllocator : public LobaAllocator {
+ public:
+  explicit LobaCountingAllocator(LobaAllocator *base) : base_(base) {}
+
+  void *LobaAlloc(size_t size) override {
+    allocs_++;
+    LobaAddLive(size);
+    return base_->LobaAlloc(size);
+  }
+  void *LobaRealloc(void *ptr, size_t old_size, size_t new_size) override {
+    reallocs_++;
+    live_ -= ptr ? old_size : 0;
+    LobaAddLive(new_size);
+    return base_->LobaRealloc(ptr, old_size, new_size);
+  }
+  void LobaDealloc(void *ptr, size_t size) override {
+    deallocs_++;
+    live_ -= size;
+    base_->LobaDealloc(ptr, size);
+  }
+
+  size_t LobaGetAllocs() const { return allocs_; }
+  size_t LobaGetReallocs() const { return reallocs_; }
+  size_t LobaGetDeallocs() const { return deallocs_; }
+  size_t LobaGetLiveBytes() const { return live_; }
+  size_t LobaGetPeakBytes() const { return peak_; }
+
+ private:
+  void LobaAddLive(size_t size) {
+    live_ += size;
+    if (live_ > peak_) {
+      peak_ = live_;
+    }
+  }
+
+  LobaAllocator *base_;
+  size_t allocs_ = 0;
+  size_t reallocs_ = 0;
+  size_t deallocs_ = 0;
+  size_t live_ = 0;
+  size_t peak_ = 0;
+};
+
+#endif  // LOBAJSON_ALLOCATOR_H_
@@ -0,0 +1,98 @@
+// Copyright (c) 2022. Yang Zhu
+
+#ifndef LOBAJSON_BATCH_H_
+#define LOBAJSON_BATCH_H_
+
+#include <cassert>
+#include <cstddef>
+#include <cstring>
+#include "lobajson.h"
+#include "lobajson_allocator.h"
+
+// 一次解析一批小文档. 整批共用一块解析栈和一个 arena, 不再为每份文档建栈、
+// 逐个释放树; 解析当前文档时预取下一份的开头. 多线程解析的设置对批量解析无效
+#define LobaBatchPrefetchBytes 256
+
+class LobaBatch : public LobaJson {
+ public:
+  explicit LobaBatch(size_t block_bytes = LobaArenaBlockBytes) : arena_(block_bytes) {
+    LobaJson::LobaSetAllocator(&arena_);
+    c_.stack = nullptr;
+    c_.size = 0;
+  }
+  LobaBatch(const LobaBatch &) = delete;
+  LobaBatch &operator=(const LobaBatch &) = delete;
+
+  // 把 docs[0..n) 解析到 out[0..n), 返回成功的份数. lens 为 nullptr 时每份文档以 '\0' 结尾;
+  // 否则 docs[i] 只读 lens[i] 个字节, 先连同结尾的 '\0' 拷进 arena 再解析.
+  // errors 不为 nullptr 时写入每份的错误码, 失败的 out[i] 为 null.
+  // 所有树都在 arena 上, 到 LobaRelease 为止有效, 不必也不能交给别的 LobaJson 释放
+  size_t LobaParseMany(const char *const *docs, const size_t *lens, size_t n, LobaValue *out,
+                       int *errors = nullptr);
+  // 整批释放: 之前解析出的树全部作废, arena 的块留给下一批
+  void LobaRelease();
+  // arena 已申请的字节数, 整批释放后不减少
+  size_t LobaGetReserved() const { return arena_.LobaGetReserved(); }
+
+ private:
+  // 树只能在 arena 上
+  using LobaJson::LobaSetAllocator;
+  static void LobaPrefetch(const char *p, size_t len);
+
+  LobaArenaAllocator arena_;
+  LobaContext c_;
+};
+
+inline void LobaBatch::LobaPrefetch(const char *p, size_t len) {
+#if defined(__GNUC__)
+  for (size_t i = 0; i < len && i < LobaBatchPrefetchBytes; i += 64) {
+    __builtin_prefetch(p + i);
+  }
+#else
+  (void)p;
+  (void)len;
+#endif
+}
+
+inline size_t LobaBatch::LobaParseMany(const char *const *docs, const size_t *lens, size_t n,
+                                       LobaValue *out, int *errors) {
+  assert(n == 0 || (docs != nullptr && out != nullptr));
+  size_t ok = 0;
+  if (n > 0) {
+    LobaPrefetch(docs[0], lens ? lens[0] : 64);
+  }
+  for (size_t i = 0; i < n; i++) {
+    if (i + 1 < n) {
+      LobaPrefetch(docs[i + 1], lens ? lens[i + 1] : 64);
+    }
+    const char *json = docs[i];
+    if (lens != nullptr) {
+      // 惰性数字可以继续指向这份拷贝
+      char *copy = (char *)LobaMalloc(lens[i] + 1);
+      memcpy(copy, docs[i], lens[i]);
+      copy[lens[i]] = '\0';
+      json = copy;
+    }
+    c_.json = json;
+    c_.top = 0;
+    c_.depth = 0;
+    int ret = LobaParseRoot(&c_, &out[i]);
+    if (ret == lobaParseOk) {
+      ok++;
+    } else {
+      LobaInit(&out[i]);
+    }
+    if (errors != nullptr) {
+      errors[i] = ret;
+    }
+  }
+  return ok;
+}
+
+inline void LobaBatch::LobaRelease() {
+  arena_.LobaReset();
+  c_.stack = nullptr;
+  c_.size = 0;
+}
+
+#endif  // LOBAJSON_BATCH_H_
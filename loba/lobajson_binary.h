@@ -0,0 +1,751 @@
+// Copyright (c) 2022. Yang Zhu
+
+#ifndef LOBAJSON_BINARY_H_
+#define LOBAJSON_BINARY_H_
+
+#include <cfloat>
+#include <cstdint>
+#include "lobajson.h"
+
+// CBOR (RFC 8949) 与 MessagePack 二进制编码, 与 LobaValue 树直接互转
+enum {
+  lobaBinaryOk = 0,
+
+  lobaBinaryTruncated,
+  lobaBinaryInvalidType,
+  lobaBinaryInvalidKey,
+  lobaBinaryRootNotSingular,
+  // 数组/映射的嵌套超过上限
+  lobaBinaryTooDeep,
+  // 文本串不是合法的 UTF-8
+  lobaBinaryInvalidUtf8
+};
+
+// 没有用 LobaSetParseLimits 设置 max_depth 时的嵌套上限, 解码是递归的
+#define LobaBinaryMaxDepth 512
+
+struct LobaBinaryReader {
+  const unsigned char *p;
+  const unsigned char *end;
+};
+
+class LobaBinary : public LobaJson {
+ public:
+  LobaBinary() = default;
+  ~LobaBinary() = default;
+
+  // 返回的缓冲区由调用者 free, 与 LobaStringify 相同; 设置了 allocator 时用 LobaDealloc(s, length) 释放.
+  // 解码的嵌套层数受 LobaParseLimits::max_depth 限制, 未设置时为 LobaBinaryMaxDepth.
+  // 文本串必须是合法的 UTF-8; 字节串 (CBOR major 2, MessagePack bin) 按 RFC 8949 §6.1 转成无填充的 base64url 字符串
+  char *LobaEncodeCbor(const LobaValue *v, size_t *length);
+  int LobaDecodeCbor(LobaValue *v, const char *data, size_t length);
+
+  char *LobaEncodeMsgPack(const LobaValue *v, size_t *length);
+  int LobaDecodeMsgPack(LobaValue *v, const char *data, size_t length);
+
+ private:
+  typedef int (LobaBinary::*Decoder)(LobaBinaryReader *r, LobaValue *v);
+
+  void LobaPutBigEndian(LobaContext *c, uint64_t n, size_t bytes);
+  int LobaGetBigEndian(LobaBinaryReader *r, size_t bytes, uint64_t *n);
+  int LobaIsInteger(double n);
+  int LobaDecodeRoot(LobaValue *v, const char *data, size_t length, Decoder decoder);
+  int LobaDecodeArray(LobaBinaryReader *r, LobaValue *v, uint64_t size, Decoder decoder);
+  int LobaDecodeObject(LobaBinaryReader *r, LobaValue *v, uint64_t size, Decoder decoder);
+  int LobaDecodeString(LobaValue *v, const unsigned char *s, size_t len, int bytes);
+
+  void LobaCborHead(LobaContext *c, unsigned major, uint64_t n);
+  void LobaCborValue(LobaContext *c, const LobaValue *v);
+  int LobaCborDecode(LobaBinaryReader *r, LobaValue *v);
+  int LobaCborChunks(LobaBinaryReader *r, LobaValue *v, unsigned major);
+  int LobaCborIndefinite(LobaBinaryReader *r, LobaValue *v, unsigned major);
+
+  void LobaMsgPackHead(LobaContext *c, unsigned fix, unsigned fix_max, unsigned base, uint64_t n);
+  void LobaMsgPackValue(LobaContext *c, const LobaValue *v);
+  int LobaMsgPackDecode(LobaBinaryReader *r, LobaValue *v);
+
+  // 当前解码的容器层数, 出错时不退回, 下一次 LobaDecodeRoot 重新开始
+  size_t depth_ = 0;
+  size_t max_depth_ = LobaBinaryMaxDepth;
+};
+
+inline void LobaBinary::LobaPutBigEndian(LobaContext *c, uint64_t n, size_t bytes) {
+  unsigned char *p = (unsigned char *)LobaContextPush(c, bytes);
+  for (size_t i = bytes; i-- > 0; n >>= 8) {
+    p[i] = static_cast<unsigned char>(n & 0xFF);
+  }
+}
+
+inline int LobaBinary::LobaGetBigEndian(LobaBinaryReader *r, size_t bytes, uint64_t *n) {
+  if (static_cast<size_t>(r->end - r->p) < bytes) {
+    return lobaBinaryTruncated;
+  }
+  *n = 0;
+  for (size_t i = 0; i < bytes; i++) {
+    *n = (*n << 8) | *r->p++;
+  }
+  return lobaBinaryOk;
+}
+
+// 能用整数无损表示的数按整数编码, -0 保留为浮点
+inline int LobaBinary::LobaIsInteger(double n) {
+  return n == std::floor(n) && n >= -9223372036854775808.0 && n < 9223372036854775808.0 &&
+      !(n == 0 && std::signbit(n));
+}
+
+inline int LobaBinary::LobaDecodeRoot(LobaValue *v, const char *data, size_t length,
+                                      Decoder decoder) {
+  assert(v != nullptr && (data != nullptr || length == 0));
+  LobaBinaryReader r;
+  r.p = reinterpret_cast<const unsigned char *>(data);
+  r.end = r.p + length;
+  depth_ = 0;
+  max_depth_ = has_limits_ && limits_.max_depth != SIZE_MAX ? limits_.max_depth : LobaBinaryMaxDepth;
+  LobaInit(v);
+  int ret = (this->*decoder)(&r, v);
+  if (ret == lobaBinaryOk && r.p != r.end) {
+    LobaFree(v);
+    ret = lobaBinaryRootNotSingular;
+  }
+  return ret;
+}
+
+// 长度已知的容器直接按长度分配, 不经过 LobaContext 栈
+inline int LobaBinary::LobaDecodeArray(LobaBinaryReader *r, LobaValue *v, uint64_t size,
+                                       Decoder decoder) {
+  if (depth_ == max_depth_) {
+    return lobaBinaryTooDeep;
+  }
+  // 每个元素至少占一个字节, 先挡住伪造的超大长度
+  if (size > static_cast<uint64_t>(r->end - r->p)) {
+    return lobaBinaryTruncated;
+  }
+  depth_++;
+  // 先把元素全部置为 null, 失败时 LobaFree 能按分配时的长度释放
+  v->type = LobaType::lobaArray;
+  v->u.a.size = size;
+  v->u.a.e = size ? (LobaValue *)LobaMalloc(size * sizeof(LobaValue)) : nullptr;
+  for (uint64_t i = 0; i < size; i++) {
+    LobaInit(&v->u.a.e[i]);
+  }
+  for (uint64_t i = 0; i < size; i++) {
+    int ret = (this->*decoder)(r, &v->u.a.e[i]);
+    if (ret != lobaBinaryOk) {
+      LobaFree(v);
+      return ret;
+    }
+  }
+  depth_--;
+  return lobaBinaryOk;
+}
+
+inline int LobaBinary::LobaDecodeObject(LobaBinaryReader *r, LobaValue *v, uint64_t size,
+                                        Decoder decoder) {
+  if (depth_ == max_depth_) {
+    return lobaBinaryTooDeep;
+  }
+  if (size > static_cast<uint64_t>(r->end - r->p) / 2) {
+    return lobaBinaryTruncated;
+  }
+  depth_++;
+  LobaMember *members = size ? (LobaMember *)LobaMalloc(size * sizeof(LobaMember)) : nullptr;
+  uint64_t i;
+  int ret = lobaBinaryOk;
+  for (i = 0; i < size; i++) {
+    LobaMember *m = &members[i];
+    LobaValue key;
+    LobaInit(&key);
+    ret = (this->*decoder)(r, &key);
+    if (ret == lobaBinaryOk && key.type != LobaType::lobaString) {
+      LobaFree(&key);
+      ret = lobaBinaryInvalidKey;
+    }
+    if (ret != lobaBinaryOk) {
+      break;
+    }
+    // 直接接管解码出的字符串作为键
+    m->k = key.u.s.s;
+    m->klen = key.u.s.len;
+    LobaInit(&m->v);
+    if ((ret = (this->*decoder)(r, &m->v)) != lobaBinaryOk) {
+      LobaDealloc(m->k, m->klen + 1);
+      break;
+    }
+  }
+  if (ret != lobaBinaryOk) {
+    while (i-- > 0) {
+      LobaDealloc(members[i].k, members[i].klen + 1);
+      LobaFree(&members[i].v);
+    }
+    LobaDealloc(members, size * sizeof(LobaMember));
+    return ret;
+  }
+  v->type = LobaType::lobaObject;
+  v->u.o.size = size;
+  v->u.o.m = members;
+  depth_--;
+  return lobaBinaryOk;
+}
+
+// bytes 为真时是字节串, 编成无填充的 base64url; 否则是文本串, 拷出后逐段校验 UTF-8.
+// scan_utf8 需要结尾的 '\0' 作哨兵, 所以在 LobaSetString 拷出的副本上扫描
+inline int LobaBinary::LobaDecodeString(LobaValue *v, const unsigned char *s, size_t len, int bytes) {
+  if (bytes) {
+    static const char kBase64Url[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    size_t out = len / 3 * 4 + (len % 3 ? len % 3 + 1 : 0), i = 0;
+    LobaFree(v);
+    char *p = v->u.s.s = (char *)LobaMalloc(out + 1);
+    for (; i + 3 <= len; i += 3) {
+      uint32_t k = static_cast<uint32_t>(s[i]) << 16 | static_cast<uint32_t>(s[i + 1]) << 8 | s[i + 2];
+      *p++ = kBase64Url[k >> 18];
+      *p++ = kBase64Url[(k >> 12) & 0x3F];
+      *p++ = kBase64Url[(k >> 6) & 0x3F];
+      *p++ = kBase64Url[k & 0x3F];
+    }
+    if (i < len) {
+      uint32_t k = static_cast<uint32_t>(s[i]) << 16 | (i + 1 < len ? static_cast<uint32_t>(s[i + 1]) << 8 : 0);
+      *p++ = kBase64Url[k >> 18];
+      *p++ = kBase64Url[(k >> 12) & 0x3F];
+      if (i + 1 < len) {
+        *p++ = kBase64Url[(k >> 6) & 0x3F];
+      }
+    }
+    *p = '\0';
+    v->u.s.len = out;
+    v->type = LobaType::lobaString;
+    return lobaBinaryOk;
+  }
+  LobaSetString(v, reinterpret_cast<const char *>(s), len);
+  const LobaKernels &kernels = LobaGetKernels();
+  const char *p = v->u.s.s, *end = p + len;
+  for (;;) {
+    p += kernels.scan_utf8(p);
+    if (p >= end) {
+      return lobaBinaryOk;
+    }
+    // scan_utf8 也会停在 '"', '\\' 和控制字符上, 它们在文本串里是合法的
+    if (static_cast<unsigned char>(*p) >= 0x80) {
+      LobaFree(v);
+      return lobaBinaryInvalidUtf8;
+    }
+    p++;
+  }
+}
+
+inline char *LobaBinary::LobaEncodeCbor(const LobaValue *v, size_t *length) {
+  LobaContext c;
+  assert(v != nullptr);
+  c.stack = (char *)LobaMalloc(c.size = LobaContextStackSize);
+  c.top = 0;
+  LobaCborValue(&c, v);
+  if (length) {
+    *length = c.top;
+  }
+  return LobaContextRelease(&c, c.top);
+}
+
+inline int LobaBinary::LobaDecodeCbor(LobaValue *v, const char *data, size_t length) {
+  return LobaDecodeRoot(v, data, length, &LobaBinary::LobaCborDecode);
+}
+
+// 初始字节: 高 3 位是 major type, 低 5 位是长度或长度的字节数
+inline void LobaBinary::LobaCborHead(LobaContext *c, unsigned major, uint64_t n) {
+  major <<= 5;
+  if (n < 24) {
+    PUTC(c, static_cast<char>(major | n));
+  } else if (n <= 0xFF) {
+    PUTC(c, static_cast<char>(major | 24));
+    LobaPutBigEndian(c, n, 1);
+  } else if (n <= 0xFFFF) {
+    PUTC(c, static_cast<char>(major | 25));
+    LobaPutBigEndian(c, n, 2);
+  } else if (n <= 0xFFFFFFFF) {
+    PUTC(c, static_cast<char>(major | 26));
+    LobaPutBigEndian(c, n, 4);
+  } else {
+    PUTC(c, static_cast<char>(major | 27));
+    LobaPutBigEndian(c, n, 8);
+  }
+}
+
+inline void LobaBinary::LobaCborValue(LobaContext *c, const LobaValue *v) {
+  size_t i;
+  switch (v->type) {
+    case LobaType::lobaNull:PUTC(c, static_cast<char>(0xF6));
+      break;
+    case LobaType::lobaFalse:PUTC(c, static_cast<char>(0xF4));
+      break;
+    case LobaType::lobaTrue:PUTC(c, static_cast<char>(0xF5));
+      break;
+    case LobaType::lobaNumber:
+    case LobaType::lobaRawNumber: {
+      double n = LobaGetNumber(v);
+      if (LobaIsInteger(n)) {
+        int64_t k = static_cast<int64_t>(n);
+        if (k >= 0) {
+          LobaCborHead(c, 0, static_cast<uint64_t>(k));
+        } else {
+          LobaCborHead(c, 1, static_cast<uint64_t>(-(k + 1)));
+        }
+      } else if (n != n || std::isinf(n) || (std::fabs(n) <= FLT_MAX && static_cast<double>(static_cast<float>(n)) == n)) {
+        float f = static_cast<float>(n);
+        uint32_t bits;
+        memcpy(&bits, &f, sizeof(bits));
+        PUTC(c, static_cast<char>(0xFA));
+        LobaPutBigEndian(c, bits, 4);
+      } else {
+        uint64_t bits;
+        memcpy(&bits, &n, sizeof(bits));
+        PUTC(c, static_cast<char>(0xFB));
+        LobaPutBigEndian(c, bits, 8);
+      }
+      break;
+    }
+    case LobaType::lobaString:LobaCborHead(c, 3, v->u.s.len);
+      if (v->u.s.len) {
+        PUTS(c, v->u.s.s, v->u.s.len);
+      }
+      break;
+    case LobaType::lobaArray:
+    case LobaType::lobaPackedArray:LobaCborHead(c, 4, LobaGetArraySize(v));
+      for (i = 0; i < LobaGetArraySize(v); i++) {
+        LobaValue proxy;
+        LobaCborValue(c, LobaGetArrayElement(v, i, &proxy));
+      }
+      break;
+    case LobaType::lobaObject:LobaCborHead(c, 5, v->u.o.size);
+      for (i = 0; i < v->u.o.size; i++) {
+        LobaCborHead(c, 3, v->u.o.m[i].klen);
+        if (v->u.o.m[i].klen) {
+          PUTS(c, v->u.o.m[i].k, v->u.o.m[i].klen);
+        }
+        LobaCborValue(c, &v->u.o.m[i].v);
+      }
+      break;
+    default:break;
+  }
+}
+
+// IEEE 754 半精度转 double
+static inline double LobaHalfToDouble(unsigned half) {
+  unsigned exp = (half >> 10) & 0x1F, mant = half & 0x3FF;
+  double val;
+  if (exp == 0) {
+    val = std::ldexp(mant, -24);
+  } else if (exp != 31) {
+    val = std::ldexp(mant + 1024, exp - 25);
+  } else {
+    val = mant == 0 ? HUGE_VAL : NAN;
+  }
+  return half & 0x8000 ? -val : val;
+}
+
+inline int LobaBinary::LobaCborDecode(LobaBinaryReader *r, LobaValue *v) {
+  unsigned major, info;
+  uint64_t n;
+  int ret;
+  // tag (major 6): 忽略标记, 直接取被标记的值. 循环跳过, 连续的标记不会递归
+  for (;;) {
+    if (r->p == r->end) {
+      return lobaBinaryTruncated;
+    }
+    unsigned head = *r->p++;
+    major = head >> 5;
+    info = head & 0x1F;
+    n = info;
+    if (major != 6) {
+      break;
+    }
+    if (info >= 28) {
+      return lobaBinaryInvalidType;
+    }
+    if (info >= 24 &&
+        (ret = LobaGetBigEndian(r, static_cast<size_t>(1) << (info - 24), &n)) != lobaBinaryOk) {
+      return ret;
+    }
+  }
+  if (major == 7) {
+    switch (info) {
+      case 20:v->type = LobaType::lobaFalse;
+        return lobaBinaryOk;
+      case 21:v->type = LobaType::lobaTrue;
+        return lobaBinaryOk;
+      case 22:
+      case 23:v->type = LobaType::lobaNull;
+        return lobaBinaryOk;
+      case 25:
+      case 26:
+      case 27: {
+        if ((ret = LobaGetBigEndian(r, static_cast<size_t>(1) << (info - 24), &n)) != lobaBinaryOk) {
+          return ret;
+        }
+        if (info == 25) {
+          v->u.n = LobaHalfToDouble(static_cast<unsigned>(n));
+        } else if (info == 26) {
+          uint32_t bits = static_cast<uint32_t>(n);
+          float f;
+          memcpy(&f, &bits, sizeof(f));
+          v->u.n = f;
+        } else {
+          memcpy(&v->u.n, &n, sizeof(n));
+        }
+        v->type = LobaType::lobaNumber;
+        return lobaBinaryOk;
+      }
+      default:return lobaBinaryInvalidType;
+    }
+  }
+  if (info == 31) {
+    if (major == 2 || major == 3) {
+      return LobaCborChunks(r, v, major);
+    }
+    if (major == 4 || major == 5) {
+      return LobaCborIndefinite(r, v, major);
+    }
+    return lobaBinaryInvalidType;
+  }
+  if (info >= 28) {
+    return lobaBinaryInvalidType;
+  }
+  if (info >= 24 &&
+      (ret = LobaGetBigEndian(r, static_cast<size_t>(1) << (info - 24), &n)) != lobaBinaryOk) {
+    return ret;
+  }
+  switch (major) {
+    case 0:v->u.n = static_cast<double>(n);
+      v->type = LobaType::lobaNumber;
+      return lobaBinaryOk;
+    case 1:v->u.n = -1.0 - static_cast<double>(n);
+      v->type = LobaType::lobaNumber;
+      return lobaBinaryOk;
+    case 2:
+    case 3:
+      if (n > static_cast<uint64_t>(r->end - r->p)) {
+        return lobaBinaryTruncated;
+      }
+      r->p += n;
+      return LobaDecodeString(v, r->p - n, static_cast<size_t>(n), major == 2);
+    case 4:return LobaDecodeArray(r, v, n, &LobaBinary::LobaCborDecode);
+    // major 5, 只剩这一种
+    default:return LobaDecodeObject(r, v, n, &LobaBinary::LobaCborDecode);
+  }
+}
+
+// 不定长字符串由若干同类型定长块组成, 以 0xFF 结束
+inline int LobaBinary::LobaCborChunks(LobaBinaryReader *r, LobaValue *v, unsigned major) {
+  LobaContext c;
+  c.stack = nullptr;
+  c.size = c.top = 0;
+  int ret = lobaBinaryOk;
+  for (;;) {
+    if (r->p == r->end) {
+      ret = lobaBinaryTruncated;
+      break;
+    }
+    if (*r->p == 0xFF) {
+      r->p++;
+      ret = LobaDecodeString(v, reinterpret_cast<const unsigned char *>(c.stack), c.top, major == 2);
+      break;
+    }
+    // 块只取原始字节, 拼接完再整体校验或转 base64url
+    unsigned info = *r->p & 0x1F;
+    if ((*r->p >> 5) != major || info >= 28) {
+      ret = lobaBinaryInvalidType;
+      break;
+    }
+    r->p++;
+    uint64_t n = info;
+    if (info >= 24 &&
+        (ret = LobaGetBigEndian(r, static_cast<size_t>(1) << (info - 24), &n)) != lobaBinaryOk) {
+      break;
+    }
+    if (n > static_cast<uint64_t>(r->end - r->p)) {
+      ret = lobaBinaryTruncated;
+      break;
+    }
+    if (n) {
+      PUTS(&c, reinterpret_cast<const char *>(r->p), static_cast<size_t>(n));
+    }
+    r->p += n;
+  }
+  LobaDealloc(c.stack, c.size);
+  return ret;
+}
+
+// 不定长数组和映射先压入 LobaContext 栈, 遇到 0xFF 再一次性拷出, 与 LobaParseArray 相同
+inline int LobaBinary::LobaCborIndefinite(LobaBinaryReader *r, LobaValue *v, unsigned major) {
+  if (depth_ == max_depth_) {
+    return lobaBinaryTooDeep;
+  }
+  depth_++;
+  LobaContext c;
+  c.stack = nullptr;
+  c.size = c.top = 0;
+  size_t size = 0, unit = major == 4 ? sizeof(LobaValue) : sizeof(LobaMember);
+  int ret = lobaBinaryOk;
+  for (;;) {
+    if (r->p == r->end) {
+      ret = lobaBinaryTruncated;
+      break;
+    }
+    if (*r->p == 0xFF) {
+      r->p++;
+      break;
+    }
+    LobaMember m;
+    LobaInit(&m.v);
+    if (major == 5) {
+      LobaValue key;
+      LobaInit(&key);
+      if ((ret = LobaCborDecode(r, &key)) == lobaBinaryOk && key.type != LobaType::lobaString) {
+        LobaFree(&key);
+        ret = lobaBinaryInvalidKey;
+      }
+      if (ret != lobaBinaryOk) {
+        break;
+      }
+      m.k = key.u.s.s;
+      m.klen = key.u.s.len;
+    }
+    if ((ret = LobaCborDecode(r, &m.v)) != lobaBinaryOk) {
+      if (major == 5) {
+        LobaDealloc(m.k, m.klen + 1);
+      }
+      break;
+    }
+    if (major == 4) {
+      memcpy(LobaContextPush(&c, unit), &m.v, unit);
+    } else {
+      memcpy(LobaContextPush(&c, unit), &m, unit);
+    }
+    size++;
+  }
+  if (ret == lobaBinaryOk) {
+    void *items = size ? memcpy(LobaMalloc(size * unit), c.stack, size * unit) : nullptr;
+    if (major == 4) {
+      v->type = LobaType::lobaArray;
+      v->u.a.size = size;
+      v->u.a.e = (LobaValue *)items;
+    } else {
+      v->type = LobaType::lobaObject;
+      v->u.o.size = size;
+      v->u.o.m = (LobaMember *)items;
+    }
+  } else {
+    for (size_t i = 0; i < size; i++) {
+      if (major == 4) {
+        LobaFree((LobaValue *)LobaContextPop(&c, unit));
+      } else {
+        LobaMember *m = (LobaMember *)LobaContextPop(&c, unit);
+        LobaDealloc(m->k, m->klen + 1);
+        LobaFree(&m->v);
+      }
+    }
+  }
+  LobaDealloc(c.stack, c.size);
+  depth_--;
+  return ret;
+}
+
+inline char *LobaBinary::LobaEncodeMsgPack(const LobaValue *v, size_t *length) {
+  LobaContext c;
+  assert(v != nullptr);
+  c.stack = (char *)LobaMalloc(c.size = LobaContextStackSize);
+  c.top = 0;
+  LobaMsgPackValue(&c, v);
+  if (length) {
+    *length = c.top;
+  }
+  return LobaContextRelease(&c, c.top);
+}
+
+inline int LobaBinary::LobaDecodeMsgPack(LobaValue *v, const char *data, size_t length) {
+  return LobaDecodeRoot(v, data, length, &LobaBinary::LobaMsgPackDecode);
+}
+
+// fix 格式放得下就用 fix, 否则依次用 base, base+1, base+2 (8/16/32 位长度)
+inline void LobaBinary::LobaMsgPackHead(LobaContext *c, unsigned fix, unsigned fix_max,
+                                        unsigned base, uint64_t n) {
+  if (n <= fix_max) {
+    PUTC(c, static_cast<char>(fix | n));
+  } else if (n <= 0xFF && base != 0xDC && base != 0xDE) {
+    PUTC(c, static_cast<char>(base));
+    LobaPutBigEndian(c, n, 1);
+  } else if (n <= 0xFFFF) {
+    // 数组和映射没有 8 位长度格式, base 直接就是 16 位的
+    PUTC(c, static_cast<char>(base == 0xDC || base == 0xDE ? base : base + 1));
+    LobaPutBigEndian(c, n, 2);
+  } else {
+    PUTC(c, static_cast<char>(base == 0xDC || base == 0xDE ? base + 1 : base + 2));
+    LobaPutBigEndian(c, n, 4);
+  }
+}
+
+inline void LobaBinary::LobaMsgPackValue(LobaContext *c, const LobaValue *v) {
+  size_t i;
+  switch (v->type) {
+    case LobaType::lobaNull:PUTC(c, static_cast<char>(0xC0));
+      break;
+    case LobaType::lobaFalse:PUTC(c, static_cast<char>(0xC2));
+      break;
+    case LobaType::lobaTrue:PUTC(c, static_cast<char>(0xC3));
+      break;
+    case LobaType::lobaNumber:
+    case LobaType::lobaRawNumber: {
+      double n = LobaGetNumber(v);
+      if (LobaIsInteger(n)) {
+        int64_t k = static_cast<int64_t>(n);
+        if (k >= 0 && k <= 0x7F) {
+          PUTC(c, static_cast<char>(k));
+        } else if (k < 0 && k >= -32) {
+          PUTC(c, static_cast<char>(0xE0 | (k & 0x1F)));
+        } else if (k >= 0) {
+          unsigned bytes = k <= 0xFF ? 1 : k <= 0xFFFF ? 2 : k <= 0xFFFFFFFF ? 4 : 8;
+          PUTC(c, static_cast<char>(0xCC + (bytes == 1 ? 0 : bytes == 2 ? 1 : bytes == 4 ? 2 : 3)));
+          LobaPutBigEndian(c, static_cast<uint64_t>(k), bytes);
+        } else {
+          unsigned bytes = k >= -128 ? 1 : k >= -32768 ? 2 : k >= -2147483648LL ? 4 : 8;
+          PUTC(c, static_cast<char>(0xD0 + (bytes == 1 ? 0 : bytes == 2 ? 1 : bytes == 4 ? 2 : 3)));
+          LobaPutBigEndian(c, static_cast<uint64_t>(k), bytes);
+        }
+      } else if (n != n || std::isinf(n) || (std::fabs(n) <= FLT_MAX && static_cast<double>(static_cast<float>(n)) == n)) {
+        float f = static_cast<float>(n);
+        uint32_t bits;
+        memcpy(&bits, &f, sizeof(bits));
+        PUTC(c, static_cast<char>(0xCA));
+        LobaPutBigEndian(c, bits, 4);
+      } else {
+        uint64_t bits;
+        memcpy(&bits, &n, sizeof(bits));
+        PUTC(c, static_cast<char>(0xCB));
+        LobaPutBigEndian(c, bits, 8);
+      }
+      break;
+    }
+    case LobaType::lobaString:LobaMsgPackHead(c, 0xA0, 31, 0xD9, v->u.s.len);
+      if (v->u.s.len) {
+        PUTS(c, v->u.s.s, v->u.s.len);
+      }
+      break;
+    case LobaType::lobaArray:
+    case LobaType::lobaPackedArray:LobaMsgPackHead(c, 0x90, 15, 0xDC, LobaGetArraySize(v));
+      for (i = 0; i < LobaGetArraySize(v); i++) {
+        LobaValue proxy;
+        LobaMsgPackValue(c, LobaGetArrayElement(v, i, &proxy));
+      }
+      break;
+    case LobaType::lobaObject:LobaMsgPackHead(c, 0x80, 15, 0xDE, v->u.o.size);
+      for (i = 0; i < v->u.o.size; i++) {
+        LobaMsgPackHead(c, 0xA0, 31, 0xD9, v->u.o.m[i].klen);
+        if (v->u.o.m[i].klen) {
+          PUTS(c, v->u.o.m[i].k, v->u.o.m[i].klen);
+        }
+        LobaMsgPackValue(c, &v->u.o.m[i].v);
+      }
+      break;
+    default:break;
+  }
+}
+
+inline int LobaBinary::LobaMsgPackDecode(LobaBinaryReader *r, LobaValue *v) {
+  if (r->p == r->end) {
+    return lobaBinaryTruncated;
+  }
+  unsigned head = *r->p++;
+  uint64_t n;
+  int ret;
+  if (head <= 0x7F || head >= 0xE0) {
+    v->u.n = static_cast<double>(static_cast<signed char>(head));
+    v->type = LobaType::lobaNumber;
+    return lobaBinaryOk;
+  }
+  if (head >= 0x80 && head <= 0x8F) {
+    return LobaDecodeObject(r, v, head & 0x0F, &LobaBinary::LobaMsgPackDecode);
+  }
+  if (head >= 0x90 && head <= 0x9F) {
+    return LobaDecodeArray(r, v, head & 0x0F, &LobaBinary::LobaMsgPackDecode);
+  }
+  if (head >= 0xA0 && head <= 0xBF) {
+    n = head & 0x1F;
+  } else {
+    static const unsigned char kBytes[] = {
+        0, 0, 0, 0, 1, 2, 4, 0, 0, 0, 4, 8, 1, 2, 4, 8,  // 0xC0 - 0xCF
+        1, 2, 4, 8, 0, 0, 0, 0, 0, 1, 2, 4, 2, 4, 2, 4   // 0xD0 - 0xDF
+    };
+    switch (head) {
+      case 0xC0:v->type = LobaType::lobaNull;
+        return lobaBinaryOk;
+      case 0xC2:v->type = LobaType::lobaFalse;
+        return lobaBinaryOk;
+      case 0xC3:v->type = LobaType::lobaTrue;
+        return lobaBinaryOk;
+      case 0xC4:
+      case 0xC5:
+      case 0xC6:
+      case 0xCA:
+      case 0xCB:
+      case 0xCC:
+      case 0xCD:
+      case 0xCE:
+      case 0xCF:
+      case 0xD0:
+      case 0xD1:
+      case 0xD2:
+      case 0xD3:
+      case 0xD9:
+      case 0xDA:
+      case 0xDB:
+      case 0xDC:
+      case 0xDD:
+      case 0xDE:
+      case 0xDF:break;
+      default:return lobaBinaryInvalidType;
+    }
+    if ((ret = LobaGetBigEndian(r, kBytes[head - 0xC0], &n)) != lobaBinaryOk) {
+      return ret;
+    }
+    switch (head) {
+      case 0xCA: {
+        uint32_t bits = static_cast<uint32_t>(n);
+        float f;
+        memcpy(&f, &bits, sizeof(f));
+        v->u.n = f;
+        v->type = LobaType::lobaNumber;
+        return lobaBinaryOk;
+      }
+      case 0xCB:memcpy(&v->u.n, &n, sizeof(n));
+        v->type = LobaType::lobaNumber;
+        return lobaBinaryOk;
+      case 0xCC:
+      case 0xCD:
+      case 0xCE:
+      case 0xCF:v->u.n = static_cast<double>(n);
+        v->type = LobaType::lobaNumber;
+        return lobaBinaryOk;
+      case 0xD0:v->u.n = static_cast<int8_t>(n);
+        v->type = LobaType::lobaNumber;
+        return lobaBinaryOk;
+      case 0xD1:v->u.n = static_cast<int16_t>(n);
+        v->type = LobaType::lobaNumber;
+        return lobaBinaryOk;
+      case 0xD2:v->u.n = static_cast<int32_t>(n);
+        v->type = LobaType::lobaNumber;
+        return lobaBinaryOk;
+      case 0xD3:v->u.n = static_cast<double>(static_cast<int64_t>(n));
+        v->type = LobaType::lobaNumber;
+        return lobaBinaryOk;
+      case 0xDC:
+      case 0xDD:return LobaDecodeArray(r, v, n, &LobaBinary::LobaMsgPackDecode);
+      case 0xDE:
+      case 0xDF:return LobaDecodeObject(r, v, n, &LobaBinary::LobaMsgPackDecode);
+      default:break;  // str 与 bin
+    }
+  }
+  if (n > static_cast<uint64_t>(r->end - r->p)) {
+    return lobaBinaryTruncated;
+  }
+  r->p += n;
+  return LobaDecodeString(v, r->p - n, static_cast<size_t>(n), head >= 0xC4 && head <= 0xC6);
+}
+
+#endif  // LOBAJSON_BINARY_H_
@@ -0,0 +1,453 @@
+// Copyright (c) 2022. Yang Zhu
+
+#ifndef LOBAJSON_COLUMNAR_H_
+#define LOBAJSON_COLUMNAR_H_
+
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+#include "lobajson.h"
+
+// 把 NDJSON 按列拆开: 每行一个对象, 按事先给定的 JSON Pointer 取出字段, 直接追加到
+// 定类型的列里, 不建树. 用的是 LobaParse 的扫描与字符串解码, 没选中的字段只校验并跳过.
+// 列的布局与 Arrow 一致: 有效位图按行从低位起, 1 表示有值; 空值也占一个槽 (数字为 0,
+// 字符串为空串); 字符串列是 rows + 1 个偏移加一整块数据
+enum LobaColumnType {
+  lobaColumnDouble,
+  lobaColumnInt64,
+  lobaColumnString
+};
+
+// 与 lobaParse* / lobaReflect* / lobaReader* 不重叠
+enum {
+  lobaShredRowNotObject = 300
+};
+
+struct LobaColumn {
+  std::string pointer;
+  LobaColumnType type;
+  size_t rows;
+  size_t null_count;
+  // 字段存在但类型不符 (如 int64 列遇到字符串或小数) 的行数, 这些行记为空值
+  size_t mismatches;
+  std::vector<uint8_t> validity;
+  std::vector<double> doubles;
+  std::vector<int64_t> ints;
+  std::vector<int64_t> offsets;
+  std::vector<char> data;
+
+  int LobaIsValid(size_t row) const { return validity[row >> 3] >> (row & 7) & 1; }
+};
+
+class LobaShredder : public LobaJson {
+ public:
+  LobaShredder() {
+    c_.stack = nullptr;
+    c_.size = 0;
+    c_.top = 0;
+    // 下标 0 是根对象
+    nodes_.emplace_back();
+  }
+  ~LobaShredder() { LobaDealloc(c_.stack, c_.size); }
+  LobaShredder(const LobaShredder &) = delete;
+  LobaShredder &operator=(const LobaShredder &) = delete;
+
+  // 添加一列, 返回列号. pointer 不合法、为空 (根本身)、与已有的列重复或互为前缀时返回 -1.
+  // 只能在第一次 LobaShred 之前添加
+  int LobaAddColumn(const char *pointer, LobaColumnType type);
+  // 逐行追加 ndjson (以 '\0' 结尾) 中的对象, 返回追加的行数. 空行忽略; 出错的行整行丢弃,
+  // 从出错位置之后的下一个换行处继续, 计入 LobaGetBadRows. 同一行里重复的键只取第一个.
+  // LobaSetParseLimits 的上限按行计算, max_input_bytes 为一行 (不含换行) 的字节数;
+  // 列的缓冲区不计入 max_alloc_bytes
+  size_t LobaShred(const char *ndjson);
+  // 清空各列的行, 列的定义保留, 缓冲区的容量也保留
+  void LobaClearRows();
+
+  size_t LobaGetColumnCount() const { return columns_.size(); }
+  const LobaColumn &LobaGetColumn(size_t index) const { return columns_[index]; }
+  size_t LobaGetRows() const { return rows_; }
+  size_t LobaGetBadRows() const { return bad_rows_; }
+  // 最近一个出错行的错误码, 沿用 lobaParse* 错误码, 根不是对象时为 lobaShredRowNotObject
+  int LobaGetLastError() const { return last_error_; }
+
+ private:
+  // 路径上的一层. 孩子通常不多, 按键线性查找
+  struct Node {
+    std::vector<std::pair<std::string, size_t>> children;
+    int column = -1;
+  };
+  size_t LobaFindChild(size_t node, const char *key, size_t klen) const;
+  int LobaShredRow(LobaParseBudget *budget);
+  int LobaShredObject(size_t node);
+  int LobaShredValue(LobaColumn *col);
+  int LobaShredInt64(LobaColumn *col);
+  static void LobaAppendValid(LobaColumn *col, int valid);
+  void LobaAppendNull(LobaColumn *col);
+  void LobaMismatch(LobaColumn *col);
+  void LobaRollback();
+
+  LobaContext c_;
+  std::vector<Node> nodes_;
+  std::vector<LobaColumn> columns_;
+  // 当前行里类型不符的列, 整行丢弃时退回它们的计数
+  std::vector<LobaColumn *> row_mismatches_;
+  size_t rows_ = 0;
+  size_t bad_rows_ = 0;
+  int last_error_ = lobaParseOk;
+};
+
+inline int LobaShredder::LobaAddColumn(const char *pointer, LobaColumnType type) {
+  assert(pointer != nullptr);
+  if (rows_ > 0 || *pointer != '/') {
+    return -1;
+  }
+  size_t node = 0;
+  std::string token;
+  for (const char *q = pointer; *q == '/';) {
+    // 读取 "/token", 还原 ~1 与 ~0
+    token.clear();
+    for (q++; *q != '\0' && *q != '/'; q++) {
+      if (*q != '~') {
+        token.push_back(*q);
+      } else if (q[1] == '0' || q[1] == '1') {
+        token.push_back(*++q == '0' ? '~' : '/');
+      } else {
+        return -1;
+      }
+    }
+    // 已经是某一列的字段不能再往下分
+    if (nodes_[node].column >= 0) {
+      return -1;
+    }
+    size_t child = LobaFindChild(node, token.data(), token.size());
+    if (child == 0) {
+      child = nodes_.size();
+      nodes_[node].children.emplace_back(token, child);
+      nodes_.emplace_back();
+    }
+    node = child;
+  }
+  if (nodes_[node].column >= 0 || !nodes_[node].children.empty()) {
+    return -1;
+  }
+  nodes_[node].column = static_cast<int>(columns_.size());
+  LobaColumn col;
+  col.pointer = pointer;
+  col.type = type;
+  col.rows = col.null_count = col.mismatches = 0;
+  if (type == lobaColumnString) {
+    col.offsets.push_back(0);
+  }
+  columns_.push_back(std::move(col));
+  return nodes_[node].column;
+}
+
+// 没有时返回 0, 根不会是谁的孩子
+inline size_t LobaShredder::LobaFindChild(size_t node, const char *key, size_t klen) const {
+  for (const auto &child : nodes_[node].children) {
+    if (child.first.size() == klen && memcmp(child.first.data(), key, klen) == 0) {
+      return child.second;
+    }
+  }
+  return 0;
+}
+
+inline void LobaShredder::LobaAppendValid(LobaColumn *col, int valid) {
+  if ((col->rows & 7) == 0) {
+    col->validity.push_back(0);
+  }
+  col->validity.back() |= static_cast<uint8_t>(valid << (col->rows & 7));
+  col->rows++;
+}
+
+inline void LobaShredder::LobaAppendNull(LobaColumn *col) {
+  switch (col->type) {
+    case lobaColumnDouble:col->doubles.push_back(0.0);
+      break;
+    case lobaColumnInt64:col->ints.push_back(0);
+      break;
+    case lobaColumnString:col->offsets.push_back(col->offsets.back());
+      break;
+  }
+  col->null_count++;
+  LobaAppendValid(col, 0);
+}
+
+inline void LobaShredder::LobaMismatch(LobaColumn *col) {
+  col->mismatches++;
+  row_mismatches_.push_back(col);
+  LobaAppendNull(col);
+}
+
+inline size_t LobaShredder::LobaShred(const char *ndjson) {
+  assert(ndjson != nullptr);
+  size_t added = 0;
+  c_.json = ndjson;
+  c_.depth = 0;
+  for (;;) {
+    LobaParseWhitespace(&c_);
+    if (*c_.json == '\0') {
+      break;
+    }
+    LobaParseBudget budget{};
+    int ret = *c_.json == '{' ? LobaShredRow(&budget) : lobaShredRowNotObject;
+    cur_budget_ = nullptr;
+    if (ret == lobaParseOk) {
+      // 对象之后到行尾只能有空白
+      while (*c_.json == ' ' || *c_.json == '\t' || *c_.json == '\r') {
+        c_.json++;
+      }
+      if (*c_.json != '\n' && *c_.json != '\0') {
+        ret = lobaParseRootNotSingular;
+      }
+    }
+    if (ret != lobaParseOk) {
+      LobaRollback();
+      bad_rows_++;
+      last_error_ = ret;
+      const char *eol = strchr(c_.json, '\n');
+      c_.json = eol != nullptr ? eol : c_.json + strlen(c_.json);
+      continue;
+    }
+    // 这一行没出现的字段记为空值
+    for (LobaColumn &col : columns_) {
+      if (col.rows == rows_) {
+        LobaAppendNull(&col);
+      }
+    }
+    row_mismatches_.clear();
+    rows_++;
+    added++;
+  }
+  return added;
+}
+
+// 有上限时这一行的解析都记在 budget 上
+inline int LobaShredder::LobaShredRow(LobaParseBudget *budget) {
+  if (has_limits_) {
+    size_t max_input = limits_.max_input_bytes;
+    if (max_input != SIZE_MAX) {
+      size_t n = strnlen(c_.json, max_input + 1);
+      if (n > max_input && memchr(c_.json, '\n', n) == nullptr) {
+        return lobaParseInputTooLarge;
+      }
+    }
+    budget->limits = limits_;
+    cur_budget_ = budget;
+  }
+  return LobaShredObject(0);
+}
+
+// 丢掉出错的这一行已经写入的值, 每列最多一个
+inline void LobaShredder::LobaRollback() {
+  for (LobaColumn *col : row_mismatches_) {
+    col->mismatches--;
+  }
+  row_mismatches_.clear();
+  for (LobaColumn &col : columns_) {
+    if (col.rows == rows_) {
+      continue;
+    }
+    col.rows = rows_;
+    if (!col.LobaIsValid(rows_)) {
+      col.null_count--;
+    }
+    if ((rows_ & 7) == 0) {
+      col.validity.pop_back();
+    } else {
+      col.validity.back() &= static_cast<uint8_t>((1u << (rows_ & 7)) - 1);
+    }
+    switch (col.type) {
+      case lobaColumnDouble:col.doubles.pop_back();
+        break;
+      case lobaColumnInt64:col.ints.pop_back();
+        break;
+      case lobaColumnString:col.offsets.pop_back();
+        col.data.resize(static_cast<size_t>(col.offsets.back()));
+        break;
+    }
+  }
+}
+
+// 与 LobaParseObject 的语法和错误码一致. 键解码到 c_ 的栈上, 查完就不再需要
+inline int LobaShredder::LobaShredObject(size_t node) {
+  int ret;
+  // 出错时整行丢弃, 预算随之作废, 只有成功返回时才需要退回深度
+  if (cur_budget_ != nullptr && ++cur_budget_->depth > cur_budget_->limits.max_depth) {
+    return lobaParseTooDeep;
+  }
+  EXPECT(&c_, '{');
+  LobaParseWhitespace(&c_);
+  if (*c_.json == '}') {
+    c_.json++;
+    if (cur_budget_ != nullptr) {
+      cur_budget_->depth--;
+    }
+    return lobaParseOk;
+  }
+  for (;;) {
+    char *key;
+    size_t klen;
+    LobaParseWhitespace(&c_);
+    if (*c_.json != '"') {
+      return lobaParseMissKey;
+    }
+    c_.top = 0;
+    if ((ret = LobaParseStringRaw(&c_, &key, &klen)) != lobaParseOk) {
+      return ret;
+    }
+    LobaParseWhitespace(&c_);
+    if (*c_.json != ':') {
+      return lobaParseMissColon;
+    }
+    c_.json++;
+    LobaParseWhitespace(&c_);
+    size_t child = LobaFindChild(node, key, klen);
+    if (child == 0) {
+      ret = LobaSkipValue(&c_);
+    } else if (nodes_[child].column >= 0) {
+      ret = LobaShredValue(&columns_[nodes_[child].column]);
+    } else if (*c_.json == '{') {
+      ret = LobaShredObject(child);
+    } else {
+      ret = LobaSkipValue(&c_);
+    }
+    if (ret != lobaParseOk || (cur_budget_ != nullptr && (ret = LobaCheckBudget()) != lobaParseOk)) {
+      return ret;
+    }
+    LobaParseWhitespace(&c_);
+    if (*c_.json == ',') {
+      c_.json++;
+    } else if (*c_.json == '}') {
+      c_.json++;
+      if (cur_budget_ != nullptr) {
+        cur_budget_->depth--;
+      }
+      return lobaParseOk;
+    } else {
+      return lobaParseMissCommaOrCurlyBracket;
+    }
+  }
+}
+
+inline int LobaShredder::LobaShredValue(LobaColumn *col) {
+  if (col->rows > rows_) {
+    // 重复的键
+    return LobaSkipValue(&c_);
+  }
+  int ret;
+  switch (*c_.json) {
+    case 'n': {
+      LobaValue tmp;
+      if ((ret = LobaParseLiteral(&c_, &tmp, "null", LobaType::lobaNull)) == lobaParseOk) {
+        LobaAppendNull(col);
+      }
+      return ret;
+    }
+    case '"':
+      if (col->type == lobaColumnString) {
+        char *s;
+        size_t len;
+        c_.top = 0;
+        if ((ret = LobaParseStringRaw(&c_, &s, &len)) == lobaParseOk) {
+          col->data.insert(col->data.end(), s, s + len);
+          col->offsets.push_back(static_cast<int64_t>(col->data.size()));
+          LobaAppendValid(col, 1);
+        }
+        return ret;
+      }
+      break;
+    case '[':
+    case '{':
+    case 't':
+    case 'f':
+    case '\0':break;
+    default:
+      if (col->type == lobaColumnDouble) {
+        LobaValue tmp;
+        if ((ret = LobaParseNumber(&c_, &tmp)) == lobaParseOk) {
+          col->doubles.push_back(tmp.u.n);
+          LobaAppendValid(col, 1);
+        }
+        return ret;
+      }
+      if (col->type == lobaColumnInt64) {
+        return LobaShredInt64(col);
+      }
+      break;
+  }
+  // 类型不符: 照常校验并跳过
+  if ((ret = LobaSkipValue(&c_)) == lobaParseOk) {
+    LobaMismatch(col);
+  }
+  return ret;
+}
+
+// 纯整数逐位累加, 不经过 double, 超过 2^53 也是精确的. 带小数或指数的按 double 转换,
+// 只接受刚好是整数且在 int64 范围内的值; 其余的和溢出的都算类型不符
+inline int LobaShredder::LobaShredInt64(LobaColumn *col) {
+  const char *p = c_.json;
+  const char *end = LobaScanNumber(p);
+  if (end == nullptr) {
+    return lobaParseInvalidValue;
+  }
+  int negative = *p == '-';
+  p += negative;
+  uint64_t u = 0;
+  int overflow = 0;
+  for (; p < end && *p >= '0' && *p <= '9'; p++) {
+    unsigned digit = static_cast<unsigned>(*p - '0');
+    if (u > (UINT64_MAX - digit) / 10) {
+      overflow = 1;
+    }
+    u = u * 10 + digit;
+  }
+  if (p == end) {
+    uint64_t limit = negative ? static_cast<uint64_t>(INT64_MAX) + 1 : static_cast<uint64_t>(INT64_MAX);
+    c_.json = end;
+    if (overflow || u > limit) {
+      LobaMismatch(col);
+    } else {
+      col->ints.push_back(negative ? static_cast<int64_t>(0 - u) : static_cast<int64_t>(u));
+      LobaAppendValid(col, 1);
+    }
+    return lobaParseOk;
+  }
+  LobaValue tmp;
+  int ret = LobaParseNumber(&c_, &tmp);
+  if (ret != lobaParseOk) {
+    return ret;
+  }
+  // -2^63 <= n < 2^63
+  if (tmp.u.n == std::floor(tmp.u.n) && tmp.u.n >= -9223372036854775808.0 && tmp.u.n < 9223372036854775808.0) {
+    col->ints.push_back(static_cast<int64_t>(tmp.u.n));
+    LobaAppendValid(col, 1);
+  } else {
+    LobaMismatch(col);
+  }
+  return lobaParseOk;
+}
+
+inline void LobaShredder::LobaClearRows() {
+  for (LobaColumn &col : columns_) {
+    col.rows = col.null_count = col.mismatches = 0;
+    col.validity.clear();
+    col.doubles.clear();
+    col.ints.clear();
+    col.offsets.clear();
+    col.data.clear();
+    if (col.type == lobaColumnString) {
+      col.offsets.push_back(0);
+    }
+  }
+  rows_ = 0;
+  bad_rows_ = 0;
+  last_error_ = lobaParseOk;
+}
+
+#endif  // LOBAJSON_COLUMNAR_H_
@@ -0,0 +1,215 @@
+// Copyright (c) 2022. Yang Zhu
+
+#ifndef LOBAJSON_DOCUMENT_H_
+#define LOBAJSON_DOCUMENT_H_
+
+#include <cassert>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include "lobajson.h"
+#include "lobajson_allocator.h"
+
+// 第一次解析时 arena 块的大小按输入估计, 夹在这两者之间
+#define LobaDocumentMinBlockBytes 1024
+#define LobaDocumentMaxBlockBytes LobaArenaBlockBytes
+
+class LobaDocument;
+
+// 指向文档中一个值的句柄, 只有几个指针, 按值传递. 不拥有任何东西, 在文档释放或
+// 重新解析之前有效; 文档被移动时句柄仍然有效. 默认构造的是空句柄; 找不到的成员、越界的下标、
+// 在非对象上查找都得到空句柄. 空句柄可以继续查找 (仍得到空句柄), 类型为 null, 大小为 0
+class LobaValueRef {
+ public:
+  LobaValueRef() = default;
+
+  explicit operator bool() const { return v_ != nullptr || d_ != nullptr; }
+  LobaType LobaGetType() const;
+  int LobaGetBoolean() const { return json_->LobaGetBoolean(v_); }
+  double LobaGetNumber() const { return d_ ? *d_ : json_->LobaGetNumber(v_); }
+  const char *LobaGetString() const { return json_->LobaGetString(v_); }
+  size_t LobaGetStringLength() const { return json_->LobaGetStringLength(v_); }
+  // 数组的元素数或对象的成员数, 其他值为 0
+  size_t LobaGetSize() const;
+  // 数组元素. 紧凑数组的元素直接指向数组里的 double, 只能读数字
+  LobaValueRef operator[](size_t index) const;
+  // 对象的第 index 个成员, 越界时键为 nullptr, 值为空句柄
+  const char *LobaGetKey(size_t index) const;
+  size_t LobaGetKeyLength(size_t index) const;
+  LobaValueRef LobaGetMember(size_t index) const;
+  LobaValueRef LobaFind(const char *key, size_t klen) const;
+  LobaValueRef LobaFind(const char *key) const { return LobaFind(key, strlen(key)); }
+  // 底层的值, 修改须经由 LobaDocument::LobaGetJson. 紧凑数组的元素没有单独的 LobaValue,
+  // 返回 nullptr
+  LobaValue *LobaGetValue() const { return v_; }
+
+ private:
+  friend class LobaDocument;
+  LobaValueRef(LobaJson *json, LobaValue *v) : json_(json), v_(v) {}
+  int LobaIsObject() const { return LobaGetType() == LobaType::lobaObject; }
+
+  LobaJson *json_ = nullptr;
+  LobaValue *v_ = nullptr;
+  // 紧凑数组的元素, 此时 v_ 为 nullptr
+  const double *d_ = nullptr;
+};
+
+inline LobaType LobaValueRef::LobaGetType() const {
+  if (d_ != nullptr) {
+    return LobaType::lobaNumber;
+  }
+  return v_ ? json_->LobaGetType(v_) : LobaType::lobaNull;
+}
+
+inline size_t LobaValueRef::LobaGetSize() const {
+  switch (LobaGetType()) {
+    case LobaType::lobaObject:return json_->LobaGetObjectSize(v_);
+    case LobaType::lobaArray:
+    case LobaType::lobaPackedArray:return json_->LobaGetArraySize(v_);
+    default:return 0;
+  }
+}
+
+inline LobaValueRef LobaValueRef::operator[](size_t index) const {
+  LobaType type = LobaGetType();
+  if ((type != LobaType::lobaArray && type != LobaType::lobaPackedArray) || index >= LobaGetSize()) {
+    return {};
+  }
+  if (v_->type == LobaType::lobaPackedArray) {
+    LobaValueRef ref;
+    ref.json_ = json_;
+    ref.d_ = json_->LobaGetPackedArray(v_) + index;
+    return ref;
+  }
+  return {json_, json_->LobaGetArrayElement(v_, index)};
+}
+
+inline const char *LobaValueRef::LobaGetKey(size_t index) const {
+  return LobaIsObject() && index < LobaGetSize() ? json_->LobaGetObjectKey(v_, index) : nullptr;
+}
+
+inline size_t LobaValueRef::LobaGetKeyLength(size_t index) const {
+  return LobaIsObject() && index < LobaGetSize() ? json_->LobaGetObjectKeyLength(v_, index) : 0;
+}
+
+inline LobaValueRef LobaValueRef::LobaGetMember(size_t index) const {
+  if (!LobaIsObject() || index >= LobaGetSize()) {
+    return {};
+  }
+  return {json_, json_->LobaGetObjectValue(v_, index)};
+}
+
+inline LobaValueRef LobaValueRef::LobaFind(const char *key, size_t klen) const {
+  if (!LobaIsObject()) {
+    return {};
+  }
+  LobaValue *v = json_->LobaFindObjectValue(v_, key, klen);
+  return v != nullptr ? LobaValueRef(json_, v) : LobaValueRef();
+}
+
+// 拥有一棵树及其 allocator 的文档, 只能移动. 树的全部内存都在文档自己的 arena 上,
+// 释放时整块归还, 不遍历树, 耗时与树的大小无关; 解析失败时也没有残留要收拾.
+// 树、arena 和 LobaJson 放在一块堆内存里, 移动只是交换一个指针, 不会抛异常
+class LobaDocument {
+ public:
+  LobaDocument() = default;
+  ~LobaDocument() = default;
+  LobaDocument(LobaDocument &&other) noexcept = default;
+  LobaDocument &operator=(LobaDocument &&other) noexcept = default;
+  LobaDocument(const LobaDocument &) = delete;
+  LobaDocument &operator=(const LobaDocument &) = delete;
+
+  // 解析 json (以 '\0' 结尾), 之前的树和句柄作废, arena 的块留着复用.
+  // 失败时根为 null, 返回错误码
+  int LobaParse(const char *json);
+  // json 只读 len 个字节, 先连同结尾的 '\0' 拷进 arena, 之后不再引用调用者的缓冲区
+  int LobaParse(const char *json, size_t len);
+  // 立即归还全部内存, 文档变为空
+  void LobaRelease() noexcept { state_.reset(); }
+
+  int LobaIsEmpty() const { return state_ == nullptr; }
+  // 空文档返回空句柄
+  LobaValueRef LobaGetRoot() const;
+  // 用来修改树的 LobaJson, 新的分配都落在文档的 arena 上, 释放的部分到 LobaRelease 才归还.
+  // 空文档先变成根为 null 的文档
+  LobaJson &LobaGetJson();
+  LobaValue *LobaGetRootValue() {
+    LobaGetJson();
+    return &state_->root;
+  }
+  std::string LobaStringify() const;
+  // arena 已申请的字节数
+  size_t LobaGetReserved() const { return state_ ? state_->arena.LobaGetReserved() : 0; }
+
+ private:
+  struct State {
+    explicit State(size_t block_bytes) : arena(block_bytes) {
+      json.LobaSetAllocator(&arena);
+      LobaInit(&root);
+    }
+    LobaArenaAllocator arena;
+    LobaJson json;
+    LobaValue root;
+  };
+  // 没有 State 时按 len 建一个, 有则清空 arena 复用
+  void LobaPrepare(size_t len);
+
+  std::unique_ptr<State> state_;
+};
+
+inline void LobaDocument::LobaPrepare(size_t len) {
+  if (state_ != nullptr) {
+    state_->arena.LobaReset();
+    LobaInit(&state_->root);
+    return;
+  }
+  // 树和解析栈大致是输入的两倍
+  size_t block = len < LobaDocumentMaxBlockBytes / 2 ? 2 * len : LobaDocumentMaxBlockBytes;
+  state_.reset(new State(block < LobaDocumentMinBlockBytes ? LobaDocumentMinBlockBytes : block));
+}
+
+inline int LobaDocument::LobaParse(const char *json) {
+  assert(json != nullptr);
+  LobaPrepare(strlen(json));
+  return state_->json.LobaParse(&state_->root, json);
+}
+
+inline int LobaDocument::LobaParse(const char *json, size_t len) {
+  assert(json != nullptr || len == 0);
+  LobaPrepare(len);
+  char *copy = (char *)state_->arena.LobaAlloc(len + 1);
+  memcpy(copy, json, len);
+  copy[len] = '\0';
+  return state_->json.LobaParse(&state_->root, copy);
+}
+
+inline LobaValueRef LobaDocument::LobaGetRoot() const {
+  if (state_ == nullptr) {
+    return {};
+  }
+  return {&state_->json, &state_->root};
+}
+
+inline LobaJson &LobaDocument::LobaGetJson() {
+  if (state_ == nullptr) {
+    state_.reset(new State(LobaDocumentMinBlockBytes));
+  }
+  return state_->json;
+}
+
+// 输出不经过 arena, 免得占用文档的内存
+inline std::string LobaDocument::LobaStringify() const {
+  if (state_ == nullptr) {
+    return std::string();
+  }
+  LobaJson plain;
+  size_t length;
+  char *s = plain.LobaStringify(&state_->root, &length);
+  std::string ret(s, length);
+  free(s);
+  return ret;
+}
+
+#endif  // LOBAJSON_DOCUMENT_H_
@@ -0,0 +1,1028 @@
+// Copyright (c) 2022. Yang Zhu
+
+#ifndef LOBAJSON_PATCH_H_
+#define LOBAJSON_PATCH_H_
+
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "lobajson.h"
+
+// JSON Patch (RFC 6902) 与 JSON Merge Patch (RFC 7386), 直接修改 LobaValue 树
+enum {
+  lobaPatchOk = 0,
+
+  lobaPatchInvalidPatch,
+  lobaPatchInvalidPointer,
+  lobaPatchPathNotFound,
+  lobaPatchTestFailed
+};
+
+// 成员数小于该值的对象直接线性查找, 不建哈希索引
+#define LobaPatchIndexMinSize 16
+// 大对象在一次调用里被线性查找这么多次后才建哈希索引. 建索引大约是几十次扫描的代价,
+// 先扫描后建索引, 总代价最多是事先知道操作数时最优做法的两倍
+#define LobaPatchIndexMinScans 32
+// 数组 diff 做 LCS 的矩阵规模上限, 超过后按位置逐个比较
+#define LobaDiffLcsMaxCells (1 << 22)
+
+class LobaPatch {
+ public:
+  LobaPatch() = default;
+  // 经由调用者的 json 修改 doc, 它压实过的树也能直接打补丁. json 须比 LobaPatch 活得久
+  explicit LobaPatch(LobaJson *json) : json_(json) {}
+  ~LobaPatch() = default;
+
+  // patch 是解析好的操作数组, 任一操作失败时 doc 回滚到调用前的状态
+  int LobaApplyPatch(LobaValue *doc, const LobaValue *patch);
+  // merge patch 总是成功, patch 为非对象时整体替换 doc
+  void LobaApplyMergePatch(LobaValue *doc, const LobaValue *patch);
+  // 按 JSON Pointer 取值, 不存在返回 nullptr. 紧凑数组不展开, 落在它的元素上时返回补丁里的
+  // 一个代理, 只读, 到下一次调用前有效
+  LobaValue *LobaResolvePointer(LobaValue *doc, const char *pointer, size_t len);
+  // 生成把 a 变成 b 的 RFC 6902 patch, 结果写入 patch (一个数组)
+  void LobaDiff(const LobaValue *a, const LobaValue *b, LobaValue *patch);
+  // doc 和 patch 结果的内存经由 allocator 分配, 需与解析 doc 时用的一致
+  void LobaSetAllocator(LobaAllocator *allocator) { json_->LobaSetAllocator(allocator); }
+  // doc 的键驻留在 table 中时必须设置同一张表
+  void LobaSetKeyTable(LobaKeyTable *table) { json_->LobaSetKeyTable(table); }
+  // doc 的序列化结果缓存在 cache 中时设置, 改动的路径随之标记失效
+  void LobaSetStringifyCache(LobaStringifyCache *cache) { json_->LobaSetStringifyCache(cache); }
+  // 改用调用者的 json, 之后的设置都作用在它上面; nullptr 回到自带的那个. doc 压实过时
+  // 必须用做压实的那个 json, 压实块只登记在它名下
+  void LobaSetJson(LobaJson *json) { json_ = json != nullptr ? json : &own_json_; }
+
+ private:
+  enum { kUndoErase, kUndoInsert, kUndoReplace };
+  // 每一步原子修改的逆操作, parent 是父容器的 pointer, index 为 LOBA_KEY_NOT_EXIST 时表示根
+  struct Undo {
+    int kind;
+    // move 中 remove 出来的值借给了后面的 add, 回滚时从 add 的逆操作取回
+    int borrowed;
+    // 修改前把父容器从紧凑数组展开了, 回滚后重新打包
+    int repack;
+    std::string parent;
+    size_t index;
+    std::string key;
+    LobaValue value;
+  };
+  // 大对象的键索引, 线性探测的开放寻址表. 槽里是成员下标加一, 0 为空槽; 键直接比较
+  // 成员数组里的, 不另存. 增删成员时整表平移下标, 顺序扫一遍槽, 与 memmove 同一量级
+  struct ObjectIndex {
+    // 建索引之前已线性查找的次数
+    size_t scans = 0;
+    std::vector<size_t> slots;
+  };
+
+  int LobaApplyOperation(LobaValue *doc, const LobaValue *op);
+  int LobaNextToken(const char **p, const char *end, std::string *token);
+  int LobaResolveParent(LobaValue *doc, const char *path, size_t len,
+                        LobaValue **parent, std::string *token, Undo *undo);
+  int LobaArrayIndex(const LobaValue *a, const std::string &token, int allow_end, size_t *index);
+  int LobaUnpackParent(LobaValue *parent);
+  void LobaRepack(LobaValue *a);
+
+  size_t LobaLookup(const LobaValue *o, const char *key, size_t klen);
+  static size_t LobaFindSlot(const std::vector<size_t> &slots, const LobaMember *m, const char *key, size_t klen);
+  static void LobaBuildIndex(ObjectIndex *index, const LobaValue *o);
+  static void LobaEraseSlot(std::vector<size_t> *slots, const LobaMember *m, size_t i);
+  void LobaInsertMember(LobaValue *o, size_t index, const char *key, size_t klen, LobaValue *v);
+  void LobaEraseMember(LobaValue *o, size_t index, LobaValue *out);
+  void LobaInsertElement(LobaValue *a, size_t index, LobaValue *v);
+  void LobaEraseElement(LobaValue *a, size_t index, LobaValue *out);
+
+  int LobaAdd(LobaValue *doc, const char *path, size_t len, LobaValue *v);
+  int LobaRemove(LobaValue *doc, const char *path, size_t len, LobaValue *out);
+  int LobaReplace(LobaValue *doc, const char *path, size_t len, LobaValue *v);
+  void LobaRollback(LobaValue *doc);
+  void LobaRelease();
+  void LobaDiscard(LobaValue *v);
+
+  void LobaMergeValue(LobaValue *target, const LobaValue *patch);
+
+  size_t LobaSubtreeHash(const LobaValue *v);
+  int LobaSameSubtree(const LobaValue *a, const LobaValue *b);
+  int LobaSubtreeEqual(const LobaValue *a, const LobaValue *b);
+  void LobaDiffValue(const LobaValue *a, const LobaValue *b, std::string *path);
+  void LobaDiffObject(const LobaValue *a, const LobaValue *b, std::string *path);
+  void LobaDiffArray(const LobaValue *a, const LobaValue *b, std::string *path);
+  void LobaEmit(const char *op, const std::string &path, const LobaValue *value);
+
+  LobaJson own_json_;
+  LobaJson *json_ = &own_json_;
+  std::vector<Undo> undo_;
+  // 以成员数组地址为键, 只在一次 apply 调用内有效
+  std::unordered_map<const LobaMember *, ObjectIndex> index_;
+  // apply 期间被替换掉的值, 推迟到索引清空后再释放, 防止地址复用命中旧索引
+  std::vector<LobaValue> garbage_;
+  // LobaResolvePointer 读紧凑数组元素用的代理
+  LobaValue proxy_;
+  // diff 用: 子树哈希缓存和生成中的操作
+  std::unordered_map<const LobaValue *, size_t> hash_;
+  std::vector<LobaValue> ops_;
+};
+
+inline int LobaPatch::LobaApplyPatch(LobaValue *doc, const LobaValue *patch) {
+  assert(doc != nullptr && patch != nullptr);
+  if (patch->type != LobaType::lobaArray) {
+    return lobaPatchInvalidPatch;
+  }
+  int ret = lobaPatchOk;
+  for (size_t i = 0; i < patch->u.a.size; i++) {
+    if ((ret = LobaApplyOperation(doc, &patch->u.a.e[i])) != lobaPatchOk) {
+      LobaRollback(doc);
+      break;
+    }
+  }
+  LobaRelease();
+  return ret;
+}
+
+inline void LobaPatch::LobaApplyMergePatch(LobaValue *doc, const LobaValue *patch) {
+  assert(doc != nullptr && patch != nullptr);
+  LobaMergeValue(doc, patch);
+  LobaRelease();
+}
+
+inline LobaValue *LobaPatch::LobaResolvePointer(LobaValue *doc, const char *pointer, size_t len) {
+  assert(doc != nullptr && pointer != nullptr);
+  const char *p = pointer, *end = pointer + len;
+  std::string token;
+  LobaValue *v = doc;
+  while (p != end) {
+    if (LobaNextToken(&p, end, &token) != lobaPatchOk) {
+      return nullptr;
+    }
+    if (v->type == LobaType::lobaObject) {
+      size_t index = LobaLookup(v, token.data(), token.size());
+      if (index == LOBA_KEY_NOT_EXIST) {
+        return nullptr;
+      }
+      v = &v->u.o.m[index].v;
+    } else if (v->type == LobaType::lobaArray || v->type == LobaType::lobaPackedArray) {
+      size_t index;
+      if (LobaArrayIndex(v, token, 0, &index) != lobaPatchOk) {
+        return nullptr;
+      }
+      v = const_cast<LobaValue *>(json_->LobaGetArrayElement(v, index, &proxy_));
+    } else {
+      return nullptr;
+    }
+  }
+  return v;
+}
+
+// 读取 "/token", 还原 ~1 与 ~0
+inline int LobaPatch::LobaNextToken(const char **p, const char *end, std::string *token) {
+  const char *q = *p;
+  if (*q++ != '/') {
+    return lobaPatchInvalidPointer;
+  }
+  token->clear();
+  for (; q != end && *q != '/'; q++) {
+    if (*q != '~') {
+      token->push_back(*q);
+    } else if (q + 1 != end && (q[1] == '0' || q[1] == '1')) {
+      token->push_back(*++q == '0' ? '~' : '/');
+    } else {
+      return lobaPatchInvalidPointer;
+    }
+  }
+  *p = q;
+  return lobaPatchOk;
+}
+
+// 解析父容器和最后一个 token, 同时初始化 undo 记录
+inline int LobaPatch::LobaResolveParent(LobaValue *doc, const char *path, size_t len,
+                                        LobaValue **parent, std::string *token, Undo *undo) {
+  const char *last = path + len;
+  while (last != path && *--last != '/') {}
+  if (len == 0 || *last != '/') {
+    return lobaPatchInvalidPointer;
+  }
+  const char *p = last;
+  if (LobaNextToken(&p, path + len, token) != lobaPatchOk) {
+    return lobaPatchInvalidPointer;
+  }
+  *parent = LobaResolvePointer(doc, path, last - path);
+  if (*parent == nullptr) {
+    return lobaPatchPathNotFound;
+  }
+  if (json_->LobaGetType(*parent) != LobaType::lobaObject && json_->LobaGetType(*parent) != LobaType::lobaArray) {
+    return lobaPatchPathNotFound;
+  }
+  undo->borrowed = 0;
+  undo->repack = 0;
+  undo->parent.assign(path, last - path);
+  LobaInit(&undo->value);
+  return lobaPatchOk;
+}
+
+// 数组下标不允许前导零, allow_end 时 "-" 表示末尾
+inline int LobaPatch::LobaArrayIndex(const LobaValue *a, const std::string &token,
+                                     int allow_end, size_t *index) {
+  size_t size = json_->LobaGetArraySize(a);
+  size_t limit = size + (allow_end ? 1 : 0);
+  if (allow_end && token == "-") {
+    *index = size;
+    return lobaPatchOk;
+  }
+  if (token.empty() || (token.size() > 1 && token[0] == '0')) {
+    return lobaPatchInvalidPointer;
+  }
+  size_t n = 0;
+  for (char ch : token) {
+    if (!ISDIGIT(ch)) {
+      return lobaPatchInvalidPointer;
+    }
+    if (n > (limit - (ch - '0')) / 10) {
+      return lobaPatchPathNotFound;
+    }
+    n = n * 10 + (ch - '0');
+  }
+  if (n >= limit) {
+    return lobaPatchPathNotFound;
+  }
+  *index = n;
+  return lobaPatchOk;
+}
+
+// 要修改的数组是紧凑数组时就地展开, 返回是否展开了. 只展开真正被修改的那一个
+inline int LobaPatch::LobaUnpackParent(LobaValue *parent) {
+  if (parent->type != LobaType::lobaPackedArray) {
+    return 0;
+  }
+  json_->LobaUnpackArray(parent);
+  return 1;
+}
+
+// 回滚后数组又全是数字, 打包回去
+inline void LobaPatch::LobaRepack(LobaValue *a) {
+  std::vector<double> d(a->u.a.size);
+  for (size_t i = 0; i < a->u.a.size; i++) {
+    d[i] = a->u.a.e[i].u.n;
+  }
+  json_->LobaSetPackedArray(a, d.data(), d.size());
+}
+
+// 大对象先线性查找并计数, 同一次调用里查得多了才建哈希索引, 只有几个操作的补丁
+// 不为大对象付出建索引的代价
+inline size_t LobaPatch::LobaLookup(const LobaValue *o, const char *key, size_t klen) {
+  if (o->u.o.size < LobaPatchIndexMinSize) {
+    return json_->LobaFindObjectIndex(o, key, klen);
+  }
+  ObjectIndex &index = index_[o->u.o.m];
+  if (index.slots.empty()) {
+    if (++index.scans <= LobaPatchIndexMinScans) {
+      return json_->LobaFindObjectIndex(o, key, klen);
+    }
+    LobaBuildIndex(&index, o);
+  }
+  size_t slot = index.slots[LobaFindSlot(index.slots, o->u.o.m, key, klen)];
+  return slot == 0 ? LOBA_KEY_NOT_EXIST : slot - 1;
+}
+
+// key 所在的槽, 不存在时是探测到的第一个空槽
+inline size_t LobaPatch::LobaFindSlot(const std::vector<size_t> &slots, const LobaMember *m,
+                                      const char *key, size_t klen) {
+  size_t mask = slots.size() - 1;
+  for (size_t i = std::hash<std::string_view>()(std::string_view(key, klen)) & mask;; i = (i + 1) & mask) {
+    size_t slot = slots[i];
+    if (slot == 0 || (m[slot - 1].klen == klen && memcmp(m[slot - 1].k, key, klen) == 0)) {
+      return i;
+    }
+  }
+}
+
+// 槽数取不小于成员数两倍的 2 的幂. 重复键保留第一个, 与线性查找的结果一致
+inline void LobaPatch::LobaBuildIndex(ObjectIndex *index, const LobaValue *o) {
+  size_t n = LobaPatchIndexMinSize;
+  while (n < o->u.o.size * 2) {
+    n <<= 1;
+  }
+  index->slots.assign(n, 0);
+  for (size_t i = 0; i < o->u.o.size; i++) {
+    size_t &slot = index->slots[LobaFindSlot(index->slots, o->u.o.m, o->u.o.m[i].k, o->u.o.m[i].klen)];
+    if (slot == 0) {
+      slot = i + 1;
+    }
+  }
+}
+
+// 清空第 i 个槽, 把探测链上后面的项往前挪, 不留墓碑. m 须是下标还没变的成员数组
+inline void LobaPatch::LobaEraseSlot(std::vector<size_t> *slots, const LobaMember *m, size_t i) {
+  size_t mask = slots->size() - 1;
+  for (size_t j = (i + 1) & mask; (*slots)[j] != 0; j = (j + 1) & mask) {
+    const LobaMember *e = &m[(*slots)[j] - 1];
+    size_t home = std::hash<std::string_view>()(std::string_view(e->k, e->klen)) & mask;
+    // i 落在 j 上这一项的探测路径 [home, j] 里才能挪过去
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      (*slots)[i] = (*slots)[j];
+      i = j;
+    }
+  }
+  (*slots)[i] = 0;
+}
+
+// v 的所有权转移到对象中. 已建的索引随成员数组搬到新地址, 插入点及之后的下标加一
+inline void LobaPatch::LobaInsertMember(LobaValue *o, size_t index, const char *key,
+                                        size_t klen, LobaValue *v) {
+  assert(index <= o->u.o.size);
+  auto node = index_.extract(o->u.o.m);
+  o->u.o.m = (LobaMember *)json_->LobaRealloc(o->u.o.m, o->u.o.size * sizeof(LobaMember),
+                                              (o->u.o.size + 1) * sizeof(LobaMember));
+  memmove(&o->u.o.m[index + 1], &o->u.o.m[index], (o->u.o.size - index) * sizeof(LobaMember));
+  LobaMember *m = &o->u.o.m[index];
+  m->k = json_->LobaNewKey(key, klen);
+  m->klen = klen;
+  memcpy(&m->v, v, sizeof(LobaValue));
+  LobaInit(v);
+  o->u.o.size++;
+  if (node.empty()) {
+    return;
+  }
+  std::vector<size_t> &slots = node.mapped().slots;
+  if (o->u.o.size * 2 > slots.size()) {
+    // 装载率过半时加倍重建, 追加成员均摊下来仍是常数
+    if (!slots.empty()) {
+      LobaBuildIndex(&node.mapped(), o);
+    }
+  } else {
+    if (index + 1 != o->u.o.size) {
+      for (size_t &slot : slots) {
+        slot += slot > index;
+      }
+    }
+    size_t &slot = slots[LobaFindSlot(slots, o->u.o.m, m->k, klen)];
+    if (slot == 0 || slot > index + 1) {
+      slot = index + 1;
+    }
+  }
+  node.key() = o->u.o.m;
+  index_.insert(std::move(node));
+}
+
+// 已建的索引去掉被删的键, 之后的下标减一. 被删的是重复键中登记的那个时, 补上后面的同名键
+inline void LobaPatch::LobaEraseMember(LobaValue *o, size_t index, LobaValue *out) {
+  assert(index < o->u.o.size);
+  auto node = index_.extract(o->u.o.m);
+  LobaMember *m = &o->u.o.m[index];
+  size_t duplicate = LOBA_KEY_NOT_EXIST;
+  if (!node.empty() && !node.mapped().slots.empty()) {
+    std::vector<size_t> &slots = node.mapped().slots;
+    size_t i = LobaFindSlot(slots, o->u.o.m, m->k, m->klen);
+    if (slots[i] == index + 1) {
+      LobaEraseSlot(&slots, o->u.o.m, i);
+      for (size_t j = index + 1; j < o->u.o.size; j++) {
+        if (o->u.o.m[j].klen == m->klen && memcmp(o->u.o.m[j].k, m->k, m->klen) == 0) {
+          duplicate = j - 1;
+          break;
+        }
+      }
+    }
+  }
+  json_->LobaFreeKey(m->k, m->klen);
+  memcpy(out, &m->v, sizeof(LobaValue));
+  memmove(m, m + 1, (o->u.o.size - index - 1) * sizeof(LobaMember));
+  // 缩到准确的长度, 释放时 allocator 拿到的大小才和分配时一致
+  o->u.o.m = (LobaMember *)json_->LobaRealloc(o->u.o.m, o->u.o.size * sizeof(LobaMember),
+                                              (o->u.o.size - 1) * sizeof(LobaMember));
+  o->u.o.size--;
+  if (node.empty() || o->u.o.size == 0) {
+    return;
+  }
+  std::vector<size_t> &slots = node.mapped().slots;
+  if (!slots.empty()) {
+    for (size_t &slot : slots) {
+      slot -= slot > index + 1;
+    }
+    if (duplicate != LOBA_KEY_NOT_EXIST) {
+      const LobaMember *d = &o->u.o.m[duplicate];
+      slots[LobaFindSlot(slots, o->u.o.m, d->k, d->klen)] = duplicate + 1;
+    }
+  }
+  node.key() = o->u.o.m;
+  index_.insert(std::move(node));
+}
+
+inline void LobaPatch::LobaInsertElement(LobaValue *a, size_t index, LobaValue *v) {
+  assert(index <= a->u.a.size);
+  a->u.a.e = (LobaValue *)json_->LobaRealloc(a->u.a.e, a->u.a.size * sizeof(LobaValue),
+                                            (a->u.a.size + 1) * sizeof(LobaValue));
+  memmove(&a->u.a.e[index + 1], &a->u.a.e[index], (a->u.a.size - index) * sizeof(LobaValue));
+  memcpy(&a->u.a.e[index], v, sizeof(LobaValue));
+  LobaInit(v);
+  a->u.a.size++;
+}
+
+inline void LobaPatch::LobaEraseElement(LobaValue *a, size_t index, LobaValue *out) {
+  assert(index < a->u.a.size);
+  memcpy(out, &a->u.a.e[index], sizeof(LobaValue));
+  memmove(&a->u.a.e[index], &a->u.a.e[index + 1], (a->u.a.size - index - 1) * sizeof(LobaValue));
+  a->u.a.e = (LobaValue *)json_->LobaRealloc(a->u.a.e, a->u.a.size * sizeof(LobaValue),
+                                            (a->u.a.size - 1) * sizeof(LobaValue));
+  a->u.a.size--;
+}
+
+// 以下三个原子操作都会把逆操作记入 undo_, v 的所有权被转移
+inline int LobaPatch::LobaAdd(LobaValue *doc, const char *path, size_t len, LobaValue *v) {
+  Undo undo;
+  if (len == 0) {
+    undo.kind = kUndoReplace;
+    undo.borrowed = 0;
+    undo.repack = 0;
+    undo.index = LOBA_KEY_NOT_EXIST;
+    memcpy(&undo.value, doc, sizeof(LobaValue));
+    memcpy(doc, v, sizeof(LobaValue));
+    LobaInit(v);
+    undo_.push_back(std::move(undo));
+    return lobaPatchOk;
+  }
+  LobaValue *parent;
+  std::string token;
+  int ret = LobaResolveParent(doc, path, len, &parent, &token, &undo);
+  if (ret != lobaPatchOk) {
+    return ret;
+  }
+  if (parent->type == LobaType::lobaObject) {
+    size_t index = LobaLookup(parent, token.data(), token.size());
+    if (index != LOBA_KEY_NOT_EXIST) {
+      undo.kind = kUndoReplace;
+      undo.index = index;
+      memcpy(&undo.value, &parent->u.o.m[index].v, sizeof(LobaValue));
+      memcpy(&parent->u.o.m[index].v, v, sizeof(LobaValue));
+      LobaInit(v);
+    } else {
+      undo.kind = kUndoErase;
+      undo.index = parent->u.o.size;
+      LobaInsertMember(parent, parent->u.o.size, token.data(), token.size(), v);
+    }
+  } else {
+    size_t index;
+    if ((ret = LobaArrayIndex(parent, token, 1, &index)) != lobaPatchOk) {
+      return ret;
+    }
+    undo.kind = kUndoErase;
+    undo.index = index;
+    undo.repack = LobaUnpackParent(parent);
+    LobaInsertElement(parent, index, v);
+  }
+  undo_.push_back(std::move(undo));
+  return lobaPatchOk;
+}
+
+inline int LobaPatch::LobaRemove(LobaValue *doc, const char *path, size_t len, LobaValue *out) {
+  LobaValue *parent;
+  std::string token;
+  Undo undo;
+  int ret = LobaResolveParent(doc, path, len, &parent, &token, &undo);
+  if (ret != lobaPatchOk) {
+    return ret;
+  }
+  undo.kind = kUndoInsert;
+  if (parent->type == LobaType::lobaObject) {
+    size_t index = LobaLookup(parent, token.data(), token.size());
+    if (index == LOBA_KEY_NOT_EXIST) {
+      return lobaPatchPathNotFound;
+    }
+    undo.index = index;
+    undo.key = token;
+    LobaEraseMember(parent, index, out);
+  } else {
+    if ((ret = LobaArrayIndex(parent, token, 0, &undo.index)) != lobaPatchOk) {
+      return ret;
+    }
+    undo.repack = LobaUnpackParent(parent);
+    LobaEraseElement(parent, undo.index, out);
+  }
+  // 被删除的值由调用者决定放回 undo.value 还是借给 move
+  undo_.push_back(std::move(undo));
+  return lobaPatchOk;
+}
+
+inline int LobaPatch::LobaReplace(LobaValue *doc, const char *path, size_t len, LobaValue *v) {
+  Undo undo;
+  LobaValue *target = doc;
+  if (len == 0) {
+    undo.borrowed = 0;
+    undo.repack = 0;
+    undo.index = LOBA_KEY_NOT_EXIST;
+    LobaInit(&undo.value);
+  } else {
+    LobaValue *parent;
+    std::string token;
+    int ret = LobaResolveParent(doc, path, len, &parent, &token, &undo);
+    if (ret != lobaPatchOk) {
+      return ret;
+    }
+    if (parent->type == LobaType::lobaObject) {
+      if ((undo.index = LobaLookup(parent, token.data(), token.size())) == LOBA_KEY_NOT_EXIST) {
+        return lobaPatchPathNotFound;
+      }
+      target = &parent->u.o.m[undo.index].v;
+    } else {
+      if ((ret = LobaArrayIndex(parent, token, 0, &undo.index)) != lobaPatchOk) {
+        return ret;
+      }
+      undo.repack = LobaUnpackParent(parent);
+      target = &parent->u.a.e[undo.index];
+    }
+  }
+  undo.kind = kUndoReplace;
+  memcpy(&undo.value, target, sizeof(LobaValue));
+  memcpy(target, v, sizeof(LobaValue));
+  LobaInit(v);
+  undo_.push_back(std::move(undo));
+  return lobaPatchOk;
+}
+
+inline int LobaPatch::LobaApplyOperation(LobaValue *doc, const LobaValue *op) {
+  if (op->type != LobaType::lobaObject) {
+    return lobaPatchInvalidPatch;
+  }
+  const LobaValue *name = json_->LobaFindObjectValue(op, "op", 2);
+  const LobaValue *path = json_->LobaFindObjectValue(op, "path", 4);
+  if (name == nullptr || name->type != LobaType::lobaString ||
+      path == nullptr || path->type != LobaType::lobaString) {
+    return lobaPatchInvalidPatch;
+  }
+  const char *p = path->u.s.s;
+  size_t len = path->u.s.len;
+  if (len != 0 && *p != '/') {
+    return lobaPatchInvalidPointer;
+  }
+  std::string_view kind(name->u.s.s, name->u.s.len);
+  const LobaValue *value = json_->LobaFindObjectValue(op, "value", 5);
+  const LobaValue *from = json_->LobaFindObjectValue(op, "from", 4);
+  LobaStringifyCache *cache = json_->LobaGetStringifyCache();
+  if (cache != nullptr && kind != "test") {
+    cache->LobaMarkDirty(doc, p, len);
+    if (from != nullptr && from->type == LobaType::lobaString) {
+      cache->LobaMarkDirty(doc, from->u.s.s, from->u.s.len);
+    }
+  }
+  LobaValue v;
+  LobaInit(&v);
+  int ret;
+  if (kind == "add" || kind == "replace" || kind == "test") {
+    if (value == nullptr) {
+      return lobaPatchInvalidPatch;
+    }
+    if (kind == "test") {
+      const LobaValue *target = LobaResolvePointer(doc, p, len);
+      if (target == nullptr) {
+        return lobaPatchPathNotFound;
+      }
+      return json_->LobaIsEqual(target, value) ? lobaPatchOk : lobaPatchTestFailed;
+    }
+    json_->LobaCopy(&v, value);
+    ret = kind == "add" ? LobaAdd(doc, p, len, &v) : LobaReplace(doc, p, len, &v);
+  } else if (kind == "remove") {
+    if (len == 0) {
+      return lobaPatchInvalidPointer;
+    }
+    ret = LobaRemove(doc, p, len, &v);
+    if (ret == lobaPatchOk) {
+      json_->LobaMove(&undo_.back().value, &v);
+    }
+  } else if (kind == "move" || kind == "copy") {
+    if (from == nullptr || from->type != LobaType::lobaString) {
+      return lobaPatchInvalidPatch;
+    }
+    const char *f = from->u.s.s;
+    size_t flen = from->u.s.len;
+    if (kind == "copy") {
+      const LobaValue *source = LobaResolvePointer(doc, f, flen);
+      if (source == nullptr) {
+        return lobaPatchPathNotFound;
+      }
+      json_->LobaCopy(&v, source);
+      ret = LobaAdd(doc, p, len, &v);
+    } else {
+      if (flen == len && memcmp(f, p, len) == 0) {
+        return LobaResolvePointer(doc, f, flen) ? lobaPatchOk : lobaPatchPathNotFound;
+      }
+      // 不能把值移动到它自己的子孙节点
+      if (flen < len && memcmp(f, p, flen) == 0 && p[flen] == '/') {
+        return lobaPatchInvalidPatch;
+      }
+      if (flen == 0) {
+        return lobaPatchInvalidPointer;
+      }
+      if ((ret = LobaRemove(doc, f, flen, &v)) != lobaPatchOk) {
+        return ret;
+      }
+      size_t removed = undo_.size() - 1;
+      if ((ret = LobaAdd(doc, p, len, &v)) == lobaPatchOk) {
+        undo_[removed].borrowed = 1;
+      } else {
+        json_->LobaMove(&undo_[removed].value, &v);
+      }
+    }
+  } else {
+    return lobaPatchInvalidPatch;
+  }
+  json_->LobaFree(&v);
+  return ret;
+}
+
+inline void LobaPatch::LobaRollback(LobaValue *doc) {
+  LobaValue held;
+  LobaInit(&held);
+  while (!undo_.empty()) {
+    Undo &undo = undo_.back();
+    LobaValue *parent = undo.index == LOBA_KEY_NOT_EXIST ? nullptr :
+                        LobaResolvePointer(doc, undo.parent.data(), undo.parent.size());
+    switch (undo.kind) {
+      case kUndoErase:assert(parent != nullptr);
+        LobaDiscard(&held);
+        if (parent->type == LobaType::lobaObject) {
+          LobaEraseMember(parent, undo.index, &held);
+        } else {
+          LobaEraseElement(parent, undo.index, &held);
+        }
+        break;
+      case kUndoInsert:assert(parent != nullptr);
+        if (undo.borrowed) {
+          json_->LobaMove(&undo.value, &held);
+        }
+        if (parent->type == LobaType::lobaObject) {
+          LobaInsertMember(parent, undo.index, undo.key.data(), undo.key.size(), &undo.value);
+        } else {
+          LobaInsertElement(parent, undo.index, &undo.value);
+        }
+        break;
+      case kUndoReplace: {
+        LobaValue *target = parent == nullptr ? doc :
+                            parent->type == LobaType::lobaObject ?
+                            &parent->u.o.m[undo.index].v : &parent->u.a.e[undo.index];
+        LobaDiscard(&held);
+        json_->LobaSwap(&held, target);
+        json_->LobaSwap(target, &undo.value);
+        break;
+      }
+    }
+    if (undo.repack) {
+      LobaRepack(parent);
+    }
+    LobaDiscard(&undo.value);
+    undo_.pop_back();
+  }
+  LobaDiscard(&held);
+}
+
+inline void LobaPatch::LobaDiscard(LobaValue *v) {
+  if (v->type == LobaType::lobaArray || v->type == LobaType::lobaObject) {
+    garbage_.push_back(*v);
+    LobaInit(v);
+  } else {
+    json_->LobaFree(v);
+  }
+}
+
+inline void LobaPatch::LobaRelease() {
+  for (Undo &undo : undo_) {
+    json_->LobaFree(&undo.value);
+  }
+  undo_.clear();
+  index_.clear();
+  for (LobaValue &v : garbage_) {
+    json_->LobaFree(&v);
+  }
+  garbage_.clear();
+}
+
+inline void LobaPatch::LobaMergeValue(LobaValue *target, const LobaValue *patch) {
+  if (json_->LobaGetStringifyCache() != nullptr) {
+    json_->LobaGetStringifyCache()->LobaMarkDirty(target);
+  }
+  if (patch->type != LobaType::lobaObject) {
+    LobaDiscard(target);
+    json_->LobaCopy(target, patch);
+    return;
+  }
+  if (target->type != LobaType::lobaObject) {
+    LobaDiscard(target);
+    target->type = LobaType::lobaObject;
+    target->u.o.m = nullptr;
+    target->u.o.size = 0;
+  }
+  std::vector<size_t> removed;
+  for (size_t i = 0; i < patch->u.o.size; i++) {
+    const LobaMember *pm = &patch->u.o.m[i];
+    size_t index = LobaLookup(target, pm->k, pm->klen);
+    if (pm->v.type == LobaType::lobaNull) {
+      if (index != LOBA_KEY_NOT_EXIST) {
+        removed.push_back(index);
+      }
+    } else if (index != LOBA_KEY_NOT_EXIST) {
+      LobaMergeValue(&target->u.o.m[index].v, &pm->v);
+    } else {
+      LobaValue v;
+      LobaInit(&v);
+      LobaMergeValue(&v, &pm->v);
+      LobaInsertMember(target, target->u.o.size, pm->k, pm->klen, &v);
+    }
+  }
+  if (removed.empty()) {
+    return;
+  }
+  // 删除集中到最后一次压缩, 避免大对象上反复 memmove
+  std::sort(removed.begin(), removed.end());
+  removed.erase(std::unique(removed.begin(), removed.end()), removed.end());
+  index_.erase(target->u.o.m);
+  size_t next = 0, kept = 0;
+  for (size_t i = 0; i < target->u.o.size; i++) {
+    if (next < removed.size() && removed[next] == i) {
+      next++;
+      json_->LobaFreeKey(target->u.o.m[i].k, target->u.o.m[i].klen);
+      LobaDiscard(&target->u.o.m[i].v);
+    } else {
+      memmove(&target->u.o.m[kept++], &target->u.o.m[i], sizeof(LobaMember));
+    }
+  }
+  target->u.o.m = (LobaMember *)json_->LobaRealloc(target->u.o.m,
+                                                  target->u.o.size * sizeof(LobaMember),
+                                                  kept * sizeof(LobaMember));
+  target->u.o.size = kept;
+}
+
+inline void LobaPatch::LobaDiff(const LobaValue *a, const LobaValue *b, LobaValue *patch) {
+  assert(a != nullptr && b != nullptr && patch != nullptr);
+  std::string path;
+  LobaDiffValue(a, b, &path);
+  json_->LobaFree(patch);
+  patch->type = LobaType::lobaArray;
+  patch->u.a.size = ops_.size();
+  patch->u.a.e = nullptr;
+  if (!ops_.empty()) {
+    patch->u.a.e = (LobaValue *)json_->LobaMalloc(ops_.size() * sizeof(LobaValue));
+    memcpy(patch->u.a.e, ops_.data(), ops_.size() * sizeof(LobaValue));
+  }
+  ops_.clear();
+  hash_.clear();
+  index_.clear();
+}
+
+// 与 LobaIsEqual 一致: 对象哈希与成员顺序无关, 0 与 -0 相同
+inline size_t LobaPatch::LobaSubtreeHash(const LobaValue *v) {
+  auto it = hash_.find(v);
+  if (it != hash_.end()) {
+    return it->second;
+  }
+  size_t h = static_cast<size_t>(json_->LobaGetType(v)) * 0x9E3779B97F4A7C15ULL;
+  switch (v->type) {
+    case LobaType::lobaNumber:
+    case LobaType::lobaRawNumber: {
+      double n = json_->LobaGetNumber(v);
+      n = n == 0 ? 0 : n;
+      h ^= LobaHash(reinterpret_cast<const char *>(&n), sizeof(n));
+      break;
+    }
+    case LobaType::lobaString:h ^= LobaHash(v->u.s.s, v->u.s.len);
+      break;
+    case LobaType::lobaArray:
+      for (size_t i = 0; i < v->u.a.size; i++) {
+        h = (h ^ LobaSubtreeHash(&v->u.a.e[i])) * 1099511628211ULL;
+      }
+      break;
+    case LobaType::lobaPackedArray:
+      // 数字的哈希不进缓存, 用栈上的临时值算, 与展开后的数组一致
+      for (size_t i = 0; i < v->u.p.size; i++) {
+        LobaValue n;
+        n.type = LobaType::lobaNumber;
+        n.u.n = v->u.p.d[i];
+        h = (h ^ LobaSubtreeHash(&n)) * 1099511628211ULL;
+      }
+      break;
+    case LobaType::lobaObject:
+      for (size_t i = 0; i < v->u.o.size; i++) {
+        size_t k = LobaHash(v->u.o.m[i].k, v->u.o.m[i].klen);
+        h += (k ^ LobaSubtreeHash(&v->u.o.m[i].v)) * 0x9E3779B97F4A7C15ULL + k;
+      }
+      break;
+    default:break;
+  }
+  if (v->type == LobaType::lobaArray || v->type == LobaType::lobaPackedArray ||
+      v->type == LobaType::lobaObject) {
+    hash_.emplace(v, h);
+  }
+  return h;
+}
+
+// 哈希不同一定不等, 相同时再完整比较一次, 比较过的子树不会再往下走
+inline int LobaPatch::LobaSameSubtree(const LobaValue *a, const LobaValue *b) {
+  return json_->LobaGetType(a) == json_->LobaGetType(b) && LobaSubtreeHash(a) == LobaSubtreeHash(b) &&
+      LobaSubtreeEqual(a, b);
+}
+
+// 与 LobaIsEqual 的结果相同. 对象成员经 LobaLookup 的键索引配对, 孩子先比缓存的哈希,
+// 相等的大对象只走一遍, 不会因逐个线性查找变成平方
+inline int LobaPatch::LobaSubtreeEqual(const LobaValue *a, const LobaValue *b) {
+  if (a->type == LobaType::lobaArray && b->type == LobaType::lobaArray) {
+    if (a->u.a.size != b->u.a.size) {
+      return 0;
+    }
+    for (size_t i = 0; i < a->u.a.size; i++) {
+      if (!LobaSameSubtree(&a->u.a.e[i], &b->u.a.e[i])) {
+        return 0;
+      }
+    }
+    return 1;
+  }
+  if (a->type != LobaType::lobaObject || b->type != LobaType::lobaObject) {
+    return json_->LobaIsEqual(a, b);
+  }
+  if (a->u.o.size != b->u.o.size) {
+    return 0;
+  }
+  for (size_t i = 0; i < a->u.o.size; i++) {
+    const LobaMember *m = &a->u.o.m[i];
+    size_t j = b->u.o.m[i].k == m->k ? i : LobaLookup(b, m->k, m->klen);
+    if (j == LOBA_KEY_NOT_EXIST || !LobaSameSubtree(&m->v, &b->u.o.m[j].v)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+inline void LobaPatch::LobaEmit(const char *op, const std::string &path, const LobaValue *value) {
+  LobaValue o;
+  size_t size = value ? 3 : 2;
+  o.type = LobaType::lobaObject;
+  o.u.o.size = size;
+  o.u.o.m = (LobaMember *)json_->LobaMalloc(size * sizeof(LobaMember));
+  const char *keys[] = {"op", "path", "value"};
+  for (size_t i = 0; i < size; i++) {
+    LobaMember *m = &o.u.o.m[i];
+    m->klen = strlen(keys[i]);
+    m->k = json_->LobaNewKey(keys[i], m->klen);
+    LobaInit(&m->v);
+  }
+  json_->LobaSetString(&o.u.o.m[0].v, op, strlen(op));
+  json_->LobaSetString(&o.u.o.m[1].v, path.data(), path.size());
+  if (value) {
+    json_->LobaCopy(&o.u.o.m[2].v, value);
+  }
+  ops_.push_back(o);
+}
+
+inline void LobaPatch::LobaDiffValue(const LobaValue *a, const LobaValue *b, std::string *path) {
+  if (LobaSameSubtree(a, b)) {
+    return;
+  }
+  if (a->type == LobaType::lobaObject && b->type == LobaType::lobaObject) {
+    LobaDiffObject(a, b, path);
+  } else if (a->type == LobaType::lobaArray && b->type == LobaType::lobaArray) {
+    LobaDiffArray(a, b, path);
+  } else if (json_->LobaGetType(a) == LobaType::lobaArray && json_->LobaGetType(b) == LobaType::lobaArray) {
+    // 有紧凑数组时对展开的副本逐元素比较; 紧凑数组里只有数字, 数字的哈希不进缓存
+    LobaValue x, y;
+    LobaInit(&x);
+    LobaInit(&y);
+    json_->LobaCopy(&x, a);
+    json_->LobaCopy(&y, b);
+    json_->LobaUnpackArray(&x);
+    json_->LobaUnpackArray(&y);
+    LobaDiffArray(&x, &y, path);
+    json_->LobaFree(&x);
+    json_->LobaFree(&y);
+  } else {
+    LobaEmit("replace", *path, b);
+  }
+}
+
+// 追加一个转义后的 token, 返回追加前的长度便于恢复
+static inline size_t LobaAppendToken(std::string *path, const char *k, size_t klen) {
+  size_t old = path->size();
+  path->push_back('/');
+  for (size_t i = 0; i < klen; i++) {
+    if (k[i] == '~') {
+      path->append("~0");
+    } else if (k[i] == '/') {
+      path->append("~1");
+    } else {
+      path->push_back(k[i]);
+    }
+  }
+  return old;
+}
+
+inline void LobaPatch::LobaDiffObject(const LobaValue *a, const LobaValue *b, std::string *path) {
+  std::vector<char> matched(b->u.o.size, 0);
+  for (size_t i = 0; i < a->u.o.size; i++) {
+    const LobaMember *m = &a->u.o.m[i];
+    size_t old = LobaAppendToken(path, m->k, m->klen);
+    size_t j = LobaLookup(b, m->k, m->klen);
+    if (j == LOBA_KEY_NOT_EXIST) {
+      LobaEmit("remove", *path, nullptr);
+    } else {
+      matched[j] = 1;
+      LobaDiffValue(&m->v, &b->u.o.m[j].v, path);
+    }
+    path->resize(old);
+  }
+  for (size_t j = 0; j < b->u.o.size; j++) {
+    if (!matched[j]) {
+      const LobaMember *m = &b->u.o.m[j];
+      size_t old = LobaAppendToken(path, m->k, m->klen);
+      LobaEmit("add", *path, &m->v);
+      path->resize(old);
+    }
+  }
+}
+
+// 先去掉相同的首尾, 中间部分在规模允许时用 LCS 对齐, 否则按位置比较
+inline void LobaPatch::LobaDiffArray(const LobaValue *a, const LobaValue *b, std::string *path) {
+  const LobaValue *x = a->u.a.e, *y = b->u.a.e;
+  size_t n = a->u.a.size, m = b->u.a.size, head = 0;
+  while (head < n && head < m && LobaSameSubtree(&x[head], &y[head])) {
+    head++;
+  }
+  while (n > head && m > head && LobaSameSubtree(&x[n - 1], &y[m - 1])) {
+    n--;
+    m--;
+  }
+  x += head;
+  y += head;
+  n -= head;
+  m -= head;
+  // script: 0 保留, 1 删除 x 中元素, 2 插入 y 中元素
+  std::vector<char> script;
+  if (n > 0 && m > 0 && n < LobaDiffLcsMaxCells && m < LobaDiffLcsMaxCells &&
+      (n + 1) * (m + 1) <= LobaDiffLcsMaxCells) {
+    std::vector<unsigned> lcs((n + 1) * (m + 1), 0);
+    std::vector<size_t> hx(n), hy(m);
+    for (size_t i = 0; i < n; i++) {
+      hx[i] = LobaSubtreeHash(&x[i]);
+    }
+    for (size_t j = 0; j < m; j++) {
+      hy[j] = LobaSubtreeHash(&y[j]);
+    }
+    for (size_t i = n; i-- > 0;) {
+      for (size_t j = m; j-- > 0;) {
+        unsigned *cell = &lcs[i * (m + 1) + j];
+        if (hx[i] == hy[j] && LobaSubtreeEqual(&x[i], &y[j])) {
+          *cell = lcs[(i + 1) * (m + 1) + j + 1] + 1;
+        } else {
+          unsigned down = lcs[(i + 1) * (m + 1) + j], right = lcs[i * (m + 1) + j + 1];
+          *cell = down > right ? down : right;
+        }
+      }
+    }
+    size_t i = 0, j = 0;
+    while (i < n && j < m) {
+      if (hx[i] == hy[j] && lcs[i * (m + 1) + j] == lcs[(i + 1) * (m + 1) + j + 1] + 1 &&
+          LobaSubtreeEqual(&x[i], &y[j])) {
+        script.push_back(0);
+        i++;
+        j++;
+      } else if (lcs[(i + 1) * (m + 1) + j] >= lcs[i * (m + 1) + j + 1]) {
+        script.push_back(1);
+        i++;
+      } else {
+        script.push_back(2);
+        j++;
+      }
+    }
+    script.insert(script.end(), n - i, 1);
+    script.insert(script.end(), m - j, 2);
+  } else {
+    script.assign(n, 1);
+    script.insert(script.end(), m, 2);
+  }
+  // 连续的删除和插入两两配对成就地修改, 剩下的才产生 remove/add
+  size_t i = 0, j = 0, index = head, k = 0;
+  while (k < script.size()) {
+    if (script[k] == 0) {
+      i++;
+      j++;
+      index++;
+      k++;
+      continue;
+    }
+    size_t removes = 0, adds = 0;
+    for (; k < script.size() && script[k] == 1; k++) {
+      removes++;
+    }
+    for (; k < script.size() && script[k] == 2; k++) {
+      adds++;
+    }
+    for (; removes > 0 && adds > 0; removes--, adds--) {
+      size_t old = path->size();
+      path->append("/" + std::to_string(index++));
+      LobaDiffValue(&x[i++], &y[j++], path);
+      path->resize(old);
+    }
+    for (; removes > 0; removes--, i++) {
+      LobaEmit("remove", *path + "/" + std::to_string(index), nullptr);
+    }
+    for (; adds > 0; adds--) {
+      LobaEmit("add", *path + "/" + std::to_string(index++), &y[j++]);
+    }
+  }
+}
+
+#endif  // LOBAJSON_PATCH_H_
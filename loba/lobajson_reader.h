@@ -0,0 +1,351 @@
+// Copyright (c) 2022. Yang Zhu
+
+#ifndef LOBAJSON_READER_H_
+#define LOBAJSON_READER_H_
+
+#include <cassert>
+#include <cstddef>
+#include "lobajson.h"
+
+// 拉取式读取器: 反复调用 LobaNext 取得下一个记号, 再按类型取值, 不建树.
+// 语法与 LobaParse 一致, 语法错误沿用 lobaParse* 错误码. 只有一个固定大小的嵌套栈,
+// 字符串解码借用一块随最长字符串增长的缓冲区, 之后每个记号都不再分配内存
+enum LobaToken {
+  lobaTokenNull,
+  lobaTokenFalse,
+  lobaTokenTrue,
+  lobaTokenNumber,
+  lobaTokenString,
+  lobaTokenKey,
+  lobaTokenStartArray,
+  lobaTokenEndArray,
+  lobaTokenStartObject,
+  lobaTokenEndObject,
+  // 根值之后只剩空白
+  lobaTokenEnd,
+  lobaTokenError
+};
+
+// 与 lobaParse* 和 lobaReflect* 不重叠
+enum {
+  lobaReaderTooDeep = 200
+};
+
+#define LobaReaderMaxDepth 256
+
+class LobaReader : public LobaJson {
+ public:
+  LobaReader() {
+    c_.stack = nullptr;
+    c_.size = 0;
+    LobaReset("");
+  }
+  ~LobaReader() { LobaDealloc(c_.stack, c_.size); }
+  LobaReader(const LobaReader &) = delete;
+  LobaReader &operator=(const LobaReader &) = delete;
+
+  // 从头读取 json, json 须以 '\0' 结尾并在读取期间保持有效; 解码缓冲区留给下一份输入复用
+  void LobaReset(const char *json);
+  // 出错后一直返回 lobaTokenError, 错误码见 LobaGetError
+  LobaToken LobaNext();
+  // 跳过一个值而不产生记号: 刚读到 StartArray/StartObject 时跳过该容器余下的部分 (含结束括号);
+  // 刚读到 Key 时跳过它的值; 在数组中跳过下一个元素, 对象中跳过下一个成员.
+  // 已经到了容器或输入的结尾时什么也不跳, 结束记号留给下一次 LobaNext
+  int LobaSkipValue();
+
+  int LobaGetError() const { return error_; }
+  // 当前嵌套层数, 根值之外为 0
+  size_t LobaGetDepth() const { return depth_; }
+  // String 与 Key 记号的内容, 以 '\0' 结尾, 到下一次 LobaNext / LobaSkipValue 之前有效
+  const char *LobaGetString() const;
+  size_t LobaGetStringLength() const;
+  double LobaGetNumber() const;
+  int LobaGetBoolean() const;
+
+ private:
+  enum LobaExpect {
+    lobaExpectValue,  // 根值或 ':' 之后
+    lobaExpectFirstElement,
+    lobaExpectFirstMember,
+    lobaExpectNext,  // 容器中一个值之后, 等 ',' 或结束括号
+    lobaExpectDone
+  };
+  int LobaAdvance(LobaToken *end);
+  LobaToken LobaReadValue();
+  LobaToken LobaReadKey();
+  int LobaReadString();
+  void LobaPop();
+  LobaToken LobaFail(int error);
+
+  LobaContext c_;
+  LobaExpect expect_;
+  LobaToken last_;
+  // LobaSkipValue 停在结束括号前时记下已消费的结束记号
+  LobaToken pending_;
+  int error_;
+  char stack_[LobaReaderMaxDepth];
+  size_t depth_;
+  // 最近一个 '[' / '{' 的位置, 用于跳过刚打开的容器
+  const char *open_;
+  const char *str_;
+  size_t len_;
+  double n_;
+};
+
+inline void LobaReader::LobaReset(const char *json) {
+  assert(json != nullptr);
+  c_.json = json;
+  c_.top = 0;
+  c_.depth = 0;
+  expect_ = lobaExpectValue;
+  last_ = lobaTokenEnd;
+  pending_ = lobaTokenEnd;
+  error_ = lobaParseOk;
+  depth_ = 0;
+  open_ = nullptr;
+  str_ = nullptr;
+  len_ = 0;
+  n_ = 0.0;
+}
+
+inline LobaToken LobaReader::LobaFail(int error) {
+  error_ = error;
+  return last_ = lobaTokenError;
+}
+
+inline void LobaReader::LobaPop() {
+  assert(depth_ > 0);
+  depth_--;
+  expect_ = depth_ > 0 ? lobaExpectNext : lobaExpectDone;
+}
+
+// 吃掉值之前的分隔符. 返回 1 表示后面是值, 2 表示后面是对象的键,
+// 0 表示遇到了结束括号或输入结尾 (已消费, 记号写入 end), -1 表示出错
+inline int LobaReader::LobaAdvance(LobaToken *end) {
+  LobaParseWhitespace(&c_);
+  char ch = *c_.json;
+  switch (expect_) {
+    case lobaExpectValue:return 1;
+    case lobaExpectFirstElement:
+      if (ch == ']') {
+        c_.json++;
+        LobaPop();
+        *end = lobaTokenEndArray;
+        return 0;
+      }
+      return 1;
+    case lobaExpectFirstMember:
+      if (ch == '}') {
+        c_.json++;
+        LobaPop();
+        *end = lobaTokenEndObject;
+        return 0;
+      }
+      return 2;
+    case lobaExpectNext:
+      if (stack_[depth_ - 1] == '[') {
+        if (ch == ',') {
+          c_.json++;
+          LobaParseWhitespace(&c_);
+          return 1;
+        }
+        if (ch == ']') {
+          c_.json++;
+          LobaPop();
+          *end = lobaTokenEndArray;
+          return 0;
+        }
+        LobaFail(lobaParseMissCommaOrSquareBracket);
+        return -1;
+      }
+      if (ch == ',') {
+        c_.json++;
+        return 2;
+      }
+      if (ch == '}') {
+        c_.json++;
+        LobaPop();
+        *end = lobaTokenEndObject;
+        return 0;
+      }
+      LobaFail(lobaParseMissCommaOrCurlyBracket);
+      return -1;
+    case lobaExpectDone:
+      if (ch != '\0') {
+        LobaFail(lobaParseRootNotSingular);
+        return -1;
+      }
+      *end = lobaTokenEnd;
+      return 0;
+  }
+  return -1;
+}
+
+inline LobaToken LobaReader::LobaReadValue() {
+  LobaValue tmp;
+  LobaToken token;
+  int ret;
+  switch (*c_.json) {
+    case '[':
+    case '{':
+      if (depth_ == LobaReaderMaxDepth) {
+        return LobaFail(lobaReaderTooDeep);
+      }
+      open_ = c_.json;
+      stack_[depth_++] = *c_.json;
+      if (*c_.json++ == '[') {
+        expect_ = lobaExpectFirstElement;
+        return last_ = lobaTokenStartArray;
+      }
+      expect_ = lobaExpectFirstMember;
+      return last_ = lobaTokenStartObject;
+    case 'n':ret = LobaParseLiteral(&c_, &tmp, "null", LobaType::lobaNull);
+      token = lobaTokenNull;
+      break;
+    case 't':ret = LobaParseLiteral(&c_, &tmp, "true", LobaType::lobaTrue);
+      token = lobaTokenTrue;
+      break;
+    case 'f':ret = LobaParseLiteral(&c_, &tmp, "false", LobaType::lobaFalse);
+      token = lobaTokenFalse;
+      break;
+    case '"':ret = LobaReadString();
+      token = lobaTokenString;
+      break;
+    case '\0':return LobaFail(lobaParseExpectValue);
+    default:ret = LobaParseNumber(&c_, &tmp);
+      n_ = tmp.u.n;
+      token = lobaTokenNumber;
+      break;
+  }
+  if (ret != lobaParseOk) {
+    return LobaFail(ret);
+  }
+  expect_ = depth_ > 0 ? lobaExpectNext : lobaExpectDone;
+  return last_ = token;
+}
+
+// 每个字符串都从缓冲区开头解码, 缓冲区只增长到最长的那个字符串
+inline int LobaReader::LobaReadString() {
+  char *s;
+  c_.top = 0;
+  int ret = LobaParseStringRaw(&c_, &s, &len_);
+  if (ret != lobaParseOk) {
+    return ret;
+  }
+  if (len_ == 0) {
+    str_ = "";
+  } else {
+    // 解码结果刚从栈上弹出, 紧随其后的一个字节仍在缓冲区内
+    s[len_] = '\0';
+    str_ = s;
+  }
+  return lobaParseOk;
+}
+
+inline LobaToken LobaReader::LobaReadKey() {
+  int ret;
+  LobaParseWhitespace(&c_);
+  if (*c_.json != '"') {
+    return LobaFail(lobaParseMissKey);
+  }
+  if ((ret = LobaReadString()) != lobaParseOk) {
+    return LobaFail(ret);
+  }
+  LobaParseWhitespace(&c_);
+  if (*c_.json != ':') {
+    return LobaFail(lobaParseMissColon);
+  }
+  c_.json++;
+  expect_ = lobaExpectValue;
+  return last_ = lobaTokenKey;
+}
+
+inline LobaToken LobaReader::LobaNext() {
+  if (error_ != lobaParseOk) {
+    return lobaTokenError;
+  }
+  if (pending_ != lobaTokenEnd) {
+    last_ = pending_;
+    pending_ = lobaTokenEnd;
+    return last_;
+  }
+  LobaToken end;
+  switch (LobaAdvance(&end)) {
+    case 1:LobaParseWhitespace(&c_);
+      return LobaReadValue();
+    case 2:return LobaReadKey();
+    case 0:return last_ = end;
+    default:return lobaTokenError;
+  }
+}
+
+inline int LobaReader::LobaSkipValue() {
+  int ret;
+  if (error_ != lobaParseOk) {
+    return error_;
+  }
+  if (pending_ != lobaTokenEnd) {
+    return lobaParseOk;
+  }
+  if ((last_ == lobaTokenStartArray && expect_ == lobaExpectFirstElement) ||
+      (last_ == lobaTokenStartObject && expect_ == lobaExpectFirstMember)) {
+    // 回到开括号, 整个容器交给 LobaJson::LobaSkipValue 校验并跳过
+    c_.json = open_;
+    c_.top = 0;
+    // 这个容器已经算在 depth_ 里
+    if ((ret = LobaJson::LobaSkipValue(&c_, LobaReaderMaxDepth - depth_ + 1)) != lobaParseOk) {
+      // 与 LobaNext 一样报告为 lobaReaderTooDeep
+      LobaFail(ret = ret == lobaParseTooDeep ? lobaReaderTooDeep : ret);
+      return ret;
+    }
+    last_ = stack_[depth_ - 1] == '[' ? lobaTokenEndArray : lobaTokenEndObject;
+    LobaPop();
+    return lobaParseOk;
+  }
+  LobaToken end;
+  switch (LobaAdvance(&end)) {
+    case 0:
+      if (end != lobaTokenEnd) {
+        pending_ = end;
+      }
+      return lobaParseOk;
+    case 2:
+      if (LobaReadKey() == lobaTokenError) {
+        return error_;
+      }
+      break;
+    case 1:break;
+    default:return error_;
+  }
+  LobaParseWhitespace(&c_);
+  c_.top = 0;
+  if ((ret = LobaJson::LobaSkipValue(&c_, LobaReaderMaxDepth - depth_)) != lobaParseOk) {
+    LobaFail(ret = ret == lobaParseTooDeep ? lobaReaderTooDeep : ret);
+    return ret;
+  }
+  expect_ = depth_ > 0 ? lobaExpectNext : lobaExpectDone;
+  last_ = lobaTokenNull;
+  return lobaParseOk;
+}
+
+inline const char *LobaReader::LobaGetString() const {
+  assert(last_ == lobaTokenString || last_ == lobaTokenKey);
+  return str_;
+}
+
+inline size_t LobaReader::LobaGetStringLength() const {
+  assert(last_ == lobaTokenString || last_ == lobaTokenKey);
+  return len_;
+}
+
+inline double LobaReader::LobaGetNumber() const {
+  assert(last_ == lobaTokenNumber);
+  return n_;
+}
+
+inline int LobaReader::LobaGetBoolean() const {
+  assert(last_ == lobaTokenTrue || last_ == lobaTokenFalse);
+  return last_ == lobaTokenTrue;
+}
+
+#endif  // LOBAJSON_READER_H_
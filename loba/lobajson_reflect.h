@@ -0,0 +1,450 @@
+// Copyright (c) 2022. Yang Zhu
+
+#ifndef LOBAJSON_REFLECT_H_
+#define LOBAJSON_REFLECT_H_
+
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "lobajson.h"
+
+// 结构体与 JSON 直接互转, 不经过 LobaValue 树. 用法 (须在全局命名空间):
+//   struct Order { int id; double price; std::vector<Item> items; };
+//   LOBA_REFLECT(Order, id, price, items)
+// 字段可以是 bool、算术类型、std::string、std::vector 以及其他 LOBA_REFLECT 过的结构体.
+// 语法错误沿用 lobaParse* 错误码, 以下两个错误码与之不重叠
+enum {
+  lobaReflectTypeMismatch = 100,
+  lobaReflectNumberOutOfRange
+};
+
+// 未经 LOBA_REFLECT 声明的类型
+template <typename T>
+struct LobaReflectTraits {
+  static constexpr int kReflected = 0;
+};
+
+#define LOBA_REFLECT_EXPAND(x) x
+#define LOBA_REFLECT_CAT(a, b) LOBA_REFLECT_CAT_(a, b)
+#define LOBA_REFLECT_CAT_(a, b) a##b
+// 最多支持 32 个字段
+#define LOBA_REFLECT_N(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, \
+    _17, _18, _19, _20, _21, _22, _23, _24, _25, _26, _27, _28, _29, _30, _31, _32, N, ...) N
+#define LOBA_REFLECT_COUNT(...) \
+    LOBA_REFLECT_EXPAND(LOBA_REFLECT_N(__VA_ARGS__, 32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, \
+    21, 20, 19, 18, 17, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1))
+#define LOBA_REFLECT_EACH_1(m, x) m(x)
+#define LOBA_REFLECT_EACH_2(m, x, ...) m(x) LOBA_REFLECT_EXPAND(LOBA_REFLECT_EACH_1(m, __VA_ARGS__))
+#define LOBA_REFLECT_EACH_3(m, x, ...) m(x) LOBA_REFLECT_EXPAND(LOBA_REFLECT_EACH_2(m, __VA_ARGS__))
+#define LOBA_REFLECT_EACH_4(m, x, ...) m(x) LOBA_REFLECT_EXPAND(LOBA_REFLECT_EACH_3(m, __VA_ARGS__))
+#define LOBA_REFLECT_EACH_5(m, x, ...) m(x) LOBA_REFLECT_EXPAND(LOBA_REFLECT_EACH_4(m, __VA_ARGS__))
+#define LOBA_REFLECT_EACH_6(m, x, ...) m(x) LOBA_REFLECT_EXPAND(LOBA_REFLECT_EACH_5(m, __VA_ARGS__))
+#define LOBA_REFLECT_EACH_7(m, x, ...) m(x) LOBA_REFLECT_EXPAND(LOBA_REFLECT_EACH_6(m, __VA_ARGS__))
+#define LOBA_REFLECT_EACH_8(m, x, ...) m(x) LOBA_REFLECT_EXPAND(LOBA_REFLECT_EACH_7(m, __VA_ARGS__))
+#define LOBA_REFLECT_EACH_9(m, x, ...) m(x) LOBA_REFLECT_EXPAND(LOBA_REFLECT_EACH_8(m, __VA_ARGS__))
+#define LOBA_REFLECT_EACH_10(m, x, ...) m(x) LOBA_REFLECT_EXPAND(LOBA_REFLECT_EACH_9(m, \
+    __VA_ARGS__))
+#define LOBA_REFLECT_EACH_11(m, x, ...) m(x) LOBA_REFLECT_EXPAND(LOBA_REFLECT_EACH_10(m, \
+    __VA_ARGS__))
+#define LOBA_REFLECT_EACH_12(m, x, ...) m(x) LOBA_REFLECT_EXPAND(LOBA_REFLECT_EACH_11(m, \
+    __VA_ARGS__))
+#define LOBA_REFLECT_EACH_13(m, x, ...) m(x) LOBA_REFLECT_EXPAND(LOBA_REFLECT_EACH_12(m, \
+    __VA_ARGS__))
+#define LOBA_REFLECT_EACH_14(m, x, ...) m(x) LOBA_REFLECT_EXPAND(LOBA_REFLECT_EACH_13(m, \
+    __VA_ARGS__))
+#define LOBA_REFLECT_EACH_15(m, x, ...) m(x) LOBA_REFLECT_EXPAND(LOBA_REFLECT_EACH_14(m, \
+    __VA_ARGS__))
+#define LOBA_REFLECT_EACH_16(m, x, ...) m(x) LOBA_REFLECT_EXPAND(LOBA_REFLECT_EACH_15(m, \
+    __VA_ARGS__))
+#define LOBA_REFLECT_EACH_17(m, x, ...) m(x) LOBA_REFLECT_EXPAND(LOBA_REFLECT_EACH_16(m, \
+    __VA_ARGS__))
+#define LOBA_REFLECT_EACH_18(m, x, ...) m(x) LOBA_REFLECT_EXPAND(LOBA_REFLECT_EACH_17(m, \
+    __VA_ARGS__))
+#define LOBA_REFLECT_EACH_19(m, x, ...) m(x) LOBA_REFLECT_EXPAND(LOBA_REFLECT_EACH_18(m, \
+    __VA_ARGS__))
+#define LOBA_REFLECT_EACH_20(m, x, ...) m(x) LOBA_REFLECT_EXPAND(LOBA_REFLECT_EACH_19(m, \
+    __VA_ARGS__))
+#define LOBA_REFLECT_EACH_21(m, x, ...) m(x) LOBA_REFLECT_EXPAND(LOBA_REFLECT_EACH_20(m, \
+    __VA_ARGS__))
+#define LOBA_REFLECT_EACH_22(m, x, ...) m(x) LOBA_REFLECT_EXPAND(LOBA_REFLECT_EACH_21(m, \
+    __VA_ARGS__))
+#define LOBA_REFLECT_EACH_23(m, x, ...) m(x) LOBA_REFLECT_EXPAND(LOBA_REFLECT_EACH_22(m, \
+    __VA_ARGS__))
+#define LOBA_REFLECT_EACH_24(m, x, ...) m(x) LOBA_REFLECT_EXPAND(LOBA_REFLECT_EACH_23(m, \
+    __VA_ARGS__))
+#define LOBA_REFLECT_EACH_25(m, x, ...) m(x) LOBA_REFLECT_EXPAND(LOBA_REFLECT_EACH_24(m, \
+    __VA_ARGS__))
+#define LOBA_REFLECT_EACH_26(m, x, ...) m(x) LOBA_REFLECT_EXPAND(LOBA_REFLECT_EACH_25(m, \
+    __VA_ARGS__))
+#define LOBA_REFLECT_EACH_27(m, x, ...) m(x) LOBA_REFLECT_EXPAND(LOBA_REFLECT_EACH_26(m, \
+    __VA_ARGS__))
+#define LOBA_REFLECT_EACH_28(m, x, ...) m(x) LOBA_REFLECT_EXPAND(LOBA_REFLECT_EACH_27(m, \
+    __VA_ARGS__))
+#define LOBA_REFLECT_EACH_29(m, x, ...) m(x) LOBA_REFLECT_EXPAND(LOBA_REFLECT_EACH_28(m, \
+    __VA_ARGS__))
+#define LOBA_REFLECT_EACH_30(m, x, ...) m(x) LOBA_REFLECT_EXPAND(LOBA_REFLECT_EACH_29(m, \
+    __VA_ARGS__))
+#define LOBA_REFLECT_EACH_31(m, x, ...) m(x) LOBA_REFLECT_EXPAND(LOBA_REFLECT_EACH_30(m, \
+    __VA_ARGS__))
+#define LOBA_REFLECT_EACH_32(m, x, ...) m(x) LOBA_REFLECT_EXPAND(LOBA_REFLECT_EACH_31(m, \
+    __VA_ARGS__))
+#define LOBA_REFLECT_FOR_EACH(m, ...) \
+    LOBA_REFLECT_EXPAND(LOBA_REFLECT_CAT(LOBA_REFLECT_EACH_, LOBA_REFLECT_COUNT(__VA_ARGS__))(m, __VA_ARGS__))
+
+#define LOBA_REFLECT_VISIT(field) f(#field, sizeof(#field) - 1, t.field);
+// 键先按编译期算好的哈希分派, 命中后再比较一次字符串
+#define LOBA_REFLECT_CASE(field) \
+    case LobaHash(#field, sizeof(#field) - 1): \
+      if (klen == sizeof(#field) - 1 && memcmp(k, #field, klen) == 0) { \
+        return f(t.field); \
+      } \
+      break;
+
+#define LOBA_REFLECT(Type, ...) \
+  template <> \
+  struct LobaReflectTraits<Type> { \
+    static constexpr int kReflected = 1; \
+    template <typename T, typename F> \
+    static void LobaForEach(T &t, F &&f) { \
+      LOBA_REFLECT_FOR_EACH(LOBA_REFLECT_VISIT, __VA_ARGS__) \
+    } \
+    /* 未知的键返回 -1 */ \
+    template <typename F> \
+    static int LobaDispatch(Type &t, const char *k, size_t klen, F &&f) { \
+      switch (LobaHash(k, klen)) { \
+        LOBA_REFLECT_FOR_EACH(LOBA_REFLECT_CASE, __VA_ARGS__) \
+        default:break; \
+      } \
+      return -1; \
+    } \
+  };
+
+class LobaReflect : public LobaJson {
+ public:
+  LobaReflect() = default;
+  ~LobaReflect() = default;
+
+  // 缺少的键和 null 保持字段原值, 多余的键校验后跳过; 出错时 out 可能已被部分写入
+  template <typename T>
+  int LobaParseStruct(T *out, const char *json);
+  // 返回的缓冲区与 LobaStringify 相同, 由调用者释放
+  template <typename T>
+  char *LobaStringifyStruct(const T &in, size_t *length);
+
+ private:
+  template <typename T>
+  int LobaReadValue(LobaContext *c, T *out);
+  int LobaRead(LobaContext *c, bool *out);
+  int LobaRead(LobaContext *c, std::string *out);
+  template <typename T>
+  std::enable_if_t<std::is_arithmetic<T>::value, int> LobaRead(LobaContext *c, T *out);
+  template <typename T>
+  int LobaRead(LobaContext *c, std::vector<T> *out);
+  template <typename T>
+  std::enable_if_t<LobaReflectTraits<T>::kReflected, int> LobaRead(LobaContext *c, T *out);
+  int LobaMismatch(LobaContext *c);
+
+  void LobaWrite(LobaContext *c, bool in);
+  void LobaWrite(LobaContext *c, const std::string &in);
+  template <typename T>
+  std::enable_if_t<std::is_arithmetic<T>::value> LobaWrite(LobaContext *c, T in);
+  template <typename T>
+  void LobaWrite(LobaContext *c, const std::vector<T> &in);
+  template <typename T>
+  std::enable_if_t<LobaReflectTraits<T>::kReflected> LobaWrite(LobaContext *c, const T &in);
+};
+
+template <typename T>
+inline int LobaReflect::LobaParseStruct(T *out, const char *json) {
+  LobaContext c;
+  assert(out != nullptr && json != nullptr);
+  c.json = json;
+  c.stack = nullptr;
+  c.size = c.top = 0;
+  c.depth = 0;
+  LobaParseWhitespace(&c);
+  int ret = LobaReadValue(&c, out);
+  if (ret == lobaParseOk) {
+    LobaParseWhitespace(&c);
+    if (*c.json != '\0') {
+      ret = lobaParseRootNotSingular;
+    }
+  }
+  LobaDealloc(c.stack, c.size);
+  return ret;
+}
+
+template <typename T>
+inline char *LobaReflect::LobaStringifyStruct(const T &in, size_t *length) {
+  LobaContext c;
+  c.stack = (char *)LobaMalloc(c.size = LobaContextStackSize);
+  c.top = 0;
+  LobaWrite(&c, in);
+  if (length) {
+    *length = c.top;
+  }
+  PUTC(&c, '\0');
+  return LobaContextRelease(&c, c.top);
+}
+
+template <typename T>
+inline int LobaReflect::LobaReadValue(LobaContext *c, T *out) {
+  if (*c->json == 'n') {
+    LobaValue tmp;
+    return LobaParseLiteral(c, &tmp, "null", LobaType::lobaNull);
+  }
+  return LobaRead(c, out);
+}
+
+// 类型不符时先确认该位置确实是一个合法值的开头, 否则报告语法错误
+inline int LobaReflect::LobaMismatch(LobaContext *c) {
+  switch (*c->json) {
+    case '\0':return lobaParseExpectValue;
+    case 't':
+    case 'f':
+    case '"':
+    case '[':
+    case '{':
+    case '-':return lobaReflectTypeMismatch;
+    default:break;
+  }
+  if (ISDIGIT(*c->json)) {
+    return lobaReflectTypeMismatch;
+  }
+  return lobaParseInvalidValue;
+}
+
+inline int LobaReflect::LobaRead(LobaContext *c, bool *out) {
+  LobaValue tmp;
+  int ret;
+  if (*c->json == 't') {
+    ret = LobaParseLiteral(c, &tmp, "true", LobaType::lobaTrue);
+  } else if (*c->json == 'f') {
+    ret = LobaParseLiteral(c, &tmp, "false", LobaType::lobaFalse);
+  } else {
+    return LobaMismatch(c);
+  }
+  if (ret == lobaParseOk) {
+    *out = tmp.type == LobaType::lobaTrue;
+  }
+  return ret;
+}
+
+inline int LobaReflect::LobaRead(LobaContext *c, std::string *out) {
+  if (*c->json != '"') {
+    return LobaMismatch(c);
+  }
+  char *s;
+  size_t len;
+  int ret = LobaParseStringRaw(c, &s, &len);
+  if (ret == lobaParseOk) {
+    out->assign(s, len);
+  }
+  return ret;
+}
+
+// 整数要求值是整数且在 T 的范围内. 纯整数逐位累加, 与 LobaShredInt64 相同, 超过 2^53 也是精确的;
+// 带小数或指数的才按 double 转换
+template <typename T>
+inline std::enable_if_t<std::is_arithmetic<T>::value, int> LobaReflect::LobaRead(LobaContext *c,
+                                                                                  T *out) {
+  if (*c->json != '-' && !ISDIGIT(*c->json)) {
+    return LobaMismatch(c);
+  }
+  if (std::is_integral<T>::value) {
+    const char *end = LobaScanNumber(c->json);
+    if (end == nullptr) {
+      return lobaParseInvalidValue;
+    }
+    const char *p = c->json;
+    int negative = *p == '-';
+    p += negative;
+    uint64_t u = 0;
+    int overflow = 0;
+    for (; p < end && ISDIGIT(*p); p++) {
+      unsigned digit = static_cast<unsigned>(*p - '0');
+      if (u > (UINT64_MAX - digit) / 10) {
+        overflow = 1;
+      }
+      u = u * 10 + digit;
+    }
+    if (p == end) {
+      uint64_t max = static_cast<uint64_t>(std::numeric_limits<T>::max());
+      // 无符号类型只接受 -0
+      uint64_t limit = negative ? (std::is_signed<T>::value ? max + 1 : 0) : max;
+      c->json = end;
+      if (overflow || u > limit) {
+        return lobaReflectNumberOutOfRange;
+      }
+      *out = negative ? static_cast<T>(static_cast<int64_t>(0 - u)) : static_cast<T>(u);
+      return lobaParseOk;
+    }
+  }
+  LobaValue tmp;
+  int ret = LobaParseNumber(c, &tmp);
+  if (ret != lobaParseOk) {
+    return ret;
+  }
+  if (std::is_integral<T>::value) {
+    // [lo, hi) 两端都是 2 的幂, 能用 double 精确表示
+    constexpr double hi = static_cast<double>(std::numeric_limits<T>::max() / 2 + 1) * 2.0;
+    constexpr double lo = std::is_signed<T>::value ? -hi : 0.0;
+    if (tmp.u.n != std::floor(tmp.u.n) || tmp.u.n < lo || tmp.u.n >= hi) {
+      return lobaReflectNumberOutOfRange;
+    }
+  } else if (std::fabs(tmp.u.n) > static_cast<double>(std::numeric_limits<T>::max())) {
+    // 超出 float 范围的 double 直接转换是未定义行为
+    return lobaReflectNumberOutOfRange;
+  }
+  *out = static_cast<T>(tmp.u.n);
+  return lobaParseOk;
+}
+
+template <typename T>
+inline int LobaReflect::LobaRead(LobaContext *c, std::vector<T> *out) {
+  if (*c->json != '[') {
+    return LobaMismatch(c);
+  }
+  out->clear();
+  c->json++;
+  LobaParseWhitespace(c);
+  if (*c->json == ']') {
+    c->json++;
+    return lobaParseOk;
+  }
+  for (;;) {
+    LobaParseWhitespace(c);
+    T e{};
+    int ret = LobaReadValue(c, &e);
+    if (ret != lobaParseOk) {
+      return ret;
+    }
+    out->push_back(std::move(e));
+    LobaParseWhitespace(c);
+    if (*c->json == ',') {
+      c->json++;
+    } else if (*c->json == ']') {
+      c->json++;
+      return lobaParseOk;
+    } else {
+      return lobaParseMissCommaOrSquareBracket;
+    }
+  }
+}
+
+// 键留在 c 的栈顶之上, 分派时比较完才会被后续的值覆盖
+template <typename T>
+inline std::enable_if_t<LobaReflectTraits<T>::kReflected, int> LobaReflect::LobaRead(LobaContext *c,
+                                                                                     T *out) {
+  if (*c->json != '{') {
+    return LobaMismatch(c);
+  }
+  c->json++;
+  LobaParseWhitespace(c);
+  if (*c->json == '}') {
+    c->json++;
+    return lobaParseOk;
+  }
+  for (;;) {
+    char *k;
+    size_t klen;
+    LobaParseWhitespace(c);
+    if (*c->json != '"') {
+      return lobaParseMissKey;
+    }
+    int ret = LobaParseStringRaw(c, &k, &klen);
+    if (ret != lobaParseOk) {
+      return ret;
+    }
+    LobaParseWhitespace(c);
+    if (*c->json != ':') {
+      return lobaParseMissColon;
+    }
+    c->json++;
+    LobaParseWhitespace(c);
+    ret = LobaReflectTraits<T>::LobaDispatch(*out, k, klen, [this, c](auto &field) {
+      return LobaReadValue(c, &field);
+    });
+    if (ret == -1) {
+      ret = LobaSkipValue(c);
+    }
+    if (ret != lobaParseOk) {
+      return ret;
+    }
+    LobaParseWhitespace(c);
+    if (*c->json == ',') {
+      c->json++;
+    } else if (*c->json == '}') {
+      c->json++;
+      return lobaParseOk;
+    } else {
+      return lobaParseMissCommaOrCurlyBracket;
+    }
+  }
+}
+
+inline void LobaReflect::LobaWrite(LobaContext *c, bool in) {
+  if (in) {
+    PUTS(c, "true", 4);
+  } else {
+    PUTS(c, "false", 5);
+  }
+}
+
+inline void LobaReflect::LobaWrite(LobaContext *c, const std::string &in) {
+  LobaStringifyString(c, in.data(), in.size());
+}
+
+// 浮点与 LobaStringify 的格式一致, 整数按原样输出不经过 double
+template <typename T>
+inline std::enable_if_t<std::is_arithmetic<T>::value> LobaReflect::LobaWrite(LobaContext *c, T in) {
+  if (std::is_floating_point<T>::value) {
+    LobaValue tmp;
+    tmp.type = LobaType::lobaNumber;
+    tmp.u.n = static_cast<double>(in);
+    LobaStringifyNumber(c, &tmp);
+    return;
+  }
+  char buffer[32];
+  int length;
+  if (std::is_signed<T>::value) {
+    length = snprintf(buffer, sizeof(buffer), "%lld", static_cast<long long>(in));
+  } else {
+    length = snprintf(buffer, sizeof(buffer), "%llu", static_cast<unsigned long long>(in));
+  }
+  PUTS(c, buffer, static_cast<size_t>(length));
+}
+
+template <typename T>
+inline void LobaReflect::LobaWrite(LobaContext *c, const std::vector<T> &in) {
+  PUTC(c, '[');
+  for (size_t i = 0; i < in.size(); i++) {
+    if (i > 0) {
+      PUTC(c, ',');
+    }
+    LobaWrite(c, static_cast<const T &>(in[i]));
+  }
+  PUTC(c, ']');
+}
+
+template <typename T>
+inline std::enable_if_t<LobaReflectTraits<T>::kReflected> LobaReflect::LobaWrite(LobaContext *c,
+                                                                                 const T &in) {
+  int first = 1;
+  PUTC(c, '{');
+  LobaReflectTraits<T>::LobaForEach(in, [this, c, &first](const char *name, size_t len, const auto &field) {
+    if (!first) {
+      PUTC(c, ',');
+    }
+    first = 0;
+    LobaStringifyString(c, name, len);
+    PUTC(c, ':');
+    LobaWrite(c, field);
+  });
+  PUTC(c, '}');
+}
+
+#endif  // LOBAJSON_REFLECT_H_
@@ -0,0 +1,298 @@
+// Copyright (c) 2022. Yang Zhu
+
+#ifndef LOBAJSON_SHARED_H_
+#define LOBAJSON_SHARED_H_
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include "lobajson.h"
+
+// 多线程共享只读文档. LobaFrozenDocument 建成后不再修改, 树上的访问函数
+// (LobaGetType / LobaGetArrayElement / LobaFindObjectValue ...) 只读取参数,
+// 各线程用自己的 LobaJson 实例即可并发读取. LobaDocumentHolder 持有当前版本,
+// 读者不加锁地取得一个引用, 写者整体换上新版本; 旧树在最后一个引用放手时释放
+class LobaFrozenDocument {
+ public:
+  ~LobaFrozenDocument() { json_.LobaFree(&root_); }
+  LobaFrozenDocument(const LobaFrozenDocument &) = delete;
+  LobaFrozenDocument &operator=(const LobaFrozenDocument &) = delete;
+
+  // 解析失败返回 nullptr, 错误码写入 error (可为 nullptr)
+  static std::shared_ptr<const LobaFrozenDocument> LobaParse(const char *json, int *error);
+  // 接管 json 分配的树, *v 变为 null. 文档析构时用 json 当时的 allocator 和键表释放,
+  // 两者都须比文档活得久; 含惰性数字的树还须保留源文本. 压实过的树连同压实块一起转给文档
+  static std::shared_ptr<const LobaFrozenDocument> LobaFreeze(LobaJson &json, LobaValue *v);
+
+  const LobaValue *LobaGetRoot() const { return &root_; }
+
+ private:
+  LobaFrozenDocument() { LobaInit(&root_); }
+
+  LobaJson json_;
+  LobaValue root_;
+};
+
+inline std::shared_ptr<const LobaFrozenDocument> LobaFrozenDocument::LobaParse(const char *json,
+                                                                                int *error) {
+  assert(json != nullptr);
+  std::shared_ptr<LobaFrozenDocument> doc(new LobaFrozenDocument());
+  int ret = doc->json_.LobaParse(&doc->root_, json);
+  if (error != nullptr) {
+    *error = ret;
+  }
+  return ret == lobaParseOk ? doc : nullptr;
+}
+
+inline std::shared_ptr<const LobaFrozenDocument> LobaFrozenDocument::LobaFreeze(LobaJson &json,
+                                                                                 LobaValue *v) {
+  assert(v != nullptr);
+  std::shared_ptr<LobaFrozenDocument> doc(new LobaFrozenDocument());
+  doc->json_.LobaSetAllocator(json.LobaGetAllocator());
+  doc->json_.LobaSetKeyTable(json.LobaGetKeyTable());
+  doc->json_.LobaAdoptCompact(&json, v);
+  doc->json_.LobaMove(&doc->root_, v);
+  return doc;
+}
+
+// 读者用 hazard pointer 护住当前的 LobaSwapBox, 只在复制 shared_ptr 的几条指令内占用一个槽;
+// 写者换下旧盒子后等所有槽都不再指向它才删除. 槽数只限制同一瞬间处于这个窗口的读者数,
+// 超出时读者换一个槽重试, 不限制持有引用的读者数
+#define LobaHazardSlots 64
+
+class LobaDocumentHolder {
+ public:
+  explicit LobaDocumentHolder(std::shared_ptr<const LobaFrozenDocument> doc = nullptr)
+      : current_(new LobaSwapBox{std::move(doc)}) {
+    for (LobaHazardSlot &slot : hazard_) {
+      slot.box.store(nullptr, std::memory_order_relaxed);
+    }
+  }
+  // 析构时不能再有读者或写者在调用
+  ~LobaDocumentHolder() { delete current_.load(); }
+  LobaDocumentHolder(const LobaDocumentHolder &) = delete;
+  LobaDocumentHolder &operator=(const LobaDocumentHolder &) = delete;
+
+  // 无锁, 返回的引用在换版本之后依然有效
+  std::shared_ptr<const LobaFrozenDocument> LobaAcquire() const;
+  // 换上 doc 并返回旧版本, 可与 LobaAcquire 及其他 LobaSwap 并发
+  std::shared_ptr<const LobaFrozenDocument> LobaSwap(std::shared_ptr<const LobaFrozenDocument> doc);
+
+ private:
+  struct LobaSwapBox {
+    std::shared_ptr<const LobaFrozenDocument> doc;
+  };
+  // 每个槽独占一条缓存行, 读者之间不互相使失效
+  struct alignas(64) LobaHazardSlot {
+    std::atomic<LobaSwapBox *> box;
+  };
+  static size_t LobaSlotHint();
+
+  std::atomic<LobaSwapBox *> current_;
+  mutable LobaHazardSlot hazard_[LobaHazardSlots];
+};
+
+// 同一线程总从同一个槽开始找, 不同线程大多落在不同的槽
+inline size_t LobaDocumentHolder::LobaSlotHint() {
+  static thread_local size_t hint = std::hash<std::thread::id>()(std::this_thread::get_id());
+  return hint;
+}
+
+inline std::shared_ptr<const LobaFrozenDocument> LobaDocumentHolder::LobaAcquire() const {
+  size_t i = LobaSlotHint() % LobaHazardSlots;
+  LobaSwapBox *box = current_.load();
+  for (size_t tries = 1;; tries++) {
+    LobaSwapBox *expected = nullptr;
+    if (hazard_[i].box.compare_exchange_strong(expected, box)) {
+      break;
+    }
+    i = (i + 1) % LobaHazardSlots;
+    if (tries % LobaHazardSlots == 0) {
+      std::this_thread::yield();
+    }
+  }
+  // 公布之后 current_ 仍是它, 写者就一定能看到这个槽, 盒子在放开槽之前不会被删除
+  for (LobaSwapBox *now; (now = current_.load()) != box;) {
+    box = now;
+    hazard_[i].box.store(box);
+  }
+  std::shared_ptr<const LobaFrozenDocument> doc = box->doc;
+  hazard_[i].box.store(nullptr, std::memory_order_release);
+  return doc;
+}
+
+inline std::shared_ptr<const LobaFrozenDocument> LobaDocumentHolder::LobaSwap(
+    std::shared_ptr<const LobaFrozenDocument> doc) {
+  LobaSwapBox *old = current_.exchange(new LobaSwapBox{std::move(doc)});
+  for (LobaHazardSlot &slot : hazard_) {
+    while (slot.box.load() == old) {
+      std::this_thread::yield();
+    }
+  }
+  std::shared_ptr<const LobaFrozenDocument> ret = std::move(old->doc);
+  delete old;
+  return ret;
+}
+
+// 解析结果缓存的默认上限: 缓存的输入和树一共占用的字节数, 以及文档个数
+#define LobaParseCacheMaxBytes (64 << 20)
+#define LobaParseCacheMaxEntries 4096
+
+// 挡在解析前面的缓存, 适合反复收到同样几段 JSON 的场合. 按输入内容的哈希查找, 命中时再逐字节
+// 比较, 返回共享的只读文档而不重新解析; 按最近使用淘汰, 输入加树的字节数和文档个数都有上限.
+// 可被多个线程同时调用, 解析在锁外进行
+class LobaParseCache {
+ public:
+  explicit LobaParseCache(size_t max_bytes = LobaParseCacheMaxBytes,
+                          size_t max_entries = LobaParseCacheMaxEntries)
+      : max_bytes_(max_bytes), max_entries_(max_entries) {}
+  LobaParseCache(const LobaParseCache &) = delete;
+  LobaParseCache &operator=(const LobaParseCache &) = delete;
+
+  // json 不必以 '\0' 结尾, 但中间不能有 '\0'. 解析失败返回 nullptr 且不缓存,
+  // 错误码写入 error (可为 nullptr)
+  std::shared_ptr<const LobaFrozenDocument> LobaParse(const char *json, size_t len, int *error);
+  std::shared_ptr<const LobaFrozenDocument> LobaParse(const char *json, int *error) {
+    return LobaParse(json, strlen(json), error);
+  }
+  // 清空缓存, 已经交出去的文档不受影响
+  void LobaClear();
+
+  size_t LobaGetHits() const { return hits_.load(std::memory_order_relaxed); }
+  size_t LobaGetMisses() const { return misses_.load(std::memory_order_relaxed); }
+  size_t LobaGetEvictions() const { return evictions_.load(std::memory_order_relaxed); }
+  size_t LobaGetSize() const;
+  size_t LobaGetBytes() const;
+  // 每次处理 8 字节的乘法哈希; 命中后还要比较全文, 不需要抗碰撞
+  static uint64_t LobaHashBytes(const char *p, size_t len);
+
+ private:
+  struct Entry {
+    uint64_t hash;
+    std::string text;
+    std::shared_ptr<const LobaFrozenDocument> doc;
+    size_t bytes;
+  };
+  void LobaEvict();
+
+  size_t max_bytes_;
+  size_t max_entries_;
+  mutable std::mutex mutex_;
+  // 表头是最近用过的
+  std::list<Entry> lru_;
+  // 同一个哈希只留一份, 碰撞时新的顶替旧的
+  std::unordered_map<uint64_t, std::list<Entry>::iterator> index_;
+  size_t bytes_ = 0;
+  std::atomic<size_t> hits_{0};
+  std::atomic<size_t> misses_{0};
+  std::atomic<size_t> evictions_{0};
+};
+
+inline uint64_t LobaParseCache::LobaHashBytes(const char *p, size_t len) {
+  const uint64_t k = 0x9E3779B97F4A7C15ULL;
+  uint64_t h = len * k, w;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    memcpy(&w, p + i, 8);
+    h = (h ^ w) * k;
+    h ^= h >> 29;
+  }
+  w = 0;
+  memcpy(&w, p + i, len - i);
+  h = (h ^ w) * k;
+  return h ^ (h >> 32);
+}
+
+inline std::shared_ptr<const LobaFrozenDocument> LobaParseCache::LobaParse(const char *json, size_t len,
+                                                                           int *error) {
+  assert(json != nullptr);
+  uint64_t hash = LobaHashBytes(json, len);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = index_.find(hash);
+    if (it != index_.end() && it->second->text.size() == len &&
+        memcmp(it->second->text.data(), json, len) == 0) {
+      lru_.splice(lru_.begin(), lru_, it->second);
+      hits_.fetch_add(1, std::memory_order_relaxed);
+      if (error != nullptr) {
+        *error = lobaParseOk;
+      }
+      return it->second->doc;
+    }
+  }
+  misses_.fetch_add(1, std::memory_order_relaxed);
+  std::string text(json, len);
+  std::shared_ptr<const LobaFrozenDocument> doc = LobaFrozenDocument::LobaParse(text.c_str(), error);
+  if (doc == nullptr) {
+    return nullptr;
+  }
+  // 解析在第一个 '\0' 处就结束了, 后面还有内容时整段不是一份合法的文档
+  if (memchr(json, '\0', len) != nullptr) {
+    if (error != nullptr) {
+      *error = lobaParseRootNotSingular;
+    }
+    return nullptr;
+  }
+  LobaJson json_stats;
+  LobaMemoryStats stats;
+  json_stats.LobaMemoryUsage(doc->LobaGetRoot(), &stats);
+  size_t bytes = len + 1 + stats.total;
+  if (bytes > max_bytes_) {
+    return doc;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = index_.find(hash);
+  if (it != index_.end()) {
+    if (it->second->text == text) {
+      // 别的线程刚放进去同一段输入, 用它的结果
+      lru_.splice(lru_.begin(), lru_, it->second);
+      return it->second->doc;
+    }
+    bytes_ -= it->second->bytes;
+    lru_.erase(it->second);
+    index_.erase(it);
+  }
+  lru_.push_front(Entry{hash, std::move(text), doc, bytes});
+  index_[hash] = lru_.begin();
+  bytes_ += bytes;
+  LobaEvict();
+  return doc;
+}
+
+// 持有 mutex_ 时调用, 刚放进去的表头不会被淘汰
+inline void LobaParseCache::LobaEvict() {
+  while (lru_.size() > 1 && (bytes_ > max_bytes_ || lru_.size() > max_entries_)) {
+    bytes_ -= lru_.back().bytes;
+    index_.erase(lru_.back().hash);
+    lru_.pop_back();
+    evictions_.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+inline void LobaParseCache::LobaClear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  lru_.clear();
+  index_.clear();
+  bytes_ = 0;
+}
+
+inline size_t LobaParseCache::LobaGetSize() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return lru_.size();
+}
+
+inline size_t LobaParseCache::LobaGetBytes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return bytes_;
+}
+
+#endif  // LOBAJSON_SHARED_H_
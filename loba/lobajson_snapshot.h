@@ -0,0 +1,393 @@
+// Copyright (c) 2022. Yang Zhu
+
+#ifndef LOBAJSON_SNAPSHOT_H_
+#define LOBAJSON_SNAPSHOT_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "lobajson.h"
+
+// 可重定位的二进制快照: 所有指针都换成相对映像起始的偏移, mmap 后无需反序列化即可只读访问
+enum {
+  lobaSnapshotOk = 0,
+
+  lobaSnapshotIoError,
+  lobaSnapshotInvalidFormat
+};
+
+#define LobaSnapshotMagic "LOBASNAP"
+#define LobaSnapshotVersion 1u
+
+// 与 LobaValue 对应, off 指向字符串字节 (以 '\0' 结尾)、元素数组或成员数组
+struct LobaSnapNode {
+  union {
+    double n;
+    uint64_t off;
+  } u;
+  uint64_t size;
+  uint32_t type;
+  uint32_t reserved;
+};
+
+struct LobaSnapMember {
+  uint64_t k;
+  uint64_t klen;
+  LobaSnapNode v;
+};
+
+struct LobaSnapHeader {
+  char magic[8];
+  uint32_t version;
+  // 写入端的字节序标记, 读取端不一致时拒绝加载
+  uint32_t endian;
+  uint64_t length;
+  LobaSnapNode root;
+};
+
+class LobaSnapshot {
+ public:
+  LobaSnapshot() = default;
+  ~LobaSnapshot() { LobaUnloadSnapshot(); }
+  LobaSnapshot(const LobaSnapshot &) = delete;
+  LobaSnapshot &operator=(const LobaSnapshot &) = delete;
+
+  // 先写 path.tmp 并 fsync, 再 rename 覆盖, 中途失败不会破坏已有的快照
+  int LobaSaveSnapshot(const LobaValue *v, const char *path);
+  // 加载时遍历一遍所有节点, 类型、偏移与长度都落在映像内才返回 lobaSnapshotOk, 之后访问函数不再检查
+  int LobaLoadSnapshot(const char *path);
+  void LobaUnloadSnapshot();
+  const LobaSnapNode *LobaGetRoot() const;
+
+  // 以下访问函数与 LobaJson 同名同义, 返回的指针都指向映射区, 卸载后失效
+  LobaType LobaGetType(const LobaSnapNode *v) const;
+  int LobaGetBoolean(const LobaSnapNode *v) const;
+  double LobaGetNumber(const LobaSnapNode *v) const;
+  const char *LobaGetString(const LobaSnapNode *v) const;
+  size_t LobaGetStringLength(const LobaSnapNode *v) const;
+  size_t LobaGetArraySize(const LobaSnapNode *v) const;
+  const LobaSnapNode *LobaGetArrayElement(const LobaSnapNode *v, size_t index) const;
+  size_t LobaGetObjectSize(const LobaSnapNode *v) const;
+  const char *LobaGetObjectKey(const LobaSnapNode *v, size_t index) const;
+  size_t LobaGetObjectKeyLength(const LobaSnapNode *v, size_t index) const;
+  const LobaSnapNode *LobaGetObjectValue(const LobaSnapNode *v, size_t index) const;
+  const LobaSnapNode *LobaFindObjectValue(const LobaSnapNode *v, const char *key, size_t klen) const;
+
+  // 拷贝出一棵可修改的 LobaValue 树
+  void LobaSnapshotToValue(const LobaSnapNode *v, LobaValue *out);
+  // LobaSnapshotToValue 拷贝出的树经由 allocator 分配
+  void LobaSetAllocator(LobaAllocator *allocator) { json_.LobaSetAllocator(allocator); }
+  void LobaSetKeyTable(LobaKeyTable *table) { json_.LobaSetKeyTable(table); }
+
+ private:
+  size_t LobaReserve(std::vector<char> *image, size_t bytes);
+  void LobaWriteNode(std::vector<char> *image, size_t at, const LobaValue *v);
+  int LobaTakeBlock(uint64_t off, uint64_t count, uint64_t unit, size_t *cursor) const;
+  int LobaValidate() const;
+  const char *LobaAt(uint64_t off) const { return base_ + off; }
+
+  const char *base_ = nullptr;
+  size_t length_ = 0;
+  LobaJson json_;
+};
+
+// 按 8 字节对齐追加 bytes 个零字节, 返回起始偏移
+inline size_t LobaSnapshot::LobaReserve(std::vector<char> *image, size_t bytes) {
+  size_t at = (image->size() + 7) & ~static_cast<size_t>(7);
+  image->resize(at + bytes);
+  return at;
+}
+
+// 先给子节点整块占位再逐个填写, 同一容器的子节点在映像中连续存放
+inline void LobaSnapshot::LobaWriteNode(std::vector<char> *image, size_t at, const LobaValue *v) {
+  LobaSnapNode node;
+  memset(&node, 0, sizeof(node));
+  node.type = static_cast<uint32_t>(json_.LobaGetType(v));
+  size_t i, base;
+  switch (v->type) {
+    case LobaType::lobaNumber:
+    case LobaType::lobaRawNumber:node.u.n = json_.LobaGetNumber(v);
+      break;
+    case LobaType::lobaString:node.size = v->u.s.len;
+      node.u.off = LobaReserve(image, v->u.s.len + 1);
+      memcpy(image->data() + node.u.off, v->u.s.s, v->u.s.len);
+      break;
+    case LobaType::lobaArray:
+    case LobaType::lobaPackedArray:node.size = json_.LobaGetArraySize(v);
+      node.u.off = base = LobaReserve(image, node.size * sizeof(LobaSnapNode));
+      for (i = 0; i < node.size; i++) {
+        LobaValue proxy;
+        LobaWriteNode(image, base + i * sizeof(LobaSnapNode), json_.LobaGetArrayElement(v, i, &proxy));
+      }
+      break;
+    case LobaType::lobaObject:node.size = v->u.o.size;
+      node.u.off = base = LobaReserve(image, v->u.o.size * sizeof(LobaSnapMember));
+      for (i = 0; i < v->u.o.size; i++) {
+        const LobaMember *m = &v->u.o.m[i];
+        LobaSnapMember member;
+        memset(&member, 0, sizeof(member));
+        member.klen = m->klen;
+        member.k = LobaReserve(image, m->klen + 1);
+        memcpy(image->data() + member.k, m->k, m->klen);
+        memcpy(image->data() + base + i * sizeof(LobaSnapMember), &member, sizeof(member));
+        LobaWriteNode(image, base + i * sizeof(LobaSnapMember) + offsetof(LobaSnapMember, v), &m->v);
+      }
+      break;
+    default:break;
+  }
+  memcpy(image->data() + at, &node, sizeof(node));
+}
+
+inline int LobaSnapshot::LobaSaveSnapshot(const LobaValue *v, const char *path) {
+  assert(v != nullptr && path != nullptr);
+  std::vector<char> image(sizeof(LobaSnapHeader), 0);
+  LobaWriteNode(&image, offsetof(LobaSnapHeader, root), v);
+  LobaSnapHeader header;
+  memcpy(&header, image.data(), sizeof(header));
+  memcpy(header.magic, LobaSnapshotMagic, sizeof(header.magic));
+  header.version = LobaSnapshotVersion;
+  header.endian = 0x01020304;
+  header.length = image.size();
+  memcpy(image.data(), &header, sizeof(header));
+  std::string tmp = std::string(path) + ".tmp";
+  FILE *fp = fopen(tmp.c_str(), "wb");
+  if (fp == nullptr) {
+    return lobaSnapshotIoError;
+  }
+  int ok = fwrite(image.data(), 1, image.size(), fp) == image.size();
+  ok = ok && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+  ok = fclose(fp) == 0 && ok;
+  ok = ok && rename(tmp.c_str(), path) == 0;
+  if (!ok) {
+    remove(tmp.c_str());
+  }
+  return ok ? lobaSnapshotOk : lobaSnapshotIoError;
+}
+
+// 写入端按先序依次占用 [off, off + count * unit) 这些块, 偏移严格递增且互不重叠.
+// 校验时按同样的顺序要求每块从 cursor 之后开始, 既排除越界, 也排除环和共享子树
+inline int LobaSnapshot::LobaTakeBlock(uint64_t off, uint64_t count, uint64_t unit, size_t *cursor) const {
+  if (off < *cursor || off > length_ || (off & 7) != 0 || count > (length_ - off) / unit) {
+    return 0;
+  }
+  *cursor = static_cast<size_t>(off + count * unit);
+  return 1;
+}
+
+// 用显式栈按写入顺序遍历, 层数不受调用栈限制. 成员先检查键再展开值, 与写入端相同
+inline int LobaSnapshot::LobaValidate() const {
+  struct Pending {
+    const LobaSnapNode *v;
+    const LobaSnapMember *m;
+  };
+  std::vector<Pending> stack(1, Pending{LobaGetRoot(), nullptr});
+  size_t cursor = sizeof(LobaSnapHeader), i;
+  while (!stack.empty()) {
+    Pending top = stack.back();
+    stack.pop_back();
+    const LobaSnapNode *v = top.v;
+    if (top.m != nullptr) {
+      if (top.m->klen == UINT64_MAX || !LobaTakeBlock(top.m->k, top.m->klen + 1, 1, &cursor) ||
+          LobaAt(top.m->k)[top.m->klen] != '\0') {
+        return 0;
+      }
+      v = &top.m->v;
+    }
+    switch (v->type) {
+      case LobaType::lobaNull:
+      case LobaType::lobaFalse:
+      case LobaType::lobaTrue:
+      case LobaType::lobaNumber:break;
+      case LobaType::lobaString:
+        if (v->size == UINT64_MAX || !LobaTakeBlock(v->u.off, v->size + 1, 1, &cursor) ||
+            LobaAt(v->u.off)[v->size] != '\0') {
+          return 0;
+        }
+        break;
+      case LobaType::lobaArray:
+        if (!LobaTakeBlock(v->u.off, v->size, sizeof(LobaSnapNode), &cursor)) {
+          return 0;
+        }
+        for (i = v->size; i-- > 0;) {
+          stack.push_back(Pending{reinterpret_cast<const LobaSnapNode *>(LobaAt(v->u.off)) + i, nullptr});
+        }
+        break;
+      case LobaType::lobaObject:
+        if (!LobaTakeBlock(v->u.off, v->size, sizeof(LobaSnapMember), &cursor)) {
+          return 0;
+        }
+        for (i = v->size; i-- > 0;) {
+          stack.push_back(Pending{nullptr, reinterpret_cast<const LobaSnapMember *>(LobaAt(v->u.off)) + i});
+        }
+        break;
+      default:return 0;
+    }
+  }
+  return 1;
+}
+
+inline int LobaSnapshot::LobaLoadSnapshot(const char *path) {
+  assert(path != nullptr);
+  LobaUnloadSnapshot();
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return lobaSnapshotIoError;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return lobaSnapshotIoError;
+  }
+  size_t length = static_cast<size_t>(st.st_size);
+  if (length < sizeof(LobaSnapHeader)) {
+    close(fd);
+    return lobaSnapshotInvalidFormat;
+  }
+  // MAP_SHARED + 只读: 多个进程加载同一文件时共用页缓存
+  void *base = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    return lobaSnapshotIoError;
+  }
+  const LobaSnapHeader *header = static_cast<const LobaSnapHeader *>(base);
+  if (memcmp(header->magic, LobaSnapshotMagic, sizeof(header->magic)) != 0 ||
+      header->version != LobaSnapshotVersion || header->endian != 0x01020304 ||
+      header->length != length) {
+    munmap(base, length);
+    return lobaSnapshotInvalidFormat;
+  }
+  base_ = static_cast<const char *>(base);
+  length_ = length;
+  if (!LobaValidate()) {
+    LobaUnloadSnapshot();
+    return lobaSnapshotInvalidFormat;
+  }
+  return lobaSnapshotOk;
+}
+
+inline void LobaSnapshot::LobaUnloadSnapshot() {
+  if (base_ != nullptr) {
+    munmap(const_cast<char *>(base_), length_);
+    base_ = nullptr;
+    length_ = 0;
+  }
+}
+
+inline const LobaSnapNode *LobaSnapshot::LobaGetRoot() const {
+  assert(base_ != nullptr);
+  return &reinterpret_cast<const LobaSnapHeader *>(base_)->root;
+}
+
+inline LobaType LobaSnapshot::LobaGetType(const LobaSnapNode *v) const {
+  assert(v != nullptr);
+  return static_cast<LobaType>(v->type);
+}
+
+inline int LobaSnapshot::LobaGetBoolean(const LobaSnapNode *v) const {
+  assert(v != nullptr && (v->type == LobaType::lobaTrue || v->type == LobaType::lobaFalse));
+  return v->type == LobaType::lobaTrue;
+}
+
+inline double LobaSnapshot::LobaGetNumber(const LobaSnapNode *v) const {
+  assert(v != nullptr && v->type == LobaType::lobaNumber);
+  return v->u.n;
+}
+
+inline const char *LobaSnapshot::LobaGetString(const LobaSnapNode *v) const {
+  assert(v != nullptr && v->type == LobaType::lobaString);
+  return LobaAt(v->u.off);
+}
+
+inline size_t LobaSnapshot::LobaGetStringLength(const LobaSnapNode *v) const {
+  assert(v != nullptr && v->type == LobaType::lobaString);
+  return v->size;
+}
+
+inline size_t LobaSnapshot::LobaGetArraySize(const LobaSnapNode *v) const {
+  assert(v != nullptr && v->type == LobaType::lobaArray);
+  return v->size;
+}
+
+inline const LobaSnapNode *LobaSnapshot::LobaGetArrayElement(const LobaSnapNode *v,
+                                                             size_t index) const {
+  assert(v != nullptr && v->type == LobaType::lobaArray);
+  assert(index < v->size);
+  return reinterpret_cast<const LobaSnapNode *>(LobaAt(v->u.off)) + index;
+}
+
+inline size_t LobaSnapshot::LobaGetObjectSize(const LobaSnapNode *v) const {
+  assert(v != nullptr && v->type == LobaType::lobaObject);
+  return v->size;
+}
+
+inline const char *LobaSnapshot::LobaGetObjectKey(const LobaSnapNode *v, size_t index) const {
+  assert(v != nullptr && v->type == LobaType::lobaObject);
+  assert(index < v->size);
+  return LobaAt((reinterpret_cast<const LobaSnapMember *>(LobaAt(v->u.off)) + index)->k);
+}
+
+inline size_t LobaSnapshot::LobaGetObjectKeyLength(const LobaSnapNode *v, size_t index) const {
+  assert(v != nullptr && v->type == LobaType::lobaObject);
+  assert(index < v->size);
+  return (reinterpret_cast<const LobaSnapMember *>(LobaAt(v->u.off)) + index)->klen;
+}
+
+inline const LobaSnapNode *LobaSnapshot::LobaGetObjectValue(const LobaSnapNode *v,
+                                                            size_t index) const {
+  assert(v != nullptr && v->type == LobaType::lobaObject);
+  assert(index < v->size);
+  return &(reinterpret_cast<const LobaSnapMember *>(LobaAt(v->u.off)) + index)->v;
+}
+
+inline const LobaSnapNode *LobaSnapshot::LobaFindObjectValue(const LobaSnapNode *v, const char *key,
+                                                             size_t klen) const {
+  assert(v != nullptr && v->type == LobaType::lobaObject && key != nullptr);
+  const LobaSnapMember *m = reinterpret_cast<const LobaSnapMember *>(LobaAt(v->u.off));
+  for (size_t i = 0; i < v->size; i++) {
+    if (m[i].klen == klen && memcmp(LobaAt(m[i].k), key, klen) == 0) {
+      return &m[i].v;
+    }
+  }
+  return nullptr;
+}
+
+inline void LobaSnapshot::LobaSnapshotToValue(const LobaSnapNode *v, LobaValue *out) {
+  assert(v != nullptr && out != nullptr);
+  size_t i;
+  json_.LobaFree(out);
+  switch (v->type) {
+    case LobaType::lobaNumber:json_.LobaSetNumber(out, v->u.n);
+      break;
+    case LobaType::lobaString:json_.LobaSetString(out, LobaAt(v->u.off), v->size);
+      break;
+    case LobaType::lobaArray:out->u.a.size = v->size;
+      out->u.a.e = v->size ? (LobaValue *)json_.LobaMalloc(v->size * sizeof(LobaValue)) : nullptr;
+      for (i = 0; i < v->size; i++) {
+        LobaInit(&out->u.a.e[i]);
+        LobaSnapshotToValue(LobaGetArrayElement(v, i), &out->u.a.e[i]);
+      }
+      out->type = LobaType::lobaArray;
+      break;
+    case LobaType::lobaObject:out->u.o.size = v->size;
+      out->u.o.m = v->size ? (LobaMember *)json_.LobaMalloc(v->size * sizeof(LobaMember)) : nullptr;
+      for (i = 0; i < v->size; i++) {
+        LobaMember *m = &out->u.o.m[i];
+        m->klen = LobaGetObjectKeyLength(v, i);
+        m->k = json_.LobaNewKey(LobaGetObjectKey(v, i), m->klen);
+        LobaInit(&m->v);
+        LobaSnapshotToValue(LobaGetObjectValue(v, i), &m->v);
+      }
+      out->type = LobaType::lobaObject;
+      break;
+    default:out->type = static_cast<LobaType>(v->type);
+      break;
+  }
+}
+
+#endif  // LOBAJSON_SNAPSHOT_H_
@@ -1,10 +1,21 @@
 // Copyright (c) 2022. Yang Zhu
 #include "lobajson.h"
+#include "lobajson_allocator.h"
+#include "lobajson_batch.h"
+#include "lobajson_binary.h"
+#include "lobajson_columnar.h"
+#include "lobajson_document.h"
+#include "lobajson_patch.h"
+#include "lobajson_reader.h"
+#include "lobajson_reflect.h"
+#include "lobajson_shared.h"
+#include "lobajson_snapshot.h"
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <string.h>
 #include <iostream>
+#include <type_traits>
 
 static int main_ret = 0;
 static int test_count = 0;
@@ -241,6 +252,11 @@ static void test_parse_string() {
   TEST_STRING("\xE2\x82\xAC", "\"\\u20AC\"");
   TEST_STRING("\xF0\x9D\x84\x9E", "\"\\uD834\\uDD1E\"");
   TEST_STRING("\xF0\x9D\x84\x9E", "\"\\ud834\\udd1e\"");
+  // 原样出现的多字节 UTF-8, 以及跨过 16 字节边界的长 ASCII 段
+  TEST_STRING("\xC2\xA2\xE2\x82\xAC\xF0\x9D\x84\x9E\xF4\x8F\xBF\xBF",
+              "\"\xC2\xA2\xE2\x82\xAC\xF0\x9D\x84\x9E\xF4\x8F\xBF\xBF\"");
+  TEST_STRING("0123456789abcdef0123456789abcdef\xE2\x82\xAC" "0123456789\"x",
+              "\"0123456789abcdef0123456789abcdef\xE2\x82\xAC" "0123456789\\\"x\"");
 #if 1
   printf("\x24\n");
 #endif
@@ -291,6 +307,27 @@ static void test_parse_string_invalid_unicode_surrogate() {
   TEST_ERROR(lobaParseInvalidUnicodeSurrogate, "\"\\uD800\\\\\"");
   TEST_ERROR(lobaParseInvalidUnicodeSurrogate, "\"\\uD800\\uDBFF\"");
   TEST_ERROR(lobaParseInvalidUnicodeSurrogate, "\"\\uD800\\uE000\"");
+  TEST_ERROR(lobaParseInvalidUnicodeSurrogate, "\"\\uDC00\"");
+}
+
+static void test_parse_invalid_utf8() {
+  TEST_ERROR(lobaParseInvalidUtf8, "\"\x80\"");
+  TEST_ERROR(lobaParseInvalidUtf8, "\"\xBF\"");
+  TEST_ERROR(lobaParseInvalidUtf8, "\"\xFF\"");
+  /* 过长编码 */
+  TEST_ERROR(lobaParseInvalidUtf8, "\"\xC0\xAF\"");
+  TEST_ERROR(lobaParseInvalidUtf8, "\"\xC1\xBF\"");
+  TEST_ERROR(lobaParseInvalidUtf8, "\"\xE0\x9F\xBF\"");
+  TEST_ERROR(lobaParseInvalidUtf8, "\"\xF0\x8F\xBF\xBF\"");
+  /* 代理区与超出 U+10FFFF */
+  TEST_ERROR(lobaParseInvalidUtf8, "\"\xED\xA0\x80\"");
+  TEST_ERROR(lobaParseInvalidUtf8, "\"\xF4\x90\x80\x80\"");
+  TEST_ERROR(lobaParseInvalidUtf8, "\"\xF5\x80\x80\x80\"");
+  /* 截断 */
+  TEST_ERROR(lobaParseInvalidUtf8, "\"\xE2\x82\"");
+  TEST_ERROR(lobaParseInvalidUtf8, "\"\xF0\x9D\x84");
+  TEST_ERROR(lobaParseInvalidUtf8, "\"abc\xC2");
+  TEST_ERROR(lobaParseInvalidUtf8, "[\"ok\",{\"k\xC2\":1}]");
 }
 
 #if defined(_MSC_VER)
@@ -420,6 +457,46 @@ static void test_parse_object() {
   lobajson.LobaFree(&v);
 }
 
+#ifdef LOBA_STATS
+static void test_parse_stats() {
+  LobaJson lobajson;
+  LobaParseStats stats;
+  LobaValue v;
+  size_t length;
+  const char *json = " {\"a\":[1,2,[\"x\",null]],\"b\":{\"c\":true}} ";
+  lobajson.LobaSetParseStats(&stats);
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&v, json));
+  EXPECT_EQ_SIZE_T(strlen(json), stats.bytes);
+  EXPECT_EQ_SIZE_T(2, stats.values[lobaNumber]);
+  EXPECT_EQ_SIZE_T(1, stats.values[lobaString]);
+  EXPECT_EQ_SIZE_T(2, stats.values[lobaArray]);
+  EXPECT_EQ_SIZE_T(2, stats.values[lobaObject]);
+  EXPECT_EQ_SIZE_T(1, stats.values[lobaNull]);
+  EXPECT_EQ_SIZE_T(1, stats.values[lobaTrue]);
+  EXPECT_EQ_SIZE_T(3, stats.max_depth);
+  // 3 个键, 1 个字符串, 2 个数组, 2 个对象
+  EXPECT_EQ_SIZE_T(8, stats.mallocs);
+  EXPECT_EQ_SIZE_T(1, stats.reallocs);
+  EXPECT_TRUE(stats.peak_stack >= 2 * sizeof(LobaMember));
+
+  char *json2 = lobajson.LobaStringify(&v, &length);
+  EXPECT_EQ_SIZE_T(length, stats.bytes);
+  EXPECT_EQ_SIZE_T(2, stats.values[lobaArray]);
+  EXPECT_EQ_SIZE_T(3, stats.max_depth);
+  EXPECT_EQ_SIZE_T(1, stats.mallocs);
+  free(json2);
+  lobajson.LobaFree(&v);
+
+  EXPECT_EQ_INT(lobaParseMissCommaOrSquareBracket, lobajson.LobaParse(&v, "[[1,2]"));
+  EXPECT_EQ_SIZE_T(6, stats.bytes);
+  EXPECT_EQ_SIZE_T(2, stats.max_depth);
+  lobajson.LobaSetParseStats(nullptr);
+  stats.bytes = 0;
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&v, "1"));
+  EXPECT_EQ_SIZE_T(0, stats.bytes);
+}
+#endif
+
 static void test_parse() {
   test_parse_null();
   test_parse_true();
@@ -439,9 +516,13 @@ static void test_parse() {
   test_parse_invalid_string_escape();
   test_parse_string_invalid_unicode_hex();
   test_parse_string_invalid_unicode_surrogate();
+  test_parse_invalid_utf8();
   test_parse_array();
   test_parse_invalid_array();
   test_parse_object();
+#ifdef LOBA_STATS
+  test_parse_stats();
+#endif
 }
 
 // test_get_boolean
@@ -561,6 +642,1991 @@ static void test_stringify() {
   test_stringify_object();
 }
 
+#define TEST_PATCH(error, json, patch, expect)\
+    do {\
+        LobaValue v, p;\
+        LobaJson lobajson;\
+        LobaPatch lobapatch;\
+        size_t length;\
+        LobaInit(&v);\
+        LobaInit(&p);\
+        EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&v, json));\
+        EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&p, patch));\
+        EXPECT_EQ_INT(error, lobapatch.LobaApplyPatch(&v, &p));\
+        char *json2 = lobajson.LobaStringify(&v, &length);\
+        EXPECT_EQ_STRING(expect, json2, length);\
+        lobajson.LobaFree(&v);\
+        lobajson.LobaFree(&p);\
+        free(json2);\
+    } while(0)
+
+static void test_patch_apply() {
+  TEST_PATCH(lobaPatchOk, "{\"a\":1}", "[{\"op\":\"add\",\"path\":\"/b\",\"value\":[1,2]}]",
+             "{\"a\":1,\"b\":[1,2]}");
+  TEST_PATCH(lobaPatchOk, "{\"a\":[1,2]}", "[{\"op\":\"add\",\"path\":\"/a/1\",\"value\":3}]",
+             "{\"a\":[1,3,2]}");
+  TEST_PATCH(lobaPatchOk, "{\"a\":[1,2]}", "[{\"op\":\"add\",\"path\":\"/a/-\",\"value\":3}]",
+             "{\"a\":[1,2,3]}");
+  TEST_PATCH(lobaPatchOk, "{\"a\":1,\"b\":2}", "[{\"op\":\"remove\",\"path\":\"/a\"}]",
+             "{\"b\":2}");
+  TEST_PATCH(lobaPatchOk, "{\"a\":{\"b\":1}}", "[{\"op\":\"replace\",\"path\":\"/a/b\",\"value\":\"x\"}]",
+             "{\"a\":{\"b\":\"x\"}}");
+  TEST_PATCH(lobaPatchOk, "{\"a\":{\"b\":1},\"c\":[]}",
+             "[{\"op\":\"move\",\"from\":\"/a/b\",\"path\":\"/c/0\"}]",
+             "{\"a\":{},\"c\":[1]}");
+  TEST_PATCH(lobaPatchOk, "{\"a\":[1]}", "[{\"op\":\"copy\",\"from\":\"/a\",\"path\":\"/b\"}]",
+             "{\"a\":[1],\"b\":[1]}");
+  TEST_PATCH(lobaPatchOk, "{\"a/b\":{\"~\":1}}", "[{\"op\":\"test\",\"path\":\"/a~1b/~0\",\"value\":1}]",
+             "{\"a/b\":{\"~\":1}}");
+  TEST_PATCH(lobaPatchOk, "1", "[{\"op\":\"replace\",\"path\":\"\",\"value\":[true]}]", "[true]");
+}
+
+static void test_patch_rollback() {
+  TEST_PATCH(lobaPatchTestFailed, "{\"a\":[1,2],\"b\":null}",
+             "[{\"op\":\"remove\",\"path\":\"/b\"},"
+             "{\"op\":\"add\",\"path\":\"/a/0\",\"value\":0},"
+             "{\"op\":\"move\",\"from\":\"/a/2\",\"path\":\"/c\"},"
+             "{\"op\":\"replace\",\"path\":\"\",\"value\":{}},"
+             "{\"op\":\"test\",\"path\":\"\",\"value\":1}]",
+             "{\"a\":[1,2],\"b\":null}");
+  TEST_PATCH(lobaPatchPathNotFound, "{\"a\":{\"b\":1}}",
+             "[{\"op\":\"move\",\"from\":\"/a/b\",\"path\":\"/x/y\"}]",
+             "{\"a\":{\"b\":1}}");
+  TEST_PATCH(lobaPatchPathNotFound, "[1,2]", "[{\"op\":\"remove\",\"path\":\"/0\"},{\"op\":\"remove\",\"path\":\"/5\"}]",
+             "[1,2]");
+  TEST_PATCH(lobaPatchInvalidPointer, "[1,2]", "[{\"op\":\"add\",\"path\":\"/01\",\"value\":0}]", "[1,2]");
+  TEST_PATCH(lobaPatchInvalidPatch, "{}", "[{\"op\":\"add\",\"path\":\"/a\"}]", "{}");
+  TEST_PATCH(lobaPatchInvalidPatch, "{\"a\":{}}", "[{\"op\":\"move\",\"from\":\"/a\",\"path\":\"/a/b\"}]",
+             "{\"a\":{}}");
+}
+
+// 大对象走哈希索引, 多次增删后回滚仍要还原成员顺序
+static void test_patch_large_object() {
+  LobaJson lobajson;
+  LobaPatch lobapatch;
+  std::string json = "{", patch = "[", expect;
+  for (int i = 0; i < 64; i++) {
+    json += (i ? ",\"k" : "\"k") + std::to_string(i) + "\":" + std::to_string(i);
+    patch += "{\"op\":\"remove\",\"path\":\"/k" + std::to_string(i * 7 % 64) + "\"},";
+    patch += "{\"op\":\"add\",\"path\":\"/n" + std::to_string(i) + "\",\"value\":" + std::to_string(i) + "},";
+  }
+  json += "}";
+  LobaValue v, p, ok;
+  LobaInit(&v);
+  LobaInit(&p);
+  LobaInit(&ok);
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&v, json.c_str()));
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&p, (patch + "{\"op\":\"test\",\"path\":\"/k0\",\"value\":0}]").c_str()));
+  EXPECT_EQ_INT(lobaPatchPathNotFound, lobapatch.LobaApplyPatch(&v, &p));
+  size_t length;
+  char *json2 = lobajson.LobaStringify(&v, &length);
+  EXPECT_TRUE(json.size() == length && memcmp(json.c_str(), json2, length) == 0);
+  free(json2);
+  lobajson.LobaFree(&p);
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&p, (patch + "{\"op\":\"test\",\"path\":\"/n63\",\"value\":63}]").c_str()));
+  EXPECT_EQ_INT(lobaPatchOk, lobapatch.LobaApplyPatch(&v, &p));
+  EXPECT_EQ_SIZE_T(64, lobajson.LobaGetObjectSize(&v));
+  EXPECT_EQ_STRING("n0", lobajson.LobaGetObjectKey(&v, 0), lobajson.LobaGetObjectKeyLength(&v, 0));
+  lobajson.LobaFree(&p);
+  lobajson.LobaFree(&v);
+
+  // 建好的索引随删除和回滚时的插入更新下标; 删掉重复键中的第一个后找到后面那个
+  json = "{\"d\":1";
+  for (int i = 0; i < 40; i++) {
+    json += ",\"k" + std::to_string(i) + "\":" + std::to_string(i);
+  }
+  json += ",\"d\":2}";
+  patch = "[";
+  for (int i = 0; i <= LobaPatchIndexMinScans; i++) {
+    patch += "{\"op\":\"test\",\"path\":\"/k" + std::to_string(i) + "\",\"value\":" + std::to_string(i) + "},";
+  }
+  patch += "{\"op\":\"remove\",\"path\":\"/d\"},{\"op\":\"test\",\"path\":\"/d\",\"value\":2},"
+           "{\"op\":\"remove\",\"path\":\"/k5\"},{\"op\":\"test\",\"path\":\"/k39\",\"value\":39},"
+           "{\"op\":\"add\",\"path\":\"/k5\",\"value\":5},{\"op\":\"test\",\"path\":\"/k6\",\"value\":6}";
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&v, json.c_str()));
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&p, (patch + ",{\"op\":\"test\",\"path\":\"/k7\",\"value\":0}]").c_str()));
+  EXPECT_EQ_INT(lobaPatchTestFailed, lobapatch.LobaApplyPatch(&v, &p));
+  json2 = lobajson.LobaStringify(&v, &length);
+  EXPECT_TRUE(json.size() == length && memcmp(json.c_str(), json2, length) == 0);
+  free(json2);
+  lobajson.LobaFree(&p);
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&p, (patch + "]").c_str()));
+  EXPECT_EQ_INT(lobaPatchOk, lobapatch.LobaApplyPatch(&v, &p));
+  EXPECT_EQ_SIZE_T(41, lobajson.LobaGetObjectSize(&v));
+  EXPECT_EQ_STRING("k5", lobajson.LobaGetObjectKey(&v, 40), lobajson.LobaGetObjectKeyLength(&v, 40));
+  lobajson.LobaFree(&p);
+  lobajson.LobaFree(&v);
+}
+
+#define TEST_MERGE_PATCH(json, patch, expect)\
+    do {\
+        LobaValue v, p;\
+        LobaJson lobajson;\
+        LobaPatch lobapatch;\
+        size_t length;\
+        LobaInit(&v);\
+        LobaInit(&p);\
+        EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&v, json));\
+        EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&p, patch));\
+        lobapatch.LobaApplyMergePatch(&v, &p);\
+        char *json2 = lobajson.LobaStringify(&v, &length);\
+        EXPECT_EQ_STRING(expect, json2, length);\
+        lobajson.LobaFree(&v);\
+        lobajson.LobaFree(&p);\
+        free(json2);\
+    } while(0)
+
+static void test_patch_merge() {
+  TEST_MERGE_PATCH("{\"a\":\"b\"}", "{\"a\":\"c\"}", "{\"a\":\"c\"}");
+  TEST_MERGE_PATCH("{\"a\":\"b\"}", "{\"b\":\"c\"}", "{\"a\":\"b\",\"b\":\"c\"}");
+  TEST_MERGE_PATCH("{\"a\":\"b\",\"b\":\"c\"}", "{\"a\":null}", "{\"b\":\"c\"}");
+  TEST_MERGE_PATCH("{\"a\":[\"b\"]}", "{\"a\":\"c\"}", "{\"a\":\"c\"}");
+  TEST_MERGE_PATCH("{\"a\":{\"b\":\"c\"}}", "{\"a\":{\"b\":\"d\",\"c\":null}}", "{\"a\":{\"b\":\"d\"}}");
+  TEST_MERGE_PATCH("[1,2]", "{\"a\":{\"bb\":{\"ccc\":null}}}", "{\"a\":{\"bb\":{}}}");
+  TEST_MERGE_PATCH("{\"e\":null}", "{\"a\":1}", "{\"e\":null,\"a\":1}");
+  TEST_MERGE_PATCH("{\"a\":\"foo\"}", "\"bar\"", "\"bar\"");
+}
+
+// diff 的结果作用到 a 上必须得到 b
+#define TEST_DIFF(json1, json2, count)\
+    do {\
+        LobaValue a, b, p;\
+        LobaJson lobajson;\
+        LobaPatch lobapatch;\
+        LobaInit(&a);\
+        LobaInit(&b);\
+        LobaInit(&p);\
+        EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&a, json1));\
+        EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&b, json2));\
+        lobapatch.LobaDiff(&a, &b, &p);\
+        EXPECT_EQ_SIZE_T(count, lobajson.LobaGetArraySize(&p));\
+        EXPECT_EQ_INT(lobaPatchOk, lobapatch.LobaApplyPatch(&a, &p));\
+        EXPECT_TRUE(lobajson.LobaIsEqual(&a, &b));\
+        lobajson.LobaFree(&a);\
+        lobajson.LobaFree(&b);\
+        lobajson.LobaFree(&p);\
+    } while(0)
+
+static void test_patch_diff() {
+  TEST_DIFF("{\"a\":1}", "{\"a\":1}", 0);
+  TEST_DIFF("{\"a\":1,\"b\":2}", "{\"b\":2,\"a\":1}", 0);
+  TEST_DIFF("1", "\"x\"", 1);
+  TEST_DIFF("{\"a\":1,\"b\":{\"c\":[1,2]}}", "{\"b\":{\"c\":[1,2,3]},\"d\":null}", 3);
+  TEST_DIFF("{\"a/b\":1,\"~\":2}", "{\"a/b\":2,\"~\":3}", 2);
+  TEST_DIFF("[1,2,3,4,5]", "[1,3,4,6,5]", 2);
+  TEST_DIFF("[1,2,3]", "[]", 3);
+  TEST_DIFF("[]", "[1,2,3]", 3);
+  TEST_DIFF("[{\"id\":1,\"v\":[1]},{\"id\":2,\"v\":[2]}]", "[{\"id\":1,\"v\":[1]},{\"id\":2,\"v\":[3]}]", 1);
+  TEST_DIFF("[[1],[2],[3]]", "[[0],[1],[2],[3]]", 1);
+  TEST_DIFF("[{\"a\":1,\"b\":2}]", "[{\"b\":2,\"a\":1}]", 0);
+  TEST_DIFF("{\"a\":[1,{\"x\":1}],\"b\":2}", "{\"b\":2,\"a\":[1,{\"x\":1.0}]}", 0);
+
+  // 相等的大对象按键索引配对, 成员顺序相反也不会逐个线性查找
+  std::string big1 = "{", big2 = "{";
+  for (int i = 0; i < 5000; i++) {
+    big1 += (i ? ",\"k" : "\"k") + std::to_string(i) + "\":{\"v\":" + std::to_string(i) + "}";
+    big2 += (i ? ",\"k" : "\"k") + std::to_string(4999 - i) + "\":{\"v\":" + std::to_string(4999 - i) + "}";
+  }
+  big1 += "}";
+  big2 += "}";
+  TEST_DIFF(big1.c_str(), big2.c_str(), 0);
+  big2.replace(big2.size() - 3, 1, "1");
+  TEST_DIFF(big1.c_str(), big2.c_str(), 1);
+}
+
+// 压实过的树经由做压实的 LobaJson 打补丁, 回滚和 merge patch 也一样
+static void test_patch_compact() {
+  LobaMallocAllocator malloc_allocator;
+  LobaCountingAllocator counting(&malloc_allocator);
+  LobaJson lobajson;
+  LobaPatch lobapatch(&lobajson);
+  LobaValue v, p;
+  size_t length;
+  LobaInit(&v);
+  LobaInit(&p);
+  lobajson.LobaSetAllocator(&counting);
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&v, "{\"a\":[1,\"x\"],\"b\":{\"c\":\"d\"}}"));
+  lobajson.LobaCompact(&v);
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&p, "[{\"op\":\"add\",\"path\":\"/a/0\",\"value\":0},"
+                                                   "{\"op\":\"remove\",\"path\":\"/b/c\"},"
+                                                   "{\"op\":\"test\",\"path\":\"/a/0\",\"value\":1}]"));
+  EXPECT_EQ_INT(lobaPatchTestFailed, lobapatch.LobaApplyPatch(&v, &p));
+  lobajson.LobaFree(&p);
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&p, "[{\"op\":\"add\",\"path\":\"/e\",\"value\":2},"
+                                                   "{\"op\":\"move\",\"from\":\"/b/c\",\"path\":\"/a/-\"},"
+                                                   "{\"op\":\"replace\",\"path\":\"/a/0\",\"value\":\"y\"}]"));
+  EXPECT_EQ_INT(lobaPatchOk, lobapatch.LobaApplyPatch(&v, &p));
+  lobajson.LobaFree(&p);
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&p, "{\"b\":null,\"f\":{\"g\":1}}"));
+  lobapatch.LobaApplyMergePatch(&v, &p);
+  lobajson.LobaFree(&p);
+  char *json = lobajson.LobaStringify(&v, &length);
+  EXPECT_EQ_STRING("{\"a\":[\"y\",\"x\",\"d\"],\"e\":2,\"f\":{\"g\":1}}", json, length);
+  lobajson.LobaDealloc(json, length + 1);
+  lobajson.LobaFree(&v);
+  EXPECT_EQ_SIZE_T(0, counting.LobaGetLiveBytes());
+}
+
+static void test_patch() {
+  test_patch_apply();
+  test_patch_rollback();
+  test_patch_large_object();
+  test_patch_merge();
+  test_patch_diff();
+  test_patch_compact();
+}
+
+// JSON -> 二进制 -> JSON 必须得到同样的文本
+#define TEST_BINARY_ROUNDTRIP(json)\
+    do {\
+        LobaValue v, v2;\
+        LobaBinary lobabinary;\
+        size_t length;\
+        LobaInit(&v);\
+        EXPECT_EQ_INT(lobaParseOk, lobabinary.LobaParse(&v, json));\
+        char *bin = lobabinary.LobaEncodeCbor(&v, &length);\
+        EXPECT_EQ_INT(lobaBinaryOk, lobabinary.LobaDecodeCbor(&v2, bin, length));\
+        EXPECT_TRUE(lobabinary.LobaIsEqual(&v, &v2));\
+        lobabinary.LobaFree(&v2);\
+        free(bin);\
+        bin = lobabinary.LobaEncodeMsgPack(&v, &length);\
+        EXPECT_EQ_INT(lobaBinaryOk, lobabinary.LobaDecodeMsgPack(&v2, bin, length));\
+        EXPECT_TRUE(lobabinary.LobaIsEqual(&v, &v2));\
+        char *json2 = lobabinary.LobaStringify(&v2, &length);\
+        EXPECT_EQ_STRING(json, json2, length);\
+        lobabinary.LobaFree(&v2);\
+        lobabinary.LobaFree(&v);\
+        free(bin);\
+        free(json2);\
+    } while(0)
+
+#define TEST_CBOR(json, hex)\
+    do {\
+        LobaValue v;\
+        LobaBinary lobabinary;\
+        size_t length;\
+        LobaInit(&v);\
+        EXPECT_EQ_INT(lobaParseOk, lobabinary.LobaParse(&v, json));\
+        char *bin = lobabinary.LobaEncodeCbor(&v, &length);\
+        EXPECT_EQ_STRING(hex, bin, length);\
+        lobabinary.LobaFree(&v);\
+        free(bin);\
+    } while(0)
+
+#define TEST_MSGPACK(json, hex)\
+    do {\
+        LobaValue v;\
+        LobaBinary lobabinary;\
+        size_t length;\
+        LobaInit(&v);\
+        EXPECT_EQ_INT(lobaParseOk, lobabinary.LobaParse(&v, json));\
+        char *bin = lobabinary.LobaEncodeMsgPack(&v, &length);\
+        EXPECT_EQ_STRING(hex, bin, length);\
+        lobabinary.LobaFree(&v);\
+        free(bin);\
+    } while(0)
+
+#define TEST_BINARY_ERROR(error, decode, bin)\
+    do {\
+        LobaValue v;\
+        LobaBinary lobabinary;\
+        v.type = lobaTestDefaultType;\
+        EXPECT_EQ_INT(error, lobabinary.decode(&v, bin, sizeof(bin) - 1));\
+        EXPECT_EQ_INT(lobaNull, lobabinary.LobaGetType(&v));\
+    } while(0)
+
+static void test_binary_encode() {
+  TEST_CBOR("0", "\x00");
+  TEST_CBOR("1000000", "\x1a\x00\x0f\x42\x40");
+  TEST_CBOR("-1000", "\x39\x03\xe7");
+  TEST_CBOR("1.1", "\xfb\x3f\xf1\x99\x99\x99\x99\x99\x9a");
+  TEST_CBOR("\"IETF\"", "\x64IETF");
+  TEST_CBOR("[1,[2,3],[4,5]]", "\x83\x01\x82\x02\x03\x82\x04\x05");
+  TEST_CBOR("{\"a\":1,\"b\":[2,3]}", "\xa2\x61\x61\x01\x61\x62\x82\x02\x03");
+  TEST_CBOR("[false,true,null]", "\x83\xf4\xf5\xf6");
+  TEST_MSGPACK("{\"compact\":true,\"schema\":0}", "\x82\xa7" "compact\xc3\xa6schema\x00");
+  TEST_MSGPACK("[-1,-33,200,-129,65536]", "\x95\xff\xd0\xdf\xcc\xc8\xd1\xff\x7f\xce\x00\x01\x00\x00");
+  TEST_MSGPACK("0.5", "\xca\x3f\x00\x00\x00");
+  // 超出 float 范围的 double 不能先转 float 比较
+  TEST_CBOR("1e300", "\xfb\x7e\x37\xe4\x3c\x88\x00\x75\x9c");
+  TEST_MSGPACK("-1e39", "\xcb\xc8\x07\x82\x87\xf4\x9c\x4a\x1d");
+}
+
+static void test_binary_decode() {
+  LobaBinary lobabinary;
+  LobaValue v;
+  size_t length;
+  // 不定长数组, 字符串分块, 半精度浮点与 tag
+  const char cbor[] = "\x9f\x01\x82\x02\x03\x7f\x62" "ab\x61" "c\xff\xf9\x3e\x00\xc1\x1a\x51\x4b\x67\xb0\xff";
+  EXPECT_EQ_INT(lobaBinaryOk, lobabinary.LobaDecodeCbor(&v, cbor, sizeof(cbor) - 1));
+  char *json = lobabinary.LobaStringify(&v, &length);
+  EXPECT_EQ_STRING("[1,[2,3],\"abc\",1.5,1363896240]", json, length);
+  free(json);
+  lobabinary.LobaFree(&v);
+  const char map[] = "\xbf\x63" "Fun\xf5\x63" "Amt\x21\xff";
+  EXPECT_EQ_INT(lobaBinaryOk, lobabinary.LobaDecodeCbor(&v, map, sizeof(map) - 1));
+  json = lobabinary.LobaStringify(&v, &length);
+  EXPECT_EQ_STRING("{\"Fun\":true,\"Amt\":-2}", json, length);
+  free(json);
+  lobabinary.LobaFree(&v);
+
+  TEST_BINARY_ERROR(lobaBinaryTruncated, LobaDecodeCbor, "");
+  TEST_BINARY_ERROR(lobaBinaryTruncated, LobaDecodeCbor, "\x83\x01\x02");
+  TEST_BINARY_ERROR(lobaBinaryTruncated, LobaDecodeCbor, "\x9b\xff\xff\xff\xff\xff\xff\xff\xff");
+  TEST_BINARY_ERROR(lobaBinaryTruncated, LobaDecodeCbor, "\x9f\x01\x64" "abc");
+  TEST_BINARY_ERROR(lobaBinaryInvalidKey, LobaDecodeCbor, "\xa1\x01\x02");
+  TEST_BINARY_ERROR(lobaBinaryInvalidKey, LobaDecodeCbor, "\xbf\x61" "a\x01\x02\x03\xff");
+  TEST_BINARY_ERROR(lobaBinaryInvalidType, LobaDecodeCbor, "\x1c");
+  TEST_BINARY_ERROR(lobaBinaryRootNotSingular, LobaDecodeCbor, "\x01\x02");
+  TEST_BINARY_ERROR(lobaBinaryTruncated, LobaDecodeMsgPack, "\x92\xc0");
+  TEST_BINARY_ERROR(lobaBinaryTruncated, LobaDecodeMsgPack, "\xdb\xff\xff\xff\xff");
+  TEST_BINARY_ERROR(lobaBinaryInvalidKey, LobaDecodeMsgPack, "\x81\x01\x02");
+  TEST_BINARY_ERROR(lobaBinaryInvalidType, LobaDecodeMsgPack, "\xc1");
+  TEST_BINARY_ERROR(lobaBinaryRootNotSingular, LobaDecodeMsgPack, "\xc0\xc0");
+  TEST_BINARY_ERROR(lobaBinaryInvalidUtf8, LobaDecodeCbor, "\x62\xc0\x80");
+  TEST_BINARY_ERROR(lobaBinaryInvalidUtf8, LobaDecodeCbor, "\x81\x63" "a\xe4\xb8");
+  TEST_BINARY_ERROR(lobaBinaryInvalidUtf8, LobaDecodeCbor, "\x7f\x61" "a\x61\xff\xff");
+  TEST_BINARY_ERROR(lobaBinaryInvalidUtf8, LobaDecodeMsgPack, "\xa2\xed\xa0");
+  TEST_BINARY_ERROR(lobaBinaryInvalidUtf8, LobaDecodeMsgPack, "\x81\xa1\xff\x01");
+  TEST_BINARY_ERROR(lobaBinaryInvalidType, LobaDecodeCbor, "\x5f\x61" "a\xff");
+
+  // 文本串里的 '"', '\\', 控制字符与多字节序列照常解码; 字节串转成无填充的 base64url
+  const char text[] = "\x84\x66" "a\"\\\x00\n\xc3\x63\xe4\xb8\xad\x43\xfb\xff\xbf\x5f\x41\xfb\x42\xff\xbf\xff";
+  EXPECT_EQ_INT(lobaBinaryInvalidUtf8, lobabinary.LobaDecodeCbor(&v, text, sizeof(text) - 1));
+  const char bytes[] = "\x84\x67" "a\"\\\x00\n\xc3\xa9\x63\xe4\xb8\xad\x43\xfb\xff\xbf\x5f\x41\xfb\x42\xff\xbf\xff";
+  EXPECT_EQ_INT(lobaBinaryOk, lobabinary.LobaDecodeCbor(&v, bytes, sizeof(bytes) - 1));
+  json = lobabinary.LobaStringify(&v, &length);
+  EXPECT_EQ_STRING("[\"a\\\"\\\\\\u0000\\n\xc3\xa9\",\"\xe4\xb8\xad\",\"-_-_\",\"-_-_\"]", json, length);
+  free(json);
+  lobabinary.LobaFree(&v);
+  const char bin[] = "\x93\xc4\x00\xc4\x01\xff\xc5\x00\x02\x00\x10";
+  EXPECT_EQ_INT(lobaBinaryOk, lobabinary.LobaDecodeMsgPack(&v, bin, sizeof(bin) - 1));
+  json = lobabinary.LobaStringify(&v, &length);
+  EXPECT_EQ_STRING("[\"\",\"_w\",\"ABA\"]", json, length);
+  free(json);
+  lobabinary.LobaFree(&v);
+
+  // 嵌套上限; 连续的 tag 不占层数
+  std::string deep(LobaBinaryMaxDepth, '\x81');
+  deep += '\x01';
+  EXPECT_EQ_INT(lobaBinaryOk, lobabinary.LobaDecodeCbor(&v, deep.data(), deep.size()));
+  lobabinary.LobaFree(&v);
+  deep = "\x81" + deep;
+  EXPECT_EQ_INT(lobaBinaryTooDeep, lobabinary.LobaDecodeCbor(&v, deep.data(), deep.size()));
+  deep = std::string(2000000, '\x9f');
+  EXPECT_EQ_INT(lobaBinaryTooDeep, lobabinary.LobaDecodeCbor(&v, deep.data(), deep.size()));
+  deep = std::string(2000000, '\x91');
+  EXPECT_EQ_INT(lobaBinaryTooDeep, lobabinary.LobaDecodeMsgPack(&v, deep.data(), deep.size()));
+  deep = std::string(2000000, '\xc1') + '\x01';
+  EXPECT_EQ_INT(lobaBinaryOk, lobabinary.LobaDecodeCbor(&v, deep.data(), deep.size()));
+  EXPECT_EQ_DOUBLE(1.0, lobabinary.LobaGetNumber(&v));
+  LobaParseLimits limits = {};
+  limits.max_depth = 2;
+  lobabinary.LobaSetParseLimits(&limits);
+  EXPECT_EQ_INT(lobaBinaryOk, lobabinary.LobaDecodeMsgPack(&v, "\x91\x81\xa1" "a\x01", 5));
+  lobabinary.LobaFree(&v);
+  EXPECT_EQ_INT(lobaBinaryTooDeep, lobabinary.LobaDecodeMsgPack(&v, "\x91\x91\x91\x01", 4));
+  EXPECT_EQ_INT(lobaBinaryTooDeep, lobabinary.LobaDecodeCbor(&v, "\x81\x9f\x81\x01\xff", 5));
+}
+
+static void test_binary_roundtrip() {
+  TEST_BINARY_ROUNDTRIP("null");
+  TEST_BINARY_ROUNDTRIP("-0");
+  TEST_BINARY_ROUNDTRIP("1.0000000000000002");
+  TEST_BINARY_ROUNDTRIP("-9.2233720368547758e+18");
+  TEST_BINARY_ROUNDTRIP("1.7976931348623157e+308");
+  TEST_BINARY_ROUNDTRIP("4294967296");
+  TEST_BINARY_ROUNDTRIP("\"Hello\\u0000World\"");
+  TEST_BINARY_ROUNDTRIP("[null,false,true,123,\"abc\",[1,2,3],{}]");
+  TEST_BINARY_ROUNDTRIP(
+      "{\"n\":null,\"f\":false,\"t\":true,\"i\":-123,\"s\":\"abc\",\"a\":[1,2,3],\"o\":{\"1\":1,\"2\":2,\"3\":3}}");
+  std::string big = "[";
+  for (int i = 0; i < 70000; i++) {
+    big += (i ? ",\"" : "\"") + std::string(i % 300, 'x') + "\"";
+  }
+  big += "]";
+  LobaBinary lobabinary;
+  LobaValue v, v2;
+  LobaInit(&v);
+  EXPECT_EQ_INT(lobaParseOk, lobabinary.LobaParse(&v, big.c_str()));
+  size_t length;
+  char *bin = lobabinary.LobaEncodeCbor(&v, &length);
+  EXPECT_EQ_INT(lobaBinaryOk, lobabinary.LobaDecodeCbor(&v2, bin, length));
+  EXPECT_TRUE(lobabinary.LobaIsEqual(&v, &v2));
+  lobabinary.LobaFree(&v2);
+  free(bin);
+  bin = lobabinary.LobaEncodeMsgPack(&v, &length);
+  EXPECT_EQ_INT(lobaBinaryOk, lobabinary.LobaDecodeMsgPack(&v2, bin, length));
+  EXPECT_TRUE(lobabinary.LobaIsEqual(&v, &v2));
+  lobabinary.LobaFree(&v2);
+  free(bin);
+  lobabinary.LobaFree(&v);
+}
+
+static void test_binary() {
+  test_binary_encode();
+  test_binary_decode();
+  test_binary_roundtrip();
+}
+
+static void test_snapshot() {
+  const char *path = "lobajson_test.snapshot";
+  const char *json =
+      "{\"n\":null,\"f\":false,\"t\":true,\"i\":123,\"s\":\"abc\",\"a\":[1,2,3],\"o\":{\"1\":1,\"2\":2,\"3\":3},\"e\":[]}";
+  LobaJson lobajson;
+  LobaSnapshot lobasnapshot;
+  LobaValue v, v2;
+  LobaInit(&v);
+  LobaInit(&v2);
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&v, json));
+  EXPECT_EQ_INT(lobaSnapshotOk, lobasnapshot.LobaSaveSnapshot(&v, path));
+  EXPECT_EQ_INT(lobaSnapshotOk, lobasnapshot.LobaLoadSnapshot(path));
+  const LobaSnapNode *root = lobasnapshot.LobaGetRoot();
+  EXPECT_EQ_INT(lobaObject, lobasnapshot.LobaGetType(root));
+  EXPECT_EQ_SIZE_T(8, lobasnapshot.LobaGetObjectSize(root));
+  EXPECT_EQ_STRING("t", lobasnapshot.LobaGetObjectKey(root, 2), lobasnapshot.LobaGetObjectKeyLength(root, 2));
+  EXPECT_TRUE(lobasnapshot.LobaGetBoolean(lobasnapshot.LobaGetObjectValue(root, 2)));
+  const LobaSnapNode *s = lobasnapshot.LobaFindObjectValue(root, "s", 1);
+  EXPECT_EQ_STRING("abc", lobasnapshot.LobaGetString(s), lobasnapshot.LobaGetStringLength(s));
+  EXPECT_EQ_INT('\0', lobasnapshot.LobaGetString(s)[3]);
+  const LobaSnapNode *a = lobasnapshot.LobaFindObjectValue(root, "a", 1);
+  EXPECT_EQ_SIZE_T(3, lobasnapshot.LobaGetArraySize(a));
+  EXPECT_EQ_DOUBLE(3.0, lobasnapshot.LobaGetNumber(lobasnapshot.LobaGetArrayElement(a, 2)));
+  EXPECT_TRUE(lobasnapshot.LobaFindObjectValue(root, "x", 1) == nullptr);
+  lobasnapshot.LobaSnapshotToValue(root, &v2);
+  EXPECT_TRUE(lobajson.LobaIsEqual(&v, &v2));
+  lobajson.LobaFree(&v2);
+  lobasnapshot.LobaUnloadSnapshot();
+
+  // 覆盖写经由临时文件, 成功后不留下 path.tmp; 写不出临时文件时原文件不动
+  std::string tmp = std::string(path) + ".tmp";
+  EXPECT_EQ_INT(lobaSnapshotOk, lobasnapshot.LobaSaveSnapshot(&v, path));
+  EXPECT_TRUE(access(tmp.c_str(), F_OK) != 0);
+  EXPECT_EQ_INT(lobaSnapshotIoError, lobasnapshot.LobaSaveSnapshot(&v, "no_such_dir/lobajson_test.snapshot"));
+  EXPECT_EQ_INT(lobaSnapshotOk, lobasnapshot.LobaLoadSnapshot(path));
+  lobasnapshot.LobaUnloadSnapshot();
+
+  // 改坏根节点: 偏移越界、指回文件头形成环、长度溢出、未知类型都在加载时拒绝
+  const uint64_t bad[][2] = {
+      {offsetof(LobaSnapNode, u), 1u << 20},
+      {offsetof(LobaSnapNode, u), 0},
+      {offsetof(LobaSnapNode, size), UINT64_MAX / sizeof(LobaSnapMember)},
+      {offsetof(LobaSnapNode, type), 99}};
+  for (const uint64_t *b : bad) {
+    EXPECT_EQ_INT(lobaSnapshotOk, lobasnapshot.LobaSaveSnapshot(&v, path));
+    FILE *fp = fopen(path, "r+b");
+    fseek(fp, static_cast<long>(offsetof(LobaSnapHeader, root) + b[0]), SEEK_SET);
+    if (b[0] == offsetof(LobaSnapNode, type)) {
+      uint32_t type = static_cast<uint32_t>(b[1]);
+      fwrite(&type, sizeof(type), 1, fp);
+    } else {
+      fwrite(&b[1], sizeof(b[1]), 1, fp);
+    }
+    fclose(fp);
+    EXPECT_EQ_INT(lobaSnapshotInvalidFormat, lobasnapshot.LobaLoadSnapshot(path));
+  }
+  // 字符串结尾的 '\0' 被覆盖
+  LobaValue str;
+  LobaInit(&str);
+  lobajson.LobaSetString(&str, "abc", 3);
+  EXPECT_EQ_INT(lobaSnapshotOk, lobasnapshot.LobaSaveSnapshot(&str, path));
+  FILE *fs = fopen(path, "r+b");
+  fseek(fs, static_cast<long>(sizeof(LobaSnapHeader) + 3), SEEK_SET);
+  fputc('x', fs);
+  fclose(fs);
+  EXPECT_EQ_INT(lobaSnapshotInvalidFormat, lobasnapshot.LobaLoadSnapshot(path));
+  lobajson.LobaFree(&str);
+
+  // 截断后的文件头长度对不上
+  EXPECT_EQ_INT(lobaSnapshotOk, lobasnapshot.LobaSaveSnapshot(&v, path));
+  FILE *fp = fopen(path, "r+b");
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  fclose(fp);
+  EXPECT_EQ_INT(0, truncate(path, size - 1));
+  EXPECT_EQ_INT(lobaSnapshotInvalidFormat, lobasnapshot.LobaLoadSnapshot(path));
+  remove(path);
+  EXPECT_EQ_INT(lobaSnapshotIoError, lobasnapshot.LobaLoadSnapshot(path));
+  lobajson.LobaFree(&v);
+}
+
+// 解析、拷贝、patch、diff、编解码和出错路径都走同一个 allocator, 结束后在用字节数必须归零
+static void test_allocator_roundtrip(LobaAllocator *base) {
+  const char *json =
+      "{\"n\":null,\"f\":false,\"t\":true,\"i\":123,\"s\":\"abc\",\"a\":[1,2,3],\"o\":{\"1\":1,\"2\":2,\"3\":3},\"e\":[]}";
+  LobaCountingAllocator counting(base);
+  LobaBinary lobajson;
+  LobaPatch lobapatch;
+  lobajson.LobaSetAllocator(&counting);
+  lobapatch.LobaSetAllocator(&counting);
+  EXPECT_TRUE(lobajson.LobaGetAllocator() == &counting);
+  LobaValue v, v2, p;
+  LobaInit(&v);
+  LobaInit(&v2);
+  LobaInit(&p);
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&v, json));
+  EXPECT_EQ_INT(lobaParseMissCommaOrCurlyBracket, lobajson.LobaParse(&v2, "{\"a\":[1,\"x\"],\"b\":1 2}"));
+  EXPECT_EQ_INT(lobaParseMissCommaOrSquareBracket, lobajson.LobaParse(&v2, "[\"a\",{\"b\":[]} 1]"));
+  lobajson.LobaCopy(&v2, &v);
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&p,
+      "[{\"op\":\"add\",\"path\":\"/a/1\",\"value\":\"x\"},{\"op\":\"remove\",\"path\":\"/o/2\"},"
+      "{\"op\":\"remove\",\"path\":\"/a/0\"},{\"op\":\"add\",\"path\":\"/k\",\"value\":{\"x\":[1]}},"
+      "{\"op\":\"test\",\"path\":\"/i\",\"value\":0}]"));
+  EXPECT_EQ_INT(lobaPatchTestFailed, lobapatch.LobaApplyPatch(&v2, &p));
+  lobajson.LobaFree(&p);
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&p, "{\"o\":{\"1\":null,\"3\":null},\"a\":[4],\"z\":\"z\"}"));
+  lobapatch.LobaApplyMergePatch(&v2, &p);
+  lobajson.LobaFree(&p);
+  lobapatch.LobaDiff(&v, &v2, &p);
+  lobapatch.LobaApplyPatch(&v, &p);
+  EXPECT_TRUE(lobajson.LobaIsEqual(&v, &v2));
+  size_t length;
+  char *s = lobajson.LobaStringify(&v, &length);
+  EXPECT_EQ_INT('\0', s[length]);
+  lobajson.LobaDealloc(s, length + 1);
+  char *cbor = lobajson.LobaEncodeCbor(&v, &length);
+  lobajson.LobaFree(&v2);
+  EXPECT_EQ_INT(lobaBinaryOk, lobajson.LobaDecodeCbor(&v2, cbor, length));
+  EXPECT_TRUE(lobajson.LobaIsEqual(&v, &v2));
+  lobajson.LobaFree(&v2);
+  EXPECT_EQ_INT(lobaBinaryTruncated, lobajson.LobaDecodeCbor(&v2, cbor, length - 1));
+  lobajson.LobaDealloc(cbor, length);
+  lobajson.LobaFree(&p);
+  lobajson.LobaFree(&v2);
+  lobajson.LobaFree(&v);
+  EXPECT_TRUE(counting.LobaGetAllocs() > 0);
+  EXPECT_EQ_SIZE_T(0, counting.LobaGetLiveBytes());
+}
+
+static void test_allocator() {
+  LobaMallocAllocator malloc_allocator;
+  LobaSlabAllocator slab;
+  LobaArenaAllocator arena;
+  test_allocator_roundtrip(&malloc_allocator);
+  test_allocator_roundtrip(&slab);
+  test_allocator_roundtrip(&arena);
+
+  // 大于 LobaSlabMaxSize 的字符串走 malloc
+  std::string big = "[\"" + std::string(4096, 'x') + "\",\"y\"]";
+  LobaJson lobajson;
+  LobaValue v;
+  LobaInit(&v);
+  lobajson.LobaSetAllocator(&slab);
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&v, big.c_str()));
+  EXPECT_EQ_SIZE_T(4096, lobajson.LobaGetStringLength(lobajson.LobaGetArrayElement(&v, 0)));
+  lobajson.LobaFree(&v);
+
+  // 重置后的 arena 复用已有的块
+  arena.LobaReset();
+  lobajson.LobaSetAllocator(&arena);
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&v, "{\"a\":[1,2,{\"b\":\"c\"}]}"));
+  size_t reserved = arena.LobaGetReserved();
+  EXPECT_TRUE(arena.LobaGetUsed() > 0);
+  arena.LobaReset();
+  EXPECT_EQ_SIZE_T(0, arena.LobaGetUsed());
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&v, "{\"a\":[1,2,{\"b\":\"c\"}]}"));
+  EXPECT_EQ_SIZE_T(reserved, arena.LobaGetReserved());
+}
+
+// 字符串里故意放进像元素边界的 "},{" 和 ",[", 让部分切分点猜错, 结果必须与单线程一致
+static std::string make_parallel_input(size_t count) {
+  std::string json = "[";
+  char buffer[160];
+  for (size_t i = 0; i < count; i++) {
+    snprintf(buffer, sizeof(buffer),
+             "%s{\"id\":%zu,\"s\":\"a},{\\\"x\\\":[1,2],\\\"y\\\":\\\"z\\\"},{\",\"n\":[%zu,[true,null],{\"k\":\"v, w\"}]}",
+             i ? ",\n " : "", i, i * 3);
+    json += buffer;
+    if (i % 7 == 0) {
+      json += ", 1.5e3, \",\", [[],{}]";
+    }
+  }
+  json += "]";
+  return json;
+}
+
+static void test_parse_parallel() {
+  std::string json = make_parallel_input(40000);
+  EXPECT_TRUE(json.size() > 4 * LobaParallelMinChunk);
+  LobaJson serial, parallel;
+  LobaValue v, v2;
+  LobaInit(&v);
+  LobaInit(&v2);
+  parallel.LobaSetParseThreads(4);
+  EXPECT_EQ_INT(lobaParseOk, serial.LobaParse(&v, json.c_str()));
+  EXPECT_EQ_INT(lobaParseOk, parallel.LobaParse(&v2, json.c_str()));
+  EXPECT_EQ_SIZE_T(serial.LobaGetArraySize(&v), parallel.LobaGetArraySize(&v2));
+  EXPECT_TRUE(serial.LobaIsEqual(&v, &v2));
+  parallel.LobaFree(&v2);
+  // 切块数不整除时也一样
+  parallel.LobaSetParseThreads(3);
+  EXPECT_EQ_INT(lobaParseOk, parallel.LobaParse(&v2, json.c_str()));
+  EXPECT_TRUE(serial.LobaIsEqual(&v, &v2));
+  parallel.LobaFree(&v2);
+  serial.LobaFree(&v);
+
+  // 出错时与单线程的错误码相同
+  std::string bad = json;
+  bad[bad.size() * 3 / 4] = '}';
+  int expect = serial.LobaParse(&v, bad.c_str());
+  EXPECT_TRUE(expect != lobaParseOk);
+  EXPECT_EQ_INT(expect, parallel.LobaParse(&v2, bad.c_str()));
+  EXPECT_EQ_INT(lobaParseRootNotSingular, parallel.LobaParse(&v2, (json + " 1").c_str()));
+  EXPECT_EQ_INT(lobaParseMissCommaOrSquareBracket,
+                parallel.LobaParse(&v2, json.substr(0, json.size() - 1).c_str()));
+
+  // 不是线程安全的 allocator 退回单线程
+  LobaSlabAllocator slab;
+  parallel.LobaSetAllocator(&slab);
+  EXPECT_EQ_INT(lobaParseOk, parallel.LobaParse(&v2, json.c_str()));
+  EXPECT_EQ_SIZE_T(40000 + 3 * (40000 / 7 + 1), parallel.LobaGetArraySize(&v2));
+  parallel.LobaFree(&v2);
+}
+
+static void test_stringify_parallel() {
+  std::string records = make_parallel_input(20000);
+  // 根对象只有一个重孩子时往里走, 再在数组上切分
+  std::string wrapped = "{\"meta\":{\"n\":1},\"data\":" + records + ",\"tail\":[1,2,3]}";
+  const char *inputs[] = {records.c_str(), wrapped.c_str()};
+  for (const char *json : inputs) {
+    LobaJson serial, parallel;
+    LobaValue v;
+    LobaInit(&v);
+    EXPECT_EQ_INT(lobaParseOk, serial.LobaParse(&v, json));
+    size_t length, length2;
+    char *expect = serial.LobaStringify(&v, &length);
+    for (unsigned threads : {2u, 3u, 0u}) {
+      parallel.LobaSetStringifyThreads(threads);
+      char *actual = parallel.LobaStringify(&v, &length2);
+      EXPECT_EQ_SIZE_T(length, length2);
+      EXPECT_TRUE(length == length2 && memcmp(expect, actual, length + 1) == 0);
+      free(actual);
+    }
+    free(expect);
+    serial.LobaFree(&v);
+  }
+}
+
+struct ReflectItem {
+  std::string sku;
+  int qty = 0;
+  bool gift = false;
+};
+LOBA_REFLECT(ReflectItem, sku, qty, gift)
+
+struct ReflectOrder {
+  long long id = 0;
+  double price = 0;
+  unsigned char flags = 0;
+  std::string note = "none";
+  std::vector<ReflectItem> items;
+  std::vector<std::vector<int>> matrix;
+};
+LOBA_REFLECT(ReflectOrder, id, price, flags, note, items, matrix)
+
+struct ReflectPoint {
+  float x = 0;
+  double y = 0;
+};
+LOBA_REFLECT(ReflectPoint, x, y)
+
+static void test_reflect() {
+  LobaMallocAllocator malloc_allocator;
+  LobaCountingAllocator counting(&malloc_allocator);
+  LobaReflect lobareflect;
+  lobareflect.LobaSetAllocator(&counting);
+  ReflectOrder order;
+  // 未知的键整体跳过, 缺少的 note 保持默认值
+  EXPECT_EQ_INT(lobaParseOk, lobareflect.LobaParseStruct(&order,
+      " {\"id\":9007199254740991,\"extra\":{\"a\":[1,{\"b\":null}],\"c\":\"\\u00e9\"},\"price\":12.5,"
+      "\"items\":[{\"sku\":\"a\\\"b\",\"qty\":2},{\"qty\":-1,\"gift\":true,\"sku\":\"c\"}],"
+      "\"flags\":255,\"matrix\":[[],[1,2],[3]]} "));
+  EXPECT_EQ_SIZE_T(0, counting.LobaGetAllocs());
+  EXPECT_EQ_SIZE_T(0, counting.LobaGetLiveBytes());
+  EXPECT_TRUE(order.id == 9007199254740991LL);
+  EXPECT_EQ_DOUBLE(12.5, order.price);
+  EXPECT_EQ_INT(255, order.flags);
+  EXPECT_TRUE(order.note == "none");
+  EXPECT_EQ_SIZE_T(2, order.items.size());
+  EXPECT_TRUE(order.items[0].sku == "a\"b");
+  EXPECT_EQ_INT(2, order.items[0].qty);
+  EXPECT_FALSE(order.items[0].gift);
+  EXPECT_EQ_INT(-1, order.items[1].qty);
+  EXPECT_TRUE(order.items[1].gift);
+  EXPECT_EQ_SIZE_T(3, order.matrix.size());
+  EXPECT_EQ_SIZE_T(2, order.matrix[1].size());
+
+  size_t length;
+  char *json = lobareflect.LobaStringifyStruct(order, &length);
+  const char expect[] =
+      "{\"id\":9007199254740991,\"price\":12.5,\"flags\":255,\"note\":\"none\","
+      "\"items\":[{\"sku\":\"a\\\"b\",\"qty\":2,\"gift\":false},{\"sku\":\"c\",\"qty\":-1,\"gift\":true}],"
+      "\"matrix\":[[],[1,2],[3]]}";
+  EXPECT_EQ_STRING(expect, json, length);
+  // 输出可以原样读回
+  ReflectOrder order2;
+  EXPECT_EQ_INT(lobaParseOk, lobareflect.LobaParseStruct(&order2, json));
+  EXPECT_EQ_SIZE_T(2, order2.items.size());
+  EXPECT_TRUE(order2.items[1].sku == "c");
+  lobareflect.LobaDealloc(json, length + 1);
+  EXPECT_EQ_SIZE_T(0, counting.LobaGetLiveBytes());
+
+  // null 保持原值
+  EXPECT_EQ_INT(lobaParseOk, lobareflect.LobaParseStruct(&order2, "{\"note\":null,\"items\":null}"));
+  EXPECT_TRUE(order2.note == "none");
+  EXPECT_EQ_SIZE_T(2, order2.items.size());
+
+  ReflectOrder bad;
+  EXPECT_EQ_INT(lobaReflectTypeMismatch, lobareflect.LobaParseStruct(&bad, "{\"id\":\"1\"}"));
+  EXPECT_EQ_INT(lobaReflectTypeMismatch, lobareflect.LobaParseStruct(&bad, "[]"));
+  EXPECT_EQ_INT(lobaReflectTypeMismatch, lobareflect.LobaParseStruct(&bad, "{\"items\":[1]}"));
+  EXPECT_EQ_INT(lobaReflectNumberOutOfRange, lobareflect.LobaParseStruct(&bad, "{\"flags\":256}"));
+  EXPECT_EQ_INT(lobaReflectNumberOutOfRange, lobareflect.LobaParseStruct(&bad, "{\"flags\":-1}"));
+  EXPECT_EQ_INT(lobaReflectNumberOutOfRange, lobareflect.LobaParseStruct(&bad, "{\"id\":1.5}"));
+  EXPECT_EQ_INT(lobaReflectNumberOutOfRange, lobareflect.LobaParseStruct(&bad, "{\"id\":1e19}"));
+  EXPECT_EQ_INT(lobaReflectNumberOutOfRange, lobareflect.LobaParseStruct(&bad, "{\"id\":9223372036854775808}"));
+  EXPECT_EQ_INT(lobaReflectNumberOutOfRange, lobareflect.LobaParseStruct(&bad, "{\"id\":-9223372036854775809}"));
+  EXPECT_EQ_INT(lobaReflectNumberOutOfRange, lobareflect.LobaParseStruct(&bad, "{\"id\":123456789012345678901}"));
+  // 整数不经过 double, 超过 2^53 也是精确的
+  EXPECT_EQ_INT(lobaParseOk, lobareflect.LobaParseStruct(&bad, "{\"id\":9007199254740993}"));
+  EXPECT_TRUE(bad.id == 9007199254740993LL);
+  EXPECT_EQ_INT(lobaParseOk, lobareflect.LobaParseStruct(&bad, "{\"id\":9223372036854775807}"));
+  EXPECT_TRUE(bad.id == INT64_MAX);
+  EXPECT_EQ_INT(lobaParseOk, lobareflect.LobaParseStruct(&bad, "{\"id\":-9223372036854775808,\"flags\":-0}"));
+  EXPECT_TRUE(bad.id == INT64_MIN);
+  EXPECT_EQ_INT(0, bad.flags);
+  EXPECT_EQ_INT(lobaParseOk, lobareflect.LobaParseStruct(&bad, "{\"id\":1.5e3}"));
+  EXPECT_TRUE(bad.id == 1500);
+  EXPECT_EQ_INT(lobaParseInvalidValue, lobareflect.LobaParseStruct(&bad, "{\"id\":?}"));
+  EXPECT_EQ_INT(lobaParseMissColon, lobareflect.LobaParseStruct(&bad, "{\"x\" 1}"));
+  EXPECT_EQ_INT(lobaParseMissCommaOrCurlyBracket, lobareflect.LobaParseStruct(&bad, "{\"x\":[1,2] \"y\"}"));
+  EXPECT_EQ_INT(lobaParseMissCommaOrSquareBracket, lobareflect.LobaParseStruct(&bad, "{\"x\":{\"y\":[1 2]}}"));
+  EXPECT_EQ_INT(lobaParseRootNotSingular, lobareflect.LobaParseStruct(&bad, "{} {}"));
+  ReflectPoint point;
+  EXPECT_EQ_INT(lobaReflectNumberOutOfRange, lobareflect.LobaParseStruct(&point, "{\"x\":1e300}"));
+  EXPECT_EQ_INT(lobaReflectNumberOutOfRange, lobareflect.LobaParseStruct(&point, "{\"x\":-3.5e38}"));
+  EXPECT_EQ_INT(lobaParseOk, lobareflect.LobaParseStruct(&point, "{\"x\":-3.4e38,\"y\":1e300}"));
+  EXPECT_TRUE(point.x == -3.4e38f && point.y == 1e300);
+  EXPECT_EQ_SIZE_T(0, counting.LobaGetLiveBytes());
+}
+
+static void test_key_table() {
+  const char *json = "[{\"id\":1,\"name\":\"a\"},{\"id\":2,\"name\":\"b\"},{\"name\":\"c\",\"id\":3}]";
+  LobaMallocAllocator malloc_allocator;
+  LobaCountingAllocator plain_count(&malloc_allocator), intern_count(&malloc_allocator);
+  LobaKeyTable table;
+  LobaJson plain, lobajson;
+  LobaValue v, v2, v3;
+  LobaInit(&v);
+  LobaInit(&v2);
+  LobaInit(&v3);
+  plain.LobaSetAllocator(&plain_count);
+  lobajson.LobaSetAllocator(&intern_count);
+  lobajson.LobaSetKeyTable(&table);
+  EXPECT_EQ_INT(lobaParseOk, plain.LobaParse(&v3, json));
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&v, json));
+  // 每个成员少一次分配
+  EXPECT_EQ_SIZE_T(plain_count.LobaGetAllocs() - 6, intern_count.LobaGetAllocs());
+  EXPECT_EQ_SIZE_T(2, table.LobaGetSize());
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&v2, "{\"name\":\"x\",\"other\":true}"));
+  EXPECT_EQ_SIZE_T(3, table.LobaGetSize());
+  // 跨文档的同名键是同一个指针
+  const char *name = lobajson.LobaGetObjectKey(lobajson.LobaGetArrayElement(&v, 0), 1);
+  EXPECT_TRUE(name == lobajson.LobaGetObjectKey(&v2, 0));
+  EXPECT_TRUE(name == lobajson.LobaGetObjectKey(lobajson.LobaGetArrayElement(&v, 2), 0));
+  EXPECT_TRUE(name == table.LobaIntern("name", 4));
+  EXPECT_TRUE(table.LobaOwns(name));
+  EXPECT_FALSE(table.LobaOwns(json));
+  EXPECT_EQ_SIZE_T(1, lobajson.LobaFindObjectIndex(lobajson.LobaGetArrayElement(&v, 1), name, 4));
+  EXPECT_TRUE(lobajson.LobaIsEqual(&v, &v3));
+
+  // 拷贝和 patch 在驻留的键与单独分配的键之间混用
+  LobaPatch lobapatch;
+  LobaValue p;
+  LobaInit(&p);
+  lobapatch.LobaSetAllocator(&intern_count);
+  lobapatch.LobaSetKeyTable(&table);
+  plain.LobaFree(&v3);
+  lobajson.LobaCopy(&v3, &v);
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&p,
+      "[{\"op\":\"remove\",\"path\":\"/0/name\"},{\"op\":\"add\",\"path\":\"/1/tag\",\"value\":1}]"));
+  EXPECT_EQ_INT(lobaPatchOk, lobapatch.LobaApplyPatch(&v3, &p));
+  lobajson.LobaFree(&p);
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&p, "{\"other\":null}"));
+  lobapatch.LobaApplyMergePatch(&v2, &p);
+  EXPECT_EQ_SIZE_T(1, lobajson.LobaGetObjectSize(&v2));
+  lobajson.LobaFree(&p);
+  lobajson.LobaFree(&v);
+  lobajson.LobaFree(&v3);
+  lobajson.LobaFree(&v2);
+
+  // 超长的键和表满之后的键照常单独分配
+  LobaKeyTable small(1, 4);
+  lobajson.LobaSetKeyTable(&small);
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&v, "{\"long key\":1,\"a\":2,\"b\":3,\"a\":4}"));
+  EXPECT_EQ_SIZE_T(1, small.LobaGetSize());
+  EXPECT_FALSE(small.LobaOwns(lobajson.LobaGetObjectKey(&v, 0)));
+  EXPECT_TRUE(small.LobaOwns(lobajson.LobaGetObjectKey(&v, 1)));
+  EXPECT_FALSE(small.LobaOwns(lobajson.LobaGetObjectKey(&v, 2)));
+  EXPECT_TRUE(lobajson.LobaGetObjectKey(&v, 1) == lobajson.LobaGetObjectKey(&v, 3));
+  EXPECT_EQ_INT(lobaParseMissColon, lobajson.LobaParse(&v2, "{\"a\":{\"a\" 1}}"));
+  lobajson.LobaFree(&v);
+  EXPECT_EQ_SIZE_T(0, intern_count.LobaGetLiveBytes());
+}
+
+static void test_reader() {
+  LobaMallocAllocator malloc_allocator;
+  LobaCountingAllocator counting(&malloc_allocator);
+  LobaReader reader;
+  reader.LobaSetAllocator(&counting);
+  reader.LobaReset(" {\"n\":null, \"b\":[true,false], \"s\":\"a\\u00e9\\n\", \"e\":\"\", \"x\":-1.5e2, \"o\":{}} ");
+  EXPECT_EQ_INT(lobaTokenStartObject, reader.LobaNext());
+  EXPECT_EQ_SIZE_T(1, reader.LobaGetDepth());
+  EXPECT_EQ_INT(lobaTokenKey, reader.LobaNext());
+  EXPECT_EQ_STRING("n", reader.LobaGetString(), reader.LobaGetStringLength());
+  EXPECT_EQ_INT(lobaTokenNull, reader.LobaNext());
+  EXPECT_EQ_INT(lobaTokenKey, reader.LobaNext());
+  EXPECT_EQ_INT(lobaTokenStartArray, reader.LobaNext());
+  EXPECT_EQ_SIZE_T(2, reader.LobaGetDepth());
+  EXPECT_EQ_INT(lobaTokenTrue, reader.LobaNext());
+  EXPECT_TRUE(reader.LobaGetBoolean());
+  EXPECT_EQ_INT(lobaTokenFalse, reader.LobaNext());
+  EXPECT_FALSE(reader.LobaGetBoolean());
+  EXPECT_EQ_INT(lobaTokenEndArray, reader.LobaNext());
+  EXPECT_EQ_INT(lobaTokenKey, reader.LobaNext());
+  EXPECT_EQ_INT(lobaTokenString, reader.LobaNext());
+  EXPECT_EQ_STRING("a\xC3\xA9\n", reader.LobaGetString(), reader.LobaGetStringLength());
+  EXPECT_EQ_INT('\0', reader.LobaGetString()[reader.LobaGetStringLength()]);
+  EXPECT_EQ_INT(lobaTokenKey, reader.LobaNext());
+  EXPECT_EQ_INT(lobaTokenString, reader.LobaNext());
+  EXPECT_EQ_STRING("", reader.LobaGetString(), reader.LobaGetStringLength());
+  EXPECT_EQ_INT(lobaTokenKey, reader.LobaNext());
+  EXPECT_EQ_INT(lobaTokenNumber, reader.LobaNext());
+  EXPECT_EQ_DOUBLE(-150.0, reader.LobaGetNumber());
+  EXPECT_EQ_INT(lobaTokenKey, reader.LobaNext());
+  EXPECT_EQ_INT(lobaTokenStartObject, reader.LobaNext());
+  EXPECT_EQ_INT(lobaTokenEndObject, reader.LobaNext());
+  EXPECT_EQ_INT(lobaTokenEndObject, reader.LobaNext());
+  EXPECT_EQ_SIZE_T(0, reader.LobaGetDepth());
+  EXPECT_EQ_INT(lobaTokenEnd, reader.LobaNext());
+  EXPECT_EQ_INT(lobaTokenEnd, reader.LobaNext());
+
+  // 跳过: 键的值、刚打开的容器、数组元素、对象成员, 以及已到结尾时
+  reader.LobaReset("{\"skip\":{\"a\":[1,{\"b\":2}]},\"keep\":[[1,2],3,[4],5],\"m\":{\"x\":1,\"y\":2}}");
+  EXPECT_EQ_INT(lobaTokenStartObject, reader.LobaNext());
+  EXPECT_EQ_INT(lobaTokenKey, reader.LobaNext());
+  EXPECT_EQ_INT(lobaParseOk, reader.LobaSkipValue());
+  EXPECT_EQ_INT(lobaTokenKey, reader.LobaNext());
+  EXPECT_EQ_STRING("keep", reader.LobaGetString(), reader.LobaGetStringLength());
+  EXPECT_EQ_INT(lobaTokenStartArray, reader.LobaNext());
+  EXPECT_EQ_INT(lobaTokenStartArray, reader.LobaNext());
+  EXPECT_EQ_INT(lobaParseOk, reader.LobaSkipValue());
+  EXPECT_EQ_SIZE_T(2, reader.LobaGetDepth());
+  EXPECT_EQ_INT(lobaParseOk, reader.LobaSkipValue());
+  EXPECT_EQ_INT(lobaTokenStartArray, reader.LobaNext());
+  EXPECT_EQ_INT(lobaTokenNumber, reader.LobaNext());
+  EXPECT_EQ_DOUBLE(4.0, reader.LobaGetNumber());
+  EXPECT_EQ_INT(lobaTokenEndArray, reader.LobaNext());
+  EXPECT_EQ_INT(lobaParseOk, reader.LobaSkipValue());
+  EXPECT_EQ_INT(lobaParseOk, reader.LobaSkipValue());
+  EXPECT_EQ_INT(lobaTokenEndArray, reader.LobaNext());
+  EXPECT_EQ_INT(lobaTokenKey, reader.LobaNext());
+  EXPECT_EQ_INT(lobaTokenStartObject, reader.LobaNext());
+  EXPECT_EQ_INT(lobaParseOk, reader.LobaSkipValue());
+  EXPECT_EQ_SIZE_T(1, reader.LobaGetDepth());
+  EXPECT_EQ_INT(lobaTokenEndObject, reader.LobaNext());
+  EXPECT_EQ_INT(lobaTokenEnd, reader.LobaNext());
+
+  reader.LobaReset("{\"x\":1,\"y\":\"2\"}");
+  EXPECT_EQ_INT(lobaTokenStartObject, reader.LobaNext());
+  EXPECT_EQ_INT(lobaParseOk, reader.LobaSkipValue());
+  EXPECT_EQ_INT(lobaTokenEnd, reader.LobaNext());
+  reader.LobaReset("{\"x\":1,\"y\":\"2\"}");
+  EXPECT_EQ_INT(lobaTokenStartObject, reader.LobaNext());
+  EXPECT_EQ_INT(lobaTokenKey, reader.LobaNext());
+  EXPECT_EQ_INT(lobaTokenNumber, reader.LobaNext());
+  EXPECT_EQ_INT(lobaParseOk, reader.LobaSkipValue());
+  EXPECT_EQ_INT(lobaTokenEndObject, reader.LobaNext());
+
+  // 错误码与 LobaParse 一致, 出错后停住
+  reader.LobaReset("[1,2 3]");
+  EXPECT_EQ_INT(lobaTokenStartArray, reader.LobaNext());
+  EXPECT_EQ_INT(lobaTokenNumber, reader.LobaNext());
+  EXPECT_EQ_INT(lobaTokenNumber, reader.LobaNext());
+  EXPECT_EQ_INT(lobaTokenError, reader.LobaNext());
+  EXPECT_EQ_INT(lobaParseMissCommaOrSquareBracket, reader.LobaGetError());
+  EXPECT_EQ_INT(lobaTokenError, reader.LobaNext());
+  reader.LobaReset("{\"a\" 1}");
+  EXPECT_EQ_INT(lobaTokenStartObject, reader.LobaNext());
+  EXPECT_EQ_INT(lobaTokenError, reader.LobaNext());
+  EXPECT_EQ_INT(lobaParseMissColon, reader.LobaGetError());
+  reader.LobaReset("{1:1}");
+  reader.LobaNext();
+  EXPECT_EQ_INT(lobaTokenError, reader.LobaNext());
+  EXPECT_EQ_INT(lobaParseMissKey, reader.LobaGetError());
+  reader.LobaReset("{\"a\":1]");
+  reader.LobaNext();
+  reader.LobaNext();
+  reader.LobaNext();
+  EXPECT_EQ_INT(lobaTokenError, reader.LobaNext());
+  EXPECT_EQ_INT(lobaParseMissCommaOrCurlyBracket, reader.LobaGetError());
+  reader.LobaReset("[\"\xC0\xAF\"]");
+  reader.LobaNext();
+  EXPECT_EQ_INT(lobaTokenError, reader.LobaNext());
+  EXPECT_EQ_INT(lobaParseInvalidUtf8, reader.LobaGetError());
+  reader.LobaReset("[{\"a\":tru}]");
+  reader.LobaNext();
+  reader.LobaNext();
+  EXPECT_EQ_INT(lobaParseInvalidValue, reader.LobaSkipValue());
+  EXPECT_EQ_INT(lobaTokenError, reader.LobaNext());
+  reader.LobaReset("1 2");
+  EXPECT_EQ_INT(lobaTokenNumber, reader.LobaNext());
+  EXPECT_EQ_INT(lobaTokenError, reader.LobaNext());
+  EXPECT_EQ_INT(lobaParseRootNotSingular, reader.LobaGetError());
+  reader.LobaReset("[");
+  reader.LobaNext();
+  EXPECT_EQ_INT(lobaTokenError, reader.LobaNext());
+  EXPECT_EQ_INT(lobaParseExpectValue, reader.LobaGetError());
+  std::string deep(LobaReaderMaxDepth + 1, '[');
+  reader.LobaReset(deep.c_str());
+  while (reader.LobaNext() == lobaTokenStartArray) {}
+  EXPECT_EQ_INT(lobaReaderTooDeep, reader.LobaGetError());
+  // 跳过时的嵌套上限与 LobaNext 相同, 很深的输入也不会递归
+  deep = std::string(LobaReaderMaxDepth, '[') + std::string(LobaReaderMaxDepth, ']');
+  reader.LobaReset(deep.c_str());
+  EXPECT_EQ_INT(lobaTokenStartArray, reader.LobaNext());
+  EXPECT_EQ_INT(lobaParseOk, reader.LobaSkipValue());
+  EXPECT_EQ_INT(lobaTokenEnd, reader.LobaNext());
+  deep = "[" + deep + "]";
+  reader.LobaReset(deep.c_str());
+  EXPECT_EQ_INT(lobaTokenStartArray, reader.LobaNext());
+  EXPECT_EQ_INT(lobaReaderTooDeep, reader.LobaSkipValue());
+  deep = "{\"a\":" + std::string(2000000, '[');
+  reader.LobaReset(deep.c_str());
+  EXPECT_EQ_INT(lobaTokenStartObject, reader.LobaNext());
+  EXPECT_EQ_INT(lobaTokenKey, reader.LobaNext());
+  EXPECT_EQ_INT(lobaReaderTooDeep, reader.LobaSkipValue());
+  EXPECT_EQ_INT(lobaTokenError, reader.LobaNext());
+
+  // 缓冲区长到最长的字符串后, 再多的记号也不再分配
+  std::string big = "[";
+  for (int i = 0; i < 2000; i++) {
+    big += i ? ",\"item\"" : "\"item\"";
+  }
+  big += "]";
+  reader.LobaReset(big.c_str());
+  reader.LobaNext();
+  reader.LobaNext();
+  size_t allocs = counting.LobaGetAllocs() + counting.LobaGetReallocs();
+  size_t strings = 1;
+  LobaToken token;
+  while ((token = reader.LobaNext()) == lobaTokenString) {
+    strings++;
+  }
+  EXPECT_EQ_SIZE_T(2000, strings);
+  EXPECT_EQ_INT(lobaTokenEndArray, token);
+  EXPECT_EQ_SIZE_T(allocs, counting.LobaGetAllocs() + counting.LobaGetReallocs());
+}
+
+static void test_raw_numbers() {
+  const char *json = "{\"price\":19.990000000000000000001,\"n\":[0,-0,1e400,-1.5E+3],\"s\":\"1\"}";
+  LobaJson lobajson, plain;
+  LobaValue v, v2;
+  LobaInit(&v);
+  LobaInit(&v2);
+  lobajson.LobaSetRawNumbers(1);
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&v, json));
+  LobaValue *price = lobajson.LobaFindObjectValue(&v, "price", 5);
+  EXPECT_EQ_INT(lobaNumber, lobajson.LobaGetType(price));
+  size_t length;
+  const char *raw = lobajson.LobaGetRawNumber(price, &length);
+  EXPECT_EQ_STRING("19.990000000000000000001", raw, length);
+  EXPECT_EQ_DOUBLE(19.99, lobajson.LobaGetNumber(price));
+  LobaValue *n = lobajson.LobaFindObjectValue(&v, "n", 1);
+  EXPECT_EQ_DOUBLE(-1500.0, lobajson.LobaGetNumber(lobajson.LobaGetArrayElement(n, 3)));
+  EXPECT_EQ_DOUBLE(HUGE_VAL, lobajson.LobaGetNumber(lobajson.LobaGetArrayElement(n, 2)));
+  // 原样输出, 不经过 %.17g
+  char *out = lobajson.LobaStringify(&v, &length);
+  EXPECT_EQ_STRING("{\"price\":19.990000000000000000001,\"n\":[0,-0,1e400,-1.5E+3],\"s\":\"1\"}", out, length);
+  free(out);
+  EXPECT_EQ_INT(lobaParseNumberTooBig, plain.LobaParse(&v2, json));
+  // 与普通数字按值比较
+  EXPECT_EQ_INT(lobaParseOk, plain.LobaParse(&v2, "{\"s\":\"1\",\"price\":19.99,\"n\":[0,0,1e308,-1500]}"));
+  EXPECT_FALSE(lobajson.LobaIsEqual(&v, &v2));
+  lobajson.LobaSetNumber(lobajson.LobaGetArrayElement(n, 2), 1e308);
+  EXPECT_TRUE(lobajson.LobaIsEqual(&v, &v2));
+  EXPECT_TRUE(lobajson.LobaGetRawNumber(lobajson.LobaGetArrayElement(n, 2), &length) == nullptr);
+  // 拷贝仍指向同一段源文本
+  LobaValue copy;
+  LobaInit(&copy);
+  lobajson.LobaCopy(&copy, price);
+  EXPECT_TRUE(lobajson.LobaGetRawNumber(&copy, &length) == raw);
+  EXPECT_TRUE(lobajson.LobaIsEqual(&copy, price));
+  lobajson.LobaFree(&copy);
+  plain.LobaFree(&v2);
+
+  // diff 把惰性数字与等值的普通数字看作相同
+  LobaPatch lobapatch;
+  LobaValue patch;
+  EXPECT_EQ_INT(lobaParseOk, plain.LobaParse(&v2, "[1,2.50,[3]]"));
+  LobaValue raw_array;
+  LobaInit(&raw_array);
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&raw_array, "[1,2.5,[3]]"));
+  LobaInit(&patch);
+  lobapatch.LobaDiff(&v2, &raw_array, &patch);
+  EXPECT_EQ_SIZE_T(0, lobajson.LobaGetArraySize(&patch));
+  lobajson.LobaFree(&patch);
+  lobajson.LobaFree(&raw_array);
+  plain.LobaFree(&v2);
+  lobajson.LobaFree(&v);
+
+  EXPECT_EQ_INT(lobaParseInvalidValue, lobajson.LobaParse(&v, "[1.]"));
+  EXPECT_EQ_INT(lobaParseInvalidValue, lobajson.LobaParse(&v, "-"));
+  EXPECT_EQ_INT(lobaParseRootNotSingular, lobajson.LobaParse(&v, "012"));
+}
+
+static void test_shared_document() {
+  int error;
+  EXPECT_TRUE(LobaFrozenDocument::LobaParse("[1,", &error) == nullptr);
+  EXPECT_EQ_INT(lobaParseExpectValue, error);
+  std::shared_ptr<const LobaFrozenDocument> v1 = LobaFrozenDocument::LobaParse("{\"version\":1}", &error);
+  EXPECT_EQ_INT(lobaParseOk, error);
+
+  // 接管已有的树, 释放时沿用原来的 allocator
+  LobaMallocAllocator malloc_allocator;
+  LobaCountingAllocator counting(&malloc_allocator);
+  LobaJson lobajson;
+  LobaValue v;
+  lobajson.LobaSetAllocator(&counting);
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&v, "{\"version\":2,\"list\":[1,2,3]}"));
+  std::shared_ptr<const LobaFrozenDocument> v2 = LobaFrozenDocument::LobaFreeze(lobajson, &v);
+  EXPECT_EQ_INT(lobaNull, lobajson.LobaGetType(&v));
+
+  // 压实过的树连同压实块一起转给文档, 或者交给另一个 LobaJson 释放
+  size_t live = counting.LobaGetLiveBytes();
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&v, "{\"name\":\"packed\",\"list\":[1,\"two\",{\"k\":[]}]}"));
+  lobajson.LobaCompact(&v);
+  std::shared_ptr<const LobaFrozenDocument> compacted = LobaFrozenDocument::LobaFreeze(lobajson, &v);
+  const LobaValue *name = lobajson.LobaFindObjectValue(compacted->LobaGetRoot(), "name", 4);
+  EXPECT_EQ_STRING("packed", lobajson.LobaGetString(name), lobajson.LobaGetStringLength(name));
+  compacted.reset();
+  EXPECT_EQ_SIZE_T(live, counting.LobaGetLiveBytes());
+  LobaJson other;
+  other.LobaSetAllocator(&counting);
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&v, "[\"a\",[\"b\"]]"));
+  lobajson.LobaCompact(&v);
+  other.LobaAdoptCompact(&lobajson, &v);
+  other.LobaFree(&v);
+  EXPECT_EQ_SIZE_T(live, counting.LobaGetLiveBytes());
+  static_assert(!std::is_copy_constructible<LobaJson>::value, "");
+
+  LobaDocumentHolder holder(v1);
+  std::weak_ptr<const LobaFrozenDocument> weak1 = v1;
+  v1.reset();
+  std::shared_ptr<const LobaFrozenDocument> reader = holder.LobaAcquire();
+  EXPECT_EQ_DOUBLE(1.0, lobajson.LobaGetNumber(
+      lobajson.LobaFindObjectValue(reader->LobaGetRoot(), "version", 7)));
+  // 换下的旧版本在读者放手之后才释放
+  holder.LobaSwap(v2).reset();
+  EXPECT_FALSE(weak1.expired());
+  EXPECT_EQ_DOUBLE(1.0, lobajson.LobaGetNumber(
+      lobajson.LobaFindObjectValue(reader->LobaGetRoot(), "version", 7)));
+  reader.reset();
+  EXPECT_TRUE(weak1.expired());
+  EXPECT_TRUE(holder.LobaAcquire() == v2);
+  v2.reset();
+  EXPECT_TRUE(holder.LobaSwap(nullptr) != nullptr);
+  EXPECT_EQ_SIZE_T(0, counting.LobaGetLiveBytes());
+  EXPECT_TRUE(holder.LobaAcquire() == nullptr);
+
+  // 读者并发取版本, 写者不停地换; 每个读者看到的版本号单调不减
+  holder.LobaSwap(LobaFrozenDocument::LobaParse("{\"version\":0}", nullptr));
+  std::atomic<int> bad(0);
+  std::atomic<int> done(0);
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 4; t++) {
+    readers.emplace_back([&holder, &bad, &done]() {
+      LobaJson local;
+      double last = 0;
+      while (!done.load()) {
+        std::shared_ptr<const LobaFrozenDocument> doc = holder.LobaAcquire();
+        double version = local.LobaGetNumber(local.LobaFindObjectValue(doc->LobaGetRoot(), "version", 7));
+        if (version < last) {
+          bad++;
+        }
+        last = version;
+      }
+    });
+  }
+  std::vector<std::weak_ptr<const LobaFrozenDocument>> old;
+  for (int i = 1; i <= 200; i++) {
+    std::string json = "{\"version\":" + std::to_string(i) + "}";
+    old.push_back(holder.LobaSwap(LobaFrozenDocument::LobaParse(json.c_str(), nullptr)));
+    if (i % 20 == 0) {
+      std::this_thread::yield();
+    }
+  }
+  done = 1;
+  for (std::thread &t : readers) {
+    t.join();
+  }
+  EXPECT_EQ_INT(0, bad.load());
+  size_t alive = 0;
+  for (const std::weak_ptr<const LobaFrozenDocument> &w : old) {
+    alive += !w.expired();
+  }
+  EXPECT_EQ_SIZE_T(0, alive);
+}
+
+static void test_parse_cache() {
+  LobaParseCache cache(1 << 20, 3);
+  int error;
+  // 输入不必以 '\0' 结尾, 内容相同就命中同一份文档
+  const char *buffer = "{\"ok\":true}{\"ok\":true}";
+  std::shared_ptr<const LobaFrozenDocument> a = cache.LobaParse(buffer, 11, &error);
+  EXPECT_EQ_INT(lobaParseOk, error);
+  std::shared_ptr<const LobaFrozenDocument> b = cache.LobaParse(buffer + 11, 11, &error);
+  EXPECT_TRUE(a != nullptr && a == b);
+  EXPECT_EQ_SIZE_T(1, cache.LobaGetHits());
+  EXPECT_EQ_SIZE_T(1, cache.LobaGetMisses());
+  EXPECT_EQ_SIZE_T(1, cache.LobaGetSize());
+  EXPECT_TRUE(cache.LobaGetBytes() > 12);
+  // 失败的解析不缓存
+  EXPECT_TRUE(cache.LobaParse("[1,", &error) == nullptr);
+  EXPECT_EQ_INT(lobaParseExpectValue, error);
+  EXPECT_TRUE(cache.LobaParse("[1,", &error) == nullptr);
+  EXPECT_EQ_SIZE_T(1, cache.LobaGetSize());
+  EXPECT_EQ_SIZE_T(3, cache.LobaGetMisses());
+  // 中间的 '\0' 不能截断输入
+  EXPECT_TRUE(cache.LobaParse("{}\0garbage", 10, &error) == nullptr);
+  EXPECT_EQ_INT(lobaParseRootNotSingular, error);
+  EXPECT_TRUE(cache.LobaParse("{}\0garbage", 10, &error) == nullptr);
+  EXPECT_EQ_SIZE_T(1, cache.LobaGetSize());
+  EXPECT_EQ_SIZE_T(5, cache.LobaGetMisses());
+
+  // 个数上限 3: 最久没用的 [1] 被淘汰, 刚用过的 {"ok":true} 留下
+  std::shared_ptr<const LobaFrozenDocument> one = cache.LobaParse("[1]", &error);
+  cache.LobaParse("[2]", &error);
+  cache.LobaParse("{\"ok\":true}", &error);
+  cache.LobaParse("[3]", &error);
+  EXPECT_EQ_SIZE_T(3, cache.LobaGetSize());
+  EXPECT_EQ_SIZE_T(1, cache.LobaGetEvictions());
+  EXPECT_TRUE(cache.LobaParse("{\"ok\":true}", &error) == a);
+  EXPECT_TRUE(cache.LobaParse("[1]", &error) != one);
+  // 被淘汰的文档在外面仍然有效
+  EXPECT_EQ_DOUBLE(1.0, one->LobaGetRoot()->u.a.e[0].u.n);
+
+  // 字节上限: 放不下的文档照常返回但不进缓存
+  LobaParseCache small(64);
+  std::string big = "[\"" + std::string(100, 'x') + "\"]";
+  EXPECT_TRUE(small.LobaParse(big.c_str(), &error) != nullptr);
+  EXPECT_EQ_SIZE_T(0, small.LobaGetSize());
+  EXPECT_TRUE(LobaParseCache::LobaHashBytes("[1]", 3) != LobaParseCache::LobaHashBytes("[2]", 3));
+  EXPECT_TRUE(LobaParseCache::LobaHashBytes("abcdefgh1", 9) != LobaParseCache::LobaHashBytes("abcdefgh2", 9));
+
+  // 多线程同时查同一批输入, 每段输入最终只留一份
+  LobaParseCache shared;
+  const char *bodies[] = {"{\"health\":\"ok\"}", "{\"config\":[1,2,3]}", "[true,false,null]"};
+  std::vector<std::thread> threads;
+  std::atomic<int> failures{0};
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&shared, &bodies, &failures]() {
+      for (int i = 0; i < 300; i++) {
+        int err;
+        std::shared_ptr<const LobaFrozenDocument> doc = shared.LobaParse(bodies[i % 3], &err);
+        if (doc == nullptr || err != lobaParseOk) {
+          failures++;
+        }
+      }
+    });
+  }
+  for (std::thread &t : threads) {
+    t.join();
+  }
+  EXPECT_EQ_INT(0, failures.load());
+  EXPECT_EQ_SIZE_T(3, shared.LobaGetSize());
+  EXPECT_EQ_SIZE_T(1200, shared.LobaGetHits() + shared.LobaGetMisses());
+  shared.LobaClear();
+  EXPECT_EQ_SIZE_T(0, shared.LobaGetSize());
+  EXPECT_EQ_SIZE_T(0, shared.LobaGetBytes());
+}
+
+static void test_compact() {
+  const char *json = "{\"name\":\"lobajson\",\"tags\":[\"a\",\"bc\",[]],\"n\":1,\"o\":{\"k\":{}}}";
+  LobaMallocAllocator malloc_allocator;
+  LobaCountingAllocator counting(&malloc_allocator);
+  LobaJson lobajson, plain;
+  LobaValue v, expect;
+  LobaInit(&v);
+  LobaInit(&expect);
+  lobajson.LobaSetAllocator(&counting);
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&v, json));
+  EXPECT_EQ_INT(lobaParseOk, plain.LobaParse(&expect, json));
+
+  LobaMemoryStats before, after;
+  lobajson.LobaMemoryUsage(&v, &before);
+  EXPECT_EQ_SIZE_T(4 * sizeof(LobaMember) + 3 * sizeof(LobaValue) + 1 * sizeof(LobaMember), before.nodes);
+  EXPECT_EQ_SIZE_T(9 + 2 + 3, before.strings);
+  EXPECT_EQ_SIZE_T(5 + 5 + 2 + 2 + 2, before.keys);
+  EXPECT_EQ_SIZE_T(11, before.blocks);
+  EXPECT_EQ_SIZE_T(before.nodes + before.strings + before.keys, before.total);
+  EXPECT_EQ_SIZE_T(0, before.slack);
+  plain.LobaMemoryUsage(&expect, &after);
+  EXPECT_EQ_SIZE_T(before.nodes + before.strings + before.keys, after.nodes + after.strings + after.keys);
+  EXPECT_TRUE(after.slack > 0);
+
+  // 整棵树落进一块, 深度优先排布
+  lobajson.LobaCompact(&v);
+  lobajson.LobaMemoryUsage(&v, &after);
+  EXPECT_EQ_SIZE_T(1, after.blocks);
+  EXPECT_EQ_SIZE_T(before.nodes, after.nodes);
+  EXPECT_EQ_SIZE_T(before.strings, after.strings);
+  EXPECT_EQ_SIZE_T(before.keys, after.keys);
+  EXPECT_EQ_SIZE_T(after.total, counting.LobaGetLiveBytes());
+  EXPECT_TRUE(lobajson.LobaIsEqual(&v, &expect));
+  const char *base = (const char *)v.u.o.m;
+  EXPECT_TRUE(lobajson.LobaGetObjectKey(&v, 0) > base);
+  EXPECT_TRUE(lobajson.LobaGetString(lobajson.LobaGetObjectValue(&v, 0)) > lobajson.LobaGetObjectKey(&v, 0));
+  EXPECT_TRUE(lobajson.LobaGetObjectKey(&v, 1) > lobajson.LobaGetString(lobajson.LobaGetObjectValue(&v, 0)));
+  char *out = lobajson.LobaStringify(&v, nullptr);
+  EXPECT_EQ_INT(0, strcmp(json, out));
+  lobajson.LobaDealloc(out, strlen(out) + 1);
+
+  // 压实后照常修改: 新内容落在块外, 块里的片释放后整块归还
+  LobaValue *tags = lobajson.LobaGetObjectValue(&v, 1);
+  lobajson.LobaSetString(lobajson.LobaGetArrayElement(tags, 0), "xyz", 3);
+  lobajson.LobaMemoryUsage(&v, &after);
+  EXPECT_EQ_SIZE_T(2, after.blocks);
+  LobaValue copy;
+  LobaInit(&copy);
+  lobajson.LobaCopy(&copy, tags);
+  lobajson.LobaFree(tags);
+  lobajson.LobaMove(tags, &copy);
+  lobajson.LobaCompact(&v);
+  lobajson.LobaMemoryUsage(&v, &after);
+  EXPECT_EQ_SIZE_T(1, after.blocks);
+  EXPECT_EQ_SIZE_T(after.total, counting.LobaGetLiveBytes());
+  lobajson.LobaFree(&v);
+  EXPECT_EQ_SIZE_T(0, counting.LobaGetLiveBytes());
+
+  // 标量不需要压实; 驻留的键留在键表里
+  LobaKeyTable table;
+  lobajson.LobaSetKeyTable(&table);
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&v, "[{\"id\":1},{\"id\":2}]"));
+  lobajson.LobaCompact(&v);
+  lobajson.LobaMemoryUsage(&v, &after);
+  EXPECT_EQ_SIZE_T(0, after.keys);
+  EXPECT_EQ_SIZE_T(1, after.blocks);
+  EXPECT_TRUE(lobajson.LobaGetObjectKey(lobajson.LobaGetArrayElement(&v, 0), 0) ==
+              lobajson.LobaGetObjectKey(lobajson.LobaGetArrayElement(&v, 1), 0));
+  lobajson.LobaFree(&v);
+  lobajson.LobaSetNumber(&v, 1.0);
+  lobajson.LobaCompact(&v);
+  lobajson.LobaMemoryUsage(&v, &after);
+  EXPECT_EQ_SIZE_T(0, after.total);
+  plain.LobaFree(&expect);
+  lobajson.LobaSetKeyTable(nullptr);
+  EXPECT_EQ_SIZE_T(0, counting.LobaGetLiveBytes());
+}
+
+static void test_packed_array() {
+  const char *json = "{\"v\":[1,-2,0.5,-0,1e300,123456789012345,5e-324],\"short\":[1,2],\"mixed\":[1,2,3,\"x\"]}";
+  LobaJson lobajson, plain;
+  LobaValue v, expect;
+  LobaInit(&v);
+  LobaInit(&expect);
+  lobajson.LobaSetPackNumbers(1);
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&v, json));
+  EXPECT_EQ_INT(lobaParseOk, plain.LobaParse(&expect, json));
+  LobaValue *a = lobajson.LobaFindObjectValue(&v, "v", 1);
+  EXPECT_EQ_INT(lobaArray, lobajson.LobaGetType(a));
+  EXPECT_EQ_SIZE_T(7, lobajson.LobaGetArraySize(a));
+  const double *d = lobajson.LobaGetPackedArray(a);
+  EXPECT_TRUE(d != nullptr);
+  EXPECT_EQ_DOUBLE(0.5, d[2]);
+  EXPECT_EQ_DOUBLE(1e300, d[4]);
+  // 元素经调用者给的代理只读地取出, 代理各自独立
+  LobaValue p0, p1;
+  const LobaValue *e0 = lobajson.LobaGetArrayElement(a, 0, &p0), *e1 = lobajson.LobaGetArrayElement(a, 1, &p1);
+  EXPECT_TRUE(e0 == &p0);
+  EXPECT_EQ_INT(lobaNumber, lobajson.LobaGetType(e0));
+  EXPECT_EQ_DOUBLE(1.0, lobajson.LobaGetNumber(e0));
+  EXPECT_EQ_DOUBLE(-2.0, lobajson.LobaGetNumber(e1));
+  LobaValue *m = lobajson.LobaFindObjectValue(&v, "mixed", 5);
+  EXPECT_TRUE(lobajson.LobaGetArrayElement(m, 0, &p0) == lobajson.LobaGetArrayElement(m, 0));
+  EXPECT_TRUE(lobajson.LobaGetPackedArray(lobajson.LobaFindObjectValue(&v, "short", 5)) == nullptr);
+  EXPECT_TRUE(lobajson.LobaGetPackedArray(lobajson.LobaFindObjectValue(&v, "mixed", 5)) == nullptr);
+  EXPECT_TRUE(lobajson.LobaIsEqual(&v, &expect));
+  EXPECT_TRUE(lobajson.LobaIsEqual(&expect, &v));
+  // 按老办法逐个取可修改的元素时先就地展开
+  LobaValue loose;
+  LobaInit(&loose);
+  lobajson.LobaCopy(&loose, a);
+  LobaValue *e = lobajson.LobaGetArrayElement(&loose, 4);
+  EXPECT_TRUE(lobajson.LobaGetPackedArray(&loose) == nullptr);
+  EXPECT_EQ_DOUBLE(1e300, lobajson.LobaGetNumber(e));
+  lobajson.LobaSetNumber(e, 2.0);
+  EXPECT_EQ_DOUBLE(2.0, lobajson.LobaGetNumber(lobajson.LobaGetArrayElement(&loose, 4, &p0)));
+  EXPECT_EQ_SIZE_T(7, lobajson.LobaGetArraySize(&loose));
+  lobajson.LobaFree(&loose);
+
+  // 输出与普通数组逐字节相同
+  size_t length, expect_length;
+  char *out = lobajson.LobaStringify(&v, &length);
+  char *expect_out = plain.LobaStringify(&expect, &expect_length);
+  EXPECT_EQ_SIZE_T(expect_length, length);
+  EXPECT_TRUE(memcmp(out, expect_out, length) == 0);
+  free(out);
+  free(expect_out);
+
+  // 拷贝、压实、二进制编码与快照都按普通数组对待
+  LobaValue copy;
+  LobaInit(&copy);
+  lobajson.LobaCopy(&copy, a);
+  EXPECT_TRUE(lobajson.LobaGetPackedArray(&copy) != nullptr);
+  EXPECT_TRUE(lobajson.LobaIsEqual(&copy, a));
+  lobajson.LobaFree(&copy);
+  LobaMemoryStats stats;
+  lobajson.LobaMemoryUsage(a, &stats);
+  EXPECT_EQ_SIZE_T(7 * sizeof(double), stats.nodes);
+  lobajson.LobaCopy(&copy, &v);
+  lobajson.LobaCompact(&copy);
+  EXPECT_TRUE(lobajson.LobaIsEqual(&copy, &expect));
+  lobajson.LobaFree(&copy);
+  LobaBinary lobabinary;
+  size_t packed_size, plain_size;
+  char *packed_cbor = lobabinary.LobaEncodeCbor(&v, &packed_size);
+  char *plain_cbor = lobabinary.LobaEncodeCbor(&expect, &plain_size);
+  EXPECT_EQ_SIZE_T(plain_size, packed_size);
+  EXPECT_TRUE(memcmp(packed_cbor, plain_cbor, plain_size) == 0);
+  free(packed_cbor);
+  free(plain_cbor);
+
+  // patch 只展开要修改的紧凑数组; diff 把它与等值的普通数组看作相同
+  LobaPatch lobapatch;
+  LobaValue patch;
+  LobaInit(&patch);
+  lobapatch.LobaDiff(&v, &expect, &patch);
+  EXPECT_EQ_SIZE_T(0, lobajson.LobaGetArraySize(&patch));
+  lobajson.LobaFree(&patch);
+  // 只读的 test 和 copy 的 from 经代理读元素, 不展开; 失败回滚后重新打包
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&patch, "[{\"op\":\"test\",\"path\":\"/v/2\",\"value\":0.5},"
+                                                       "{\"op\":\"copy\",\"from\":\"/v/0\",\"path\":\"/c\"}]"));
+  EXPECT_EQ_INT(lobaPatchOk, lobapatch.LobaApplyPatch(&v, &patch));
+  lobajson.LobaFree(&patch);
+  EXPECT_TRUE(lobajson.LobaGetPackedArray(lobajson.LobaFindObjectValue(&v, "v", 1)) != nullptr);
+  EXPECT_EQ_DOUBLE(1.0, lobajson.LobaGetNumber(lobajson.LobaFindObjectValue(&v, "c", 1)));
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&patch, "[{\"op\":\"replace\",\"path\":\"/v/1\",\"value\":\"x\"},"
+                                                       "{\"op\":\"remove\",\"path\":\"/v/0\"},"
+                                                       "{\"op\":\"move\",\"from\":\"/v/0\",\"path\":\"/v/3\"},"
+                                                       "{\"op\":\"replace\",\"path\":\"/v/9\",\"value\":1}]"));
+  EXPECT_EQ_INT(lobaPatchPathNotFound, lobapatch.LobaApplyPatch(&v, &patch));
+  lobajson.LobaFree(&patch);
+  EXPECT_TRUE(lobajson.LobaGetPackedArray(lobajson.LobaFindObjectValue(&v, "v", 1)) != nullptr);
+  EXPECT_TRUE(lobajson.LobaIsEqual(lobajson.LobaFindObjectValue(&v, "v", 1), &expect.u.o.m[0].v));
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&patch, "[{\"op\":\"remove\",\"path\":\"/c\"}]"));
+  EXPECT_EQ_INT(lobaPatchOk, lobapatch.LobaApplyPatch(&v, &patch));
+  lobajson.LobaFree(&patch);
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&patch, "[{\"op\":\"replace\",\"path\":\"/v/1\",\"value\":7}]"));
+  EXPECT_EQ_INT(lobaPatchOk, lobapatch.LobaApplyPatch(&v, &patch));
+  lobajson.LobaFree(&patch);
+  a = lobajson.LobaFindObjectValue(&v, "v", 1);
+  EXPECT_TRUE(lobajson.LobaGetPackedArray(a) == nullptr);
+  EXPECT_EQ_DOUBLE(7.0, lobajson.LobaGetNumber(lobajson.LobaGetArrayElement(a, 1)));
+  LobaValue packed;
+  LobaInit(&packed);
+  const double nums[] = {1, 7, 0.5, -0.0, 1e300, 123456789012345, 5e-324};
+  lobajson.LobaSetPackedArray(&packed, nums, 7);
+  EXPECT_TRUE(lobajson.LobaIsEqual(&packed, a));
+  lobapatch.LobaDiff(&packed, &expect.u.o.m[0].v, &patch);
+  EXPECT_EQ_SIZE_T(1, lobajson.LobaGetArraySize(&patch));
+  lobajson.LobaFree(&patch);
+  lobajson.LobaUnpackArray(&packed);
+  EXPECT_TRUE(lobajson.LobaGetPackedArray(&packed) == nullptr);
+  EXPECT_TRUE(lobajson.LobaIsEqual(&packed, a));
+  lobajson.LobaFree(&packed);
+  lobajson.LobaFree(&v);
+
+  // 多线程解析的根数组同样打包
+  std::string big = "[";
+  for (int i = 0; i < 100000; i++) {
+    big += std::to_string(i) + ",";
+  }
+  big.back() = ']';
+  lobajson.LobaSetParseThreads(4);
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&v, big.c_str()));
+  EXPECT_TRUE(lobajson.LobaGetPackedArray(&v) != nullptr);
+  EXPECT_EQ_DOUBLE(99999.0, lobajson.LobaGetPackedArray(&v)[99999]);
+  out = lobajson.LobaStringify(&v, &length);
+  EXPECT_EQ_SIZE_T(big.size(), length);
+  EXPECT_TRUE(memcmp(out, big.c_str(), length) == 0);
+  free(out);
+  lobajson.LobaFree(&v);
+  plain.LobaFree(&expect);
+}
+
+static void test_parse_many() {
+  // 按长度给出的文档在缓冲区中首尾相接, 都不以 '\0' 结尾
+  const char *buffer = "{\"id\":1,\"tags\":[\"a\",\"b\"]}[1,2,3] \"s\" [1,}nul";
+  const char *docs[] = {buffer, buffer + 25, buffer + 32, buffer + 37, buffer + 41};
+  size_t lens[] = {25, 7, 5, 4, 3};
+  LobaValue out[5];
+  int errors[5];
+  LobaBatch batch;
+  EXPECT_EQ_SIZE_T(3, batch.LobaParseMany(docs, lens, 5, out, errors));
+  EXPECT_EQ_INT(lobaParseOk, errors[0]);
+  EXPECT_EQ_INT(lobaParseOk, errors[1]);
+  EXPECT_EQ_INT(lobaParseOk, errors[2]);
+  EXPECT_EQ_INT(lobaParseInvalidValue, errors[3]);
+  EXPECT_EQ_INT(lobaParseInvalidValue, errors[4]);
+  EXPECT_EQ_INT(LobaType::lobaNull, batch.LobaGetType(&out[3]));
+  EXPECT_EQ_INT(LobaType::lobaNull, batch.LobaGetType(&out[4]));
+  size_t length;
+  char *s = batch.LobaStringify(&out[0], &length);
+  EXPECT_EQ_STRING("{\"id\":1,\"tags\":[\"a\",\"b\"]}", s, length);
+  batch.LobaDealloc(s, length + 1);
+  EXPECT_EQ_SIZE_T(3, batch.LobaGetArraySize(&out[1]));
+  EXPECT_EQ_STRING("s", batch.LobaGetString(&out[2]), batch.LobaGetStringLength(&out[2]));
+
+  // 以 '\0' 结尾的文档, 惰性数字指向各自的拷贝或原文
+  batch.LobaRelease();
+  size_t reserved = batch.LobaGetReserved();
+  const char *terminated[] = {"[0.10, 2e3]", " {} ", ""};
+  batch.LobaSetRawNumbers(1);
+  EXPECT_EQ_SIZE_T(2, batch.LobaParseMany(terminated, nullptr, 3, out, errors));
+  EXPECT_EQ_INT(lobaParseExpectValue, errors[2]);
+  s = batch.LobaStringify(&out[0], &length);
+  EXPECT_EQ_STRING("[0.10,2e3]", s, length);
+  batch.LobaDealloc(s, length + 1);
+  EXPECT_EQ_SIZE_T(0, batch.LobaGetObjectSize(&out[1]));
+  EXPECT_EQ_SIZE_T(2, batch.LobaParseMany(docs, lens, 2, out, nullptr));
+  s = batch.LobaStringify(&out[1], &length);
+  EXPECT_EQ_STRING("[1,2,3]", s, length);
+  batch.LobaDealloc(s, length + 1);
+  // 第二批复用第一批的块
+  EXPECT_EQ_SIZE_T(reserved, batch.LobaGetReserved());
+  EXPECT_EQ_SIZE_T(0, batch.LobaParseMany(docs, lens, 0, out, errors));
+}
+
+// 带缓存与不带缓存的输出逐字节相同
+static void check_cached_stringify(LobaJson *json, const LobaValue *v) {
+  LobaJson plain;
+  size_t length, expect_length;
+  char *expect = plain.LobaStringify(v, &expect_length);
+  char *actual = json->LobaStringify(v, &length);
+  EXPECT_EQ_SIZE_T(expect_length, length);
+  EXPECT_TRUE(memcmp(expect, actual, length) == 0);
+  free(actual);
+  free(expect);
+}
+
+static void test_stringify_cache() {
+  std::string text = "{\"meta\":{\"name\":\"doc\",\"tags\":[\"a\",\"b\"]},\"items\":[";
+  for (int i = 0; i < 40; i++) {
+    text += (i ? "," : "") + std::string("{\"id\":") + std::to_string(i) +
+        ",\"title\":\"item number " + std::to_string(i) + "\",\"sub\":{\"x\":[1,2,3]}}";
+  }
+  text += "]}";
+  LobaJson lobajson;
+  LobaStringifyCache cache(16);
+  lobajson.LobaSetStringifyCache(&cache);
+  LobaValue v;
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&v, text.c_str()));
+  check_cached_stringify(&lobajson, &v);
+  EXPECT_EQ_SIZE_T(0, cache.LobaGetHits());
+  size_t entries = cache.LobaGetSize();
+  EXPECT_TRUE(entries > 40);
+  // 没有改动时根直接命中
+  check_cached_stringify(&lobajson, &v);
+  EXPECT_EQ_SIZE_T(1, cache.LobaGetHits());
+
+  // 直接改一个深处的值, 按路径标记后路径上的容器只重做被改的孩子, 其余字节照搬
+  LobaValue *item = lobajson.LobaGetArrayElement(lobajson.LobaFindObjectValue(&v, "items", 5), 7);
+  lobajson.LobaSetString(lobajson.LobaFindObjectValue(item, "title", 5), "changed", 7);
+  EXPECT_TRUE(cache.LobaMarkDirty(&v, "/items/7/title", 14));
+  size_t misses = cache.LobaGetMisses();
+  check_cached_stringify(&lobajson, &v);
+  EXPECT_EQ_SIZE_T(misses, cache.LobaGetMisses());
+  EXPECT_EQ_SIZE_T(3, cache.LobaGetPartialHits());
+  // 改短之后各孩子的位置也跟着平移
+  lobajson.LobaSetString(lobajson.LobaFindObjectValue(item, "title", 5), "", 0);
+  cache.LobaMarkDirty(&v, "/items/7/title", 14);
+  lobajson.LobaSetNumber(lobajson.LobaFindObjectValue(lobajson.LobaGetArrayElement(
+      lobajson.LobaFindObjectValue(&v, "items", 5), 9), "id", 2), 123456);
+  cache.LobaMarkDirty(&v, "/items/9/id", 11);
+  check_cached_stringify(&lobajson, &v);
+  lobajson.LobaSetString(lobajson.LobaFindObjectValue(item, "title", 5), "changed", 7);
+  cache.LobaMarkDirty(&v, "/items/7/title", 14);
+  check_cached_stringify(&lobajson, &v);
+  EXPECT_EQ_SIZE_T(misses, cache.LobaGetMisses());
+  EXPECT_EQ_SIZE_T(entries, cache.LobaGetSize());
+  EXPECT_FALSE(cache.LobaMarkDirty(&v, "/items/99", 9));
+  EXPECT_FALSE(cache.LobaMarkDirty(&v, "/nope", 5));
+
+  // 经由 LobaPatch 修改时自动标记, 释放的子树移出缓存
+  LobaPatch lobapatch;
+  lobapatch.LobaSetStringifyCache(&cache);
+  LobaValue p;
+  const char *ops = "[{\"op\":\"replace\",\"path\":\"/items/3/sub\",\"value\":{\"y\":true}},"
+                    "{\"op\":\"add\",\"path\":\"/meta/tags/-\",\"value\":\"c\"},"
+                    "{\"op\":\"remove\",\"path\":\"/items/0\"}]";
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&p, ops));
+  EXPECT_EQ_INT(lobaPatchOk, lobapatch.LobaApplyPatch(&v, &p));
+  lobajson.LobaFree(&p);
+  EXPECT_TRUE(cache.LobaGetSize() < entries);
+  check_cached_stringify(&lobajson, &v);
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&p, "{\"meta\":{\"name\":null},\"extra\":[1]}"));
+  lobapatch.LobaApplyMergePatch(&v, &p);
+  lobajson.LobaFree(&p);
+  check_cached_stringify(&lobajson, &v);
+
+  // 交换两个元素: 孩子缓冲区跟着值走, 元素自己不标记也不会命中旧结果, 只需标记数组和祖先
+  LobaValue *items = lobajson.LobaFindObjectValue(&v, "items", 5);
+  lobajson.LobaSwap(lobajson.LobaGetArrayElement(items, 0), lobajson.LobaGetArrayElement(items, 1));
+  EXPECT_TRUE(cache.LobaMarkDirty(&v, "/items", 6));
+  check_cached_stringify(&lobajson, &v);
+
+  // 删除元素后挪过位置的旧条目不再命中, 留到 LobaClear
+  lobajson.LobaFree(&v);
+  cache.LobaClear();
+  EXPECT_EQ_SIZE_T(0, cache.LobaGetSize());
+  EXPECT_EQ_SIZE_T(0, cache.LobaGetBytes());
+}
+
+#define TEST_CANONICAL_NUMBER(expect, bits) \
+    do { \
+        uint64_t u = bits; \
+        double d; \
+        memcpy(&d, &u, sizeof(d)); \
+        LobaValue v; \
+        LobaInit(&v); \
+        lobajson.LobaSetNumber(&v, d); \
+        size_t length; \
+        char *actual = lobajson.LobaStringifyCanonical(&v, &length); \
+        EXPECT_EQ_STRING(expect, actual, length); \
+        free(actual); \
+    } while(0)
+
+static void test_stringify_canonical() {
+  LobaJson lobajson;
+  // RFC 8785 附录 B 的数字
+  TEST_CANONICAL_NUMBER("0", 0x0000000000000000ULL);
+  TEST_CANONICAL_NUMBER("0", 0x8000000000000000ULL);
+  TEST_CANONICAL_NUMBER("5e-324", 0x0000000000000001ULL);
+  TEST_CANONICAL_NUMBER("-5e-324", 0x8000000000000001ULL);
+  TEST_CANONICAL_NUMBER("1.7976931348623157e+308", 0x7fefffffffffffffULL);
+  TEST_CANONICAL_NUMBER("-1.7976931348623157e+308", 0xffefffffffffffffULL);
+  TEST_CANONICAL_NUMBER("8.98846567431158e+307", 0x7fe0000000000000ULL);
+  TEST_CANONICAL_NUMBER("2.2250738585072014e-308", 0x0010000000000000ULL);
+  TEST_CANONICAL_NUMBER("2.225073858507201e-308", 0x000fffffffffffffULL);
+  TEST_CANONICAL_NUMBER("9007199254740992", 0x4340000000000000ULL);
+  TEST_CANONICAL_NUMBER("-9007199254740992", 0xc340000000000000ULL);
+  TEST_CANONICAL_NUMBER("295147905179352830000", 0x4430000000000000ULL);
+  TEST_CANONICAL_NUMBER("9.999999999999997e+22", 0x44b52d02c7e14af5ULL);
+  TEST_CANONICAL_NUMBER("1e+23", 0x44b52d02c7e14af6ULL);
+  TEST_CANONICAL_NUMBER("1.0000000000000001e+23", 0x44b52d02c7e14af7ULL);
+  TEST_CANONICAL_NUMBER("999999999999999700000", 0x444b1ae4d6e2ef4eULL);
+  TEST_CANONICAL_NUMBER("999999999999999900000", 0x444b1ae4d6e2ef4fULL);
+  TEST_CANONICAL_NUMBER("1e+21", 0x444b1ae4d6e2ef50ULL);
+  TEST_CANONICAL_NUMBER("9.999999999999997e-7", 0x3eb0c6f7a0b5ed8cULL);
+  TEST_CANONICAL_NUMBER("0.000001", 0x3eb0c6f7a0b5ed8dULL);
+  TEST_CANONICAL_NUMBER("333333333.3333332", 0x41b3de4355555553ULL);
+  TEST_CANONICAL_NUMBER("333333333.33333325", 0x41b3de4355555554ULL);
+  TEST_CANONICAL_NUMBER("333333333.3333333", 0x41b3de4355555555ULL);
+  TEST_CANONICAL_NUMBER("333333333.3333334", 0x41b3de4355555556ULL);
+  TEST_CANONICAL_NUMBER("333333333.33333343", 0x41b3de4355555557ULL);
+  TEST_CANONICAL_NUMBER("-0.0000033333333333333333", 0xbecbf647612f3696ULL);
+  TEST_CANONICAL_NUMBER("1424953923781206.2", 0x43143ff3c1cb0959ULL);
+  // 2^803: 最近的 16 位小数还原不了, 相邻的那个可以
+  TEST_CANONICAL_NUMBER("5.334411546303884e+241", 0x7220000000000000ULL);
+
+  // RFC 8785 3.2.2 的例子, 外加惰性数字和紧凑数组
+  const char *json = "{\"numbers\":[333333333.33333329,1E30,4.50,2e-3,0.000000000000000000000000001],"
+                     "\"string\":\"\\u20ac$\\u000F\\u000aA'\\u0042\\u0022\\u005c\\\\\\\"\\/\","
+                     "\"literals\":[null,true,false]}";
+  const char *expect = "{\"literals\":[null,true,false],"
+                       "\"numbers\":[333333333.3333333,1e+30,4.5,0.002,1e-27],"
+                       "\"string\":\"\xE2\x82\xAC$\\u000f\\nA'B\\\"\\\\\\\\\\\"/\"}";
+  LobaValue v;
+  size_t length;
+  for (int mode = 0; mode < 3; mode++) {
+    LobaJson json_mode;
+    json_mode.LobaSetRawNumbers(mode == 1);
+    json_mode.LobaSetPackNumbers(mode == 2);
+    EXPECT_EQ_INT(lobaParseOk, json_mode.LobaParse(&v, json));
+    char *actual = json_mode.LobaStringifyCanonical(&v, &length);
+    EXPECT_EQ_SIZE_T(strlen(expect), length);
+    EXPECT_TRUE(memcmp(expect, actual, length) == 0);
+    free(actual);
+    json_mode.LobaFree(&v);
+  }
+
+  // 3.2.3: 按 UTF-16 码元排序, U+1F600 (代理对) 排在 U+FB33 之前; 重复的键保持原顺序
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&v,
+      "{\"\\u20ac\":1,\"\\r\":2,\"\\ufb33\":3,\"1\":4,\"\\ud83d\\ude00\":5,\"\\u0080\":6,\"\\u00f6\":7,"
+      "\"b\":{\"z\":[{\"y\":1,\"x\":2}],\"a\":0},\"1\":8}"));
+  char *actual = lobajson.LobaStringifyCanonical(&v, &length);
+  const char *sorted = "{\"\\r\":2,\"1\":4,\"1\":8,\"b\":{\"a\":0,\"z\":[{\"x\":2,\"y\":1}]},"
+                       "\"\xC2\x80\":6,\"\xC3\xB6\":7,\"\xE2\x82\xAC\":1,\"\xF0\x9F\x98\x80\":5,\"\xEF\xAC\xB3\":3}";
+  EXPECT_EQ_SIZE_T(strlen(sorted), length);
+  EXPECT_TRUE(memcmp(sorted, actual, length) == 0);
+  free(actual);
+  lobajson.LobaFree(&v);
+
+  lobajson.LobaSetNumber(&v, NAN);
+  EXPECT_TRUE(lobajson.LobaStringifyCanonical(&v, &length) == nullptr);
+}
+
+static void test_parse_limits() {
+  LobaJson lobajson;
+  LobaValue v;
+  LobaParseLimits limits = {};
+  limits.max_input_bytes = 32;
+  limits.max_depth = 3;
+  limits.max_string_length = 8;
+  limits.max_elements = 6;
+  lobajson.LobaSetParseLimits(&limits);
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&v, "[[[1]], \"12345678\", {\"k\":2}]"));
+  lobajson.LobaFree(&v);
+  // 失败时 v 为 null, 中途分配的都已释放
+  v.type = lobaTestDefaultType;
+  EXPECT_EQ_INT(lobaParseInputTooLarge, lobajson.LobaParse(&v, "[1,2,3,4,5,6,7,8,9,10,11,12,13,14]"));
+  EXPECT_EQ_INT(lobaNull, lobajson.LobaGetType(&v));
+  EXPECT_EQ_INT(lobaParseTooDeep, lobajson.LobaParse(&v, "[\"a\",[[[1]]]]"));
+  EXPECT_EQ_INT(lobaNull, lobajson.LobaGetType(&v));
+  EXPECT_EQ_INT(lobaParseStringTooLong, lobajson.LobaParse(&v, "[\"a\",\"123456789\"]"));
+  EXPECT_EQ_INT(lobaParseStringTooLong, lobajson.LobaParse(&v, "{\"1234567\\n\\t\":1}"));
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&v, "{\"123456\\n\\t\":1}"));
+  lobajson.LobaFree(&v);
+  // 元素按整份文档累计, 对象成员也算
+  EXPECT_EQ_INT(lobaParseTooManyElements, lobajson.LobaParse(&v, "[[1,2,3],{\"a\":4,\"b\":5}]"));
+  EXPECT_EQ_INT(lobaNull, lobajson.LobaGetType(&v));
+
+  // 分配量包括树和解析栈, 同一份文档放宽上限后可以解析
+  limits = {};
+  limits.max_alloc_bytes = 1024;
+  lobajson.LobaSetParseLimits(&limits);
+  std::string big = "[";
+  for (int i = 0; i < 100; i++) {
+    big += i ? ",\"abc\"" : "\"abc\"";
+  }
+  big += "]";
+  EXPECT_EQ_INT(lobaParseMemoryLimit, lobajson.LobaParse(&v, big.c_str()));
+  EXPECT_EQ_INT(lobaNull, lobajson.LobaGetType(&v));
+  std::string huge(4096, 'x');
+  EXPECT_EQ_INT(lobaParseMemoryLimit, lobajson.LobaParse(&v, ("\"" + huge + "\"").c_str()));
+  limits.max_alloc_bytes = 1 << 20;
+  lobajson.LobaSetParseLimits(&limits);
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&v, big.c_str()));
+  EXPECT_EQ_SIZE_T(100, lobajson.LobaGetArraySize(&v));
+  lobajson.LobaFree(&v);
+
+  // 取消后不再受限, 批量解析同样受限
+  lobajson.LobaSetParseLimits(nullptr);
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&v, ("\"" + huge + "\"").c_str()));
+  lobajson.LobaFree(&v);
+  LobaBatch batch;
+  limits = {};
+  limits.max_depth = 1;
+  batch.LobaSetParseLimits(&limits);
+  const char *docs[] = {"[1,2]", "[[1]]"};
+  LobaValue out[2];
+  int errors[2];
+  EXPECT_EQ_SIZE_T(1, batch.LobaParseMany(docs, nullptr, 2, out, errors));
+  EXPECT_EQ_INT(lobaParseTooDeep, errors[1]);
+}
+
+static void test_shred() {
+  LobaShredder shredder;
+  EXPECT_EQ_INT(0, shredder.LobaAddColumn("/id", lobaColumnInt64));
+  EXPECT_EQ_INT(1, shredder.LobaAddColumn("/user/name", lobaColumnString));
+  EXPECT_EQ_INT(2, shredder.LobaAddColumn("/score", lobaColumnDouble));
+  EXPECT_EQ_INT(3, shredder.LobaAddColumn("/a~1b", lobaColumnInt64));
+  // 重复、互为前缀、根本身、不合法的转义
+  EXPECT_EQ_INT(-1, shredder.LobaAddColumn("/id", lobaColumnDouble));
+  EXPECT_EQ_INT(-1, shredder.LobaAddColumn("/user", lobaColumnString));
+  EXPECT_EQ_INT(-1, shredder.LobaAddColumn("/id/x", lobaColumnString));
+  EXPECT_EQ_INT(-1, shredder.LobaAddColumn("", lobaColumnString));
+  EXPECT_EQ_INT(-1, shredder.LobaAddColumn("/x~2", lobaColumnString));
+
+  const char *ndjson =
+      "{\"id\":9007199254740993,\"user\":{\"name\":\"ann\",\"age\":30},\"score\":1.5,\"a/b\":-7}\n"
+      "{\"score\":2,\"extra\":[1,{\"k\":\"v\"}],\"id\":1e2,\"user\":{\"name\":\"b\\u00e9n\"}}\r\n"
+      "\n"
+      "{\"id\":1,\"user\":{\"name\":\"bad\"},\"score\":}\n"
+      "[1,2]\n"
+      "{\"id\":\"x\",\"user\":null,\"score\":null,\"id\":5}\n"
+      "{\"id\":1.5,\"user\":{\"name\":7},\"a/b\":-9223372036854775808} {}\n"
+      "{\"id\":-9223372036854775808,\"a/b\":9223372036854775808,\"user\":{\"name\":\"\"}}";
+  EXPECT_EQ_SIZE_T(4, shredder.LobaShred(ndjson));
+  EXPECT_EQ_SIZE_T(4, shredder.LobaGetRows());
+  EXPECT_EQ_SIZE_T(3, shredder.LobaGetBadRows());
+  EXPECT_EQ_INT(lobaParseRootNotSingular, shredder.LobaGetLastError());
+
+  // 大于 2^53 的整数也是精确的; 1e2 是整数; 重复的 id 取第一个 "x", 类型不符
+  const LobaColumn &id = shredder.LobaGetColumn(0);
+  EXPECT_EQ_SIZE_T(4, id.rows);
+  EXPECT_TRUE(id.ints[0] == 9007199254740993LL);
+  EXPECT_TRUE(id.ints[1] == 100);
+  EXPECT_FALSE(id.LobaIsValid(2));
+  EXPECT_TRUE(id.ints[3] == INT64_MIN);
+  EXPECT_EQ_SIZE_T(1, id.null_count);
+  EXPECT_EQ_SIZE_T(1, id.mismatches);
+
+  const LobaColumn &name = shredder.LobaGetColumn(1);
+  EXPECT_EQ_SIZE_T(5, name.offsets.size());
+  EXPECT_EQ_STRING("ann", name.data.data() + name.offsets[0], name.offsets[1] - name.offsets[0]);
+  EXPECT_EQ_STRING("b\xC3\xA9n", name.data.data() + name.offsets[1], name.offsets[2] - name.offsets[1]);
+  EXPECT_FALSE(name.LobaIsValid(2));
+  EXPECT_TRUE(name.LobaIsValid(3));
+  EXPECT_TRUE(name.offsets[3] == name.offsets[4]);
+  EXPECT_EQ_SIZE_T(1, name.null_count);
+  EXPECT_EQ_SIZE_T(7, name.data.size());
+
+  const LobaColumn &score = shredder.LobaGetColumn(2);
+  EXPECT_EQ_DOUBLE(1.5, score.doubles[0]);
+  EXPECT_EQ_DOUBLE(2.0, score.doubles[1]);
+  EXPECT_FALSE(score.LobaIsValid(2));
+  EXPECT_FALSE(score.LobaIsValid(3));
+  EXPECT_EQ_SIZE_T(0, score.mismatches);
+
+  // 超出 int64 的整数算类型不符
+  const LobaColumn &ab = shredder.LobaGetColumn(3);
+  EXPECT_TRUE(ab.ints[0] == -7);
+  EXPECT_FALSE(ab.LobaIsValid(3));
+  EXPECT_EQ_SIZE_T(1, ab.mismatches);
+  EXPECT_EQ_SIZE_T(3, ab.null_count);
+
+  // 跨过 8 行的位图, 以及清空后重新追加
+  shredder.LobaClearRows();
+  std::string lines;
+  for (int i = 0; i < 20; i++) {
+    lines += i % 3 ? "{\"id\":" + std::to_string(i) + "}\n" : "{}\n";
+  }
+  EXPECT_EQ_SIZE_T(20, shredder.LobaShred(lines.c_str()));
+  const LobaColumn &ids = shredder.LobaGetColumn(0);
+  EXPECT_EQ_SIZE_T(3, ids.validity.size());
+  EXPECT_EQ_SIZE_T(7, ids.null_count);
+  EXPECT_TRUE(ids.LobaIsValid(19));
+  EXPECT_FALSE(ids.LobaIsValid(18));
+  EXPECT_TRUE(ids.ints[17] == 17);
+  EXPECT_EQ_SIZE_T(0, shredder.LobaGetBadRows());
+
+  // 上限按行计算, 跳过的字段同样受限
+  LobaShredder limited;
+  limited.LobaAddColumn("/id", lobaColumnInt64);
+  LobaParseLimits limits = {};
+  limits.max_input_bytes = 40;
+  limits.max_depth = 3;
+  limits.max_string_length = 8;
+  limits.max_elements = 4;
+  limited.LobaSetParseLimits(&limits);
+  struct {
+    const char *row;
+    int error;
+  } rows[] = {
+      {"{\"id\":1,\"x\":[[1]]}", lobaParseOk},
+      {"{\"id\":2,\"x\":[[[1]]]}", lobaParseTooDeep},
+      {"{\"id\":3,\"s\":\"123456789\"}", lobaParseStringTooLong},
+      {"{\"id\":4,\"x\":[1,2,3,4]}", lobaParseTooManyElements},
+      {"{\"id\":5,\"x\":[                                        ]}", lobaParseInputTooLarge},
+      {"{\"id\":6,\"y\":{\"z\":{}}}", lobaParseOk},
+  };
+  for (const auto &row : rows) {
+    size_t shredded = row.error == lobaParseOk ? 1 : 0;
+    EXPECT_EQ_SIZE_T(shredded, limited.LobaShred((std::string(row.row) + "\n").c_str()));
+    if (row.error != lobaParseOk) {
+      EXPECT_EQ_INT(row.error, limited.LobaGetLastError());
+    }
+  }
+  EXPECT_EQ_SIZE_T(2, limited.LobaGetRows());
+  EXPECT_EQ_SIZE_T(4, limited.LobaGetBadRows());
+  EXPECT_TRUE(limited.LobaGetColumn(0).ints[1] == 6);
+  // 没有上限时很深的未选字段也不会递归
+  std::string deep = "{\"id\":1,\"x\":" + std::string(2000000, '[');
+  EXPECT_EQ_SIZE_T(0, shredder.LobaShred(deep.c_str()));
+  EXPECT_EQ_INT(lobaParseExpectValue, shredder.LobaGetLastError());
+}
+
+static LobaDocument LobaPassDocument(LobaDocument doc) {
+  return doc;
+}
+
+static void test_document() {
+  static_assert(std::is_nothrow_move_constructible<LobaDocument>::value, "");
+  static_assert(std::is_nothrow_move_assignable<LobaDocument>::value, "");
+  static_assert(!std::is_copy_constructible<LobaDocument>::value, "");
+
+  LobaDocument doc;
+  EXPECT_TRUE(doc.LobaIsEmpty());
+  EXPECT_TRUE(!doc.LobaGetRoot());
+  EXPECT_EQ_INT(lobaParseOk, doc.LobaParse("{\"name\":\"loba\",\"list\":[1,2,3],\"nested\":{\"ok\":true}}"));
+  LobaValueRef root = doc.LobaGetRoot();
+  EXPECT_EQ_INT(LobaType::lobaObject, root.LobaGetType());
+  EXPECT_EQ_SIZE_T(3, root.LobaGetSize());
+  EXPECT_EQ_STRING("loba", root.LobaFind("name").LobaGetString(), root.LobaFind("name").LobaGetStringLength());
+  EXPECT_EQ_DOUBLE(3.0, root.LobaFind("list")[2].LobaGetNumber());
+  EXPECT_TRUE(root.LobaFind("nested").LobaFind("ok").LobaGetBoolean());
+  EXPECT_TRUE(!root.LobaFind("missing"));
+  // 空句柄上继续查找不会解引用空指针
+  EXPECT_TRUE(!root.LobaFind("missing").LobaFind("b"));
+  EXPECT_TRUE(!root.LobaFind("missing")[0].LobaGetMember(0));
+  EXPECT_EQ_SIZE_T(0, root.LobaFind("missing").LobaGetSize());
+  EXPECT_EQ_INT(LobaType::lobaNull, root.LobaFind("missing").LobaGetType());
+  EXPECT_TRUE(!root.LobaFind("list").LobaFind("a"));
+  EXPECT_TRUE(!root.LobaFind("list")[3]);
+  EXPECT_TRUE(!root.LobaGetMember(3));
+  EXPECT_TRUE(root.LobaGetKey(3) == nullptr);
+  EXPECT_TRUE(!LobaValueRef()[0]);
+  EXPECT_EQ_STRING("list", root.LobaGetKey(1), root.LobaGetKeyLength(1));
+
+  // 紧凑数组的元素句柄直接指向数组, 取再多别的元素也不会变
+  LobaDocument packed;
+  packed.LobaGetJson().LobaSetPackNumbers(1);
+  EXPECT_EQ_INT(lobaParseOk, packed.LobaParse("[10,11,12,13,14,15,16,17,18,19]"));
+  LobaValueRef first = packed.LobaGetRoot()[0];
+  EXPECT_EQ_SIZE_T(10, packed.LobaGetRoot().LobaGetSize());
+  double sum = 0;
+  for (size_t i = 0; i < 10; i++) {
+    sum += packed.LobaGetRoot()[i].LobaGetNumber();
+  }
+  EXPECT_EQ_DOUBLE(145.0, sum);
+  EXPECT_TRUE(static_cast<bool>(first));
+  EXPECT_EQ_INT(LobaType::lobaNumber, first.LobaGetType());
+  EXPECT_EQ_DOUBLE(10.0, first.LobaGetNumber());
+  EXPECT_TRUE(first.LobaGetValue() == nullptr);
+  EXPECT_EQ_SIZE_T(0, first.LobaGetSize());
+  EXPECT_TRUE(!first[0]);
+  EXPECT_TRUE(!packed.LobaGetRoot()[10]);
+
+  // 移动只交换指针, 句柄跟着树走, 被移走的文档为空
+  LobaValueRef list = root.LobaFind("list");
+  LobaDocument next = LobaPassDocument(std::move(doc));
+  EXPECT_TRUE(doc.LobaIsEmpty());
+  EXPECT_TRUE(!doc.LobaGetRoot());
+  EXPECT_EQ_SIZE_T(3, list.LobaGetSize());
+  EXPECT_TRUE(list.LobaGetValue() == next.LobaGetRoot().LobaFind("list").LobaGetValue());
+
+  // 经由 LobaGetJson 修改, 新的分配落在文档的 arena 上
+  LobaJson &json = next.LobaGetJson();
+  json.LobaSetString(root.LobaFind("name").LobaGetValue(), "moved", 5);
+  EXPECT_TRUE(next.LobaStringify() == "{\"name\":\"moved\",\"list\":[1,2,3],\"nested\":{\"ok\":true}}");
+
+  // 失败时根为 null, 没有残留; 重新解析复用 arena 的块
+  size_t reserved = next.LobaGetReserved();
+  EXPECT_EQ_INT(lobaParseMissCommaOrSquareBracket, next.LobaParse("[\"a\",{\"b\":[1,2}]"));
+  EXPECT_EQ_INT(LobaType::lobaNull, next.LobaGetRoot().LobaGetType());
+  const char buffer[] = "[true,\"x\"]garbage";
+  EXPECT_EQ_INT(lobaParseOk, next.LobaParse(buffer, 10));
+  EXPECT_EQ_SIZE_T(reserved, next.LobaGetReserved());
+  EXPECT_TRUE(next.LobaStringify() == "[true,\"x\"]");
+
+  // 移动赋值释放原来的树
+  LobaDocument other;
+  EXPECT_EQ_INT(lobaParseOk, other.LobaParse("42"));
+  other = std::move(next);
+  EXPECT_EQ_SIZE_T(2, other.LobaGetRoot().LobaGetSize());
+  other.LobaRelease();
+  EXPECT_TRUE(other.LobaIsEmpty());
+  EXPECT_EQ_SIZE_T(0, other.LobaGetReserved());
+  EXPECT_TRUE(other.LobaStringify().empty());
+
+  // 从空文档开始建树
+  LobaDocument built;
+  built.LobaGetJson().LobaSetNumber(built.LobaGetRootValue(), 1.5);
+  EXPECT_EQ_DOUBLE(1.5, built.LobaGetRoot().LobaGetNumber());
+}
+
+static void test_simd_kernels() {
+  const LobaSimdLevel saved = LobaGetSimdLevel();
+  const LobaKernels &scalar = LobaKernelTable(lobaSimdScalar);
+  // 各类字节混在一起, 让每个内核在块内外的各个位置停下
+  const char alphabet[] = {'a', 'Z', '0', ' ', ' ', '\t', '\n', '\r', '"', '\\', '\x01', '\x1F', '\x7F',
+                           '\x80', '\xC3', '\xFF', '\xE0', '\xA0', '\xED', '\x9F', '\xF4', '\x8F', '\x90',
+                           '\xBF', '\0'};
+  // 合法的多字节字符成段出现, 随机的尾部常把序列截断
+  const char *const fills[] = {"a", " ", "\"", "\xC3", "\xE4\xB8\xAD", "\xF0\x9F\x98\x80", "\xC3\xA9" "a"};
+  alignas(64) char buffer[320];
+  unsigned seed = 12345;
+  const char *doc = "{\n    \"name\": \"caf\xC3\xA9 \\\"quoted\\\" \\\\ \\t \\u0001\",\n"
+                    "    \"list\": [ 1,  2 ,\t3,\r\n\n        \"                                                            \" ],\n"
+                    "    \"long\": \"abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789abcdefghijklmnop\"\n}";
+  LobaJson lobajson;
+  LobaValue v;
+  EXPECT_EQ_INT(lobaSimdScalar, LobaSetSimdLevel(lobaSimdScalar));
+  EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&v, doc));
+  size_t expect_length;
+  char *expect = lobajson.LobaStringify(&v, &expect_length);
+  lobajson.LobaFree(&v);
+
+  for (int level = lobaSimdScalar; level <= LobaGetMaxSimdLevel(); level++) {
+    EXPECT_EQ_INT(0, LobaSetSimdLevel(static_cast<LobaSimdLevel>(level)));
+    EXPECT_EQ_INT(level, LobaGetSimdLevel());
+    const LobaKernels &kernels = LobaKernelTable(static_cast<LobaSimdLevel>(level));
+    size_t mismatches = 0;
+    for (int round = 0; round < 200; round++) {
+      // 前面若干段是同一类字节, 尾部随机, 覆盖长短不同的连续段
+      size_t prefix = round % 150;
+      const char *fill = fills[round % (sizeof(fills) / sizeof(fills[0]))];
+      for (size_t i = 0; i < sizeof(buffer) - 1; i++) {
+        seed = seed * 1103515245 + 12345;
+        buffer[i] = i < prefix ? fill[i % strlen(fill)] : alphabet[(seed >> 16) % sizeof(alphabet)];
+      }
+      buffer[sizeof(buffer) - 1] = '\0';
+      for (size_t offset = 0; offset < 64; offset++) {
+        const char *p = buffer + offset;
+        size_t len = (offset * 7 + round) % (sizeof(buffer) - offset);
+        mismatches += scalar.scan_plain(p) != kernels.scan_plain(p);
+        mismatches += scalar.scan_space(p) != kernels.scan_space(p);
+        mismatches += scalar.scan_escape(p, len) != kernels.scan_escape(p, len);
+        mismatches += scalar.scan_utf8(p) != kernels.scan_utf8(p);
+      }
+    }
+    EXPECT_EQ_SIZE_T(0, mismatches);
+    // 各种边界上的合法与不合法序列, 放在块内的每个位置, 跨块的也要查出来
+    static const struct {
+      const char *text;
+      int expect;
+    } cases[] = {
+        {"\xE0\xA0\x80", lobaParseOk}, {"\xED\x9F\xBF", lobaParseOk}, {"\xF4\x8F\xBF\xBF", lobaParseOk},
+        {"\xE0\x9F\xBF", lobaParseInvalidUtf8}, {"\xED\xA0\x80", lobaParseInvalidUtf8},
+        {"\xF4\x90\x80\x80", lobaParseInvalidUtf8}, {"\xC1\xBF", lobaParseInvalidUtf8},
+        {"\xF5\x80\x80\x80", lobaParseInvalidUtf8}, {"\x80", lobaParseInvalidUtf8},
+        {"\xE4\xB8", lobaParseInvalidUtf8}, {"\xE4\xB8\xAD\xAD", lobaParseInvalidUtf8},
+    };
+    size_t failures = 0;
+    for (const auto &t : cases) {
+      for (size_t offset = 0; offset < 64; offset++) {
+        std::string json = "\"" + std::string(offset, 'a');
+        for (int i = 0; i < 12; i++) {
+          json += "\xE4\xB8\xAD";
+        }
+        json += t.text;
+        json += "\xE4\xB8\xAD\"";
+        failures += lobajson.LobaParse(&v, json.c_str()) != t.expect;
+        lobajson.LobaFree(&v);
+        // 截断在 '\0' 上的序列
+        json.resize(json.size() - 4);
+        failures += lobajson.LobaParse(&v, json.c_str()) != (t.expect == lobaParseOk ? lobaParseMissQuotationMark
+                                                                                      : lobaParseInvalidUtf8);
+        lobajson.LobaFree(&v);
+      }
+    }
+    EXPECT_EQ_SIZE_T(0, failures);
+    // 整条解析和序列化的结果也相同
+    EXPECT_EQ_INT(lobaParseOk, lobajson.LobaParse(&v, doc));
+    size_t length;
+    char *actual = lobajson.LobaStringify(&v, &length);
+    EXPECT_EQ_SIZE_T(expect_length, length);
+    EXPECT_TRUE(memcmp(expect, actual, length) == 0);
+    free(actual);
+    lobajson.LobaFree(&v);
+  }
+  free(expect);
+  EXPECT_EQ_INT(-1, LobaSetSimdLevel(static_cast<LobaSimdLevel>(lobaSimdAvx512 + 1)));
+  EXPECT_EQ_INT(0, LobaSetSimdLevel(saved));
+}
+
 static void TestWholeOperator() {
   LobaJson lobajson;
   LobaValue v;
@@ -584,6 +2650,27 @@ int main() {
   test_parse();
   test_access();
   test_stringify();
+  test_patch();
+  test_binary();
+  test_snapshot();
+  test_allocator();
+  test_parse_parallel();
+  test_stringify_parallel();
+  test_reflect();
+  test_key_table();
+  test_reader();
+  test_raw_numbers();
+  test_shared_document();
+  test_compact();
+  test_packed_array();
+  test_parse_many();
+  test_stringify_cache();
+  test_stringify_canonical();
+  test_parse_cache();
+  test_simd_kernels();
+  test_parse_limits();
+  test_shred();
+  test_document();
   printf("================\n");
   TestWholeOperator();
   printf("\n");